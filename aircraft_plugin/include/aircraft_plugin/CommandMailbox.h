@@ -0,0 +1,185 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+  In-process mailbox of motor commands, from the ArduPilot world plugin to the plugins
+  actuating a model (AircraftPlugin, rover drive), without going through ROS topics.
+
+  One mailbox per model, found by model name: the world plugin and the model plugin both
+  call 'CommandMailbox::get("cessna")' at load time, in any order, and keep the pointer.
+  The world plugin posts the commands received from ArduPilot; the model plugin fetches
+  the newest one in its 'WorldUpdateBegin' callback, so a command received before a step
+  is applied within that very step.
+
+  Posting and fetching are wait-free: the commands are exchanged through three copies, as
+  in a triple buffer. Only valid with a SINGLE posting thread and a SINGLE fetching thread
+  per mailbox. The registry itself is locked, but only used at load time.
+
+  Header-only: the registry is a function-local static of an inline function, which the
+  toolchain makes unique in the process even when several plugin libraries include it.
+ */
+
+#ifndef COMMAND_MAILBOX_H
+#define COMMAND_MAILBOX_H
+
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+
+#define COMMAND_MAILBOX_MAX_VALUES   16          // same as the servo packets of ArduPilot
+#define MOTOR_SPEED_SUBSCRIBER_QUEUE 2           // messages queued by the model plugins subscribed to 'command/motor_speed',
+                                                 // only the newest matters (the mailbox carries them all)
+
+
+struct motor_command {
+    uint32_t    seq;                                  // incremented by each post, 0 before the first one
+    uint32_t    nb_values;
+    float       values[COMMAND_MAILBOX_MAX_VALUES];   // same units as the 'command/motor_speed' topic
+};
+
+
+class CommandMailbox {
+public:
+    CommandMailbox()
+        : _middle(1),
+          _back(0),
+          _front(2),
+          _seq(0)
+    {
+        int i;
+
+        for (i=0; i<3; i++) {
+            _slots[i].seq = 0;
+            _slots[i].nb_values = 0;
+        }
+    }
+
+    /*
+      @return the mailbox of the model 'model_name', created on the first call
+     */
+    static std::shared_ptr<CommandMailbox> get(const std::string &model_name)
+    {
+        registry &reg = get_registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+
+        std::shared_ptr<CommandMailbox> &mailbox = reg.mailboxes[model_name];
+        if (!mailbox)
+            mailbox = std::make_shared<CommandMailbox>();
+        return mailbox;
+    }
+
+    // Producer side ------------------------
+
+    void post(const float *values, unsigned int nb_values)
+    {
+        motor_command &cmd = _slots[_back];
+        unsigned int i;
+
+        if (nb_values > COMMAND_MAILBOX_MAX_VALUES)
+            nb_values = COMMAND_MAILBOX_MAX_VALUES;
+        for (i=0; i<nb_values; i++)
+            cmd.values[i] = values[i];
+        cmd.nb_values = nb_values;
+        cmd.seq = ++_seq;
+
+        _back = _middle.exchange(_back | FRESH_BIT, std::memory_order_acq_rel) & INDEX_MASK;
+    }
+
+    // Consumer side ------------------------
+
+    /*
+      @return the newest command if it was not fetched yet, otherwise NULL.
+      It stays valid until the next call.
+     */
+    const motor_command* fetch()
+    {
+        if (!(_middle.load(std::memory_order_relaxed) & FRESH_BIT))
+            return NULL;
+        _front = _middle.exchange(_front, std::memory_order_acq_rel) & INDEX_MASK;
+        return &_slots[_front];
+    }
+
+private:
+    enum {
+        INDEX_MASK = 0x3,
+        FRESH_BIT  = 0x4         // the middle copy has not been fetched yet
+    };
+
+    struct registry {
+        std::mutex mutex;
+        std::map<std::string, std::shared_ptr<CommandMailbox> > mailboxes;
+    };
+
+    static registry& get_registry()
+    {
+        static registry s_registry;
+        return s_registry;
+    }
+
+    // Not copyable, the indexes are owned by their threads
+    CommandMailbox(const CommandMailbox&);
+    CommandMailbox& operator=(const CommandMailbox&);
+
+    motor_command _slots[3];
+    std::atomic<unsigned int> _middle;      // index of the middle copy, and FRESH_BIT
+    unsigned int _back;                     // producer: index of its copy
+    unsigned int _front;                    // consumer: index of its copy
+    uint32_t     _seq;                      // producer: seq of the last post
+};
+
+
+/*
+  Command of a step, from the mailbox of the world plugin (direct) and the one of the ROS topic.
+  With MOTOR_COMMAND_OUTPUT both, the topic carries copies of the direct commands, which may
+  arrive steps later: once a direct command was received, the topic is still drained but its
+  commands are dropped, so a late copy never overrides a newer direct command.
+  Only used by the consumer thread of both mailboxes.
+ */
+class CommandSelector {
+public:
+    CommandSelector()
+        : _has_direct(false)
+    {
+    }
+
+    /*
+      @return the command to apply, NULL if none is new. It stays valid until the next
+      call on the same mailboxes.
+     */
+    const motor_command* select(CommandMailbox &direct, CommandMailbox &topic)
+    {
+        const motor_command *cmd = direct.fetch();
+        const motor_command *topic_cmd = topic.fetch();
+
+        if (cmd)
+            _has_direct = true;
+        else if (!_has_direct)
+            cmd = topic_cmd;
+        return cmd;
+    }
+
+    bool has_direct() const
+    {
+        return _has_direct;
+    }
+
+private:
+    bool _has_direct;                       // a direct command was received: the topic is ignored
+};
+
+#endif // COMMAND_MAILBOX_H
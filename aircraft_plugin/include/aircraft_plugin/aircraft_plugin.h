@@ -36,7 +36,7 @@
 
 // This plugin implements a thread, based on boost, for the communication with Ardupilot
 #include <boost/bind.hpp>
-#include <mutex>
+#include <memory>
 
 // Gazebo includes
 #include <sdf/sdf.hh>
@@ -56,8 +56,17 @@
 #include <ros/callback_queue.h>
 #include <ros/ros.h>
 
+// Commands from the ArduPilot world plugin, in the same process
+#include "CommandMailbox.h"
+
 #define PI      3.1415926536
 
+// Control of the surfaces and of the propeller (SDF control_pid, false by default):
+// proportional to the error, or a full PID of Gazebo
+#define SURFACE_P_GAIN_DEFAULT      5.0
+#define SURFACE_FORCE_MAX_DEFAULT   20.0      // [N.m] PID only
+#define PROPELLER_P_GAIN_DEFAULT    1000.0
+
 namespace gazebo {
 
    class AircraftPlugin : public ModelPlugin {
@@ -76,6 +85,8 @@ namespace gazebo {
 
       private: 
          void UpdatePIDs(double _dt); 
+         void SetCommands(const float *motor_speed, size_t nb_values);
+         void InitControlSurfaces(sdf::ElementPtr _sdf);
 
          // Read an SDF parameter with a joint name and initialize a pointer to this joint.
             // _sdfParam SDF parameter containing a joint name.
@@ -99,6 +110,7 @@ namespace gazebo {
          static const unsigned int kElevators    = 4;
          static const unsigned int kRudder       = 5;
          static const unsigned int kPropeller    = 6;
+         static const unsigned int kNbSurfaces   = 6;     // joints before the propeller
 
          // ROS messages
          std::string command_sub_topic_;
@@ -106,6 +118,13 @@ namespace gazebo {
          ros::NodeHandle* node_handle_;
          ros::Subscriber command_sub_;
 
+         // Commands posted by the world plugin, fetched at each update
+         std::shared_ptr<CommandMailbox> command_mailbox_;
+         // Commands of the ROS topic, posted by 'OnControl()': only the update thread touches 'cmds'
+         std::shared_ptr<CommandMailbox> control_mailbox_;
+         // Which of the two drives the model
+         CommandSelector command_selector_;
+
          // Gazebo messages / data
          physics::ModelPtr model_;
          physics::LinkPtr link_Propeller;
@@ -126,15 +145,28 @@ namespace gazebo {
          //Next command to be applied to the propeller and control surfaces.
          std::array<float, 5> cmds;
       
+         // Control surfaces, as a structure of arrays indexed like 'joints' (kLeftAileron..kRudder).
+         // The targets are computed once per command, the update is then a loop over plain
+         // doubles between the reads of the angles and the writes of the forces.
+         unsigned int surfaceChannel[kNbSurfaces];   // index in 'cmds'
+         double surfaceCenter[kNbSurfaces];          // command of the neutral position
+         double surfaceScale[kNbSurfaces];           // [rad] per command unit, sign included
+         double surfaceGain[kNbSurfaces];            // [N.m/rad] proportional control
+         double surfaceTarget[kNbSurfaces];          // [rad]
+         double surfaceAngle[kNbSurfaces];           // [rad]
+         double surfaceForce[kNbSurfaces];           // [N.m]
+         double propellerGain = PROPELLER_P_GAIN_DEFAULT;
+         double propellerTarget = 0;                 // [rad/s], 0 when the throttle is off
+      
+         // PID control instead of the proportional one (SDF control_pid)
+         bool usePID = false;
+      
          // Velocity PID for the propeller.
          common::PID propellerPID;
       
          // Position PID for the control surfaces.
          std::array<common::PID, 6> controlSurfacesPID;         
 
-         // Controller update mutex.
-         std::mutex mutex;
-
          void QueueThread();
    };
 }
@@ -31,14 +31,6 @@ namespace gazebo {
           node_handle_->shutdown();
           delete node_handle_;
       }
-      for (auto &pid : this->controlSurfacesPID)
-      {
-          pid.Init(50.0, 0.1, 1, 0.0, 0.0, 20.0, -20.0);
-          pid.SetCmd(0.0);
-          pid.SetPGain(2000);
-          pid.SetIGain(0);
-          pid.SetDGain(0);
-     }
    }
 
    void AircraftPlugin::InitializeParams() {}
@@ -91,8 +83,9 @@ namespace gazebo {
 
       for (size_t i = 0; i < requiredParams.size(); ++i)
       {
-         if (!this->FindJoint(requiredParams[i], _sdf, this->joints[i]));
-         //return;
+         // The update reads every joint, without checking them
+         if (!this->FindJoint(requiredParams[i], _sdf, this->joints[i]))
+            return;
       }
 
       if (_sdf->HasElement("commandSubTopic"))
@@ -107,13 +100,19 @@ namespace gazebo {
 
       this->lastControllerUpdateTime = this->model_->GetWorld()->GetSimTime();
 
+      this->limit_Upper = this->joints[kLeftAileron]->GetUpperLimit(0).Degree() ;
+      this->limit_Lower = this->joints[kLeftFlap]->GetLowerLimit(0).Degree() ;
+      this->InitControlSurfaces(_sdf);
+
+      // Same commands, when the world plugin writes them directly (MOTOR_COMMAND_OUTPUT direct or both)
+      this->command_mailbox_ = CommandMailbox::get(this->model_->GetName());
+      // Not in the registry: only 'OnControl()' posts to it
+      this->control_mailbox_ = std::make_shared<CommandMailbox>();
+      this->command_sub_ = node_handle_->subscribe(this->command_sub_topic_, MOTOR_SPEED_SUBSCRIBER_QUEUE, &AircraftPlugin::OnControl, this);
+
       // Listen to the update event. This event is broadcast every
       // simulation iteration.
       updateConnection_ = event::Events::ConnectWorldUpdateBegin(boost::bind(&AircraftPlugin::OnUpdate, this, _1));
-
-      this->command_sub_ = node_handle_->subscribe(this->command_sub_topic_, 1000, &AircraftPlugin::OnControl, this);
-      this->limit_Upper = this->joints[kLeftAileron]->GetUpperLimit(0).Degree() ;
-      this->limit_Lower = this->joints[kLeftFlap]->GetLowerLimit(0).Degree() ;
 #if GAZEBO_MAJOR_VERSION >= 7
       this->joints[kLeftAileron]->SetPosition(0, 0);
       this->joints[kRightAileron]->SetPosition(0, 0);
@@ -131,12 +130,75 @@ namespace gazebo {
 #endif
    }
 
+   /*
+     Builds the table of the control surfaces, from the joint limits and the SDF gains:
+        <control_pid>true</control_pid>               PID instead of proportional (default: false)
+        <surface_p_gain>5</surface_p_gain>            [N.m/rad]
+        <surface_i_gain>0</surface_i_gain>            PID only
+        <surface_d_gain>0</surface_d_gain>            PID only
+        <surface_force_max>20</surface_force_max>     [N.m] PID only
+        <propeller_p_gain>1000</propeller_p_gain>     [N.m.s/rad]
+        <propeller_i_gain>0</propeller_i_gain>        PID only
+        <propeller_d_gain>0</propeller_d_gain>        PID only
+   */
+   void AircraftPlugin::InitControlSurfaces(sdf::ElementPtr _sdf)
+   {
+      // Same channel and law for both ailerons, mirrored, and for both flaps
+      static const unsigned int channels[kNbSurfaces] = { Aileron, Flap, Aileron, Flap, Elevators, Rudder };
+      static const double centers[kNbSurfaces]  = { 500, 0, 500, 0, 500, 500 };
+      double deflection = (limit_Upper/500)*PI/180;     // [rad] per command unit, from the neutral
+      double flap = (limit_Lower/1000)*PI/180;
+      const double scales[kNbSurfaces] = { -deflection, flap, deflection, flap, -deflection, deflection };
+      double p_gain = SURFACE_P_GAIN_DEFAULT, i_gain = 0, d_gain = 0;
+      double force_max = SURFACE_FORCE_MAX_DEFAULT;
+      double propeller_i_gain = 0, propeller_d_gain = 0;
+      unsigned int i;
+
+      if (_sdf->HasElement("control_pid"))
+         this->usePID = _sdf->Get<bool>("control_pid");
+      if (_sdf->HasElement("surface_p_gain"))
+         p_gain = _sdf->Get<double>("surface_p_gain");
+      if (_sdf->HasElement("surface_i_gain"))
+         i_gain = _sdf->Get<double>("surface_i_gain");
+      if (_sdf->HasElement("surface_d_gain"))
+         d_gain = _sdf->Get<double>("surface_d_gain");
+      if (_sdf->HasElement("surface_force_max"))
+         force_max = _sdf->Get<double>("surface_force_max");
+      if (_sdf->HasElement("propeller_p_gain"))
+         this->propellerGain = _sdf->Get<double>("propeller_p_gain");
+      if (_sdf->HasElement("propeller_i_gain"))
+         propeller_i_gain = _sdf->Get<double>("propeller_i_gain");
+      if (_sdf->HasElement("propeller_d_gain"))
+         propeller_d_gain = _sdf->Get<double>("propeller_d_gain");
+
+      for (i = 0; i < kNbSurfaces; ++i)
+      {
+         this->surfaceChannel[i] = channels[i];
+         this->surfaceCenter[i] = centers[i];
+         this->surfaceScale[i] = scales[i];
+         this->surfaceGain[i] = p_gain;
+         // Neutral of the commands not received yet
+         this->surfaceTarget[i] = (this->cmds[channels[i]] - centers[i]) * scales[i];
+         this->surfaceAngle[i] = 0;
+         this->surfaceForce[i] = 0;
+         this->controlSurfacesPID[i].Init(p_gain, i_gain, d_gain, 0.0, 0.0, force_max, -force_max);
+      }
+      // No limit (0, 0): common::PID clamps the command as soon as one of them is non-zero
+      this->propellerPID.Init(this->propellerGain, propeller_i_gain, propeller_d_gain, 0.0, 0.0, 0.0, 0.0);
+      ROS_INFO("AIRCRAFT: %s control of the surfaces and the propeller", this->usePID ? "PID" : "proportional");
+   }
+
    // This gets called by the world update start event.
    void AircraftPlugin::OnUpdate(const common::UpdateInfo& _info) {
       
-      std::lock_guard<std::mutex> lock(this->mutex);
       gazebo::common::Time curTime = this->model_->GetWorld()->GetSimTime();
 
+      // The command received from ArduPilot before this step, or the topic's until a first
+      // direct one: with both sources active, the late topic copies are dropped
+      const motor_command *cmd = this->command_selector_.select(*this->command_mailbox_, *this->control_mailbox_);
+      if (cmd)
+         this->SetCommands(cmd->values, cmd->nb_values);
+
       sampling_time_ = _info.simTime.Double() - prev_sim_time_;
       prev_sim_time_ = _info.simTime.Double();
       if (curTime > this->lastControllerUpdateTime)
@@ -149,56 +211,63 @@ namespace gazebo {
    
    void AircraftPlugin::UpdatePIDs(double _dt)
    {  
-      // Position PID for the control surfaces.
-      float Aileron_val = -1*((this->cmds[Aileron]-500)*(limit_Upper/500)*PI/180);
-      float Elevators_val = -1*((this->cmds[Elevators]-500)*(limit_Upper/500)*PI/180);
-      float Rudder_val = ((this->cmds[Rudder]-500)*(limit_Upper/500)*PI/180);
-      float throttle_val = ((this->cmds[Propeller])/1000.0);
-      float Flap_val = ((this->cmds[Flap])*(limit_Lower/1000)*PI/180);
-
-      double pos = this->joints[kElevators]->GetAngle(0).Radian();
-      double error = pos - Elevators_val;
-      this->joints[kElevators]->SetForce(0, error*-5);
-
-      pos = this->joints[kLeftAileron]->GetAngle(0).Radian();
-      error = pos - Aileron_val;
-      this->joints[kLeftAileron]->SetForce(0, error*-5);
-
-      pos = this->joints[kRightAileron]->GetAngle(0).Radian();
-      error = pos - (-1*Aileron_val);
-      this->joints[kRightAileron]->SetForce(0, error*-5);
-
-      pos = this->joints[kRudder]->GetAngle(0).Radian();
-      error = pos - Rudder_val;
-      this->joints[kRudder]->SetForce(0, error*-5);
-
-      pos = this->joints[kLeftFlap]->GetAngle(0).Radian();
-      error = pos - Flap_val;
-      this->joints[kLeftFlap]->SetForce(0, error*-5);
-      pos = this->joints[kRightFlap]->GetAngle(0).Radian();
-      error = pos - Flap_val;
-      this->joints[kRightFlap]->SetForce(0, error*-5);
-
-      if(throttle_val>0)
+      unsigned int i;
+
+      for (i = 0; i < kNbSurfaces; ++i)
+         this->surfaceAngle[i] = this->joints[i]->GetAngle(0).Radian();
+
+      if (this->usePID)
       {
-         double vel = this->joints[kPropeller]->GetVelocity(0);
-         double maxVel = this->propellerMaxRpm*2.0*M_PI/60.0;
-         double target = maxVel * throttle_val;
-         error = vel - target;
-         this->joints[kPropeller]->SetForce(0, error*-1000);
-         //ROS_WARN("%f",error);
+         for (i = 0; i < kNbSurfaces; ++i)
+            this->surfaceForce[i] = this->controlSurfacesPID[i].Update(this->surfaceAngle[i] - this->surfaceTarget[i], _dt);
       }
-      else{
-         //ROS_WARN("throttle_val=<0 %f",throttle_val);
+      else
+      {
+         // Independent iterations over contiguous doubles: vectorised by the compiler
+         for (i = 0; i < kNbSurfaces; ++i)
+            this->surfaceForce[i] = this->surfaceGain[i] * (this->surfaceTarget[i] - this->surfaceAngle[i]);
+      }
+
+      for (i = 0; i < kNbSurfaces; ++i)
+         this->joints[i]->SetForce(0, this->surfaceForce[i]);
+
+      // The propeller is left free while the throttle is off
+      if (this->propellerTarget > 0)
+      {
+         double error = this->joints[kPropeller]->GetVelocity(0) - this->propellerTarget;
+         if (this->usePID)
+            this->joints[kPropeller]->SetForce(0, this->propellerPID.Update(error, _dt));
+         else
+            this->joints[kPropeller]->SetForce(0, error*-this->propellerGain);
       }
    }
 
    void AircraftPlugin::OnControl(const mav_msgs::CommandMotorSpeedConstPtr& roll_velocities) {
-      this->cmds[Aileron] = roll_velocities->motor_speed[Aileron];
-      this->cmds[Elevators] = roll_velocities->motor_speed[Elevators];
-      this->cmds[Propeller] = roll_velocities->motor_speed[Propeller]/10;
-      this->cmds[Rudder] = roll_velocities->motor_speed[Rudder];
-      this->cmds[Flap] = roll_velocities->motor_speed[Flap];
+      // Runs on the ROS spinner: the command is applied by the next update
+      this->control_mailbox_->post(roll_velocities->motor_speed.data(), roll_velocities->motor_speed.size());
+   }
+
+   /*
+     Takes a new command, and computes the targets of the surfaces and of the propeller.
+     Only called by the update thread.
+   */
+   void AircraftPlugin::SetCommands(const float *motor_speed, size_t nb_values) {
+      unsigned int i;
+
+      if (nb_values < this->cmds.size())
+         return;
+      this->cmds[Aileron] = motor_speed[Aileron];
+      this->cmds[Elevators] = motor_speed[Elevators];
+      this->cmds[Propeller] = motor_speed[Propeller]/10;
+      this->cmds[Rudder] = motor_speed[Rudder];
+      this->cmds[Flap] = motor_speed[Flap];
+
+      for (i = 0; i < kNbSurfaces; ++i)
+         this->surfaceTarget[i] = (this->cmds[this->surfaceChannel[i]] - this->surfaceCenter[i]) * this->surfaceScale[i];
+
+      double throttle = this->cmds[Propeller]/1000.0;
+      double maxVel = this->propellerMaxRpm*2.0*M_PI/60.0;
+      this->propellerTarget = (throttle > 0) ? maxVel * throttle : 0;
    }
 
    GZ_REGISTER_MODEL_PLUGIN(AircraftPlugin);
@@ -0,0 +1,93 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+  Commands of the steps of AircraftPlugin, from the direct mailbox and the topic's
+  (MOTOR_COMMAND_OUTPUT both), one 'select()' per substep.
+ */
+
+#include <gtest/gtest.h>
+#include "../include/aircraft_plugin/CommandMailbox.h"
+
+static void post(CommandMailbox &mailbox, float value)
+{
+    mailbox.post(&value, 1);
+}
+
+TEST(CommandMailbox, FetchOnlyOnce)
+{
+    CommandMailbox mailbox;
+
+    EXPECT_EQ(NULL, mailbox.fetch());
+    post(mailbox, 1.0f);
+    post(mailbox, 2.0f);
+    const motor_command *cmd = mailbox.fetch();
+    ASSERT_TRUE(cmd != NULL);
+    EXPECT_EQ(2.0f, cmd->values[0]);
+    EXPECT_EQ(2u, cmd->seq);
+    EXPECT_EQ(NULL, mailbox.fetch());
+}
+
+TEST(CommandSelector, TopicDrivesUntilDirect)
+{
+    CommandMailbox direct, topic;
+    CommandSelector selector;
+
+    post(topic, 1.0f);
+    const motor_command *cmd = selector.select(direct, topic);
+    ASSERT_TRUE(cmd != NULL);
+    EXPECT_EQ(1.0f, cmd->values[0]);
+    EXPECT_FALSE(selector.has_direct());
+}
+
+TEST(CommandSelector, DirectWinsSameSubstep)
+{
+    CommandMailbox direct, topic;
+    CommandSelector selector;
+
+    post(topic, 1.0f);
+    post(direct, 2.0f);
+    const motor_command *cmd = selector.select(direct, topic);
+    ASSERT_TRUE(cmd != NULL);
+    EXPECT_EQ(2.0f, cmd->values[0]);
+}
+
+TEST(CommandSelector, LateTopicCopyDropped)
+{
+    CommandMailbox direct, topic;
+    CommandSelector selector;
+
+    // Frame N-1: its direct command, the topic copy not there yet
+    post(direct, 1.0f);
+    ASSERT_TRUE(selector.select(direct, topic) != NULL);
+    // Frame N: its direct command, then the late copy of N-1 on the next substep
+    post(direct, 2.0f);
+    const motor_command *cmd = selector.select(direct, topic);
+    ASSERT_TRUE(cmd != NULL);
+    EXPECT_EQ(2.0f, cmd->values[0]);
+    post(topic, 1.0f);
+    EXPECT_EQ(NULL, selector.select(direct, topic));
+    // Drained: a copy is not applied later either
+    post(direct, 3.0f);
+    cmd = selector.select(direct, topic);
+    ASSERT_TRUE(cmd != NULL);
+    EXPECT_EQ(3.0f, cmd->values[0]);
+    EXPECT_EQ(NULL, topic.fetch());
+}
+
+int main(int argc, char **argv)
+{
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,41 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+  One direction of the packet exchange with ArduPilot SITL (servo packets in, FDM packets out).
+  Implemented by SocketAPM (UDP) and ShmTransportAPM (shared memory rings).
+ */
+
+#ifndef APM_TRANSPORT_H
+#define APM_TRANSPORT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+
+class ApmTransport {
+public:
+    virtual ~ApmTransport() {}
+
+    virtual ssize_t send(void *pkt, size_t size) = 0;
+    // waits at most 'timeout_ms' for a packet
+    virtual ssize_t recv(void *pkt, size_t size, uint32_t timeout_ms) = 0;
+    // returns the newest queued packet without waiting, counting the older ones in 'nb_dropped'
+    virtual ssize_t recv_latest(void *pkt, size_t size, unsigned int *nb_dropped = NULL) = 0;
+
+    // file descriptor readable on input, for a poll/epoll set; -1 if the transport has none
+    virtual int get_fd() const = 0;
+};
+
+#endif // APM_TRANSPORT_H
@@ -0,0 +1,334 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+  Versioned FDM packet sent to ArduPilot (SDF <FDM_FORMAT>v2</FDM_FORMAT>).
+
+  Unlike the legacy 'fdm_packet', whose size depends on the build flags of both sides, a v2
+  packet describes itself:
+      fdm_v2_header           magic, version, total size, and the mask of the sensor blocks present
+      fdm_v2_core             state always present (IMU, velocities, positions)
+      sensor blocks           one per bit of the mask, in the order of the bits
+  All fields are little-endian, packed, and each block is a multiple of 8 bytes, so the doubles
+  stay aligned in the packet.
+
+  The blocks are described once, by the 'fdm_sensor_block<SENSOR>' traits below; adding a sensor is
+  adding its id, block and traits. A 'FdmLayout' computes the offsets for the mask of a vehicle
+  once, then packing a packet is a straight copy of each block.
+
+  Each FDM packet carries the sequence number of its frame. A peer answering with the v2 servo
+  packet below echoes it, along with the simulation time of the packet: the plugin can then tell
+  the lost and reordered servo packets, measure the round trip, and run a few frames ahead of
+  a remote ArduPilot (SDF PIPELINE_WINDOW).
+      servo_v2_header         magic, version, number of servos, sequences and echoed time
+      float servos[]          'nb_servos' values, from 0 to 1
+
+  Header-only, so that a peer can decode a packet with the same description.
+ */
+
+#ifndef FDM_WIRE_FORMAT_H
+#define FDM_WIRE_FORMAT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <string>
+
+
+#define FDM_V2_MAGIC         0x324d4446     // "FDM2"
+#define FDM_V2_VERSION       1
+#define FDM_NB_RPM           8              // motors reported by the RPM block
+#define SERVO_V2_MAGIC       0x32565253     // "SRV2"
+#define SERVO_V2_MAX_SERVOS  32
+
+// Sensor blocks, bit 'id' of the mask
+enum fdm_sensor_id {
+    FDM_SENSOR_RANGEFINDER_DOWN = 0,
+    FDM_SENSOR_RANGEFINDER_FRONT,
+    FDM_SENSOR_AIRSPEED,
+    FDM_SENSOR_RPM,
+    FDM_SENSOR_SAMPLE_TIMES,
+    FDM_NB_SENSORS
+};
+
+
+#pragma pack(push, 1)
+
+struct fdm_v2_header {
+    uint32_t magic;                           // FDM_V2_MAGIC
+    uint16_t version;                         // FDM_V2_VERSION
+    uint16_t size;                            // [bytes] of the whole packet
+    uint32_t sensor_mask;                     // bit (1 << fdm_sensor_id) set for each block present
+    uint32_t sequence;                        // frame of the vehicle, from 1, echoed by the servo packets
+};
+
+struct fdm_v2_core {
+    double timestamp;                         // [seconds] simulation time
+    double imu_angular_velocity_rpy[3];       // [rad/s]
+    double imu_linear_acceleration_xyz[3];    // [m/s/s] in NED, body frame
+    double imu_orientation_quat[4];           // rotation quaternion, APM conventions, from body to earth
+    double velocity_xyz[3];                   // [m/s] in NED
+    double position_xyz[3];                   // [m] in NED, from Gazebo's map origin (0,0,0)
+    double position_latlonalt[3];             // [degrees], altitude is Up
+};
+
+struct fdm_rangefinder_block {
+    double distance;                          // [m]
+};
+
+struct fdm_airspeed_block {
+    double airspeed;                          // [m/s]
+};
+
+struct fdm_rpm_block {
+    double rpm[FDM_NB_RPM];                   // [rev/min]
+};
+
+// Freshness of the sensors: a value older than the packet's timestamp was not sampled again since
+struct fdm_sample_times_block {
+    double imu;                               // [seconds] simulation time of the sample, 0 if none yet
+    double gps;                               // [seconds] position, velocity and lat/lon/alt
+    double rangefinder_down;                  // [seconds]
+    double rangefinder_front;                 // [seconds]
+};
+
+struct servo_v2_header {
+    uint32_t magic;                           // SERVO_V2_MAGIC
+    uint16_t version;                         // FDM_V2_VERSION
+    uint16_t nb_servos;                       // values that follow, at most SERVO_V2_MAX_SERVOS
+    uint32_t sequence;                        // servo packet of this peer, from 1
+    uint32_t fdm_sequence;                    // sequence of the last FDM packet received: the one answered
+    double   fdm_timestamp;                   // [seconds] simulation time of that FDM packet
+};
+
+#pragma pack(pop)
+
+
+/*
+  Description of the sensor blocks: type and name (as in the SDF FDM_SENSORS list)
+ */
+template <int SENSOR> struct fdm_sensor_block;
+
+template <> struct fdm_sensor_block<FDM_SENSOR_RANGEFINDER_DOWN> {
+    typedef fdm_rangefinder_block type;
+    static const char* name() { return "rangefinder_down"; }
+};
+template <> struct fdm_sensor_block<FDM_SENSOR_RANGEFINDER_FRONT> {
+    typedef fdm_rangefinder_block type;
+    static const char* name() { return "rangefinder_front"; }
+};
+template <> struct fdm_sensor_block<FDM_SENSOR_AIRSPEED> {
+    typedef fdm_airspeed_block type;
+    static const char* name() { return "airspeed"; }
+};
+template <> struct fdm_sensor_block<FDM_SENSOR_RPM> {
+    typedef fdm_rpm_block type;
+    static const char* name() { return "rpm"; }
+};
+template <> struct fdm_sensor_block<FDM_SENSOR_SAMPLE_TIMES> {
+    typedef fdm_sample_times_block type;
+    static const char* name() { return "sample_times"; }
+};
+
+/*
+  Tables indexed by sensor id, unrolled from the traits at compile time
+ */
+template <int SENSOR = 0>
+struct fdm_sensor_table {
+    static void fill(uint16_t *sizes, const char **names)
+    {
+        static_assert(sizeof(typename fdm_sensor_block<SENSOR>::type) % 8 == 0, "sensor blocks must keep the doubles aligned");
+        sizes[SENSOR] = sizeof(typename fdm_sensor_block<SENSOR>::type);
+        names[SENSOR] = fdm_sensor_block<SENSOR>::name();
+        fdm_sensor_table<SENSOR + 1>::fill(sizes, names);
+    }
+    static constexpr size_t max_size()
+    {
+        return sizeof(typename fdm_sensor_block<SENSOR>::type) + fdm_sensor_table<SENSOR + 1>::max_size();
+    }
+};
+
+template <>
+struct fdm_sensor_table<FDM_NB_SENSORS> {
+    static void fill(uint16_t *, const char **) {}
+    static constexpr size_t max_size() { return 0; }
+};
+
+// Size of a packet with every sensor block
+#define FDM_V2_MAX_SIZE     (sizeof(fdm_v2_header) + sizeof(fdm_v2_core) + fdm_sensor_table<>::max_size())
+
+static_assert(sizeof(fdm_v2_header) % 8 == 0, "the header must keep the doubles aligned");
+static_assert(sizeof(fdm_v2_core) % 8 == 0, "the core block must keep the doubles aligned");
+static_assert(sizeof(servo_v2_header) % 8 == 0, "the servo header must keep the doubles aligned");
+
+#define SERVO_V2_MAX_SIZE   (sizeof(servo_v2_header) + SERVO_V2_MAX_SERVOS * sizeof(float))
+
+
+/*
+  Writes a v2 servo packet in 'buf' (at least SERVO_V2_MAX_SIZE bytes)
+  @return the size of the packet
+ */
+static inline size_t servo_v2_pack(void *buf, const servo_v2_header &header, const float *servos)
+{
+    char *dst = static_cast<char*>(buf);
+    servo_v2_header h = header;
+
+    if (h.nb_servos > SERVO_V2_MAX_SERVOS)
+        h.nb_servos = SERVO_V2_MAX_SERVOS;
+    h.magic   = SERVO_V2_MAGIC;
+    h.version = FDM_V2_VERSION;
+    memcpy(dst, &h, sizeof(h));
+    memcpy(dst + sizeof(h), servos, h.nb_servos * sizeof(float));
+    return sizeof(h) + h.nb_servos * sizeof(float);
+}
+
+/*
+  Decodes a v2 servo packet. The values beyond 'max_servos' are ignored, the missing ones are 0.
+  @return false if it is not a valid v2 servo packet (e.g. a legacy one)
+ */
+static inline bool servo_v2_unpack(const void *buf, size_t size, servo_v2_header *header, float *servos, int max_servos)
+{
+    const char *src = static_cast<const char*>(buf);
+    int i;
+
+    if (size < sizeof(servo_v2_header))
+        return false;
+    memcpy(header, src, sizeof(*header));
+    if ((header->magic != SERVO_V2_MAGIC) || (header->version != FDM_V2_VERSION) ||
+        (header->nb_servos > SERVO_V2_MAX_SERVOS) || (size != sizeof(servo_v2_header) + header->nb_servos * sizeof(float)))
+        return false;
+    for (i=0; i<max_servos; i++) {
+        servos[i] = 0;
+        if (i < header->nb_servos)
+            memcpy(&servos[i], src + sizeof(servo_v2_header) + i * sizeof(float), sizeof(float));
+    }
+    return true;
+}
+
+
+/*
+  Layout of the packets for a given sensor mask
+ */
+class FdmLayout {
+public:
+    FdmLayout()
+    {
+        fdm_sensor_table<>::fill(_sizes, _names);
+        init(0);
+    }
+
+    /*
+      Computes the offsets of the blocks present in 'sensor_mask' (unknown bits are ignored)
+     */
+    void init(uint32_t sensor_mask)
+    {
+        size_t offset = sizeof(fdm_v2_header) + sizeof(fdm_v2_core);
+        int id;
+
+        _nb_present = 0;
+        for (id=0; id<FDM_NB_SENSORS; id++) {
+            _offsets[id] = 0;
+            if (!(sensor_mask & (1u << id)))
+                continue;
+            _offsets[id] = offset;
+            _present[_nb_present++] = id;
+            offset += _sizes[id];
+        }
+
+        memset(&_header, 0, sizeof(_header));
+        _header.magic       = FDM_V2_MAGIC;
+        _header.version     = FDM_V2_VERSION;
+        _header.size        = offset;
+        _header.sensor_mask = sensor_mask & ((1u << FDM_NB_SENSORS) - 1);
+    }
+
+    uint32_t get_mask() const { return _header.sensor_mask; }
+    size_t get_size() const { return _header.size; }
+    bool has_sensor(int id) const { return (_header.sensor_mask & (1u << id)) != 0; }
+
+    // byte offset of a sensor block in the packet, 0 if absent
+    size_t get_offset(int id) const { return _offsets[id]; }
+
+    /*
+      Writes a packet in 'buf' (at least 'get_size()' bytes).
+      'blocks' points, for each sensor id, to its block; only those present are read.
+      @return the size of the packet
+     */
+    size_t pack(void *buf, const fdm_v2_core &core, const void *const blocks[FDM_NB_SENSORS], uint32_t sequence = 0) const
+    {
+        char *dst = static_cast<char*>(buf);
+        int i;
+
+        memcpy(dst, &_header, sizeof(_header));
+        memcpy(dst + offsetof(fdm_v2_header, sequence), &sequence, sizeof(sequence));
+        memcpy(dst + sizeof(_header), &core, sizeof(core));
+        for (i=0; i<_nb_present; i++)
+            memcpy(dst + _offsets[_present[i]], blocks[_present[i]], _sizes[_present[i]]);
+        return _header.size;
+    }
+
+    /*
+      Decodes the header of a received packet, and the layout of its blocks
+      @return false if it is not a valid v2 packet
+     */
+    bool unpack_header(const void *buf, size_t size)
+    {
+        fdm_v2_header header;
+
+        if (size < sizeof(fdm_v2_header) + sizeof(fdm_v2_core))
+            return false;
+        memcpy(&header, buf, sizeof(header));
+        if ((header.magic != FDM_V2_MAGIC) || (header.version != FDM_V2_VERSION))
+            return false;
+        init(header.sensor_mask);
+        return (header.size == _header.size) && (size >= _header.size);
+    }
+
+    /*
+      @return the sequence number of a packet, after 'unpack_header()'
+     */
+    static uint32_t get_sequence(const void *buf)
+    {
+        uint32_t sequence;
+
+        memcpy(&sequence, static_cast<const char*>(buf) + offsetof(fdm_v2_header, sequence), sizeof(sequence));
+        return sequence;
+    }
+
+    /*
+      @return the sensor id named 'name', or -1
+     */
+    int find_sensor(const std::string &name) const
+    {
+        int id;
+
+        for (id=0; id<FDM_NB_SENSORS; id++) {
+            if (name == _names[id])
+                return id;
+        }
+        return -1;
+    }
+
+    const char* get_sensor_name(int id) const { return _names[id]; }
+
+private:
+    fdm_v2_header   _header;                    // prebuilt, copied in each packet
+    uint16_t        _sizes[FDM_NB_SENSORS];
+    const char     *_names[FDM_NB_SENSORS];
+    size_t          _offsets[FDM_NB_SENSORS];
+    int             _present[FDM_NB_SENSORS];   // ids of the blocks present, in packet order
+    int             _nb_present;
+};
+
+#endif // FDM_WIRE_FORMAT_H
@@ -0,0 +1,75 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+  Holders of the lapse-lock, which keeps the main loop from stepping the simulation.
+
+  Each 'take()' registers a holder with its own wall-clock deadline, and returns a token.
+  The lock is held while at least one holder is registered. A holder leaves when it is
+  released by its token, or when its own deadline passes: the expiry of one holder never
+  frees the others.
+  The holders are kept in a min-heap on their deadline, so the loop knows in O(1) how long
+  it may sleep before the next expiry. The position of each token in the heap is kept up to
+  date, so a holder is taken, released or expired in O(log n).
+
+  Deadlines are on CLOCK_MONOTONIC. Thread-safe: taken and released from the ROS service
+  and Gazebo threads, checked from the loop thread.
+ */
+
+#ifndef LAPSE_LOCK_H
+#define LAPSE_LOCK_H
+
+#include <stdint.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+#define LAPSE_LOCK_NO_TOKEN      0          // never returned by 'take()'
+
+
+class LapseLock {
+public:
+    LapseLock();
+
+    uint32_t take(double max_duration, const std::string &holder_name);
+    bool release(uint32_t token, const std::string &holder_name);
+    void clear();
+
+    int64_t check(unsigned int *nb_expired = NULL);
+    unsigned int get_nb_holders();
+    bool is_held(uint32_t token);
+
+    static int64_t now_ns();
+
+private:
+    struct holder {
+        int64_t     deadline_ns;
+        uint32_t    token;
+        std::string name;
+    };
+
+    void remove(size_t index);
+    size_t sift_up(size_t index);
+    void sift_down(size_t index);
+    void swap_holders(size_t a, size_t b);
+
+    std::mutex          _mutex;
+    std::vector<holder> _holders;           // min-heap on 'deadline_ns'
+    std::unordered_map<uint32_t, size_t> _indexes;  // of each token in '_holders'
+    uint32_t            _next_token;
+};
+
+#endif // LAPSE_LOCK_H
@@ -0,0 +1,59 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+  Fixed-size histogram of durations, for the timing of the lockstep loop.
+
+  Buckets are log-linear: each power of 2 of nanoseconds is split in
+  HISTOGRAM_SUB_BUCKETS, i.e. a resolution of ~20%, from 1 us to ~1 s.
+  Recording a sample is a few integer operations, with no allocation.
+  Percentiles are estimated at the middle of their bucket; the max is exact.
+ */
+
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <stdint.h>
+
+
+#define HISTOGRAM_MIN_POW2        10          // 2^10 ns ~= 1 us, shorter durations go in the first bucket
+#define HISTOGRAM_MAX_POW2        30          // 2^30 ns ~= 1 s, longer durations go in the last bucket
+#define HISTOGRAM_SUB_BITS        2
+#define HISTOGRAM_SUB_BUCKETS     (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_NB_BUCKETS      ((HISTOGRAM_MAX_POW2 - HISTOGRAM_MIN_POW2) * HISTOGRAM_SUB_BUCKETS + 2)
+
+
+class LatencyHistogram {
+public:
+    LatencyHistogram();
+
+    void add(int64_t duration_ns);
+    void reset();
+
+    uint32_t get_count() const;
+    int64_t get_max() const;
+    int64_t get_percentile(double ratio) const;     // ratio in [0, 1], e.g. 0.99
+
+    static int64_t now_ns();                        // CLOCK_MONOTONIC, to time the samples
+
+private:
+    uint32_t _buckets[HISTOGRAM_NB_BUCKETS];
+    uint32_t _count;
+    int64_t _max_ns;
+
+    static int bucket_index(int64_t duration_ns);
+    static int64_t bucket_middle(int index);
+};
+
+#endif // LATENCY_HISTOGRAM_H
@@ -0,0 +1,73 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+  Wall-clock pacing of the lockstep loop.
+  
+  The simulation advances in steps of fixed simulation time. The pacer decides how long
+  each step should last in wall time:
+    - realtime:      1 s of simulation per 1 s of wall time
+    - speedup:<N>    N s of simulation per 1 s of wall time
+    - afap:          as fast as possible, never waits (for CI / batch runs)
+    - replay:        as afap, for the replay of a log without ArduPilot (REPLAY_FILE),
+                     which is then checked and ends gzserver with its status
+  
+  Deadlines are absolute (anchor + simulated time / factor) and waited on with
+  'clock_nanosleep(TIMER_ABSTIME)', so sleep overshoots do not accumulate into drift.
+ */
+
+#ifndef LOCKSTEP_PACER_H
+#define LOCKSTEP_PACER_H
+
+#include <time.h>
+#include <stdint.h>
+#include <string>
+
+
+// When the simulation lags more than this behind its schedule (slow physics, stall...),
+// the schedule is re-anchored instead of running a burst of steps to catch up.
+#define PACING_MAX_LAG       0.1          // [s] wall time
+
+
+class LockstepPacer {
+public:
+    enum Mode {
+        PACING_REALTIME,
+        PACING_SPEEDUP,
+        PACING_AFAP,
+        PACING_REPLAY
+    };
+    
+    LockstepPacer();
+    
+    bool set_mode(const std::string &mode_str);
+    std::string get_mode_str() const;
+    Mode get_mode() const;
+    double get_speedup() const;
+    
+    void reset();
+    void wait_step(double sim_dt);
+
+private:
+    Mode _mode;
+    double _speedup;               // simulated seconds per wall second
+    
+    bool _is_anchored;
+    int64_t _anchor_ns;            // [ns] CLOCK_MONOTONIC time of the schedule origin
+    int64_t _sim_elapsed_ns;       // [ns] simulation time elapsed since the anchor
+    
+    static int64_t now_ns();
+};
+
+#endif // LOCKSTEP_PACER_H
@@ -0,0 +1,74 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+  Parallel loading of the meshes of the world (SDF MESH_PRELOAD_THREADS, MESH_PRELOAD_URIS).
+
+  Gazebo loads each mesh only when a visual or a camera first needs it, one after the other.
+  The preloader parses the meshes of the world, and those listed, with a few threads, while
+  the plugin initializes; the meshes are then registered in Gazebo's MeshManager, so they are
+  not loaded again.
+
+  The MeshManager is not thread safe: the threads only parse, each with its own loaders, and
+  the meshes are registered by the thread calling 'finish()'.
+ */
+
+#ifndef MESH_PRELOADER_H
+#define MESH_PRELOADER_H
+
+#include <atomic>
+#include <set>
+#include <string>
+#include <vector>
+#include <boost/thread.hpp>
+#include <sdf/sdf.hh>
+#include "gazebo/common/Mesh.hh"
+
+
+#define MESH_PRELOAD_THREADS_DEFAULT   4          // 0 to load the meshes on demand, as Gazebo does
+
+
+class MeshPreloader {
+public:
+    MeshPreloader();
+    ~MeshPreloader();
+
+    void set_nb_threads(unsigned int nb_threads);
+    unsigned int get_nb_threads() const;
+
+    void add_sdf_meshes(const sdf::ElementPtr &sdf);
+    void add_uris(const std::string &uris);
+    size_t get_nb_meshes() const;
+
+    void start();
+    unsigned int finish(std::string *failed_names);
+
+private:
+    struct preload_mesh {
+        std::string             filename;       // full path, the name of the mesh in the MeshManager
+        bool                    is_stl;         // else Collada
+        gazebo::common::Mesh   *mesh;           // NULL until parsed, or if it failed
+    };
+
+    void add_uri(const std::string &uri);
+    void worker();
+
+    unsigned int _nb_threads;
+    std::vector<preload_mesh> _meshes;
+    std::set<std::string> _filenames;
+    std::atomic<size_t> _next_mesh;             // index of the next mesh to parse
+    boost::thread_group _threads;
+};
+
+#endif // MESH_PRELOADER_H
@@ -0,0 +1,73 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+  Real-time settings of the loop thread (SDF LOOP_CPUS, LOOP_PRIORITY, LOCK_MEMORY).
+
+  By default the loop thread is scheduled as any other thread of gzserver (physics, rendering,
+  ROS spinners), and its steps are delayed whenever the host is busy. It can be:
+    - pinned to a set of CPUs, ideally kept away from the other threads (isolcpus...)
+    - run with the SCHED_FIFO policy, ahead of every normal thread. The policy is left while
+      the thread waits for a normal one, which it would otherwise keep from running on its CPU
+      (see 'suspend_priority()')
+    - protected from page faults: the memory of gzserver is locked (mlockall), and the
+      stack of the thread is touched in advance
+
+  Each setting is applied by the thread itself and returns the errno of its failure, the
+  privileges required (CAP_SYS_NICE, 'ulimit -r' and 'ulimit -l') being often missing.
+ */
+
+#ifndef REALTIME_THREAD_H
+#define REALTIME_THREAD_H
+
+#include <sched.h>
+#include <string>
+
+
+#define LOOP_PRIORITY_DEFAULT      0            // normal scheduling, else the SCHED_FIFO priority
+#define LOOP_STACK_PREFAULT_SIZE   (256*1024)   // [bytes] of stack touched when the memory is locked
+
+
+class RealtimeThread {
+public:
+    RealtimeThread();
+
+    bool set_cpus(const std::string &cpus_str);
+    std::string get_cpus_str() const;
+    bool has_cpus() const;
+
+    bool set_priority(int priority);
+    int get_priority() const;
+
+    void set_lock_memory(bool is_locked);
+    bool is_memory_locked() const;
+
+    int apply_cpus();
+    int apply_priority();
+    int suspend_priority();
+    int resume_priority();
+    int apply_lock_memory();
+
+private:
+    cpu_set_t _cpus;
+    std::string _cpus_str;
+    int _priority;                  // SCHED_FIFO priority, 0 for SCHED_OTHER
+    bool _is_priority_applied;      // the last 'apply_priority()' succeeded
+    bool _is_priority_suspended;    // by 'suspend_priority()', until 'resume_priority()'
+    bool _is_memory_locked;
+
+    static void prefault_stack();
+};
+
+#endif // REALTIME_THREAD_H
@@ -0,0 +1,81 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+  Depth of the rendering pipeline of the vehicles' cameras (SDF RENDER_PIPELINE_DEPTH).
+
+  Cameras and depth cameras are rendered by Gazebo's sensors thread, concurrently with the
+  physics, each image stamped with the simulation time it was rendered for. When the physics
+  runs faster than the rendering, the images get older: instead of holding the loop at every
+  frame (the lapse-lock), it is only held while a camera lags more than the depth, in frames
+  of that camera, behind the simulation time.
+      lag = (simulation time - time of the last image) * update rate of the camera
+  An inactive camera (no subscriber, not always on) does not render, and does not hold the
+  loop. An active one which does not render any image while it holds the loop for
+  RENDER_STALL_TIMEOUT (no rendering engine...) is left out, so it can't block it, until it
+  renders again.
+
+  While held, the loop sleeps until a camera renders: each one calls back at each image
+  (see 'add_sensor()'). Only used by the loop thread, but for these callbacks.
+ */
+
+#ifndef RENDER_PIPELINE_H
+#define RENDER_PIPELINE_H
+
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <vector>
+#include "gazebo/sensors/sensors.hh"
+
+
+#define RENDER_PIPELINE_DEPTH_DEFAULT  0          // [frames] of each camera, 0 to never hold the loop
+#define RENDER_WAIT_TIMEOUT_MS         100        // [ms] wall time without any image before checking the stalled cameras
+#define RENDER_STALL_TIMEOUT           2.0        // [s] wall time without any image while holding the loop
+
+
+class RenderPipeline {
+public:
+    RenderPipeline();
+
+    void set_depth(unsigned int depth);
+    unsigned int get_depth() const;
+    bool is_enabled() const;
+
+    static bool is_render_sensor(const gazebo::sensors::SensorPtr &sensor);
+    bool add_sensor(const gazebo::sensors::SensorPtr &sensor, const std::function<void()> &on_image);
+    size_t get_nb_sensors() const;
+
+    bool is_full(const gazebo::common::Time &sim_time, int64_t now_ns, std::string *stalled_names, std::string *resumed_names);
+    double get_max_lag() const;
+    void reset_stats();
+    void clear();
+
+private:
+    struct render_sensor {
+        gazebo::sensors::SensorPtr  sensor;
+        std::string                 name;
+        double                      rate;               // [Hz]
+        gazebo::common::Time        last_image_time;    // simulation time of its last image
+        int64_t                     last_image_ns;      // [ns] wall time it was noticed, 0 while inactive
+        bool                        is_stalled;         // left out until its next image
+        gazebo::event::ConnectionPtr image_connection;  // to the callback of 'add_sensor()'
+    };
+
+    unsigned int _depth;                    // [frames], 0 if disabled
+    std::vector<render_sensor> _sensors;
+    double _max_lag;                        // [frames] over the statistics period
+};
+
+#endif // RENDER_PIPELINE_H
@@ -0,0 +1,94 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+  Comparison of the FDM packets produced by a replay with those of the replay log
+  (PACING_MODE replay, see 'ReplayLog.h').
+
+  Both the legacy and the v2 packets are, after the v2 header, a sequence of doubles whose
+  first 20 are the same core state. Each double is compared with its reference, within the
+  tolerance of its field:
+      timestamp   gyro   accel   attitude   velocity   position   latlonalt   sensors
+  ('sensors' being every double after the core: range finders, v2 sensor blocks).
+  The default tolerance is 0: the replay must then be bit-for-bit.
+ */
+
+#ifndef REPLAY_CHECK_H
+#define REPLAY_CHECK_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "ReplayLog.h"
+
+
+// Exit status of gzserver at the end of a replay
+#define REPLAY_EXIT_MATCH       0       // every FDM packet within the tolerances
+#define REPLAY_EXIT_MISMATCH    1       // at least one field out of its tolerance, or a packet without counterpart
+#define REPLAY_EXIT_ERROR       2       // the replay could not be run
+
+
+enum replay_fdm_field {
+    REPLAY_FIELD_TIMESTAMP = 0,
+    REPLAY_FIELD_GYRO,
+    REPLAY_FIELD_ACCEL,
+    REPLAY_FIELD_ATTITUDE,
+    REPLAY_FIELD_VELOCITY,
+    REPLAY_FIELD_POSITION,
+    REPLAY_FIELD_LATLONALT,
+    REPLAY_FIELD_SENSORS,
+    REPLAY_NB_FIELDS
+};
+
+
+class ReplayCheck {
+public:
+    ReplayCheck();
+
+    bool set_tolerances(const std::string &tolerances_str);
+    void init(unsigned int nb_vehicles);
+
+    void set_reference(const replay_record &record);
+    void check(unsigned int vehicle, uint32_t batch, const void *data, size_t size, size_t header_size);
+    void finish();
+
+    bool is_match() const;
+    unsigned int get_nb_checked() const;
+    unsigned int get_nb_mismatches() const;
+    unsigned int get_nb_unmatched() const;
+    double get_max_error(int field) const;
+    unsigned int get_nb_field_mismatches(int field) const;
+    std::string get_first_mismatch() const;
+
+    static const char* get_field_name(int field);
+
+private:
+    static int get_field(size_t index);
+    void note_mismatch(const std::string &description);
+
+    double              _tolerances[REPLAY_NB_FIELDS];
+
+    std::vector<replay_record> _references;     // per vehicle, the FDM recorded for the current batch
+    std::vector<bool>          _has_reference;
+
+    unsigned int        _nb_checked;
+    unsigned int        _nb_mismatches;         // packets with at least one field out of tolerance
+    unsigned int        _nb_unmatched;          // packets produced without reference, or the other way around
+    double              _max_errors[REPLAY_NB_FIELDS];
+    unsigned int        _nb_field_mismatches[REPLAY_NB_FIELDS];
+    std::string         _first_mismatch;
+};
+
+#endif // REPLAY_CHECK_H
@@ -0,0 +1,127 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+  Replay log of the exchanges with ArduPilot (SDF RECORD_FILE / REPLAY_FILE).
+
+  Append-only binary file, in the byte order of the host:
+    - a 'replay_log_header',
+    - then one record per servo packet received and per FDM packet sent:
+      a 'replay_record_header' followed by 'size' bytes of the packet, as on the wire.
+  Records are tagged with the index of their lockstep batch: the servo packets of batch n
+  were applied before its step, the FDM packets of batch n were sent after it. Replaying
+  the servo records batch by batch thus runs the very same sequence of steps.
+
+  The recorder never writes from the calling thread: the records are appended to a memory
+  buffer, which a background thread swaps and writes to disk. The calling thread only takes
+  the buffer's lock for a copy, never across a disk access.
+ */
+
+#ifndef REPLAY_LOG_H
+#define REPLAY_LOG_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+#define REPLAY_LOG_MAGIC          0x41504d52      // "APMR"
+#define REPLAY_LOG_VERSION        1
+
+#define REPLAY_RECORD_SERVO       1               // servo packet received from ArduPilot
+#define REPLAY_RECORD_FDM         2               // FDM packet sent to ArduPilot (legacy or v2)
+#define REPLAY_RECORD_MAX_SIZE    512             // [bytes] max packet size
+
+#define REPLAY_FLUSH_SIZE         (256*1024)      // [bytes] buffered before waking the writer up
+#define REPLAY_FLUSH_PERIOD_MS    200             // [ms] written at least this often
+#define REPLAY_BUFFER_MAX_SIZE    (8*1024*1024)   // [bytes] allocated per buffer; beyond, the disk can't keep up: records are dropped
+
+
+struct replay_log_header {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    nb_vehicles;
+    uint32_t    steps_per_frame;
+    double      frame_duration;                   // [s] simulation time of a batch
+};
+
+struct replay_record_header {
+    uint8_t     type;                             // REPLAY_RECORD_xxx
+    uint8_t     vehicle;                          // index of the vehicle
+    uint16_t    size;                             // [bytes] of the packet that follows
+    uint32_t    batch;                            // index of the lockstep batch, from 0
+    double      sim_time;                         // [s] timestamp of the vehicle's FDM state
+};
+
+struct replay_record {
+    replay_record_header header;
+    char                 data[REPLAY_RECORD_MAX_SIZE];
+};
+
+
+/*
+  Writer of a replay log.
+  'append()' is called by a single thread, the main loop.
+ */
+class ReplayRecorder {
+public:
+    ReplayRecorder();
+    ~ReplayRecorder();
+
+    bool open(const std::string &path, const replay_log_header &header);
+    bool is_open() const;
+    void close();
+
+    void append(uint8_t type, uint8_t vehicle, uint32_t batch, double sim_time, const void *data, size_t size);
+    unsigned int get_nb_dropped();
+    int get_write_error();
+
+private:
+    void writer_thread();
+
+    FILE                   *_file;
+    std::thread             _thread;
+    std::mutex              _mutex;
+    std::condition_variable _cond;
+    std::vector<char>       _pending;       // appended by the loop, under '_mutex'
+    std::vector<char>       _writing;       // owned by the writer thread
+    bool                    _is_stopping;
+    unsigned int            _nb_dropped;    // records not buffered, '_pending' was full
+    int                     _write_error;   // errno of the first failed write, 0 if none
+};
+
+
+/*
+  Reader of a replay log, record by record
+ */
+class ReplayReader {
+public:
+    ReplayReader();
+    ~ReplayReader();
+
+    bool open(const std::string &path, replay_log_header *header);
+    bool is_open() const;
+    void close();
+
+    bool next(replay_record *record);
+
+private:
+    FILE       *_file;
+};
+
+#endif // REPLAY_LOG_H
@@ -0,0 +1,72 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+  Sampling rates of the FDM sensors of a vehicle, in simulation time (SDF SENSOR_RATES).
+
+  The direct FDM source asks the scheduler, at the end of each frame, which sensors are due:
+  only those are sampled and converted, the others keep their previous value in the FDM, with
+  the time of their sample (see the 'sample_times' block of the v2 packets).
+  Samples are on a fixed grid of simulation time from the first frame: a sensor slower than
+  the frames keeps its period (e.g. a 10 Hz GPS every 40 frames of 400 Hz), one faster than
+  the frames, or of rate 0, is sampled on every frame.
+ */
+
+#ifndef SENSOR_SCHEDULER_H
+#define SENSOR_SCHEDULER_H
+
+#include <stdint.h>
+#include <string>
+
+
+// Sensors of the FDM state, sampled together when sharing a source
+enum scheduled_sensor_id {
+    SCHEDULED_SENSOR_IMU = 0,           // attitude, angular velocity, acceleration
+    SCHEDULED_SENSOR_GPS,               // position and velocity
+    SCHEDULED_SENSOR_SONAR_DOWN,
+    SCHEDULED_SENSOR_SONAR_FRONT,
+    NB_SCHEDULED_SENSORS
+};
+
+// Default rates [Hz] of simulation time, 0 for every frame
+#define SENSOR_RATE_IMU_DEFAULT        400.0
+#define SENSOR_RATE_GPS_DEFAULT        10.0
+#define SENSOR_RATE_SONAR_DEFAULT      20.0
+
+// A sample is due this early, for the rounding of the simulation time
+#define SENSOR_SCHEDULE_TOLERANCE_NS   1000       // [ns]
+
+
+class SensorScheduler {
+public:
+    SensorScheduler();
+
+    bool set_rates(const std::string &rates_str);
+    double get_rate(int sensor) const;
+    std::string get_rates_str() const;
+
+    uint32_t update(int64_t sim_time_ns);
+    void reset();
+
+    static const char* get_sensor_name(int sensor);
+
+private:
+    double _rates[NB_SCHEDULED_SENSORS];            // [Hz]
+    int64_t _periods_ns[NB_SCHEDULED_SENSORS];      // [ns], 0 for every frame
+    int64_t _next_ns[NB_SCHEDULED_SENSORS];         // [ns] simulation time of the next sample
+    int64_t _last_ns;                               // [ns] simulation time of the last update
+    bool _is_started;
+};
+
+#endif // SENSOR_SCHEDULER_H
@@ -0,0 +1,153 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+  Shared memory transport between the plugin and ArduPilot SITL (SDF <APM_TRANSPORT>shm</APM_TRANSPORT>).
+
+  The plugin creates one POSIX shared memory segment for the world (default name
+  "/ardupilot_sitl_gazebo"), with, for each vehicle:
+    - a ring of servo packets, written by ArduPilot, read by the plugin,
+    - a ring of FDM packets, written by the plugin, read by ArduPilot.
+  A ring has a single writer and a single reader. The writer never blocks: the reader only
+  wants the newest packet, the older ones are counted as dropped.
+  Each slot is guarded by a sequence number, so a packet overwritten while being read is
+  detected and skipped.
+
+  Wake-ups use futexes on words of the segment:
+    - the reader of a ring sleeps on its 'head',
+    - the plugin sleeps on the segment's 'doorbell', incremented after each servo packet of
+      any vehicle, since the lockstep waits on all of them at once.
+  A futex wake is only issued when the other side is actually sleeping, so at full speed a
+  packet exchange costs no system call at all.
+
+  Protocol of a peer (ArduPilot side), for vehicle 'i' found from its servo port with
+  'ShmSegmentAPM::find_vehicle()':
+    ShmSegmentAPM segment;    segment.attach("/ardupilot_sitl_gazebo");
+    ShmTransportAPM servo_out(&segment, &segment.get_vehicle(i)->servo, SHM_TRANSPORT_WRITER | SHM_TRANSPORT_DOORBELL);
+    ShmTransportAPM fdm_in(&segment, &segment.get_vehicle(i)->fdm, SHM_TRANSPORT_READER);
+ */
+
+#ifndef SHM_TRANSPORT_APM_H
+#define SHM_TRANSPORT_APM_H
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+#include "ApmTransport.h"
+
+
+#define APM_SHM_MAGIC            0x41504d53      // "APMS"
+#define APM_SHM_VERSION          1
+#define APM_SHM_NB_SLOTS         8               // per ring, power of 2
+#define APM_SHM_SLOT_SIZE        512             // [bytes] max packet size
+#define APM_SHM_NAME_DEFAULT     "/ardupilot_sitl_gazebo"
+
+// Role of a 'ShmTransportAPM' on its ring
+#define SHM_TRANSPORT_READER     0x00
+#define SHM_TRANSPORT_WRITER     0x01
+#define SHM_TRANSPORT_DOORBELL   0x02            // writer which also rings the segment's doorbell (servo packets)
+
+
+/*
+  Layout of the segment, shared by both processes.
+  Written by the plugin on creation, 'magic' last.
+ */
+struct apm_shm_slot {
+    std::atomic<uint32_t>   seq;            // 2*n+1 while packet n is written, 2*n+2 once done
+    uint32_t                size;           // [bytes]
+    char                    data[APM_SHM_SLOT_SIZE];
+};
+
+struct apm_shm_ring {
+    std::atomic<uint32_t>   head;           // nb of packets written, futex of the reader
+    std::atomic<uint32_t>   reader_waiting; // the reader sleeps on 'head'
+    uint32_t                padding[14];    // keeps the slots off the cache line of the indexes
+    apm_shm_slot            slots[APM_SHM_NB_SLOTS];
+};
+
+struct apm_shm_vehicle {
+    uint32_t                port_base;      // servo port of the vehicle in UDP, to identify it
+    uint32_t                padding[15];
+    apm_shm_ring            servo;          // ArduPilot -> plugin
+    apm_shm_ring            fdm;            // plugin -> ArduPilot
+};
+
+struct apm_shm_header {
+    std::atomic<uint32_t>   magic;
+    uint32_t                version;
+    uint32_t                nb_vehicles;
+    uint32_t                vehicle_size;   // sizeof(apm_shm_vehicle), checked by the peers
+    std::atomic<uint32_t>   doorbell;       // incremented on each servo packet, futex of the plugin
+    std::atomic<uint32_t>   plugin_waiting; // the plugin sleeps on 'doorbell'
+    uint32_t                padding[10];
+};
+
+
+/*
+  Mapping of the segment, created by the plugin or attached to by a peer
+ */
+class ShmSegmentAPM {
+public:
+    ShmSegmentAPM();
+    ~ShmSegmentAPM();
+
+    bool create(const std::string &name, unsigned int nb_vehicles);
+    bool attach(const std::string &name);
+    bool is_open() const;
+
+    unsigned int get_nb_vehicles() const;
+    apm_shm_vehicle* get_vehicle(unsigned int index);
+    int find_vehicle(uint16_t port_base);
+
+    uint32_t get_doorbell() const;
+    void ring_doorbell();
+    bool wait_doorbell(uint32_t seen, int timeout_ms);
+
+private:
+    std::string     _name;
+    bool            _is_owner;      // the creator unlinks the segment
+    size_t          _size;
+    apm_shm_header *_header;
+    apm_shm_vehicle *_vehicles;
+
+    void unmap();
+};
+
+
+/*
+  One end of a ring
+ */
+class ShmTransportAPM : public ApmTransport {
+public:
+    ShmTransportAPM(ShmSegmentAPM *segment, apm_shm_ring *ring, int role);
+
+    ssize_t send(void *pkt, size_t size);
+    ssize_t recv(void *pkt, size_t size, uint32_t timeout_ms);
+    ssize_t recv_latest(void *pkt, size_t size, unsigned int *nb_dropped = NULL);
+    int get_fd() const;
+
+private:
+    ShmSegmentAPM  *_segment;
+    apm_shm_ring   *_ring;
+    int             _role;
+    uint32_t        _index;         // writer: next packet to write, reader: next packet not yet read
+};
+
+
+// Futex helpers, on words shared between processes
+int futex_wait_shared(std::atomic<uint32_t> *word, uint32_t expected, int timeout_ms);
+void futex_wake_shared(std::atomic<uint32_t> *word);
+
+#endif // SHM_TRANSPORT_APM_H
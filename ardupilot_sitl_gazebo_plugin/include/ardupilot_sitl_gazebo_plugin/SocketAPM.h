@@ -27,15 +27,23 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
-#include <sys/select.h>
+#include <poll.h>
 
 #include <stdio.h>
 #include <string.h>
 
+#include "ApmTransport.h"
 
-class SocketAPM {
+
+// Datagrams read per system call by 'recv_latest()', and their max size
+#define SOCKET_APM_RECV_BATCH        16
+#define SOCKET_APM_MAX_DATAGRAM      512
+
+
+class SocketAPM : public ApmTransport {
 public:
     SocketAPM(bool _datagram);
+    ~SocketAPM();
     bool connect(const char *address, uint16_t port);
     bool bind(const char *address, uint16_t port);
     void reuseaddress();
@@ -44,6 +52,10 @@ public:
     ssize_t send(void *pkt, size_t size);
     ssize_t sendto(void *buf, size_t size, const char *address, uint16_t port);
     ssize_t recv(void *pkt, size_t size, uint32_t timeout_ms);
+    ssize_t recv_nowait(void *pkt, size_t size);
+    ssize_t recv_latest(void *pkt, size_t size, unsigned int *nb_dropped = NULL);
+
+    int get_fd() const;
 
 private:
     bool datagram;
@@ -0,0 +1,93 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+  Telemetry of the last seconds of the loop (SDF TELEMETRY_SECONDS), for post-mortem analysis.
+
+  Fixed-size rings, always on, filled by the loop thread: each vehicle's servo packets applied
+  and FDM packets sent, and the timing of each step. Appending is a copy into a slot allocated
+  at init: no lock, no allocation, no log. The oldest records are overwritten.
+
+  A ring is read by any other thread without stopping the writer: each slot carries a sequence
+  (odd while written), and a record overwritten during its copy is left out.
+
+  A dump has the layout of a replay log (see 'ReplayLog.h'), with its own magic: a
+  'replay_log_header', then the records of each ring, oldest first, as 'replay_record_header'
+  followed by the packet. It can't be replayed (it starts in the middle of a run), but reads
+  with 'ReplayReader' or 'scripts/telemetry_dump.py'.
+ */
+
+#ifndef TELEMETRY_RING_H
+#define TELEMETRY_RING_H
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include "ReplayLog.h"
+
+
+#define TELEMETRY_SECONDS_DEFAULT   10.0            // [s] of simulation kept (frames), 0 to disable the telemetry
+
+#define TELEMETRY_DUMP_MAGIC        0x41504d54      // "APMT"
+#define TELEMETRY_DUMP_VERSION      1
+
+#define TELEMETRY_RECORD_STEP       3               // 'telemetry_step', next to REPLAY_RECORD_SERVO and REPLAY_RECORD_FDM
+#define TELEMETRY_VEHICLE_NONE      0xFF            // vehicle of the records not tied to one
+
+// Flags of a step
+#define TELEMETRY_STEP_TIMEOUT      0x01            // released by the straggler timeout
+#define TELEMETRY_STEP_PAUSED       0x02            // the world was paused, not stepped
+
+
+/*
+  Timing of a lockstep batch. Its sim time is 0: it matches the vehicles' records by batch.
+ */
+struct telemetry_step {
+    int64_t     start_ns;                           // [ns] monotonic wall time of the release
+    int64_t     wait_servo_ns;                      // [ns] previous batch end -> release, 0 if unknown
+    int64_t     step_ns;                            // [ns] 'step_gazebo_sim()'
+    int64_t     pace_ns;                            // [ns] pacer sleep
+    uint32_t    nb_vehicles;                        // FDM packets sent
+    uint32_t    flags;                              // TELEMETRY_STEP_xxx
+};
+
+
+/*
+  Ring of records, single writer ('append()'), any number of readers ('copy()')
+ */
+class TelemetryRing {
+public:
+    TelemetryRing();
+
+    void init(size_t nb_records, size_t max_size);
+    bool is_enabled() const;
+
+    void append(uint8_t type, uint8_t vehicle, uint32_t batch, double sim_time, const void *data, size_t size);
+    size_t copy(std::vector<char> *records) const;
+
+    static int dump(const std::string &path, const replay_log_header &header,
+                    const std::vector<const TelemetryRing*> &rings, size_t *nb_records);
+
+private:
+    std::vector<char>                     _slots;       // 'replay_record_header' + up to '_max_size' bytes each
+    std::unique_ptr<std::atomic<uint64_t>[]> _sequences;  // of each slot: 2*n+1 while record n is written, 2*n+2 once done
+    size_t                                _nb_records;
+    size_t                                _max_size;    // [bytes] of a packet, larger ones are truncated
+    size_t                                _stride;      // [bytes] of a slot
+    std::atomic<uint64_t>                 _head;        // nb of records appended since the start
+};
+
+#endif // TELEMETRY_RING_H
@@ -0,0 +1,89 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+  Wait-free exchange of a value between one writer thread and one reader thread.
+
+  Three copies of the value are kept: one owned by the writer, one owned by the reader,
+  and one in the middle. The writer fills its copy then swaps it with the middle one;
+  the reader swaps its copy with the middle one if it holds a newer value.
+  Neither side ever waits for the other, and the reader always gets a complete value,
+  the latest one published.
+
+  Only valid with a SINGLE writer thread and a SINGLE reader thread per buffer.
+ */
+
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <atomic>
+
+
+template <typename T>
+class TripleBuffer {
+public:
+    TripleBuffer(const T &initial_value = T())
+        : _middle(1),
+          _back(0),
+          _front(2)
+    {
+        _slots[0] = initial_value;
+        _slots[1] = initial_value;
+        _slots[2] = initial_value;
+    }
+
+    // Writer side --------------------------
+
+    // Copy to fill, before 'publish()'
+    T& write_slot() { return _slots[_back]; }
+
+    // Makes the filled copy the latest value
+    void publish()
+    {
+        _back = _middle.exchange(_back | FRESH_BIT, std::memory_order_acq_rel) & INDEX_MASK;
+    }
+
+    void write(const T &value)
+    {
+        _slots[_back] = value;
+        publish();
+    }
+
+    // Reader side --------------------------
+
+    // Returns the latest published value. It stays valid until the next call.
+    const T& read()
+    {
+        if (_middle.load(std::memory_order_relaxed) & FRESH_BIT)
+            _front = _middle.exchange(_front, std::memory_order_acq_rel) & INDEX_MASK;
+        return _slots[_front];
+    }
+
+private:
+    enum {
+        INDEX_MASK = 0x3,
+        FRESH_BIT  = 0x4         // the middle copy has not been read yet
+    };
+
+    // Not copyable, the indexes are owned by their threads
+    TripleBuffer(const TripleBuffer&);
+    TripleBuffer& operator=(const TripleBuffer&);
+
+    T _slots[3];
+    std::atomic<unsigned int> _middle;      // index of the middle copy, and FRESH_BIT
+    unsigned int _back;                     // index of the writer's copy
+    unsigned int _front;                    // index of the reader's copy
+};
+
+#endif // TRIPLE_BUFFER_H
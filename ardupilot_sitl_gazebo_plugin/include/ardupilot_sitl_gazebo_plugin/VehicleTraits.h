@@ -0,0 +1,215 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+  What differs between the vehicle types driven by the lockstep engine.
+
+  The engine (ArdupilotSitlGazeboPlugin) is the same code for every type of vehicle, built
+  once per type with the traits of that type:
+      libardupilot_sitl_gazebo_plugin.so           CopterTraits (default)
+      libardupilot_sitl_gazebo_plugin_rover.so     RoverTraits, ARDUPILOT_VEHICLE_ROVER defined
+  Traits are only constants and inline static functions, resolved at compile time: the loop
+  calls them without virtual dispatch, and the branches of the other types are compiled out.
+
+  A traits class provides:
+      HAS_PARACHUTE       the SERVO_PARACHUTE channel releases a parachute
+      HAS_DRIVE           the engine actuates the model itself, at the beginning of each step,
+                          from the mailbox of the model (see 'CommandMailbox.h')
+      IDLE_SPIN           motors all off are commanded to turn slowly, to show the simulation runs
+      default_motor_command_output()   when MOTOR_COMMAND_OUTPUT is not set
+      drive_state         the actuators of a vehicle, only used by Gazebo's update thread
+      bind_drive()        finds them in the model, once it is spawned (Gazebo's update thread)
+      apply_drive()       applies a motor command to them
+  The sensors and the FDM layout are common (FDM_FORMAT, FDM_SENSORS), as is the servo packet.
+ */
+
+#ifndef VEHICLE_TRAITS_H
+#define VEHICLE_TRAITS_H
+
+#include <math.h>
+#include <stddef.h>
+#include "gazebo/physics/physics.hh"
+
+
+/*
+  Multicopters (iris): the motors are the model's plugins (rotors motor models, AircraftPlugin)
+ */
+struct CopterTraits {
+    enum {
+        HAS_PARACHUTE = 1,
+        HAS_DRIVE     = 0,
+        IDLE_SPIN     = 1
+    };
+    static const char* default_motor_command_output() { return "ros"; }
+
+    struct drive_state {
+    };
+
+    static bool bind_drive(drive_state &drive, gazebo::physics::ModelPtr model)
+    {
+        return true;
+    }
+
+    static void apply_drive(drive_state &drive, const float *motor_speed, size_t nb_values)
+    {
+    }
+};
+
+
+/*
+  Rover: four driven wheels, the front ones steered (see 'urdf/rover.urdf').
+  The motor speeds are the servos x1000: steering on channel 0, throttle on channel 2.
+
+  Ackermann steering: the servo commands the angle of a virtual wheel at the middle of the
+  front axle, and the throttle the speed of the middle of the rear axle. Each wheel gets its
+  own angle and speed, for all of them to turn around the same center:
+      t = tan(steering), k = half track / wheel base
+      front wheels    tan(angle) = t / (1 -+ k_front t),  speed x sqrt(t^2 + (1 -+ k_front t)^2)
+      rear wheels                                          speed x (1 -+ k_rear t)
+  (- for the left wheels, + for the right ones; a positive steering turns left)
+  The ratios are computed once, from the joints of the spawned model.
+ */
+#define ROVER_STEERING_RATIO          (0.7727 / 400.0)   // [rad] per motor speed unit, 0 at 500
+#define ROVER_MAX_STEERING_ANGLE      0.7727             // [rad] limit of the steering joints
+#define ROVER_FRONT_TRACK_WIDTH       1.0                // [m] between the steering pivots, if not measurable
+#define ROVER_REAR_TRACK_WIDTH        1.5                // [m]
+#define ROVER_WHEEL_BASE_LENGTH       1.95222            // [m] front to rear axle
+
+struct RoverTraits {
+    enum {
+        HAS_PARACHUTE = 0,
+        HAS_DRIVE     = 1,
+        IDLE_SPIN     = 0
+    };
+    static const char* default_motor_command_output() { return "both"; }
+
+    enum {
+        WHEEL_FRONT_LEFT = 0,
+        WHEEL_FRONT_RIGHT,
+        WHEEL_REAR_LEFT,
+        WHEEL_REAR_RIGHT,
+        NB_WHEELS
+    };
+    enum {
+        STEERING_LEFT = 0,
+        STEERING_RIGHT,
+        NB_STEERINGS
+    };
+
+    struct drive_state {
+        gazebo::physics::JointPtr   wheel_joints[NB_WHEELS];
+        gazebo::physics::JointPtr   steering_joints[NB_STEERINGS];
+        double                      front_half_track_ratio;     // half front track / wheel base
+        double                      rear_half_track_ratio;      // half rear track / wheel base
+    };
+
+    /*
+      @return false if a joint is missing from the model
+     */
+    static bool bind_drive(drive_state &drive, gazebo::physics::ModelPtr model)
+    {
+        static const char *wheel_names[NB_WHEELS] = {
+            "front_left_wheel_joint", "front_right_wheel_joint", "rear_left_wheel_joint", "rear_right_wheel_joint"
+        };
+        static const char *steering_names[NB_STEERINGS] = {
+            "front_left_steering_joint", "front_right_steering_joint"
+        };
+        int i;
+
+        for (i=0; i<NB_WHEELS; i++) {
+            drive.wheel_joints[i] = model->GetJoint(wheel_names[i]);
+            if (!drive.wheel_joints[i])
+                return false;
+            // stop_erp == 0 means no position correction torques will act
+            drive.wheel_joints[i]->SetParam("stop_erp", 0, 0.0);
+            // Apply small damping to the joints
+            drive.wheel_joints[i]->SetParam("stop_cfm", 0, 10.0);
+        }
+        for (i=0; i<NB_STEERINGS; i++) {
+            drive.steering_joints[i] = model->GetJoint(steering_names[i]);
+            if (!drive.steering_joints[i])
+                return false;
+        }
+
+        init_geometry(drive, model);
+        return true;
+    }
+
+    /*
+      Measures the track widths and the wheel base from the anchors of the joints, in the
+      frame of the model. Falls back to the dimensions of 'rover.urdf' if they make no sense.
+     */
+    static void init_geometry(drive_state &drive, gazebo::physics::ModelPtr model)
+    {
+        const gazebo::math::Pose pose = model->GetWorldPose();
+        gazebo::math::Vector3 anchors[NB_STEERINGS + 2];
+        double front_track, rear_track, wheel_base;
+        int i;
+
+        for (i=0; i<NB_STEERINGS; i++)
+            anchors[i] = pose.rot.RotateVectorReverse(drive.steering_joints[i]->GetAnchor(0) - pose.pos);
+        for (i=0; i<2; i++)
+            anchors[NB_STEERINGS + i] = pose.rot.RotateVectorReverse(drive.wheel_joints[WHEEL_REAR_LEFT + i]->GetAnchor(0) - pose.pos);
+
+        front_track = anchors[STEERING_LEFT].y - anchors[STEERING_RIGHT].y;
+        rear_track  = anchors[NB_STEERINGS].y - anchors[NB_STEERINGS + 1].y;
+        wheel_base  = (anchors[STEERING_LEFT].x + anchors[STEERING_RIGHT].x
+                       - anchors[NB_STEERINGS].x - anchors[NB_STEERINGS + 1].x) / 2.0;
+        if (!(front_track > 0.0) || !(rear_track > 0.0) || !(wheel_base > 0.0)) {
+            front_track = ROVER_FRONT_TRACK_WIDTH;
+            rear_track  = ROVER_REAR_TRACK_WIDTH;
+            wheel_base  = ROVER_WHEEL_BASE_LENGTH;
+        }
+        drive.front_half_track_ratio = front_track / (2.0 * wheel_base);
+        drive.rear_half_track_ratio  = rear_track  / (2.0 * wheel_base);
+    }
+
+    static void apply_drive(drive_state &drive, const float *motor_speed, size_t nb_values)
+    {
+        if (nb_values <= 2)
+            return;
+
+        double steering = (500.0 - motor_speed[0]) * ROVER_STEERING_RATIO;     // [rad]
+        double speed = (motor_speed[2] - 500.0) / 80.0 + 0.0875;                // [rad/s] of a wheel
+        double t = tan(steering);
+        double front_left  = 1.0 - drive.front_half_track_ratio * t;
+        double front_right = 1.0 + drive.front_half_track_ratio * t;
+
+        drive.steering_joints[STEERING_LEFT]->SetPosition(0, clamp_steering(atan2(t, front_left)));
+        drive.steering_joints[STEERING_RIGHT]->SetPosition(0, clamp_steering(atan2(t, front_right)));
+
+        drive.wheel_joints[WHEEL_FRONT_LEFT]->SetVelocity(0, speed * sqrt(t * t + front_left * front_left));
+        drive.wheel_joints[WHEEL_FRONT_RIGHT]->SetVelocity(0, speed * sqrt(t * t + front_right * front_right));
+        drive.wheel_joints[WHEEL_REAR_LEFT]->SetVelocity(0, speed * (1.0 - drive.rear_half_track_ratio * t));
+        drive.wheel_joints[WHEEL_REAR_RIGHT]->SetVelocity(0, speed * (1.0 + drive.rear_half_track_ratio * t));
+    }
+
+    static double clamp_steering(double angle)
+    {
+        if (angle > ROVER_MAX_STEERING_ANGLE)
+            return ROVER_MAX_STEERING_ANGLE;
+        if (angle < -ROVER_MAX_STEERING_ANGLE)
+            return -ROVER_MAX_STEERING_ANGLE;
+        return angle;
+    }
+};
+
+
+#if defined(ARDUPILOT_VEHICLE_ROVER)
+typedef RoverTraits  VehicleTraits;
+#else
+typedef CopterTraits VehicleTraits;
+#endif
+
+#endif // VEHICLE_TRAITS_H
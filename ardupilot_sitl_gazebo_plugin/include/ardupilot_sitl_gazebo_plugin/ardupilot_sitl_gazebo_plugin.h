@@ -35,6 +35,7 @@
 #include "gazebo/common/Plugin.hh"
 #include "gazebo/msgs/msgs.hh"
 #include "gazebo/physics/physics.hh"
+#include "gazebo/sensors/sensors.hh"
 #include "gazebo/transport/transport.hh"
 #include "gazebo/util/system.hh"
 #include "gazebo/gui/GuiIface.hh"
@@ -48,6 +49,11 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 
+// Event-driven main loop
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+
 // ROS messages
 #include <mav_msgs/CommandMotorSpeed.h>
 #include <sensor_msgs/Imu.h>
@@ -55,6 +61,10 @@
 #include <sensor_msgs/NavSatFix.h>          // for the GPS fix
 #include <geometry_msgs/Vector3Stamped.h>   // for the GPS velocity fix
 #include <std_msgs/Empty.h>
+#include "ardupilot_sitl_gazebo_plugin/LockstepBarrierStats.h"
+#include "ardupilot_sitl_gazebo_plugin/LoopTimingStats.h"
+#include "ardupilot_sitl_gazebo_plugin/LapseLockRequest.h"
+#include "ardupilot_sitl_gazebo_plugin/LapseLockState.h"
 
 // This plugin implements a thread, based on boost, for the communication with Ardupilot
 #include <boost/date_time/posix_time/posix_time.hpp>
@@ -62,15 +72,36 @@
 #include <boost/bind.hpp>
 
 // Standard includes
+#include <atomic>
+#include <map>
 #include <string>
+#include <vector>
 #include <stdio.h>
 
 // Plugin's inner headers
 #include "SocketAPM.h"
+#include "ShmTransportAPM.h"
+#include "FdmWireFormat.h"
+#include "LockstepPacer.h"
+#include "TripleBuffer.h"
+#include "LatencyHistogram.h"
+#include "LapseLock.h"
+#include "ReplayLog.h"
+#include "ReplayCheck.h"
+#include "SensorScheduler.h"
+#include "RenderPipeline.h"
+#include "MeshPreloader.h"
+#include "RealtimeThread.h"
+#include "TelemetryRing.h"
+#include "VehicleTraits.h"
+#include "aircraft_plugin/CommandMailbox.h"
 
 // Plugin's services
 #include "ardupilot_sitl_gazebo_plugin/TakeApmLapseLock.h"
 #include "ardupilot_sitl_gazebo_plugin/ReleaseApmLapseLock.h"
+#include "ardupilot_sitl_gazebo_plugin/SaveWorldSnapshot.h"
+#include "ardupilot_sitl_gazebo_plugin/RestoreWorldSnapshot.h"
+#include "ardupilot_sitl_gazebo_plugin/DumpTelemetry.h"
 
 
 //--------------------------------------------
@@ -78,26 +109,70 @@
 #define ENABLED      1
 #define DISABLED     0
 
-#define SONAR_FRONT    ENABLED
+#define SONAR_FRONT    ENABLED       // also in the v2 FDM packets by default, see FDM_SENSORS
 
 //--------------------------------------------
 // URDF/XACRO models descriptions names
+// (default vehicle, when the plugin's SDF does not declare a list of <VEHICLE>)
+#if defined(ARDUPILOT_VEHICLE_ROVER)
+#define UAV_MODEL_NAME                 "rover"
+#else
 #define UAV_MODEL_NAME                 "iris"
+#endif
 #define UAV_MODEL_CG_LINK              "base_link"
 
 #define PARACHUTE_MODEL_NAME           "parachute_small"
 #define PARACHUTE_MODEL_ATTACH_LINK    "chute"
 
+// Parachutes inserted at startup (SDF PARACHUTE_PRELOAD) wait there, disabled, until deployed
+#define PARACHUTE_PARKING_ALTITUDE     -1000.0     // [m]
+#define PARACHUTE_PARKING_SPACING      10.0        // [m] along x, between the vehicles' parachutes
+
+// State of the parachute model of a vehicle
+#define PARACHUTE_NONE                 0       // not inserted, it is on deploy
+#define PARACHUTE_PRELOADING           1       // inserted at startup, not loaded yet
+#define PARACHUTE_LOADED               2       // loaded, parked at the beginning of the next step
+#define PARACHUTE_PARKED               3       // disabled, waiting for a deploy
+#define PARACHUTE_DEPLOYED             4       // joined to its vehicle
+
+// Ray sensors read by the direct FDM source (see 'sonar_sensor.urdf.xacro')
+#define SONAR_DOWN_SENSOR_NAME         "sonar"
+#define SONAR_FRONT_SENSOR_NAME        "sonar2"
+
 // All ROS topics emitted by this plugin with have the
 // namespace "/fdmUDP" prepended.
+// (vehicles' topics are prefixed by their own namespace, i.e. their model name by default)
 #define ROS_NAMESPACE     "/fdmUDP"
 
 
 //--------------------------------------------
 // Communication with Ardupilot
 
+// Ports of the first vehicle. Vehicle N (from 0) listens to servo packets on
+// PORT_DATA_FROM_ARDUPILOT + N * PORT_OFFSET_PER_VEHICLE, and sends the FDM to the next port,
+// which matches the port offsets of ArduPilot's SITL instances ('-I N').
 #define PORT_DATA_FROM_ARDUPILOT       9002
 #define PORT_DATA_TO_ARDUPILOT         9003
+#define PORT_OFFSET_PER_VEHICLE        10
+
+// Hosts of the UDP transport: the servo ports are bound to LISTEN_ADDRESS, the FDM is sent to
+// the APM_ADDRESS of each vehicle. Another address than the loopback runs ArduPilot on another node.
+#define LISTEN_ADDRESS_DEFAULT         "127.0.0.1"
+#define APM_ADDRESS_DEFAULT            "127.0.0.1"
+
+// Frames a vehicle answering with v2 servo packets may run ahead of its answers (SDF PIPELINE_WINDOW),
+// 0 for the strict lockstep
+#define PIPELINE_WINDOW_DEFAULT        0
+#define MAX_PIPELINE_WINDOW            16
+#define FDM_SEND_HISTORY               32      // send times kept to measure the round trips, > MAX_PIPELINE_WINDOW
+
+// Format of the FDM packets (SDF FDM_FORMAT, per vehicle)
+#define FDM_FORMAT_LEGACY              0       // 'fdm_packet', layout fixed by SONAR_FRONT
+#define FDM_FORMAT_V2                  1       // self-described, see 'FdmWireFormat.h'
+
+// Transport of the packets (SDF APM_TRANSPORT)
+#define APM_TRANSPORT_UDP              0       // loopback UDP sockets, on the ports above
+#define APM_TRANSPORT_SHM              1       // rings in a shared memory segment, see 'ShmTransportAPM.h'
 
 // Messages passed
 #define NB_SERVOS                 16
@@ -105,12 +180,80 @@
 
 #define SERVO_PARACHUTE           9
 
+// Motor speed commands published each step to the motor models
+#define MOTOR_SPEED_FRAME_ID      "quad"
+// The subscribers in gzserver hold the messages in their queues: one more for the message being
+// published, and one in a callback
+#define MOTOR_SPEED_MSG_POOL_SIZE (MOTOR_SPEED_SUBSCRIBER_QUEUE + 2)
+
+// Outputs of the motor speed commands (SDF MOTOR_COMMAND_OUTPUT, per vehicle)
+#define MOTOR_COMMAND_OUTPUT_ROS       0x01    // 'command/motor_speed' topic
+#define MOTOR_COMMAND_OUTPUT_DIRECT    0x02    // in-process mailbox of the model, see 'CommandMailbox.h'
+#define MOTOR_COMMAND_OUTPUT_BOTH      (MOTOR_COMMAND_OUTPUT_ROS | MOTOR_COMMAND_OUTPUT_DIRECT)
+
 #define STEP_SIZE_FOR_ARDUPILOT    0.0025      // in [s], = 400 Hz
 
+// Physics steps per ArduPilot frame: the physics runs at STEP_SIZE_FOR_ARDUPILOT / STEPS_PER_FRAME,
+// and ArduPilot still exchanges one servo/FDM packet per STEP_SIZE_FOR_ARDUPILOT
+#define STEPS_PER_FRAME            1           // default, SDF STEPS_PER_FRAME
+#define MAX_STEPS_PER_FRAME        20
+
+// IMU of a frame made of several physics steps (SDF IMU_SUBSTEP_MODE)
+#define IMU_SUBSTEP_LAST           0           // state of the last step, as a sampled sensor
+#define IMU_SUBSTEP_AVERAGE        1           // angular velocity and acceleration averaged over the frame's steps
+
+// Without any servo packet during this time, the connection with ArduPilot is considered off
+#define APM_INPUT_TIMEOUT_MS       100         // [ms]
+
+// Barrier of the vehicles: the world is stepped once every connected ArduPilot has sent its
+// servo packet, or once the first packet of the batch has waited this long for the stragglers
+#define STRAGGLER_TIMEOUT_MS       20          // [ms] default, SDF STRAGGLER_TIMEOUT_MS
+
+// Wall-clock period of the loop statistics (barrier waits, timing of the steps)
+#define LOOP_STATS_PERIOD          1.0         // [s]
+
+// Replay of a log, without ArduPilot (REPLAY_FILE)
+#define REPLAY_MODELS_TIMEOUT      60.0        // [s] wall time, for the vehicle models to be spawned before the replay starts
+
+// World snapshots, requested by the ROS services and run by the loop thread
+#define SNAPSHOT_NONE              0
+#define SNAPSHOT_SAVE              1
+#define SNAPSHOT_RESTORE           2
+
+// Telemetry dumps (SDF TELEMETRY_SECONDS), on request or after an incident
+#define TELEMETRY_DUMP_DIR_DEFAULT "/tmp"      // SDF TELEMETRY_DUMP_DIR, where the dumps go
+#define TELEMETRY_DUMP_LINK_LOST   0x01        // an ArduPilot connection went off
+#define TELEMETRY_DUMP_LAPSE_TIMEOUT 0x02      // a lapse-lock holder exceeded its time
+#define TELEMETRY_MAX_AUTO_DUMPS   16          // per run, so a flapping connection does not fill the disk
+
+// Events returned by 'wait_loop_event()'
+#define LOOP_EVENT_NONE            0x00        // timeout, nothing happened
+#define LOOP_EVENT_APM_INPUT       0x01        // a servo packet from ArduPilot is readable
+#define LOOP_EVENT_WAKEUP          0x02        // another thread woke up the loop (lapse-lock, pause, shutdown)
+
+#define LOOP_EVENT_ID_WAKEUP       ((uint64_t)-1)   // epoll data of the wake-up eventfd (vehicles use their index)
+#define LOOP_MAX_EVENTS            32          // max nb of epoll events handled per wake-up
+
+
+//--------------------------------------------
+// Source of the FDM data
+#define FDM_SOURCE_ROS       0         // sensor plugins' ROS topics (IMU ground truth, Hector GPS, range finders)
+#define FDM_SOURCE_DIRECT    1         // sampled from the Gazebo model at the end of each step, no ROS involved
+
+// GPS home of the direct FDM source, must match 'gps_home_location.xacro' for the ROS source
+#define REFERENCE_LATITUDE_DEFAULT     -35.363261    // [degrees]
+#define REFERENCE_LONGITUDE_DEFAULT    149.165230    // [degrees]
+#define REFERENCE_ALTITUDE_DEFAULT     584.0         // [m] above sea level
+#define REFERENCE_HEADING_DEFAULT      0.0           // [degrees]
+
+// WGS84 ellipsoid, same model as Hector's GPS plugin
+#define WGS84_EQUATORIAL_RADIUS        6378137.0          // [m]
+#define WGS84_FLATTENING               (1.0/298.257223563)
 
 
 #define MAX_LAPSE_LOCK_ON_MODEL_INSERT   5     // [s]
 #define MAX_LAPSE_LOCK_DEFAULT           1     // [s]
+#define MAX_LAPSE_LOCK_TOPIC_TAKES       256   // takes of the topics not released yet, beyond which the expired ones are forgotten
 
 
 //--------------------------------------------
@@ -120,11 +263,11 @@
 
 //--------------------------------------------
 // Log/Debug
+#if defined(ARDUPILOT_VEHICLE_ROVER)
+#define PLUGIN_LOG_PREPEND       "ROVER: "
+#else
 #define PLUGIN_LOG_PREPEND       "ARI: "
-
-// Uncomment the following lines to activate some debug
-//#define DEBUG_DISP_GPS_POSITION
-//#define DEBUG_DISP_MOTORS_COMMANDS
+#endif
 
 
 
@@ -133,6 +276,9 @@ namespace gazebo
 
 class ArdupilotSitlGazeboPlugin : public WorldPlugin
 {
+  protected:
+    struct vehicle_slot;
+    
   public:
         
     // Constructor
@@ -143,8 +289,8 @@ class ArdupilotSitlGazeboPlugin : public WorldPlugin
     void Load(physics::WorldPtr world, sdf::ElementPtr sdf);
           
     // MAIN LOOP related methods ---------------
-    void take_lapseLock(float max_holder_lock_duration = MAX_LAPSE_LOCK_DEFAULT);
-    bool release_lapseLock();
+    uint32_t take_lapseLock(float max_holder_lock_duration = MAX_LAPSE_LOCK_DEFAULT, const std::string &holder_name = "plugin");
+    bool release_lapseLock(uint32_t token, const std::string &holder_name = "plugin");
     
     // GAZEBO related methods ------------------
     void on_gazebo_update();
@@ -152,19 +298,28 @@ class ArdupilotSitlGazeboPlugin : public WorldPlugin
     void on_gazebo_modelInfo(ConstModelPtr &_msg);
   
     // ROS related methods ---------------------
-    void imu_callback(const sensor_msgs::Imu &imu_msg);
-    void gps_callback(const sensor_msgs::NavSatFix &gps_fix_msg);
-    void gps_velocity_callback(const geometry_msgs::Vector3Stamped &gps_velocity_fix_msg);
-      void sonar_down_callback(const sensor_msgs::Range &sonar_range_msg);
+    void imu_callback(const sensor_msgs::ImuConstPtr &imu_msg, vehicle_slot *vehicle);
+    void gps_callback(const sensor_msgs::NavSatFixConstPtr &gps_fix_msg, vehicle_slot *vehicle);
+    void gps_velocity_callback(const geometry_msgs::Vector3StampedConstPtr &gps_velocity_fix_msg, vehicle_slot *vehicle);
+    void sonar_down_callback(const sensor_msgs::RangeConstPtr &sonar_range_msg, vehicle_slot *vehicle);
   #if SONAR_FRONT == ENABLED
-    void sonar_front_callback(const sensor_msgs::Range &sonar_range_msg);
+    void sonar_front_callback(const sensor_msgs::RangeConstPtr &sonar_range_msg, vehicle_slot *vehicle);
   #endif
+    void manual_drive_callback(const mav_msgs::CommandMotorSpeedConstPtr &motor_speed_msg, vehicle_slot *vehicle);
     
     // Services:
     bool service_take_lapseLock(ardupilot_sitl_gazebo_plugin::TakeApmLapseLock::Request  &req,
                                 ardupilot_sitl_gazebo_plugin::TakeApmLapseLock::Response &res);
     bool service_release_lapseLock(ardupilot_sitl_gazebo_plugin::ReleaseApmLapseLock::Request  &req,
                                    ardupilot_sitl_gazebo_plugin::ReleaseApmLapseLock::Response &res);
+    bool service_save_snapshot(ardupilot_sitl_gazebo_plugin::SaveWorldSnapshot::Request  &req,
+                               ardupilot_sitl_gazebo_plugin::SaveWorldSnapshot::Response &res);
+    bool service_restore_snapshot(ardupilot_sitl_gazebo_plugin::RestoreWorldSnapshot::Request  &req,
+                                  ardupilot_sitl_gazebo_plugin::RestoreWorldSnapshot::Response &res);
+    bool service_dump_telemetry(ardupilot_sitl_gazebo_plugin::DumpTelemetry::Request  &req,
+                                ardupilot_sitl_gazebo_plugin::DumpTelemetry::Response &res);
+    void lapseLock_take_callback(const ardupilot_sitl_gazebo_plugin::LapseLockRequestConstPtr &msg);
+    void lapseLock_release_callback(const ardupilot_sitl_gazebo_plugin::LapseLockRequestConstPtr &msg);
 
     
     
@@ -177,7 +332,8 @@ class ArdupilotSitlGazeboPlugin : public WorldPlugin
     };
 
     /*
-      reply packet sent from Gazebo to ArduPilot
+      reply packet sent from Gazebo to ArduPilot, legacy format
+      (the v2 format is described in 'FdmWireFormat.h')
      */
     struct fdm_packet {
       double timestamp;                             // [seconds] simulation time
@@ -197,91 +353,442 @@ class ArdupilotSitlGazeboPlugin : public WorldPlugin
       
     };
     
+    /*
+      Parts of the FDM packet, each one written by a single sensor callback.
+      They are assembled into a 'fdm_packet' when sent to ArduPilot.
+     */
+    struct fdm_imu_block {
+      double orientation_quat[4];                   // rotation quaternion, APM conventions, from body to earth
+      double angular_velocity_rpy[3];               // [rad/s]
+      double linear_acceleration_xyz[3];            // [m/s/s] in NED, body frame
+      double position_xyz[3];                       // [m] in NED, from Gazebo's map origin (0,0,0)
+      double sample_time;                           // [seconds] simulation time of the sample
+    };
+    
+    struct fdm_gps_block {
+      double position_latlonalt[3];                 // [degrees], altitude is Up
+      double sample_time;                           // [seconds]
+    };
+    
+    struct fdm_gps_velocity_block {
+      double velocity_xyz[3];                       // [m/s] in NED
+      double sample_time;                           // [seconds]
+    };
+    
+    struct fdm_range_block {
+      double range;                                 // [m]
+      double sample_time;                           // [seconds]
+    };
+    
+    // Every block of a vehicle, as saved by a snapshot
+    struct fdm_state_block {
+      double                      timestamp;        // [seconds]
+      fdm_imu_block               imu;
+      fdm_gps_block               gps;
+      fdm_gps_velocity_block      gps_velocity;
+      fdm_range_block             sonar_down;
+      fdm_range_block             sonar_front;
+    };
+    
+    /*
+      Everything related to one vehicle, i.e. to one ArduPilot SITL instance.
+      All vehicles share the same world, and are advanced by the same steps.
+     */
+    struct vehicle_slot {
+      vehicle_slot();
+      ~vehicle_slot();
+      
+      // Configuration
+      int                         index;                  // position in '_vehicles'
+      std::string                 model_name;             // name of the model in Gazebo
+      std::string                 ros_namespace;          // prefix of the vehicle's ROS topics
+      std::string                 sonar_topic_prefix;     // prefix of the range finders topics
+      std::string                 parachute_name;         // name of the vehicle's parachute model, once inserted
+      int                         port_from_ardupilot;    // servo packets are received on this port
+      int                         port_to_ardupilot;      // FDM packets are sent to this port
+      std::string                 apm_address;            // host of its ArduPilot, receives the FDM packets
+      int                         pipeline_window;        // [frames] it may run ahead of the servo packets
+      int                         nb_motor_speed;         // nb of servos forwarded as motor speeds
+      int                         fdm_format;             // FDM_FORMAT_LEGACY or FDM_FORMAT_V2
+      int                         motor_command_output;   // MOTOR_COMMAND_OUTPUT_xxx flags
+      FdmLayout                   fdm_layout;             // sensor blocks of the v2 packets
+      
+      // Communication with its ArduPilot
+      ApmTransport               *fdm_to_ardu;
+      ApmTransport               *control_from_ardu;
+      bool                        is_control_socket_open;
+      bool                        is_fdm_socket_open;
+      bool                        is_input_ready;         // a servo packet may be readable
+      bool                        has_new_servo;          // a servo packet was received for the current step
+      bool                        is_connection_alive;    // takes part in the barrier
+      // Changes of the connection since the last statistics, logged with them rather than in a step
+      unsigned int                nb_link_connects;
+      unsigned int                nb_link_losses;
+      ros::WallTime               last_input_walltime;
+      
+      // Sequences: the FDM packets are numbered, and the v2 servo packets echo the last one
+      // received, so that a remote ArduPilot can be pipelined (see 'is_vehicle_ready()')
+      bool                        is_servo_v2;            // its last servo packet was a v2 one
+      uint32_t                    fdm_sequence;           // of the last FDM packet sent, 0 if none
+      uint32_t                    fdm_sequence_answered;  // echoed by the last servo packet applied
+      uint32_t                    servo_sequence;         // of the last servo packet applied
+      int64_t                     fdm_send_ns[FDM_SEND_HISTORY];  // [ns] wall time of the sends, by sequence
+      
+      // Barrier statistics, since the last publication
+      unsigned int                stats_nb_waits;         // nb of steps the vehicle took part in
+      unsigned int                stats_nb_missed;        // nb of steps released without its packet
+      unsigned int                stats_nb_dropped;       // nb of servo packets superseded by a newer one before use
+      double                      stats_wait_sum;         // [s] time its packet was held waiting for the others
+      double                      stats_wait_max;         // [s]
+      unsigned int                stats_nb_lost;          // nb of servo packets never received (sequence gaps)
+      unsigned int                stats_nb_reordered;     // nb of servo packets older than one already applied
+      unsigned int                stats_nb_round_trips;
+      double                      stats_round_trip_sum;   // [s] FDM sent -> servo packet echoing it received
+      double                      stats_round_trip_max;   // [s]
+      uint32_t                    stats_ahead_max;        // [frames] largest lead over the servo packets
+      unsigned int                stats_nb_motor_speed_skipped;  // motor speed messages not published, the pool being held
+      
+      // Servo packets applied and FDM packets sent, of the last TELEMETRY_SECONDS (only written by the loop thread)
+      TelemetryRing               telemetry;
+      
+      // FDM state: one wait-free buffer per writer (sensor callback, or Gazebo update for the time),
+      // all read by the loop thread in 'send_apm_output()'
+      TripleBuffer<double>                  fdm_timestamp;      // [seconds] simulation time
+      TripleBuffer<fdm_imu_block>           fdm_imu;
+      TripleBuffer<fdm_gps_block>           fdm_gps;
+      TripleBuffer<fdm_gps_velocity_block>  fdm_gps_velocity;
+      TripleBuffer<fdm_range_block>         fdm_sonar_down;
+    #if SONAR_FRONT == ENABLED
+      TripleBuffer<fdm_range_block>         fdm_sonar_front;
+    #endif
+      
+      float                       cmd_motor_speed[NB_SERVOS];    // Local copy of the motor speed command, in [rad/s]
+      
+      // ROS
+      ros::Subscriber             imu_subscriber;
+      ros::Subscriber             sonar_down_subscriber;
+      ros::Subscriber             sonar_front_subscriber;
+      ros::Subscriber             gps_subscriber;
+      ros::Subscriber             gps_velocity_subscriber;
+      ros::Publisher              motorSpd_publisher;
+      mav_msgs::CommandMotorSpeedPtr motor_speed_msgs[MOTOR_SPEED_MSG_POOL_SIZE];
+      unsigned int                next_motor_speed_msg;
+      std::shared_ptr<CommandMailbox> command_mailbox;    // read by the model plugin at each step, or by the drive
+      ros::Subscriber             manual_drive_subscriber;
+      std::shared_ptr<CommandMailbox> manual_drive_mailbox;   // commands of the 'cmd_vel' topic, for the drive
+      
+      // Gazebo
+      gazebo::physics::ModelPtr   uav_model;
+      gazebo::physics::ModelPtr   parachute_model;
+      gazebo::physics::JointPtr   uav_chute_joint;
+      bool                        is_parachute_available;
+      std::atomic<int>            parachute_state;        // PARACHUTE_xxx
+      std::atomic<bool>           is_parachute_deploy_requested;  // deploy of a preloaded parachute, at the next step
+      uint32_t                    parachute_lapse_token;  // lapse-lock held while its model loads
+      
+      // Drive of the model, VehicleTraits::HAS_DRIVE only, only used by Gazebo's update thread
+      VehicleTraits::drive_state  drive;
+      bool                        is_drive_bound;
+      bool                        is_drive_bind_failed;   // a joint is missing, reported once
+      
+      // Direct FDM source, only used by Gazebo's update thread
+      gazebo::physics::LinkPtr        direct_cg_link;
+      std::string                     direct_sonar_down_name;   // scoped name of the ray sensor, empty if none
+      std::string                     direct_sonar_front_name;
+      gazebo::sensors::RaySensorPtr   direct_sonar_down;
+      gazebo::sensors::RaySensorPtr   direct_sonar_front;
+      gazebo::math::Vector3           direct_angular_velocity_sum;   // [rad/s] over the steps of the frame, IMU_SUBSTEP_AVERAGE
+      gazebo::math::Vector3           direct_acceleration_sum;       // [m/s/s]
+      int                             direct_nb_substeps;
+      SensorScheduler                 sensor_scheduler;              // which sensors are sampled at the end of a frame (SENSOR_RATES)
+      
+      // FDM state of a restored snapshot, set by the loop thread and applied by Gazebo's update
+      // thread, the writer of 'fdm_timestamp' (and of the direct source): see 'apply_fdm_restore()'
+      fdm_state_block                 fdm_restore;
+      std::atomic<bool>               is_fdm_restore_pending;
+      
+      // Cameras of the model, in the render pipeline once they all exist (only used by the loop thread)
+      bool                            is_render_bound;
+    };
+    
+    /*
+      Saved state of the world, see 'save_snapshot()'.
+      Models and links are kept by name, so a model removed since is only skipped.
+     */
+    struct snapshot_link {
+      std::string                 name;
+      gazebo::math::Pose          pose;                   // in the world
+      gazebo::math::Vector3       linear_velocity;        // [m/s] of its center of gravity, in the world
+      gazebo::math::Vector3       angular_velocity;       // [rad/s] in the world
+    };
+    
+    struct snapshot_model {
+      std::string                 name;
+      gazebo::math::Pose          pose;
+      std::vector<snapshot_link>  links;
+    };
+    
+    struct snapshot_vehicle {
+      fdm_state_block             fdm;
+      int                         parachute_state;        // PARACHUTE_xxx
+      bool                        is_parachute_available;
+      float                       cmd_motor_speed[NB_SERVOS];
+    };
+    
+    struct world_snapshot {
+      gazebo::common::Time        sim_time;
+      std::vector<snapshot_model> models;                 // every non-static model
+      std::vector<snapshot_vehicle> vehicles;             // same order as '_vehicles'
+      // No lapse-lock: it is freed on restore, see 'restore_snapshot()'
+    };
+    
     // Initialization methods ------------------
     bool init_ros_side();
     bool init_gazebo_side(physics::WorldPtr world, sdf::ElementPtr sdf);
     bool init_ardupilot_side();
+    bool init_vehicles(sdf::ElementPtr sdf);
+    void start_mesh_preload(physics::WorldPtr world, sdf::ElementPtr sdf);
+    void finish_mesh_preload();
+    vehicle_slot* add_vehicle(sdf::ElementPtr vehicle_sdf, const std::string &default_model, int default_nb_motor_speed);
       
     // MAIN LOOP related methods ---------------
     void loop_thread();
-    bool check_lapseLock(float loop_elapsed_dt);
+    void replay_loop_thread();
+    bool wait_replay_models();
+    void end_replay(int status);
+    bool request_snapshot(int type, const std::string &name, double *sim_time, std::string *message);
+    void handle_snapshot_request();
+    bool save_snapshot(const std::string &name, double *sim_time, std::string *message);
+    bool restore_snapshot(const std::string &name, double *sim_time, std::string *message);
+    void restore_parachute(vehicle_slot *vehicle, const snapshot_vehicle &saved);
+    void resync_ardupilot();
+    bool is_render_pipeline_full();
+    void wait_render_image();
+    void on_render_image();
+    void bind_render_sensors();
+    bool init_loop_events();
+    void init_loop_realtime();
+    void report_link_events();
+    int  wait_loop_event(int timeout_ms);
+    bool wait_loop_wakeup(int timeout_ms);
+    void wake_loop_thread();
+    bool check_lapseLock(float *remaining_lock = NULL);
     void clear_lapseLock();
+    bool is_barrier_complete();
+    bool is_vehicle_ready(const vehicle_slot *vehicle) const;
+    void release_barrier(const ros::WallTime &now, bool is_timeout);
 
     // ARDUPILOT related methods --------------
-    bool open_control_socket();
-    bool open_fdm_socket();
-    bool receive_apm_input();
-    void send_apm_output();
+    bool open_control_socket(vehicle_slot *vehicle);
+    bool open_fdm_socket(vehicle_slot *vehicle);
+    bool open_shm_transport(vehicle_slot *vehicle);
+    bool receive_apm_input(vehicle_slot *vehicle);
+    bool check_servo_sequence(vehicle_slot *vehicle, const servo_v2_header &header, unsigned int nb_superseded, int64_t now_ns);
+    void apply_apm_input(vehicle_slot *vehicle, const servo_packet &pkt);
+    void send_apm_output(vehicle_slot *vehicle);
+    size_t pack_fdm_v2(vehicle_slot *vehicle, const fdm_packet &pkt, const fdm_sample_times_block &sample_times, char *buf);
+    bool init_fdm_format(vehicle_slot *vehicle, sdf::ElementPtr vehicle_sdf);
+    bool init_apm_endpoint(vehicle_slot *vehicle, sdf::ElementPtr vehicle_sdf);
+    bool init_sensor_rates(vehicle_slot *vehicle, sdf::ElementPtr vehicle_sdf);
+    bool init_motor_command_output(vehicle_slot *vehicle, sdf::ElementPtr vehicle_sdf);
+    void output_motor_commands(vehicle_slot *vehicle);
+    bool init_replay_log();
+    
+    // TELEMETRY related methods --------------
+    void init_telemetry();
+    void stop_telemetry();
+    void record_telemetry_step(int64_t start_ns, int64_t wait_servo_ns, int64_t step_ns, int64_t pace_ns,
+                               unsigned int nb_vehicles, uint32_t flags);
+    void request_telemetry_dump(int reason);
+    void telemetry_dump_thread();
+    bool dump_telemetry(const std::string &name, const std::string &reason, std::string *written_path,
+                        size_t *nb_records, std::string *message);
 
     
     // GAZEBO related methods ------------------
     void step_gazebo_sim();
-    void check_parachute_cmd(float servo_parachute);
-    void load_parachute_model();
-    void on_parachute_model_loaded();
+    void check_parachute_cmd(vehicle_slot *vehicle, float servo_parachute);
+    void load_parachute_model(vehicle_slot *vehicle);
+    void on_parachute_model_loaded(vehicle_slot *vehicle);
+    void preload_parachute_model(vehicle_slot *vehicle);
+    void park_parachute_model(vehicle_slot *vehicle);
+    void deploy_parachute_model(vehicle_slot *vehicle);
+    bool attach_parachute(vehicle_slot *vehicle);
+    void on_gazebo_update_begin();
+    void update_drive(vehicle_slot *vehicle);
+    bool init_fdm_direct();
+    bool bind_fdm_direct(vehicle_slot *vehicle);
+    void sample_fdm_direct(vehicle_slot *vehicle, bool is_frame_end, const common::Time &sim_time);
+    void apply_fdm_restore(vehicle_slot *vehicle);
+    void throttle_ray_sensor(vehicle_slot *vehicle, const sensors::RaySensorPtr &ray, int sensor);
   
     
     
     // ROS related methods ---------------------
+    void init_vehicle_ros_side(vehicle_slot *vehicle);
     void quat_to_euler(float q1, float q2, float q3, float q4,
                        float &roll, float &pitch, float &yaw);
-    void publish_commandMotorSpeed();
+    void publish_commandMotorSpeed(vehicle_slot *vehicle);
+    void publish_barrier_stats(const ros::WallTime &now);
+    void publish_loop_timing_stats(const ros::WallTime &now);
+    void publish_lapseLock_state(const std::string &process_id, uint32_t request_id, bool is_taken);
     
     
     // Node Handles
     
     // Gazebo messages / data
     gazebo::physics::WorldPtr   _parent_world;
-    gazebo::physics::ModelPtr   _uav_model;
-    gazebo::physics::ModelPtr   _parachute_model;
-    gazebo::physics::LinkPtr    _chute_link_on_uav;
-    gazebo::physics::JointPtr   _uav_chute_joint;
     sdf::ElementPtr             _sdf;
     transport::SubscriberPtr    _controlSub;      // Subscriber used to receive updates on world_control topic.
     transport::SubscriberPtr    _modelInfoSub;
   
     bool                        _isSimPaused;     // Flag to hold the simulation (pause)
     bool                        _timeMsgAlreadyDisplayed;  // for debug of the time step
-    bool                        _is_parachute_available;
+    
+    // FDM source
+    int                         _fdm_source;      // FDM_SOURCE_ROS or FDM_SOURCE_DIRECT
+    double                      _reference_latitude;       // [degrees] GPS home of the direct source
+    double                      _reference_longitude;      // [degrees]
+    double                      _reference_altitude;       // [m]
+    double                      _reference_heading;        // [rad]
+    double                      _radius_north;             // [m] ellipsoid radii at the reference latitude
+    double                      _radius_east;              // [m]
+    
+    // Physics steps of an ArduPilot frame
+    int                         _steps_per_frame;
+    int                         _imu_substep_mode;         // IMU_SUBSTEP_LAST or IMU_SUBSTEP_AVERAGE
+    bool                        _parachute_preload;        // parachutes inserted at startup, see 'preload_parachute_model()'
+    int                         _substep_index;            // steps done in the current frame, only used by Gazebo's update thread
     
     // ROS messages
     ros::NodeHandle*            _rosnode;
             
     ros::ServiceServer          _service_take_lapseLock;
     ros::ServiceServer          _service_release_lapseLock;
+    ros::ServiceServer          _service_save_snapshot;
+    ros::ServiceServer          _service_restore_snapshot;
+    ros::ServiceServer          _service_dump_telemetry;
+    ros::Publisher              _barrier_stats_publisher;
+    ros::Publisher              _loop_timing_publisher;
     
-    ros::Subscriber             _imu_subscriber;
-    ros::Subscriber             _sonar_down_subscriber;
-    ros::Subscriber             _sonar_front_subscriber;
-    ros::Subscriber             _gps_subscriber;
-    ros::Subscriber             _gps_velocity_subscriber;
+    // Lapse-lock topics, for the processes which take it often (e.g. each camera frame)
+    ros::Subscriber             _lapseLock_take_subscriber;
+    ros::Subscriber             _lapseLock_release_subscriber;
+    ros::Publisher              _lapseLock_state_publisher;
+    std::map<std::pair<std::string, uint32_t>, uint32_t> _lapseLock_topic_tokens;   // (process_id, request_id) -> token
+    boost::mutex                _lapseLock_topic_mutex;
     
-    ros::Publisher              _motorSpd_publisher;
-        
-    float                       _cmd_motor_speed[NB_SERVOS_MOTOR_SPEED];    // Local copy of the motor speed command, in [rad/s]
+    // Vehicles, one per ArduPilot SITL instance
+    //  Filled once in 'Load()', then only read: slots can be referenced by pointer from callbacks.
+    std::vector<vehicle_slot*>  _vehicles;
     
-    // Vehicle parameters
-    std::string                 _modelName;
-    int 			            _nbMotorSpeed;
+    // Barrier:
+    //  A batch opens with the first servo packet after a step. The received packets are held
+    //  until every connected vehicle has sent one, or until the straggler timeout, then the world
+    //  is stepped once and every vehicle of the batch gets its FDM.
+    //  A vehicle which stays silent for APM_INPUT_TIMEOUT_MS leaves the barrier.
+    bool                        _is_batch_open;
+    ros::WallTime               _batch_open_walltime;
+    int                         _straggler_timeout_ms;      // [ms]
+    unsigned int                _stats_nb_batches;          // nb of steps since the last statistics
+    unsigned int                _stats_nb_timeouts;         // nb of those released by the straggler timeout
+    uint32_t                    _batch_index;               // nb of batches released since the start, tags the replay records
+    ros::WallTime               _stats_walltime;            // start of the statistics period
+    
+    // Timing of the loop, since the last statistics:
+    //  Where the step budget goes, to tell a physics-bound world (step) from an I/O-bound one
+    //  (wait_servo, send). Only modified by the loop thread.
+    LatencyHistogram            _timing_wait_servo;         // previous FDM sent -> every servo packet in
+    LatencyHistogram            _timing_step;               // 'step_gazebo_sim()'
+    LatencyHistogram            _timing_pace;               // pacer sleep
+    LatencyHistogram            _timing_fdm_assembly;       // per FDM packet
+    LatencyHistogram            _timing_send;               // per FDM packet
+    int64_t                     _timing_batch_end_ns;       // [ns] end of the previous batch, 0 if none to compare with
+    unsigned int                _stats_nb_sim_steps;        // nb of Gazebo steps actually run (not paused)
+    unsigned int                _stats_nb_render_waits;     // nb of loop iterations held by the render pipeline
     
     // Timing
+    LockstepPacer               _pacer;           // wall-clock pacing of the steps (realtime, speedup, afap)
     ros::Duration               _control_period;
     ros::Time                   _last_update_sim_time_ros;
     ros::Time                   _last_write_sim_time_ros;
     
     event::ConnectionPtr        _updateConnection;
-  
-    SocketAPM *_sock_fdm_to_ardu;
-    SocketAPM *_sock_control_from_ardu;
-
-    bool _is_control_socket_open;
-    bool _is_fdm_socket_open;
-
-    fdm_packet                  _fdm;
-    boost::mutex                _fdm_mutex;
+    event::ConnectionPtr        _updateBeginConnection;    // only with the preloaded parachutes, or a drive
     
     boost::thread               _callback_loop_thread;
     
+    // Events waking up the main loop:
+    //  The loop thread sleeps in 'epoll_wait()' until either a servo packet is readable
+    //  on a vehicle's control socket, or another thread signals '_loop_wakeup_fd' (lapse-lock release,
+    //  pause toggled, shutdown). So each Gazebo step is triggered as soon as the packet arrives.
+    RealtimeThread              _loop_realtime;             // CPUs, priority and memory locking of the loop thread
+    int                         _loop_epoll_fd;
+    int                         _loop_wakeup_fd;            // eventfd
+    
+    // Shared memory transport:
+    //  Rings have no file descriptor: the loop sleeps on the segment's doorbell instead of epoll,
+    //  rung by every ArduPilot after a servo packet, and by 'wake_loop_thread()'.
+    int                         _apm_transport;             // APM_TRANSPORT_UDP or APM_TRANSPORT_SHM
+    std::string                 _listen_address;            // servo ports of the UDP transport, SDF LISTEN_ADDRESS
+    std::string                 _shm_name;
+    ShmSegmentAPM               _shm_segment;
+    uint32_t                    _shm_doorbell_seen;         // doorbell value of the last wait
+    
+    // Replay log:
+    //  With RECORD_FILE, every servo packet received and FDM packet sent is logged, see 'ReplayLog.h'.
+    //  With REPLAY_FILE, no ArduPilot is connected: the main loop is 'replay_loop_thread()', which
+    //  feeds the recorded servo packets to the vehicles, batch by batch. Both can be combined, to
+    //  record the FDM of a replay.
+    std::string                 _record_file;
+    std::string                 _replay_file;
+    ReplayRecorder              _recorder;
+    ReplayReader                _replay_reader;
+    bool                        _is_replay;                 // REPLAY_FILE is open, set once before the first step
+    ReplayCheck                 _replay_check;              // FDM of the replay against the recorded one, tolerances of SDF REPLAY_TOLERANCES
+    
+    // Telemetry:
+    //  The last TELEMETRY_SECONDS of the loop are kept in memory, in rings filled by the loop thread
+    //  without a lock nor a log: each vehicle's packets, and the timing of the steps here. They are
+    //  dumped on request (service 'dump_telemetry'), or by '_telemetry_thread' once the loop notes
+    //  an incident, so the loop never writes to the disk. See 'TelemetryRing.h'.
+    double                      _telemetry_seconds;         // [s], 0 to disable
+    std::string                 _telemetry_dump_dir;
+    TelemetryRing               _telemetry_steps;
+    boost::thread               _telemetry_thread;
+    boost::mutex                _telemetry_dump_mutex;      // one dump at a time
+    boost::mutex                _telemetry_request_mutex;   // the pending reasons, and the stop
+    boost::condition_variable   _telemetry_request_cond;
+    int                         _telemetry_request_reasons; // TELEMETRY_DUMP_xxx flags, not dumped yet
+    bool                        _is_telemetry_stopping;
+    unsigned int                _nb_telemetry_auto_dumps;   // requested by the loop, up to TELEMETRY_MAX_AUTO_DUMPS
+    
+    // Render pipeline:
+    //  The cameras render concurrently with the physics, up to RENDER_PIPELINE_DEPTH of their frames
+    //  behind the simulation time; the loop is only held beyond that, see 'RenderPipeline.h'.
+    //  While held, the loop is woken up by the images of the cameras.
+    std::atomic<bool>           _is_render_waiting;         // the loop waits for an image, see 'on_render_image()'
+    RenderPipeline              _render_pipeline;           // (after: its callbacks are disconnected first)
+    
+    // Mesh preloader:
+    //  The meshes of the world are parsed by MESH_PRELOAD_THREADS threads while the plugin
+    //  initializes, then registered in Gazebo at the end of 'Load()', see 'MeshPreloader.h'.
+    MeshPreloader               _mesh_preloader;
+    
+    // World snapshots:
+    //  A service call posts its request, then waits for the loop thread to run it between two steps:
+    //  the loop thread is the only one stepping the world and reading the FDM, and it drops the
+    //  barrier of the ArduPilots after a restore. Kept in memory, by name, only used by the loop thread.
+    std::map<std::string, world_snapshot> _snapshots;
+    boost::mutex                _snapshot_service_mutex;    // one request at a time
+    boost::mutex                _snapshot_mutex;            // the pending request and its result
+    boost::condition_variable   _snapshot_cond;
+    std::atomic<int>            _snapshot_request;          // SNAPSHOT_xxx, SNAPSHOT_NONE once done
+    std::string                 _snapshot_request_name;
+    bool                        _snapshot_success;
+    double                      _snapshot_sim_time;         // [s]
+    std::string                 _snapshot_message;
+    
     // LapseLock:
     //  A calling process can block the main loop from running, for a specified maximum time (wall-time, not sim time).
     //  The main loop is resumed if the calling process releases the lock, of if the time has elapsed.
@@ -293,22 +800,11 @@ class ArdupilotSitlGazeboPlugin : public WorldPlugin
     //      happen. However if the plugin is known to not be able to run at real-time, then it should
     //      make use of the lapse-lock to slow down the simulation. For example, the camera recorder plugin.
     
-    // Identified limit of LapseLock:
-    //  Currently their is no memory/identification of processes holding the lapse-lock, only a counter.
-    //  With this system issues might arise when the following situation occurs:
-    //
-    //      process A takes lapse-lock for 5 seconds, meanwhile it makes a long computation (e.g. 8 seconds long)
-    //      simulation is paused (lapse-lock > 0)
-    //      ... 5 seconds pass on wall clock ...
-    //      simulation is resumed (it resets nbHolders to 0)
-    //      process B takes lapse-lock for 5 seconds, meanwhile it makes a long computation -> nbHolders = 1
-    //      simulation is paused (lapse-lock > 0)
-    //      process A finishes its computation, and calls the release method -> nbHolders = 0 -> _loop_lapseLock = 0
-    //      simulation is resumed, however process B is not finished !
-    
-    float                       _loop_lapseLock;            // [s] blocks the main loop until release (-> 0), or if the timer is elapsed
-    int                         _nbHolders_lapseLock;       // [1] number of calling processes to the lapselock (case of multiple lockers)
-    boost::mutex                _lapseLock_mutex;           // to protect the lapse-lock from simulatenous modifications
+    // Each holder gets a token and its own deadline: a holder which exceeds its time only
+    // frees itself, the others keep the lock until their release or their own deadline.
+    // Meanwhile the loop sleeps until the earliest deadline, or until a release wakes it up.
+    
+    LapseLock                   _lapseLock;
     
 };
 
@@ -0,0 +1,97 @@
+#!/usr/bin/env python
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""
+Prints a telemetry dump of the plugin (see 'TelemetryRing.h') as CSV, one record per line:
+
+    telemetry_dump.py <dump.bin> [--type servo|fdm|step] [--vehicle <index>]
+
+Columns: type, vehicle, batch, sim_time, then the fields of the record:
+    servo   servo0 ... servo15
+    fdm     sequence (0 for the legacy format), timestamp, gyro_rpy[3], accel_xyz[3],
+            quat[4], velocity_ned[3], position_ned[3], lat, lon, alt
+    step    start_ns, wait_servo_ns, step_ns, pace_ns, nb_vehicles, flags (1 timeout, 2 paused)
+
+The dump is read in the byte order of the host, as written.
+"""
+
+import argparse
+import struct
+import sys
+
+TELEMETRY_DUMP_MAGIC = 0x41504d54
+FDM_V2_MAGIC = 0x324d4446
+
+RECORD_TYPES = {1: "servo", 2: "fdm", 3: "step"}
+
+DUMP_HEADER = struct.Struct("@IIIId")       # magic, version, nb_vehicles, steps_per_frame, frame_duration
+RECORD_HEADER = struct.Struct("@BBHId")     # type, vehicle, size, batch, sim_time
+FDM_V2_HEADER = struct.Struct("@IHHII")     # magic, version, size, sensor_mask, sequence
+FDM_CORE = struct.Struct("@20d")            # timestamp ... position_latlonalt, same in both formats
+SERVOS = struct.Struct("@16f")
+STEP = struct.Struct("@qqqqII")
+
+
+def decode(record_type, data):
+    if record_type == 1:
+        return SERVOS.unpack_from(data)
+    if record_type == 2:
+        sequence, offset = 0, 0
+        if len(data) >= FDM_V2_HEADER.size and struct.unpack_from("@I", data)[0] == FDM_V2_MAGIC:
+            sequence = FDM_V2_HEADER.unpack_from(data)[4]
+            offset = FDM_V2_HEADER.size
+        return (sequence,) + FDM_CORE.unpack_from(data, offset)
+    if record_type == 3:
+        return STEP.unpack_from(data)
+    return ()
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description="Prints a telemetry dump as CSV")
+    parser.add_argument("dump")
+    parser.add_argument("--type", choices=sorted(RECORD_TYPES.values()))
+    parser.add_argument("--vehicle", type=int)
+    args = parser.parse_args(argv)
+
+    with open(args.dump, "rb") as f:
+        contents = f.read()
+    if len(contents) < DUMP_HEADER.size:
+        sys.stderr.write("%s: truncated header\n" % args.dump)
+        return 1
+    magic, version, nb_vehicles, steps_per_frame, frame_duration = DUMP_HEADER.unpack_from(contents)
+    if magic != TELEMETRY_DUMP_MAGIC:
+        sys.stderr.write("%s: not a telemetry dump\n" % args.dump)
+        return 1
+    sys.stderr.write("version %u, %u vehicle(s), %u step(s) per frame of %g s\n"
+                     % (version, nb_vehicles, steps_per_frame, frame_duration))
+
+    offset = DUMP_HEADER.size
+    while offset + RECORD_HEADER.size <= len(contents):
+        record_type, vehicle, size, batch, sim_time = RECORD_HEADER.unpack_from(contents, offset)
+        offset += RECORD_HEADER.size
+        data = contents[offset:offset + size]
+        offset += size
+        name = RECORD_TYPES.get(record_type, str(record_type))
+        if (args.type and name != args.type) or (args.vehicle is not None and vehicle != args.vehicle):
+            continue
+        try:
+            fields = decode(record_type, data)
+        except struct.error:
+            fields = ("truncated",)
+        sys.stdout.write(",".join([name, str(vehicle), str(batch), repr(sim_time)] + [str(v) for v in fields]) + "\n")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1:]))
@@ -0,0 +1,203 @@
+#!/usr/bin/env python
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""
+Cached xacro expansion, a drop-in for 'xacro.py' in the launch files:
+
+    xacro_cached.py <model.xacro> [name:=value ...]
+
+The expanded URDF is printed on stdout, and kept in the cache under a hash of:
+    - the contents of the model, and of every file it includes (recursively)
+    - the arguments, and the environment variables the files read
+    - the xacro version
+so that a launch with an unchanged model skips the expansion.
+
+The includes are found as <xacro:include> or <include>, their filename in either quotes.
+If one can't be resolved statically (a substitution other than $(find) or $(arg), a package
+not found, a file missing), the model is expanded by xacro without the cache.
+
+Environment:
+    XACRO_CACHE_DIR     cache directory, $ROS_HOME/xacro_cache by default
+    XACRO_CACHE_SIZE    maximum number of cached models, the oldest are removed (64)
+    XACRO_CACHE         set to 0 to disable the cache
+"""
+
+import errno
+import hashlib
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+CACHE_VERSION = "1"
+CACHE_SIZE = 64
+
+INCLUDE_RE = re.compile(r'<(?:xacro:)?include\s[^>]*?\bfilename\s*=\s*(?:"([^"]*)"|\'([^\']*)\')')
+COMMENT_RE = re.compile(r'<!--.*?-->', re.DOTALL)
+FIND_RE = re.compile(r'\$\(find\s+([^)\s]+)\)')
+ARG_RE = re.compile(r'\$\(arg\s+([^)\s]+)\)')
+ENV_RE = re.compile(r'\$\((?:env|optenv)\s+([^)\s]+)')
+
+
+class Unresolved(Exception):
+    pass
+
+
+def find_package(name, cache={}):
+    if name not in cache:
+        try:
+            import rospkg
+            cache[name] = rospkg.RosPack().get_path(name)
+        except Exception:
+            cache[name] = subprocess.check_output(["rospack", "find", name]).decode().strip()
+    return cache[name]
+
+
+def resolve(filename, args, base_dir):
+    """Resolves the $(find) and $(arg) of an include, raises 'Unresolved' for any other substitution"""
+    try:
+        filename = FIND_RE.sub(lambda m: find_package(m.group(1)), filename)
+    except Exception:
+        raise Unresolved(filename)
+    filename = ARG_RE.sub(lambda m: args.get(m.group(1), m.group(0)), filename)
+    if "$(" in filename or "${" in filename:
+        raise Unresolved(filename)
+    return os.path.join(base_dir, filename)
+
+
+def model_key(model, args, xacro_cmd):
+    """Hash of everything the expansion of 'model' depends on"""
+    key = hashlib.sha1()
+    key.update(("%s\n%s\n" % (CACHE_VERSION, " ".join(xacro_cmd))).encode())
+    for name in sorted(args):
+        key.update(("%s:=%s\n" % (name, args[name])).encode())
+    try:
+        key.update(open(xacro_cmd[-1], "rb").read())
+    except IOError:
+        pass
+
+    pending = [os.path.abspath(model)]
+    seen = set()
+    env_names = set()
+    while pending:
+        path = pending.pop(0)
+        if path in seen:
+            continue
+        seen.add(path)
+        key.update(("\n%s\n" % path).encode())
+        try:
+            contents = open(path, "rb").read()
+        except IOError:
+            # The model itself is reported by xacro, a missing include leaves the key incomplete
+            if path != os.path.abspath(model):
+                raise Unresolved(path)
+            key.update(b"<missing>")
+            continue
+        key.update(contents)
+        text = COMMENT_RE.sub("", contents.decode("utf-8", "replace"))
+        env_names.update(ENV_RE.findall(text))
+        for match in INCLUDE_RE.finditer(text):
+            filename = match.group(1) if match.group(1) is not None else match.group(2)
+            pending.append(os.path.abspath(resolve(filename, args, os.path.dirname(path))))
+
+    for name in sorted(env_names):
+        key.update(("$%s=%s\n" % (name, os.environ.get(name, ""))).encode())
+    return key.hexdigest()
+
+
+def xacro_command():
+    try:
+        path = os.path.join(find_package("xacro"), "xacro.py")
+        if os.path.exists(path):
+            return [path]
+    except Exception:
+        pass
+    return ["xacro"]
+
+
+def cache_dir():
+    if os.environ.get("XACRO_CACHE_DIR"):
+        return os.environ["XACRO_CACHE_DIR"]
+    ros_home = os.environ.get("ROS_HOME", os.path.join(os.path.expanduser("~"), ".ros"))
+    return os.path.join(ros_home, "xacro_cache")
+
+
+def store(directory, key, urdf):
+    """Writes the entry atomically, so that concurrent launches never read a partial file"""
+    try:
+        os.makedirs(directory)
+    except OSError as e:
+        if e.errno != errno.EEXIST:
+            raise
+    fd, tmp_path = tempfile.mkstemp(dir=directory, prefix=".tmp_")
+    with os.fdopen(fd, "wb") as f:
+        f.write(urdf)
+    os.rename(tmp_path, os.path.join(directory, key + ".urdf"))
+
+    entries = [os.path.join(directory, name) for name in os.listdir(directory) if name.endswith(".urdf")]
+    size = int(os.environ.get("XACRO_CACHE_SIZE", CACHE_SIZE))
+    if len(entries) > size:
+        entries.sort(key=os.path.getmtime)
+        for path in entries[:len(entries) - size]:
+            try:
+                os.remove(path)
+            except OSError:
+                pass
+
+
+def main(argv):
+    if len(argv) < 1:
+        sys.stderr.write("usage: xacro_cached.py <model.xacro> [name:=value ...]\n")
+        return 2
+    model = argv[0]
+    args = dict(arg.split(":=", 1) for arg in argv[1:] if ":=" in arg)
+    xacro_cmd = xacro_command()
+    out = getattr(sys.stdout, "buffer", sys.stdout)
+
+    key = None
+    if os.environ.get("XACRO_CACHE", "1") != "0":
+        try:
+            key = model_key(model, args, xacro_cmd)
+        except Unresolved as e:
+            sys.stderr.write("xacro_cached: include '%s' not resolved, expanding without the cache\n" % e)
+
+    if key is not None:
+        path = os.path.join(cache_dir(), key + ".urdf")
+        try:
+            with open(path, "rb") as f:
+                urdf = f.read()
+            # Keeps the models in use out of the pruning
+            os.utime(path, None)
+            out.write(urdf)
+            return 0
+        except (IOError, OSError):
+            pass
+
+    process = subprocess.Popen(xacro_cmd + argv, stdout=subprocess.PIPE)
+    urdf = process.communicate()[0]
+    if process.returncode != 0:
+        return process.returncode
+
+    if key is not None:
+        try:
+            store(cache_dir(), key, urdf)
+        except (IOError, OSError) as e:
+            sys.stderr.write("xacro_cached: can't write the cache: %s\n" % e)
+    out.write(urdf)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1:]))
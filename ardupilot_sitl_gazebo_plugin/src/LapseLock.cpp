@@ -0,0 +1,195 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../include/ardupilot_sitl_gazebo_plugin/LapseLock.h"
+#include <time.h>
+#include <utility>
+
+
+LapseLock::LapseLock()
+    : _next_token(LAPSE_LOCK_NO_TOKEN + 1)
+{
+}
+
+int64_t LapseLock::now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+  Registers a holder, until its release or at most 'max_duration' seconds of wall time.
+  @return its token, for 'release()'
+ */
+uint32_t LapseLock::take(double max_duration, const std::string &holder_name)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    holder h;
+
+    if (max_duration < 0.0)
+        max_duration = 0.0;
+    h.deadline_ns = now_ns() + (int64_t)(max_duration * 1e9);
+    h.token = _next_token++;
+    if (_next_token == LAPSE_LOCK_NO_TOKEN)
+        _next_token++;
+    h.name = holder_name;
+
+    _holders.push_back(h);
+    _indexes[h.token] = _holders.size() - 1;
+    sift_up(_holders.size() - 1);
+    return h.token;
+}
+
+/*
+  Releases the holder of 'token'. Without token (LAPSE_LOCK_NO_TOKEN, clients of the first
+  version of the service), releases the holder of that name closest to its deadline, or else
+  the one closest to its deadline.
+  @return true if the lock is now free
+ */
+bool LapseLock::release(uint32_t token, const std::string &holder_name)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::unordered_map<uint32_t, size_t>::const_iterator it;
+    size_t i, found = _holders.size();
+
+    if (token != LAPSE_LOCK_NO_TOKEN) {
+        it = _indexes.find(token);
+        if (it != _indexes.end())
+            found = it->second;
+    } else {
+        // By name: scanned, as the clients of the first version are few
+        for (i=0; i<_holders.size(); i++) {
+            if ((_holders[i].name == holder_name) &&
+                ((found == _holders.size()) || (_holders[i].deadline_ns < _holders[found].deadline_ns)))
+                found = i;
+        }
+        if ((found == _holders.size()) && !_holders.empty())
+            found = 0;      // top of the heap
+    }
+
+    if (found < _holders.size())
+        remove(found);
+    return _holders.empty();
+}
+
+void LapseLock::clear()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _holders.clear();
+    _indexes.clear();
+}
+
+/*
+  Removes the holders whose deadline has passed.
+  @param nb_expired: if not NULL, receives the number of holders removed
+  @return 0 if the lock is free, otherwise the time until the earliest deadline, in [ns] (> 0)
+ */
+int64_t LapseLock::check(unsigned int *nb_expired)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    int64_t now = now_ns();
+    unsigned int expired = 0;
+
+    while (!_holders.empty() && (_holders.front().deadline_ns <= now)) {
+        remove(0);
+        expired++;
+    }
+    if (nb_expired)
+        *nb_expired = expired;
+
+    if (_holders.empty())
+        return 0;
+    return _holders.front().deadline_ns - now;
+}
+
+unsigned int LapseLock::get_nb_holders()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _holders.size();
+}
+
+/*
+  @return true if the holder of 'token' has neither been released nor expired
+ */
+bool LapseLock::is_held(uint32_t token)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _indexes.count(token) > 0;
+}
+
+/*
+  Removes the holder at 'index' of the heap: the last one fills the hole, then is sifted
+  up or down to its place (with '_mutex' held)
+ */
+void LapseLock::remove(size_t index)
+{
+    size_t last = _holders.size() - 1;
+
+    _indexes.erase(_holders[index].token);
+    if (index != last) {
+        std::swap(_holders[index], _holders[last]);
+        _indexes[_holders[index].token] = index;
+    }
+    _holders.pop_back();
+    if ((index < _holders.size()) && (sift_up(index) == index))
+        sift_down(index);
+}
+
+/*
+  Moves the holder at 'index' up while its deadline is earlier than its parent's
+  @return its new index
+ */
+size_t LapseLock::sift_up(size_t index)
+{
+    size_t parent;
+
+    while (index > 0) {
+        parent = (index - 1) / 2;
+        if (_holders[parent].deadline_ns <= _holders[index].deadline_ns)
+            break;
+        swap_holders(index, parent);
+        index = parent;
+    }
+    return index;
+}
+
+/*
+  Moves the holder at 'index' down while a child has an earlier deadline
+ */
+void LapseLock::sift_down(size_t index)
+{
+    size_t child, earliest;
+
+    while (true) {
+        earliest = index;
+        child = 2 * index + 1;
+        if ((child < _holders.size()) && (_holders[child].deadline_ns < _holders[earliest].deadline_ns))
+            earliest = child;
+        child++;
+        if ((child < _holders.size()) && (_holders[child].deadline_ns < _holders[earliest].deadline_ns))
+            earliest = child;
+        if (earliest == index)
+            break;
+        swap_holders(index, earliest);
+        index = earliest;
+    }
+}
+
+void LapseLock::swap_holders(size_t a, size_t b)
+{
+    std::swap(_holders[a], _holders[b]);
+    _indexes[_holders[a].token] = a;
+    _indexes[_holders[b].token] = b;
+}
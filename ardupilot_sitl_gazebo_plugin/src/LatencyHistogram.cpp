@@ -0,0 +1,131 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../include/ardupilot_sitl_gazebo_plugin/LatencyHistogram.h"
+#include <string.h>
+#include <time.h>
+
+/*
+  constructor, starts empty
+ */
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+/*
+  record one duration
+ */
+void LatencyHistogram::add(int64_t duration_ns)
+{
+    if (duration_ns < 0)
+        duration_ns = 0;
+
+    _buckets[bucket_index(duration_ns)]++;
+    _count++;
+    if (duration_ns > _max_ns)
+        _max_ns = duration_ns;
+}
+
+/*
+  forget all the samples, for a new statistics period
+ */
+void LatencyHistogram::reset()
+{
+    memset(_buckets, 0, sizeof(_buckets));
+    _count = 0;
+    _max_ns = 0;
+}
+
+uint32_t LatencyHistogram::get_count() const
+{
+    return _count;
+}
+
+int64_t LatencyHistogram::get_max() const
+{
+    return _max_ns;
+}
+
+/*
+  estimate the duration below which 'ratio' of the samples are
+  @return 0 if there is no sample
+ */
+int64_t LatencyHistogram::get_percentile(double ratio) const
+{
+    uint32_t rank, cumulated = 0;
+    int i;
+
+    if (_count == 0)
+        return 0;
+
+    // Rank of the sample, from 1
+    rank = (uint32_t)(ratio * _count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    if (rank > _count)
+        rank = _count;
+
+    for (i=0; i<HISTOGRAM_NB_BUCKETS; i++) {
+        cumulated += _buckets[i];
+        if (cumulated >= rank) {
+            // Never more than what was actually seen
+            int64_t estimate = bucket_middle(i);
+            return (estimate < _max_ns) ? estimate : _max_ns;
+        }
+    }
+    return _max_ns;
+}
+
+int64_t LatencyHistogram::now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+  bucket 0 holds the durations below 2^HISTOGRAM_MIN_POW2, the last one those above 2^HISTOGRAM_MAX_POW2.
+  In between, the power of 2 selects a group of HISTOGRAM_SUB_BUCKETS, and the bits following
+  the most significant one select the bucket within the group.
+ */
+int LatencyHistogram::bucket_index(int64_t duration_ns)
+{
+    int pow2;
+
+    if (duration_ns < (1LL << HISTOGRAM_MIN_POW2))
+        return 0;
+    if (duration_ns >= (1LL << HISTOGRAM_MAX_POW2))
+        return HISTOGRAM_NB_BUCKETS - 1;
+
+    pow2 = 63 - __builtin_clzll((unsigned long long)duration_ns);
+    return 1 + (pow2 - HISTOGRAM_MIN_POW2) * HISTOGRAM_SUB_BUCKETS
+             + (int)((duration_ns >> (pow2 - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+int64_t LatencyHistogram::bucket_middle(int index)
+{
+    int pow2, sub;
+    int64_t width;
+
+    if (index <= 0)
+        return (1LL << HISTOGRAM_MIN_POW2) / 2;
+    if (index >= HISTOGRAM_NB_BUCKETS - 1)
+        return (1LL << HISTOGRAM_MAX_POW2);
+
+    pow2 = HISTOGRAM_MIN_POW2 + (index - 1) / HISTOGRAM_SUB_BUCKETS;
+    sub  = (index - 1) % HISTOGRAM_SUB_BUCKETS;
+    width = (1LL << pow2) / HISTOGRAM_SUB_BUCKETS;
+    return (1LL << pow2) + sub * width + width / 2;
+}
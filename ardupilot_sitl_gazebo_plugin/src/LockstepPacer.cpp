@@ -0,0 +1,149 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../include/ardupilot_sitl_gazebo_plugin/LockstepPacer.h"
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+/*
+  constructor, defaults to real-time
+ */
+LockstepPacer::LockstepPacer() :
+    _mode(PACING_REALTIME),
+    _speedup(1.0),
+    _is_anchored(false),
+    _anchor_ns(0),
+    _sim_elapsed_ns(0)
+{
+}
+
+/*
+  set the pacing mode from its textual form: "realtime", "speedup:<N>", "afap" or "replay"
+  @return false if the string is not recognized (the mode is then left unchanged)
+ */
+bool LockstepPacer::set_mode(const std::string &mode_str)
+{
+    static const std::string speedup_prefix = "speedup:";
+    
+    if (mode_str == "realtime") {
+        _mode = PACING_REALTIME;
+        _speedup = 1.0;
+    } else if (mode_str == "afap") {
+        _mode = PACING_AFAP;
+        _speedup = 0.0;
+    } else if (mode_str == "replay") {
+        _mode = PACING_REPLAY;
+        _speedup = 0.0;
+    } else if (mode_str.compare(0, speedup_prefix.size(), speedup_prefix) == 0) {
+        const char *factor_str = mode_str.c_str() + speedup_prefix.size();
+        char *end = NULL;
+        double factor = strtod(factor_str, &end);
+        
+        if ((end == factor_str) || (*end != '\0') || !(factor > 0.0))
+            return false;
+        _mode = PACING_SPEEDUP;
+        _speedup = factor;
+    } else {
+        return false;
+    }
+    
+    reset();
+    return true;
+}
+
+/*
+  textual form of the current mode, for logs
+ */
+std::string LockstepPacer::get_mode_str() const
+{
+    char buf[64];
+    
+    switch (_mode) {
+        case PACING_AFAP:
+            return "afap";
+        case PACING_REPLAY:
+            return "replay";
+        case PACING_SPEEDUP:
+            snprintf(buf, sizeof(buf), "speedup:%g", _speedup);
+            return buf;
+        case PACING_REALTIME:
+        default:
+            return "realtime";
+    }
+}
+
+LockstepPacer::Mode LockstepPacer::get_mode() const
+{
+    return _mode;
+}
+
+double LockstepPacer::get_speedup() const
+{
+    return _speedup;
+}
+
+/*
+  forget the current schedule, the next step re-anchors it on the current time.
+  To be called whenever the simulation did not progress for a while (pause, lapse-lock,
+  ArduPilot reconnection), so the pacer does not try to catch up that time afterwards.
+ */
+void LockstepPacer::reset()
+{
+    _is_anchored = false;
+}
+
+/*
+  account for a simulation step of 'sim_dt' seconds, and sleep until its wall-clock deadline
+ */
+void LockstepPacer::wait_step(double sim_dt)
+{
+    struct timespec deadline;
+    int64_t deadline_ns, now;
+    
+    if ((_mode == PACING_AFAP) || (_mode == PACING_REPLAY))
+        return;
+    
+    now = now_ns();
+    if (!_is_anchored) {
+        _anchor_ns = now;
+        _sim_elapsed_ns = 0;
+        _is_anchored = true;
+    }
+    
+    // Integer nanoseconds: the deadline of step N does not depend on the rounding of previous steps
+    _sim_elapsed_ns += llround(sim_dt * 1e9);
+    deadline_ns = _anchor_ns + llround(_sim_elapsed_ns / _speedup);
+    
+    if (deadline_ns <= now) {
+        // Late. If too late, gives up on that lag rather than bursting to catch up
+        if ((now - deadline_ns) > llround(PACING_MAX_LAG * 1e9)) {
+            _anchor_ns = now;
+            _sim_elapsed_ns = 0;
+        }
+        return;
+    }
+    
+    deadline.tv_sec  = deadline_ns / 1000000000LL;
+    deadline.tv_nsec = deadline_ns % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {}
+}
+
+int64_t LockstepPacer::now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
@@ -0,0 +1,170 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../include/ardupilot_sitl_gazebo_plugin/MeshPreloader.h"
+#include <sstream>
+#include <algorithm>
+#include "gazebo/common/ColladaLoader.hh"
+#include "gazebo/common/STLLoader.hh"
+#include "gazebo/common/MeshManager.hh"
+#include "gazebo/common/SystemPaths.hh"
+
+
+MeshPreloader::MeshPreloader()
+    : _nb_threads(MESH_PRELOAD_THREADS_DEFAULT),
+      _next_mesh(0)
+{
+}
+
+MeshPreloader::~MeshPreloader()
+{
+    size_t i;
+
+    // Not finished (the plugin failed to load): the threads may still be parsing
+    _threads.join_all();
+    for (i=0; i<_meshes.size(); i++)
+        delete _meshes[i].mesh;
+}
+
+void MeshPreloader::set_nb_threads(unsigned int nb_threads)
+{
+    _nb_threads = nb_threads;
+}
+
+unsigned int MeshPreloader::get_nb_threads() const
+{
+    return _nb_threads;
+}
+
+/*
+  Adds the meshes of the geometries found in 'sdf' and its children (a world, a model...)
+ */
+void MeshPreloader::add_sdf_meshes(const sdf::ElementPtr &sdf)
+{
+    sdf::ElementPtr child;
+
+    if (!sdf)
+        return;
+    if ((sdf->GetName() == "mesh") && sdf->HasElement("uri"))
+        add_uri(sdf->Get<std::string>("uri"));
+    for (child = sdf->GetFirstElement(); child; child = child->GetNextElement())
+        add_sdf_meshes(child);
+}
+
+/*
+  Adds meshes by URI, separated by spaces: "model://iris/meshes/iris.dae file:///..."
+ */
+void MeshPreloader::add_uris(const std::string &uris)
+{
+    std::istringstream stream(uris);
+    std::string uri;
+
+    while (stream >> uri)
+        add_uri(uri);
+}
+
+/*
+  Ignores the meshes already loaded, the formats without a loader here, and those not found:
+  Gazebo reports them when it needs them
+ */
+void MeshPreloader::add_uri(const std::string &uri)
+{
+    std::string filename = gazebo::common::find_file(uri);
+    std::string extension;
+    preload_mesh entry;
+
+    if (filename.empty() || _filenames.count(filename))
+        return;
+    extension = filename.substr(filename.find_last_of('.') + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    if ((extension != "dae") && (extension != "stl"))
+        return;
+    if (gazebo::common::MeshManager::Instance()->HasMesh(filename))
+        return;
+
+    _filenames.insert(filename);
+    entry.filename = filename;
+    entry.is_stl = (extension == "stl");
+    entry.mesh = NULL;
+    _meshes.push_back(entry);
+}
+
+size_t MeshPreloader::get_nb_meshes() const
+{
+    return _meshes.size();
+}
+
+/*
+  Starts parsing, returns at once
+ */
+void MeshPreloader::start()
+{
+    unsigned int nb_threads = std::min<size_t>(_nb_threads, _meshes.size());
+    unsigned int i;
+
+    _next_mesh = 0;
+    for (i=0; i<nb_threads; i++)
+        _threads.create_thread(boost::bind(&MeshPreloader::worker, this));
+}
+
+void MeshPreloader::worker()
+{
+    gazebo::common::ColladaLoader collada_loader;
+    gazebo::common::STLLoader stl_loader;
+    size_t i;
+
+    while ((i = _next_mesh++) < _meshes.size()) {
+        preload_mesh &entry = _meshes[i];
+
+        if (entry.is_stl)
+            entry.mesh = stl_loader.Load(entry.filename);
+        else
+            entry.mesh = collada_loader.Load(entry.filename);
+    }
+}
+
+/*
+  Waits for the threads, then registers the meshes in the MeshManager.
+  Must be called by the thread which loads the world (a plugin's 'Load()').
+  @param failed_names: gets the files which could not be parsed, if any
+  @return the number of meshes registered
+ */
+unsigned int MeshPreloader::finish(std::string *failed_names)
+{
+    gazebo::common::MeshManager *mesh_manager = gazebo::common::MeshManager::Instance();
+    unsigned int nb_registered = 0;
+    size_t i;
+
+    _threads.join_all();
+    for (i=0; i<_meshes.size(); i++) {
+        preload_mesh &entry = _meshes[i];
+
+        if (entry.mesh == NULL) {
+            *failed_names += (failed_names->empty() ? "" : ", ") + entry.filename;
+            continue;
+        }
+        // Named as 'MeshManager::Load()' does, so that it finds it
+        entry.mesh->SetName(entry.filename);
+        if (mesh_manager->HasMesh(entry.filename)) {
+            delete entry.mesh;
+        } else {
+            mesh_manager->AddMesh(entry.mesh);
+            nb_registered++;
+        }
+        entry.mesh = NULL;
+    }
+    _meshes.clear();
+    _filenames.clear();
+    return nb_registered;
+}
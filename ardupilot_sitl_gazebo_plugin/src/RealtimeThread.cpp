@@ -0,0 +1,194 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../include/ardupilot_sitl_gazebo_plugin/RealtimeThread.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/*
+  constructor, leaves the thread as it is
+ */
+RealtimeThread::RealtimeThread() :
+    _priority(LOOP_PRIORITY_DEFAULT),
+    _is_priority_applied(false),
+    _is_priority_suspended(false),
+    _is_memory_locked(false)
+{
+    CPU_ZERO(&_cpus);
+}
+
+/*
+  set the CPUs from a list of ids and ranges: "3", "2,3", "2-5,7"
+  @return false if the list is not valid (the CPUs are then left unchanged)
+ */
+bool RealtimeThread::set_cpus(const std::string &cpus_str)
+{
+    cpu_set_t cpus;
+    const char *str = cpus_str.c_str();
+    char *end;
+    long first, last, cpu;
+
+    CPU_ZERO(&cpus);
+    while (*str != '\0') {
+        first = strtol(str, &end, 10);
+        if ((end == str) || (first < 0))
+            return false;
+        last = first;
+        if (*end == '-') {
+            str = end + 1;
+            last = strtol(str, &end, 10);
+            if ((end == str) || (last < first))
+                return false;
+        }
+        if (last >= CPU_SETSIZE)
+            return false;
+        for (cpu=first; cpu<=last; cpu++)
+            CPU_SET(cpu, &cpus);
+        if (*end == ',')
+            end++;
+        else if (*end != '\0')
+            return false;
+        str = end;
+    }
+
+    _cpus = cpus;
+    _cpus_str = cpus_str;
+    return true;
+}
+
+std::string RealtimeThread::get_cpus_str() const
+{
+    return _cpus_str;
+}
+
+bool RealtimeThread::has_cpus() const
+{
+    return CPU_COUNT(&_cpus) > 0;
+}
+
+/*
+  set the SCHED_FIFO priority, 0 for the normal scheduling
+  @return false if out of the range of SCHED_FIFO
+ */
+bool RealtimeThread::set_priority(int priority)
+{
+    if ((priority != 0) &&
+        ((priority < sched_get_priority_min(SCHED_FIFO)) || (priority > sched_get_priority_max(SCHED_FIFO))))
+        return false;
+    _priority = priority;
+    return true;
+}
+
+int RealtimeThread::get_priority() const
+{
+    return _priority;
+}
+
+void RealtimeThread::set_lock_memory(bool is_locked)
+{
+    _is_memory_locked = is_locked;
+}
+
+bool RealtimeThread::is_memory_locked() const
+{
+    return _is_memory_locked;
+}
+
+/*
+  pins the calling thread to the CPUs, if any
+  @return 0, or the errno of the failure
+ */
+int RealtimeThread::apply_cpus()
+{
+    if (!has_cpus())
+        return 0;
+    return pthread_setaffinity_np(pthread_self(), sizeof(_cpus), &_cpus);
+}
+
+/*
+  schedules the calling thread with SCHED_FIFO, if a priority is set
+  @return 0, or the errno of the failure (EPERM without CAP_SYS_NICE or an 'rtprio' limit)
+ */
+int RealtimeThread::apply_priority()
+{
+    struct sched_param param;
+
+    int err;
+
+    if (_priority == 0)
+        return 0;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = _priority;
+    err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    _is_priority_applied = (err == 0);
+    return err;
+}
+
+/*
+  schedules the calling thread with SCHED_OTHER again, until 'resume_priority()', while it
+  polls for a normal thread: at SCHED_FIFO, a poll sleeping 1 ns returns at once
+  (no timer slack), and keeps that thread off its CPU
+  @return 0, or the errno of the failure
+ */
+int RealtimeThread::suspend_priority()
+{
+    struct sched_param param;
+
+    if (!_is_priority_applied)
+        return 0;
+    _is_priority_applied = false;
+    _is_priority_suspended = true;
+    memset(&param, 0, sizeof(param));
+    return pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+}
+
+/*
+  schedules the calling thread with SCHED_FIFO again, after 'suspend_priority()'
+  (a priority which failed to apply is not retried)
+  @return 0, or the errno of the failure
+ */
+int RealtimeThread::resume_priority()
+{
+    if (!_is_priority_suspended)
+        return 0;
+    _is_priority_suspended = false;
+    return apply_priority();
+}
+
+/*
+  locks the memory of the process, present and future, then touches the stack of the calling
+  thread, so that it does not fault in a step
+  @return 0, or the errno of the failure (ENOMEM or EPERM beyond the 'memlock' limit)
+ */
+int RealtimeThread::apply_lock_memory()
+{
+    if (!_is_memory_locked)
+        return 0;
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+        return errno;
+    prefault_stack();
+    return 0;
+}
+
+void RealtimeThread::prefault_stack()
+{
+    volatile char stack[LOOP_STACK_PREFAULT_SIZE];
+    size_t i;
+
+    for (i=0; i<sizeof(stack); i+=4096)
+        stack[i] = 0;
+}
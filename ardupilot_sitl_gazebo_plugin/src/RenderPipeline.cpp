@@ -0,0 +1,145 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../include/ardupilot_sitl_gazebo_plugin/RenderPipeline.h"
+
+
+RenderPipeline::RenderPipeline()
+    : _depth(RENDER_PIPELINE_DEPTH_DEFAULT),
+      _max_lag(0.0)
+{
+}
+
+void RenderPipeline::set_depth(unsigned int depth)
+{
+    _depth = depth;
+}
+
+unsigned int RenderPipeline::get_depth() const
+{
+    return _depth;
+}
+
+bool RenderPipeline::is_enabled() const
+{
+    return _depth > 0;
+}
+
+/*
+  Returns 'true' for the sensors rendered by Gazebo (cameras, depth cameras)
+ */
+bool RenderPipeline::is_render_sensor(const gazebo::sensors::SensorPtr &sensor)
+{
+    std::string type = sensor->GetType();
+
+    return (type == "camera") || (type == "depth") || (type == "multicamera") || (type == "wideanglecamera");
+}
+
+/*
+  Adds a camera to the pipeline.
+  @param on_image: called by Gazebo's sensors thread after each image of the camera
+  @return false if it has no update rate: it renders as often as it can, it has no frame to
+          lag by and is ignored
+ */
+bool RenderPipeline::add_sensor(const gazebo::sensors::SensorPtr &sensor, const std::function<void()> &on_image)
+{
+    render_sensor entry;
+
+    entry.sensor = sensor;
+    entry.name = sensor->GetScopedName();
+    entry.rate = sensor->GetUpdateRate();
+    if (!(entry.rate > 0.0))
+        return false;
+    entry.last_image_time = sensor->GetLastMeasurementTime();
+    entry.last_image_ns = 0;
+    entry.is_stalled = false;
+    entry.image_connection = sensor->ConnectUpdated(on_image);
+    _sensors.push_back(entry);
+    return true;
+}
+
+size_t RenderPipeline::get_nb_sensors() const
+{
+    return _sensors.size();
+}
+
+/*
+  @param now_ns: CLOCK_MONOTONIC wall time, for the stalled cameras
+  @param stalled_names: gets the names of the cameras left out by this call, if any
+  @param resumed_names: gets the names of the cameras back in by this call, if any
+  @return true if an active camera lags more than the depth behind 'sim_time': the loop
+          should wait before the next step
+ */
+bool RenderPipeline::is_full(const gazebo::common::Time &sim_time, int64_t now_ns, std::string *stalled_names, std::string *resumed_names)
+{
+    bool is_pipeline_full = false;
+    double lag;
+    size_t i;
+
+    for (i=0; i<_sensors.size(); i++) {
+        render_sensor &entry = _sensors[i];
+        const gazebo::common::Time image_time = entry.sensor->GetLastMeasurementTime();
+
+        // A new image: the camera is alive
+        if (image_time != entry.last_image_time) {
+            entry.last_image_time = image_time;
+            entry.last_image_ns = now_ns;
+            if (entry.is_stalled) {
+                entry.is_stalled = false;
+                *resumed_names += (resumed_names->empty() ? "" : ", ") + entry.name;
+            }
+        }
+        // Not rendered (no subscriber): does not lag, its stall timeout starts once active
+        if (!entry.sensor->IsActive()) {
+            entry.last_image_ns = 0;
+            continue;
+        }
+        if (entry.last_image_ns == 0)
+            entry.last_image_ns = now_ns;
+        if (entry.is_stalled)
+            continue;
+
+        lag = (sim_time - image_time).Double() * entry.rate;
+        if (lag > _max_lag)
+            _max_lag = lag;
+        if (lag > _depth) {
+            if ((now_ns - entry.last_image_ns) * 1e-9 > RENDER_STALL_TIMEOUT) {
+                entry.is_stalled = true;
+                *stalled_names += (stalled_names->empty() ? "" : ", ") + entry.name;
+                continue;
+            }
+            is_pipeline_full = true;
+        }
+    }
+    return is_pipeline_full;
+}
+
+/*
+  @return the largest lag of a camera seen since the last 'reset_stats()' [frames]
+ */
+double RenderPipeline::get_max_lag() const
+{
+    return _max_lag;
+}
+
+void RenderPipeline::reset_stats()
+{
+    _max_lag = 0.0;
+}
+
+void RenderPipeline::clear()
+{
+    _sensors.clear();
+    _max_lag = 0.0;
+}
@@ -0,0 +1,247 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../include/ardupilot_sitl_gazebo_plugin/ReplayCheck.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sstream>
+
+
+// First double of each field of the core state, then the sensors up to the end of the packet
+static const size_t s_field_starts[REPLAY_NB_FIELDS] = { 0, 1, 4, 7, 11, 14, 17, 20 };
+static const char *s_field_names[REPLAY_NB_FIELDS] = {
+    "timestamp", "gyro", "accel", "attitude", "velocity", "position", "latlonalt", "sensors"
+};
+
+
+ReplayCheck::ReplayCheck()
+    : _nb_checked(0),
+      _nb_mismatches(0),
+      _nb_unmatched(0)
+{
+    int i;
+
+    for (i=0; i<REPLAY_NB_FIELDS; i++) {
+        _tolerances[i] = 0.0;
+        _max_errors[i] = 0.0;
+        _nb_field_mismatches[i] = 0;
+    }
+}
+
+/*
+  Sets the tolerances from their textual form, e.g. "position:1e-3 velocity:1e-3",
+  'all' standing for every field. The fields not listed keep their tolerance.
+  @return false if a field or a value is not recognized (the former ones are still set)
+ */
+bool ReplayCheck::set_tolerances(const std::string &tolerances_str)
+{
+    std::istringstream stream(tolerances_str);
+    std::string item, name;
+    size_t colon;
+    char *end;
+    double value;
+    bool is_known;
+    int i;
+
+    while (stream >> item) {
+        colon = item.find(':');
+        if (colon == std::string::npos)
+            return false;
+        name = item.substr(0, colon);
+        value = strtod(item.c_str() + colon + 1, &end);
+        if ((end == item.c_str() + colon + 1) || (*end != '\0') || !(value >= 0.0))
+            return false;
+
+        is_known = false;
+        for (i=0; i<REPLAY_NB_FIELDS; i++) {
+            if ((name == "all") || (name == s_field_names[i])) {
+                _tolerances[i] = value;
+                is_known = true;
+            }
+        }
+        if (!is_known)
+            return false;
+    }
+    return true;
+}
+
+void ReplayCheck::init(unsigned int nb_vehicles)
+{
+    _references.resize(nb_vehicles);
+    _has_reference.assign(nb_vehicles, false);
+}
+
+/*
+  Keeps a recorded FDM record, until the replay produces its packet
+ */
+void ReplayCheck::set_reference(const replay_record &record)
+{
+    unsigned int vehicle = record.header.vehicle;
+
+    if (vehicle >= _references.size())
+        return;
+    // The replay did not send this vehicle the FDM of the previous batch
+    if (_has_reference[vehicle]) {
+        std::ostringstream msg;
+        msg << "batch " << _references[vehicle].header.batch << ", vehicle " << vehicle << ": recorded FDM not produced";
+        note_mismatch(msg.str());
+        _nb_unmatched++;
+    }
+    _references[vehicle] = record;
+    _has_reference[vehicle] = true;
+}
+
+/*
+  Compares a packet produced by the replay with the reference of its vehicle.
+  @param header_size: [bytes] before the doubles, 0 for the legacy format, sizeof(fdm_v2_header) for v2
+ */
+void ReplayCheck::check(unsigned int vehicle, uint32_t batch, const void *data, size_t size, size_t header_size)
+{
+    const replay_record *reference;
+    const char *produced_bytes = (const char*)data;
+    double produced, recorded, error;
+    bool is_mismatch = false;
+    size_t i, nb_doubles;
+    int field;
+
+    _nb_checked++;
+    if ((vehicle >= _references.size()) || !_has_reference[vehicle] || (_references[vehicle].header.batch != batch)) {
+        std::ostringstream msg;
+        msg << "batch " << batch << ", vehicle " << vehicle << ": FDM produced without a recorded one";
+        note_mismatch(msg.str());
+        _nb_unmatched++;
+        return;
+    }
+    reference = &_references[vehicle];
+    _has_reference[vehicle] = false;
+
+    // Different formats or sets of sensors can't be compared field by field
+    if ((size != reference->header.size) || (size < header_size) ||
+        (memcmp(produced_bytes, reference->data, header_size) != 0)) {
+        std::ostringstream msg;
+        msg << "batch " << batch << ", vehicle " << vehicle << ": FDM layout differs from the recorded one";
+        note_mismatch(msg.str());
+        _nb_mismatches++;
+        return;
+    }
+
+    nb_doubles = (size - header_size) / sizeof(double);
+    for (i=0; i<nb_doubles; i++) {
+        memcpy(&produced, produced_bytes + header_size + i * sizeof(double), sizeof(double));
+        memcpy(&recorded, reference->data + header_size + i * sizeof(double), sizeof(double));
+        // Bit-identical, NaNs included
+        if (memcmp(&produced, &recorded, sizeof(double)) == 0)
+            continue;
+
+        field = get_field(i);
+        error = fabs(produced - recorded);
+        if (!(error <= _max_errors[field]))
+            _max_errors[field] = error;     // NaN stays the max
+        if (error <= _tolerances[field])
+            continue;
+
+        _nb_field_mismatches[field]++;
+        if (_first_mismatch.empty()) {
+            char buf[256];
+            snprintf(buf, sizeof(buf), "batch %u, vehicle %u: %s[%u] = %.17g, recorded %.17g (tolerance %g)",
+                     batch, vehicle, s_field_names[field], (unsigned int)(i - s_field_starts[field]),
+                     produced, recorded, _tolerances[field]);
+            note_mismatch(buf);
+        }
+        is_mismatch = true;
+    }
+    if (is_mismatch)
+        _nb_mismatches++;
+}
+
+/*
+  To be called at the end of the replay: the references left were never produced
+ */
+void ReplayCheck::finish()
+{
+    size_t i;
+
+    for (i=0; i<_has_reference.size(); i++) {
+        if (!_has_reference[i])
+            continue;
+        std::ostringstream msg;
+        msg << "batch " << _references[i].header.batch << ", vehicle " << i << ": recorded FDM not produced";
+        note_mismatch(msg.str());
+        _nb_unmatched++;
+        _has_reference[i] = false;
+    }
+}
+
+bool ReplayCheck::is_match() const
+{
+    return (_nb_mismatches == 0) && (_nb_unmatched == 0);
+}
+
+unsigned int ReplayCheck::get_nb_checked() const
+{
+    return _nb_checked;
+}
+
+unsigned int ReplayCheck::get_nb_mismatches() const
+{
+    return _nb_mismatches;
+}
+
+unsigned int ReplayCheck::get_nb_unmatched() const
+{
+    return _nb_unmatched;
+}
+
+double ReplayCheck::get_max_error(int field) const
+{
+    return _max_errors[field];
+}
+
+unsigned int ReplayCheck::get_nb_field_mismatches(int field) const
+{
+    return _nb_field_mismatches[field];
+}
+
+/*
+  @return the description of the first mismatch, empty if none
+ */
+std::string ReplayCheck::get_first_mismatch() const
+{
+    return _first_mismatch;
+}
+
+const char* ReplayCheck::get_field_name(int field)
+{
+    return s_field_names[field];
+}
+
+/*
+  @return the field of the double at 'index' in the packet
+ */
+int ReplayCheck::get_field(size_t index)
+{
+    int field = REPLAY_NB_FIELDS - 1;
+
+    while ((field > 0) && (index < s_field_starts[field]))
+        field--;
+    return field;
+}
+
+void ReplayCheck::note_mismatch(const std::string &description)
+{
+    if (_first_mismatch.empty())
+        _first_mismatch = description;
+}
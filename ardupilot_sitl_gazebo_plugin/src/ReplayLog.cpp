@@ -0,0 +1,237 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../include/ardupilot_sitl_gazebo_plugin/ReplayLog.h"
+#include <errno.h>
+#include <string.h>
+#include <chrono>
+
+
+//-------------------------------------------------
+//  Recorder
+//-------------------------------------------------
+
+ReplayRecorder::ReplayRecorder()
+    : _file(NULL),
+      _is_stopping(false),
+      _nb_dropped(0),
+      _write_error(0)
+{
+}
+
+ReplayRecorder::~ReplayRecorder()
+{
+    close();
+}
+
+/*
+  Creates the log (truncated if it exists) and starts the writer thread.
+  @return false if the file can't be created, errno is set
+ */
+bool ReplayRecorder::open(const std::string &path, const replay_log_header &header)
+{
+    if (_file)
+        return false;
+
+    _file = fopen(path.c_str(), "wb");
+    if (!_file)
+        return false;
+    if (fwrite(&header, sizeof(header), 1, _file) != 1) {
+        fclose(_file);
+        _file = NULL;
+        return false;
+    }
+
+    // Both buffers are allocated once to their full size: 'append()' never grows them,
+    // and swapping them never reallocates
+    _pending.reserve(REPLAY_BUFFER_MAX_SIZE);
+    _writing.reserve(REPLAY_BUFFER_MAX_SIZE);
+    _is_stopping = false;
+    _thread = std::thread(&ReplayRecorder::writer_thread, this);
+    return true;
+}
+
+bool ReplayRecorder::is_open() const
+{
+    return _file != NULL;
+}
+
+/*
+  Writes what is still buffered, then closes the log
+ */
+void ReplayRecorder::close()
+{
+    if (!_file)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _is_stopping = true;
+    }
+    _cond.notify_one();
+    _thread.join();
+
+    fclose(_file);
+    _file = NULL;
+}
+
+/*
+  Buffers a record. Only copies to memory: never waits for the disk, nor allocates.
+  Once the buffer is full (the writer lags behind), the record is dropped and counted.
+ */
+void ReplayRecorder::append(uint8_t type, uint8_t vehicle, uint32_t batch, double sim_time, const void *data, size_t size)
+{
+    replay_record_header header;
+    bool is_flush_due;
+
+    if (!_file)
+        return;
+    if (size > REPLAY_RECORD_MAX_SIZE)
+        size = REPLAY_RECORD_MAX_SIZE;
+
+    header.type = type;
+    header.vehicle = vehicle;
+    header.size = size;
+    header.batch = batch;
+    header.sim_time = sim_time;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        if (_pending.size() + sizeof(header) + size > _pending.capacity()) {
+            _nb_dropped++;
+            return;
+        }
+        _pending.insert(_pending.end(), (const char*)&header, (const char*)&header + sizeof(header));
+        _pending.insert(_pending.end(), (const char*)data, (const char*)data + size);
+        is_flush_due = (_pending.size() >= REPLAY_FLUSH_SIZE);
+    }
+    if (is_flush_due)
+        _cond.notify_one();
+}
+
+unsigned int ReplayRecorder::get_nb_dropped()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _nb_dropped;
+}
+
+/*
+  @return the errno of the first failed write to the log, 0 if none
+ */
+int ReplayRecorder::get_write_error()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _write_error;
+}
+
+/*
+  Writes the buffered records, once enough are pending or periodically.
+  The disk is only accessed without '_mutex' held, on the buffer swapped out.
+ */
+void ReplayRecorder::writer_thread()
+{
+    bool is_last;
+    int error;
+
+    do {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cond.wait_for(lock, std::chrono::milliseconds(REPLAY_FLUSH_PERIOD_MS),
+                           [this] { return _is_stopping || (_pending.size() >= REPLAY_FLUSH_SIZE); });
+            _pending.swap(_writing);
+            is_last = _is_stopping;
+        }
+
+        error = 0;
+        if (!_writing.empty() && (fwrite(_writing.data(), _writing.size(), 1, _file) != 1))
+            error = errno;
+        if (fflush(_file) != 0)
+            error = errno;
+        _writing.clear();
+
+        if (error) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (!_write_error)
+                _write_error = error;
+        }
+    } while (!is_last);
+}
+
+
+//-------------------------------------------------
+//  Reader
+//-------------------------------------------------
+
+ReplayReader::ReplayReader()
+    : _file(NULL)
+{
+}
+
+ReplayReader::~ReplayReader()
+{
+    close();
+}
+
+/*
+  Opens a log and checks its header.
+  @return false if the file can't be read, or is not a replay log of this version
+ */
+bool ReplayReader::open(const std::string &path, replay_log_header *header)
+{
+    if (_file)
+        return false;
+
+    _file = fopen(path.c_str(), "rb");
+    if (!_file)
+        return false;
+
+    if ((fread(header, sizeof(*header), 1, _file) != 1) ||
+        (header->magic != REPLAY_LOG_MAGIC) || (header->version != REPLAY_LOG_VERSION)) {
+        close();
+        errno = EINVAL;
+        return false;
+    }
+    return true;
+}
+
+bool ReplayReader::is_open() const
+{
+    return _file != NULL;
+}
+
+void ReplayReader::close()
+{
+    if (_file)
+        fclose(_file);
+    _file = NULL;
+}
+
+/*
+  Reads the next record.
+  @return false at the end of the log, or on a truncated record (the recording was killed)
+ */
+bool ReplayReader::next(replay_record *record)
+{
+    if (!_file)
+        return false;
+
+    if (fread(&record->header, sizeof(record->header), 1, _file) != 1)
+        return false;
+    if (record->header.size > REPLAY_RECORD_MAX_SIZE)
+        return false;
+    if ((record->header.size > 0) && (fread(record->data, record->header.size, 1, _file) != 1))
+        return false;
+    return true;
+}
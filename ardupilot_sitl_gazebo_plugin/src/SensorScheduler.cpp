@@ -0,0 +1,144 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../include/ardupilot_sitl_gazebo_plugin/SensorScheduler.h"
+#include <stdlib.h>
+#include <sstream>
+
+
+static const char *s_sensor_names[NB_SCHEDULED_SENSORS] = {
+    "imu", "gps", "sonar_down", "sonar_front"
+};
+
+
+SensorScheduler::SensorScheduler()
+{
+    int i;
+
+    _rates[SCHEDULED_SENSOR_IMU]         = SENSOR_RATE_IMU_DEFAULT;
+    _rates[SCHEDULED_SENSOR_GPS]         = SENSOR_RATE_GPS_DEFAULT;
+    _rates[SCHEDULED_SENSOR_SONAR_DOWN]  = SENSOR_RATE_SONAR_DEFAULT;
+    _rates[SCHEDULED_SENSOR_SONAR_FRONT] = SENSOR_RATE_SONAR_DEFAULT;
+    for (i=0; i<NB_SCHEDULED_SENSORS; i++)
+        _periods_ns[i] = (int64_t)(1e9 / _rates[i] + 0.5);
+    reset();
+}
+
+/*
+  Sets the rates from their textual form, e.g. "gps:5 sonar_down:10" [Hz], 'sonar' standing
+  for both range finders, and 0 for every frame. The sensors not listed keep their rate.
+  @return false if a sensor or a value is not recognized (the former ones are still set)
+ */
+bool SensorScheduler::set_rates(const std::string &rates_str)
+{
+    std::istringstream stream(rates_str);
+    std::string item, name;
+    size_t colon;
+    char *end;
+    double value;
+    bool is_known;
+    int i;
+
+    while (stream >> item) {
+        colon = item.find(':');
+        if (colon == std::string::npos)
+            return false;
+        name = item.substr(0, colon);
+        value = strtod(item.c_str() + colon + 1, &end);
+        if ((end == item.c_str() + colon + 1) || (*end != '\0') || !(value >= 0.0))
+            return false;
+
+        is_known = false;
+        for (i=0; i<NB_SCHEDULED_SENSORS; i++) {
+            if ((name == s_sensor_names[i]) ||
+                ((name == "sonar") && ((i == SCHEDULED_SENSOR_SONAR_DOWN) || (i == SCHEDULED_SENSOR_SONAR_FRONT)))) {
+                _rates[i] = value;
+                _periods_ns[i] = (value > 0.0) ? (int64_t)(1e9 / value + 0.5) : 0;
+                is_known = true;
+            }
+        }
+        if (!is_known)
+            return false;
+    }
+    reset();
+    return true;
+}
+
+/*
+  @return the rate of a sensor [Hz], 0 for every frame
+ */
+double SensorScheduler::get_rate(int sensor) const
+{
+    return _rates[sensor];
+}
+
+std::string SensorScheduler::get_rates_str() const
+{
+    std::ostringstream msg;
+    int i;
+
+    for (i=0; i<NB_SCHEDULED_SENSORS; i++)
+        msg << (i ? " " : "") << s_sensor_names[i] << ":" << _rates[i];
+    return msg.str();
+}
+
+/*
+  To be called at the end of each frame.
+  @return the mask of the sensors due at this simulation time (bit 1 << scheduled_sensor_id),
+          their next sample being scheduled
+ */
+uint32_t SensorScheduler::update(int64_t sim_time_ns)
+{
+    uint32_t due = 0;
+    int i;
+
+    // First frame, or the time went back (world reset, snapshot restored): everything is sampled
+    if (!_is_started || (sim_time_ns < _last_ns)) {
+        for (i=0; i<NB_SCHEDULED_SENSORS; i++)
+            _next_ns[i] = sim_time_ns;
+        _is_started = true;
+    }
+    _last_ns = sim_time_ns;
+
+    for (i=0; i<NB_SCHEDULED_SENSORS; i++) {
+        if (sim_time_ns + SENSOR_SCHEDULE_TOLERANCE_NS < _next_ns[i])
+            continue;
+        due |= (1u << i);
+        if (_periods_ns[i] == 0)
+            continue;       // every frame
+        // On the grid of the first sample, the missed ones being skipped (frames slower than the sensor)
+        _next_ns[i] += _periods_ns[i];
+        if (_next_ns[i] <= sim_time_ns + SENSOR_SCHEDULE_TOLERANCE_NS)
+            _next_ns[i] += ((sim_time_ns + SENSOR_SCHEDULE_TOLERANCE_NS - _next_ns[i]) / _periods_ns[i] + 1) * _periods_ns[i];
+    }
+    return due;
+}
+
+/*
+  Every sensor is due at the next update, which starts a new grid
+ */
+void SensorScheduler::reset()
+{
+    int i;
+
+    _is_started = false;
+    _last_ns = 0;
+    for (i=0; i<NB_SCHEDULED_SENSORS; i++)
+        _next_ns[i] = 0;
+}
+
+const char* SensorScheduler::get_sensor_name(int sensor)
+{
+    return s_sensor_names[sensor];
+}
@@ -0,0 +1,354 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../include/ardupilot_sitl_gazebo_plugin/ShmTransportAPM.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex words must be plain 32-bit integers");
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "atomics of the segment must be lock-free to be shared");
+
+
+//-------------------------------------------------
+//  Futexes
+//-------------------------------------------------
+
+/*
+  Sleeps while '*word' == 'expected', at most 'timeout_ms' (< 0 for no timeout).
+  Not private futexes: the words are shared between processes.
+  @return 0 when woken up (or the value already differed), -1 on timeout or signal
+ */
+int futex_wait_shared(std::atomic<uint32_t> *word, uint32_t expected, int timeout_ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+
+    if (syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, expected,
+                (timeout_ms < 0) ? NULL : &ts, NULL, 0) == 0)
+        return 0;
+    return (errno == EAGAIN) ? 0 : -1;
+}
+
+void futex_wake_shared(std::atomic<uint32_t> *word)
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+
+//-------------------------------------------------
+//  Segment
+//-------------------------------------------------
+
+ShmSegmentAPM::ShmSegmentAPM()
+    : _is_owner(false),
+      _size(0),
+      _header(NULL),
+      _vehicles(NULL)
+{
+}
+
+ShmSegmentAPM::~ShmSegmentAPM()
+{
+    unmap();
+}
+
+void ShmSegmentAPM::unmap()
+{
+    if (_header)
+        munmap(_header, _size);
+    if (_is_owner)
+        shm_unlink(_name.c_str());
+    _header = NULL;
+    _vehicles = NULL;
+    _is_owner = false;
+}
+
+/*
+  Creates the segment, replacing any left by a previous run.
+  In case of failure, returns 'false', with errno set.
+ */
+bool ShmSegmentAPM::create(const std::string &name, unsigned int nb_vehicles)
+{
+    void *mapping;
+    int fd;
+
+    unmap();
+    _name = name;
+    _size = sizeof(apm_shm_header) + nb_vehicles * sizeof(apm_shm_vehicle);
+
+    // A new object: peers still mapping an old one are not mixed with this run
+    shm_unlink(_name.c_str());
+    fd = shm_open(_name.c_str(), O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0660);
+    if (fd < 0)
+        return false;
+    if (ftruncate(fd, _size) != 0) {
+        close(fd);
+        shm_unlink(_name.c_str());
+        return false;
+    }
+    mapping = mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        shm_unlink(_name.c_str());
+        return false;
+    }
+
+    // ftruncate() zero-fills: all indexes and sequences start at 0
+    _header = static_cast<apm_shm_header*>(mapping);
+    _vehicles = reinterpret_cast<apm_shm_vehicle*>(_header + 1);
+    _is_owner = true;
+
+    _header->version = APM_SHM_VERSION;
+    _header->nb_vehicles = nb_vehicles;
+    _header->vehicle_size = sizeof(apm_shm_vehicle);
+    _header->magic.store(APM_SHM_MAGIC, std::memory_order_release);
+    return true;
+}
+
+/*
+  Maps a segment created by the plugin.
+  In case of failure (not created yet, other version), returns 'false'.
+ */
+bool ShmSegmentAPM::attach(const std::string &name)
+{
+    apm_shm_header *header;
+    struct stat st;
+    void *mapping;
+    int fd;
+
+    unmap();
+    _name = name;
+
+    fd = shm_open(_name.c_str(), O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0)
+        return false;
+    if ((fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(apm_shm_header))) {
+        close(fd);
+        return false;
+    }
+    mapping = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return false;
+
+    header = static_cast<apm_shm_header*>(mapping);
+    if ((header->magic.load(std::memory_order_acquire) != APM_SHM_MAGIC) ||
+        (header->version != APM_SHM_VERSION) ||
+        (header->vehicle_size != sizeof(apm_shm_vehicle)) ||
+        ((size_t)st.st_size < sizeof(apm_shm_header) + header->nb_vehicles * sizeof(apm_shm_vehicle))) {
+        munmap(mapping, st.st_size);
+        return false;
+    }
+
+    _size = st.st_size;
+    _header = header;
+    _vehicles = reinterpret_cast<apm_shm_vehicle*>(_header + 1);
+    return true;
+}
+
+bool ShmSegmentAPM::is_open() const
+{
+    return _header != NULL;
+}
+
+unsigned int ShmSegmentAPM::get_nb_vehicles() const
+{
+    return _header ? _header->nb_vehicles : 0;
+}
+
+apm_shm_vehicle* ShmSegmentAPM::get_vehicle(unsigned int index)
+{
+    if (index >= get_nb_vehicles())
+        return NULL;
+    return &_vehicles[index];
+}
+
+/*
+  @return the index of the vehicle using this servo port in UDP, or -1
+ */
+int ShmSegmentAPM::find_vehicle(uint16_t port_base)
+{
+    unsigned int i;
+
+    for (i=0; i<get_nb_vehicles(); i++) {
+        if (_vehicles[i].port_base == port_base)
+            return i;
+    }
+    return -1;
+}
+
+uint32_t ShmSegmentAPM::get_doorbell() const
+{
+    return _header->doorbell.load(std::memory_order_acquire);
+}
+
+/*
+  Signals the plugin that a servo packet was written (or that it must re-evaluate its state)
+ */
+void ShmSegmentAPM::ring_doorbell()
+{
+    _header->doorbell.fetch_add(1, std::memory_order_seq_cst);
+    if (_header->plugin_waiting.load(std::memory_order_seq_cst))
+        futex_wake_shared(&_header->doorbell);
+}
+
+/*
+  Sleeps until the doorbell differs from 'seen', at most 'timeout_ms'.
+  @return true if it rang
+ */
+bool ShmSegmentAPM::wait_doorbell(uint32_t seen, int timeout_ms)
+{
+    // Announces the sleep before checking again, so a concurrent ring is never missed
+    _header->plugin_waiting.store(1, std::memory_order_seq_cst);
+    if (_header->doorbell.load(std::memory_order_seq_cst) == seen)
+        futex_wait_shared(&_header->doorbell, seen, timeout_ms);
+    _header->plugin_waiting.store(0, std::memory_order_relaxed);
+
+    return get_doorbell() != seen;
+}
+
+
+//-------------------------------------------------
+//  Ring ends
+//-------------------------------------------------
+
+/*
+  constructor: a reader starts after the packets already in the ring, a writer after the last one
+ */
+ShmTransportAPM::ShmTransportAPM(ShmSegmentAPM *segment, apm_shm_ring *ring, int role)
+    : _segment(segment),
+      _ring(ring),
+      _role(role),
+      _index(ring->head.load(std::memory_order_acquire))
+{
+}
+
+/*
+  Writes a packet in the next slot, overwriting the oldest one. Never blocks.
+  @return the size written, or -1 if too large for a slot, or not the writer
+ */
+ssize_t ShmTransportAPM::send(void *pkt, size_t size)
+{
+    if (!(_role & SHM_TRANSPORT_WRITER) || (size > APM_SHM_SLOT_SIZE))
+        return -1;
+
+    apm_shm_slot &slot = _ring->slots[_index % APM_SHM_NB_SLOTS];
+
+    // Seqlock: odd while the slot is being written
+    slot.seq.store(2*_index + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.size = size;
+    memcpy(slot.data, pkt, size);
+    slot.seq.store(2*_index + 2, std::memory_order_release);
+
+    _index++;
+    _ring->head.store(_index, std::memory_order_seq_cst);
+    if (_ring->reader_waiting.load(std::memory_order_seq_cst))
+        futex_wake_shared(&_ring->head);
+    if (_role & SHM_TRANSPORT_DOORBELL)
+        _segment->ring_doorbell();
+    return size;
+}
+
+/*
+  Reads the newest packet not read yet, without waiting
+  @return its size, or -1 if there is none
+ */
+ssize_t ShmTransportAPM::recv_latest(void *pkt, size_t size, unsigned int *nb_dropped)
+{
+    uint32_t head, seq, packet_size;
+
+    if (_role & SHM_TRANSPORT_WRITER)
+        return -1;
+
+    while (true) {
+        head = _ring->head.load(std::memory_order_acquire);
+        if (head == _index)
+            return -1;
+
+        const uint32_t newest = head - 1;
+        apm_shm_slot &slot = _ring->slots[newest % APM_SHM_NB_SLOTS];
+
+        seq = slot.seq.load(std::memory_order_acquire);
+        if (seq != 2*newest + 2)
+            continue;       // already overwritten by a newer packet
+        packet_size = slot.size;
+        if (packet_size > size)
+            packet_size = size;
+        memcpy(pkt, slot.data, packet_size);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) != seq)
+            continue;       // overwritten while being copied
+
+        if (nb_dropped)
+            *nb_dropped += newest - _index;
+        _index = head;
+        return packet_size;
+    }
+}
+
+/*
+  Waits at most 'timeout_ms' for a packet, and reads the newest one
+  @return its size, or -1 on timeout
+ */
+ssize_t ShmTransportAPM::recv(void *pkt, size_t size, uint32_t timeout_ms)
+{
+    struct timespec now, deadline;
+    ssize_t received;
+    int remaining_ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    while (true) {
+        received = recv_latest(pkt, size);
+        if (received >= 0)
+            return received;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        remaining_ms = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000L;
+        if (remaining_ms <= 0)
+            return -1;
+
+        // Announces the sleep before checking again, so a concurrent write is never missed
+        _ring->reader_waiting.store(1, std::memory_order_seq_cst);
+        if (_ring->head.load(std::memory_order_seq_cst) == _index)
+            futex_wait_shared(&_ring->head, _index, remaining_ms);
+        _ring->reader_waiting.store(0, std::memory_order_relaxed);
+    }
+}
+
+/*
+  no file descriptor: the plugin sleeps on the segment's doorbell instead
+ */
+int ShmTransportAPM::get_fd() const
+{
+    return -1;
+}
@@ -31,6 +31,16 @@ datagram(_datagram)
     setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
 }
 
+/*
+  destructor, closes the socket
+ */
+SocketAPM::~SocketAPM()
+{
+    if (fd >= 0) {
+        ::close(fd);
+    }
+}
+
 void SocketAPM::make_sockaddr(const char *address, uint16_t port, struct sockaddr_in &sockaddr)
 {
     memset(&sockaddr, 0, sizeof(sockaddr));
@@ -116,20 +126,74 @@ ssize_t SocketAPM::sendto(void *buf, size_t size, const char *address, uint16_t
  */
 ssize_t SocketAPM::recv(void *buf, size_t size, uint32_t timeout_ms)
 {
-    fd_set fds;
-    struct timeval tv;
+    struct pollfd pfd;
 
-    FD_ZERO(&fds);
-    FD_SET(fd, &fds);
+    // poll() rather than select(): no FD_SETSIZE limit on the descriptor's value
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
 
-    tv.tv_sec = timeout_ms / 1000;
-    tv.tv_usec = (timeout_ms % 1000) * 1000UL;
-
-    if (select(fd+1, &fds, NULL, NULL, &tv) != 1) {
+    if (poll(&pfd, 1, timeout_ms) != 1) {
         return -1;
     }
     
-    return ::recv(fd, buf, size, 0);
+    return ::recv(fd, buf, size, MSG_DONTWAIT);
+}
+
+/*
+  receive some data, without waiting for the socket to become readable
+  (the caller is expected to have already polled the file descriptor)
+ */
+ssize_t SocketAPM::recv_nowait(void *buf, size_t size)
+{
+    return ::recv(fd, buf, size, MSG_DONTWAIT);
 }
 
+/*
+  receive all the datagrams queued on the socket, and keep only the newest one
+  (the caller is expected to have already polled the file descriptor).
+  Datagrams are read by batches of SOCKET_APM_RECV_BATCH per system call, the older
+  ones being counted in 'nb_dropped'.
+  @return the size of the newest datagram, or -1 if none was queued
+ */
+ssize_t SocketAPM::recv_latest(void *buf, size_t size, unsigned int *nb_dropped)
+{
+    char batch_buf[SOCKET_APM_RECV_BATCH][SOCKET_APM_MAX_DATAGRAM];
+    struct mmsghdr msgs[SOCKET_APM_RECV_BATCH];
+    struct iovec iovecs[SOCKET_APM_RECV_BATCH];
+    size_t datagram_size = (size < SOCKET_APM_MAX_DATAGRAM) ? size : SOCKET_APM_MAX_DATAGRAM;
+    ssize_t latest_size = -1;
+    unsigned int nb_received = 0;
+    int i, n;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i=0; i<SOCKET_APM_RECV_BATCH; i++) {
+        iovecs[i].iov_base = batch_buf[i];
+        iovecs[i].iov_len  = datagram_size;
+        msgs[i].msg_hdr.msg_iov    = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    do {
+        n = recvmmsg(fd, msgs, SOCKET_APM_RECV_BATCH, MSG_DONTWAIT, NULL);
+        if (n <= 0)
+            break;
+        nb_received += n;
+        latest_size = msgs[n-1].msg_len;
+        memcpy(buf, batch_buf[n-1], latest_size);
+        // A partial batch means the queue is empty
+    } while (n == SOCKET_APM_RECV_BATCH);
+
+    if (nb_dropped && (nb_received > 1))
+        *nb_dropped += nb_received - 1;
+    return latest_size;
+}
+
+/*
+  file descriptor of the socket, so it can be registered in a poll/epoll set
+ */
+int SocketAPM::get_fd() const
+{
+    return fd;
+}
 
@@ -0,0 +1,146 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../include/ardupilot_sitl_gazebo_plugin/TelemetryRing.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+
+TelemetryRing::TelemetryRing()
+    : _nb_records(0),
+      _max_size(0),
+      _stride(0),
+      _head(0)
+{
+}
+
+/*
+  Allocates the slots, and touches them: 'append()' neither allocates nor faults.
+  Not thread safe, called before the loop starts. 0 records disables the ring.
+ */
+void TelemetryRing::init(size_t nb_records, size_t max_size)
+{
+    size_t i;
+
+    _max_size = std::min<size_t>(max_size, REPLAY_RECORD_MAX_SIZE);
+    _stride = (sizeof(replay_record_header) + _max_size + 7) & ~(size_t)7;
+    _nb_records = nb_records;
+    _slots.assign(_nb_records * _stride, 0);
+    _sequences.reset(_nb_records ? new std::atomic<uint64_t>[_nb_records] : NULL);
+    for (i=0; i<_nb_records; i++)
+        _sequences[i].store(0, std::memory_order_relaxed);
+    _head.store(0, std::memory_order_relaxed);
+}
+
+bool TelemetryRing::is_enabled() const
+{
+    return _nb_records > 0;
+}
+
+/*
+  Appends a record, overwriting the oldest one. Called by a single thread, the main loop.
+ */
+void TelemetryRing::append(uint8_t type, uint8_t vehicle, uint32_t batch, double sim_time, const void *data, size_t size)
+{
+    uint64_t n;
+    size_t slot;
+    replay_record_header header;
+
+    if (_nb_records == 0)
+        return;
+
+    n = _head.load(std::memory_order_relaxed);
+    slot = n % _nb_records;
+    size = std::min(size, _max_size);
+
+    header.type = type;
+    header.vehicle = vehicle;
+    header.size = size;
+    header.batch = batch;
+    header.sim_time = sim_time;
+
+    // Readers of the slot see it as being written, until the record is complete
+    _sequences[slot].store(2*n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(&_slots[slot * _stride], &header, sizeof(header));
+    memcpy(&_slots[slot * _stride + sizeof(header)], data, size);
+    _sequences[slot].store(2*n + 2, std::memory_order_release);
+    _head.store(n + 1, std::memory_order_release);
+}
+
+/*
+  Appends the complete records of the ring to 'records', oldest first, each as a
+  'replay_record_header' followed by its packet. Any thread, while the writer goes on.
+  @return the number of records copied
+ */
+size_t TelemetryRing::copy(std::vector<char> *records) const
+{
+    std::vector<char> slot_copy(_stride);
+    const replay_record_header *header = (const replay_record_header*)slot_copy.data();
+    uint64_t head, n;
+    uint64_t sequence;
+    size_t slot, size, nb_copied = 0;
+
+    if (_nb_records == 0)
+        return 0;
+
+    head = _head.load(std::memory_order_acquire);
+    n = (head > _nb_records) ? (head - _nb_records) : 0;
+    records->reserve(records->size() + (head - n) * _stride);
+    for (; n<head; n++) {
+        slot = n % _nb_records;
+        sequence = _sequences[slot].load(std::memory_order_acquire);
+        if (sequence != 2*n + 2)
+            continue;       // already overwritten, or being so
+        memcpy(slot_copy.data(), &_slots[slot * _stride], _stride);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (_sequences[slot].load(std::memory_order_relaxed) != sequence)
+            continue;       // overwritten during the copy
+        size = sizeof(replay_record_header) + std::min<size_t>(header->size, _max_size);
+        records->insert(records->end(), slot_copy.begin(), slot_copy.begin() + size);
+        nb_copied++;
+    }
+    return nb_copied;
+}
+
+/*
+  Writes a dump of the rings to 'path', replacing it. Any thread.
+  @param nb_records: gets the number of records written
+  @return 0, or the errno of the failure
+ */
+int TelemetryRing::dump(const std::string &path, const replay_log_header &header,
+                        const std::vector<const TelemetryRing*> &rings, size_t *nb_records)
+{
+    std::vector<char> records;
+    FILE *file;
+    size_t i;
+    int err = 0;
+
+    *nb_records = 0;
+    for (i=0; i<rings.size(); i++)
+        *nb_records += rings[i]->copy(&records);
+
+    file = fopen(path.c_str(), "wb");
+    if (!file)
+        return errno;
+    errno = 0;
+    if ((fwrite(&header, sizeof(header), 1, file) != 1) ||
+        (!records.empty() && (fwrite(records.data(), records.size(), 1, file) != 1)))
+        err = errno ? errno : EIO;
+    if ((fclose(file) != 0) && (err == 0))
+        err = errno;
+    return err;
+}
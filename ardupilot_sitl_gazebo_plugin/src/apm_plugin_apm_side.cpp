@@ -21,6 +21,8 @@
  */
 
 #include "../include/ardupilot_sitl_gazebo_plugin/ardupilot_sitl_gazebo_plugin.h"
+#include <math.h>
+#include <algorithm>
 
 namespace gazebo
 {
@@ -35,14 +37,94 @@ namespace gazebo
  */
 bool ArdupilotSitlGazeboPlugin::init_ardupilot_side()
 {
-    // Setup network infrastructure (opens ports from/to ArduPilot)
-    open_control_socket();
-    open_fdm_socket();
+    if (!init_replay_log()) {
+        // The CI job waiting for the status must not hang
+        end_replay(REPLAY_EXIT_ERROR);
+        return false;
+    }
+    
+    // Rings of the last frames, filled from the first one
+    init_telemetry();
+    
+    if (_is_replay) {
+        // The servo packets come from the log, no ArduPilot to talk to
+        ROS_INFO( PLUGIN_LOG_PREPEND "Replay mode, ArduPilot transports not opened");
+    } else if (_apm_transport == APM_TRANSPORT_SHM) {
+        // One segment for the world, with the rings of each vehicle
+        if (!_shm_segment.create(_shm_name, _vehicles.size())) {
+            ROS_ERROR( PLUGIN_LOG_PREPEND "Failed to create the shared memory segment '%s': %s", _shm_name.c_str(), strerror(errno));
+            return false;
+        }
+        ROS_INFO( PLUGIN_LOG_PREPEND "Shared memory transport on segment '%s'", _shm_name.c_str());
+        for (size_t i=0; i<_vehicles.size(); i++)
+            open_shm_transport(_vehicles[i]);
+    } else {
+        // Setup network infrastructure (opens ports from/to each ArduPilot)
+        for (size_t i=0; i<_vehicles.size(); i++) {
+            open_control_socket(_vehicles[i]);
+            open_fdm_socket(_vehicles[i]);
+        }
+    }
+
+    // The main loop sleeps on the control sockets
+    if (!init_loop_events())
+        return false;
 
     return true;
 }
 
 
+/*
+  Opens the replay logs: REPLAY_FILE to read the servo packets from, RECORD_FILE to write
+  the exchanges to.
+  In case of fatal failure, returns 'false'.
+ */
+bool ArdupilotSitlGazeboPlugin::init_replay_log()
+{
+    replay_log_header header;
+    
+    if ((_pacer.get_mode() == LockstepPacer::PACING_REPLAY) && _replay_file.empty()) {
+        ROS_ERROR( PLUGIN_LOG_PREPEND "PACING_MODE replay requires a REPLAY_FILE");
+        return false;
+    }
+    
+    if (!_replay_file.empty()) {
+        if (!_replay_reader.open(_replay_file, &header)) {
+            ROS_ERROR( PLUGIN_LOG_PREPEND "Failed to open the replay log '%s': %s", _replay_file.c_str(), strerror(errno));
+            return false;
+        }
+        if (header.nb_vehicles != _vehicles.size())
+            ROS_WARN( PLUGIN_LOG_PREPEND "Replay log '%s' recorded %u vehicle(s), %u declared", _replay_file.c_str(),
+                      header.nb_vehicles, (unsigned int)_vehicles.size());
+        if ((int)header.steps_per_frame != _steps_per_frame)
+            ROS_WARN( PLUGIN_LOG_PREPEND "Replay log '%s' recorded %u step(s) per frame, %d configured: the physics will differ",
+                      _replay_file.c_str(), header.steps_per_frame, _steps_per_frame);
+        if (_fdm_source != FDM_SOURCE_DIRECT)
+            ROS_WARN( PLUGIN_LOG_PREPEND "Replay with FDM_SOURCE ros: the sensor topics are not synchronised with the steps, the FDM may differ from run to run");
+        _replay_check.init(_vehicles.size());
+        _is_replay = true;
+    }
+    
+    if (!_record_file.empty()) {
+        if (_record_file == _replay_file) {
+            ROS_ERROR( PLUGIN_LOG_PREPEND "RECORD_FILE and REPLAY_FILE must differ");
+            return false;
+        }
+        header.magic = REPLAY_LOG_MAGIC;
+        header.version = REPLAY_LOG_VERSION;
+        header.nb_vehicles = _vehicles.size();
+        header.steps_per_frame = _steps_per_frame;
+        header.frame_duration = STEP_SIZE_FOR_ARDUPILOT;
+        if (!_recorder.open(_record_file, header)) {
+            ROS_ERROR( PLUGIN_LOG_PREPEND "Failed to create the replay log '%s': %s", _record_file.c_str(), strerror(errno));
+            return false;
+        }
+        ROS_INFO( PLUGIN_LOG_PREPEND "Recording the ArduPilot exchanges to '%s'", _record_file.c_str());
+    }
+    return true;
+}
+
+
 //-------------------------------------------------
 //  ArduPilot communication - initialization
 //-------------------------------------------------
@@ -50,21 +132,26 @@ bool ArdupilotSitlGazeboPlugin::init_ardupilot_side()
 /*
   open control socket from ArduPilot
  */
-bool ArdupilotSitlGazeboPlugin::open_control_socket()
+bool ArdupilotSitlGazeboPlugin::open_control_socket(vehicle_slot *vehicle)
 {
-    if (_is_control_socket_open)
+    if (vehicle->is_control_socket_open)
         return true;
 
-    ROS_INFO( PLUGIN_LOG_PREPEND "Binding to listening port from ArduPilot...\n");
-    if (!_sock_control_from_ardu->bind("127.0.0.1", PORT_DATA_FROM_ARDUPILOT)) {
-        ROS_WARN( PLUGIN_LOG_PREPEND "FAILED to bind to port from ArduPilot\n");
+    SocketAPM *sock = new SocketAPM(true);
+
+    ROS_INFO( PLUGIN_LOG_PREPEND "[%s] Binding to listening port %s:%d from ArduPilot...\n", vehicle->model_name.c_str(),
+              _listen_address.c_str(), vehicle->port_from_ardupilot);
+    if (!sock->bind(_listen_address.c_str(), vehicle->port_from_ardupilot)) {
+        ROS_WARN( PLUGIN_LOG_PREPEND "[%s] FAILED to bind to port from ArduPilot\n", vehicle->model_name.c_str());
+        delete sock;
         return false;
     }
 
-    ROS_INFO( PLUGIN_LOG_PREPEND "SUCCESS in binding to port from ArduPilot\n");
-    _sock_control_from_ardu->set_blocking(false);
-    _sock_control_from_ardu->reuseaddress();
-    _is_control_socket_open = true;
+    ROS_INFO( PLUGIN_LOG_PREPEND "[%s] SUCCESS in binding to port from ArduPilot\n", vehicle->model_name.c_str());
+    sock->set_blocking(false);
+    sock->reuseaddress();
+    vehicle->control_from_ardu = sock;
+    vehicle->is_control_socket_open = true;
 
     return true;
 }
@@ -72,26 +159,55 @@ bool ArdupilotSitlGazeboPlugin::open_control_socket()
 /*
   open fdm socket to ArduPilot
  */
-bool ArdupilotSitlGazeboPlugin::open_fdm_socket()
+bool ArdupilotSitlGazeboPlugin::open_fdm_socket(vehicle_slot *vehicle)
 {
-    if (_is_fdm_socket_open)
+    if (vehicle->is_fdm_socket_open)
         return true;
 
-    ROS_INFO( PLUGIN_LOG_PREPEND "Connecting send port to ArduPilot...\n");
-    if (!_sock_fdm_to_ardu->connect("127.0.0.1", PORT_DATA_TO_ARDUPILOT)) {
+    SocketAPM *sock = new SocketAPM(true);
+
+    ROS_INFO( PLUGIN_LOG_PREPEND "[%s] Connecting send port %s:%d to ArduPilot...\n", vehicle->model_name.c_str(),
+              vehicle->apm_address.c_str(), vehicle->port_to_ardupilot);
+    if (!sock->connect(vehicle->apm_address.c_str(), vehicle->port_to_ardupilot)) {
         //check_stdout();
-        ROS_WARN( PLUGIN_LOG_PREPEND "FAILED to connect to port to ArduPilot\n");
+        ROS_WARN( PLUGIN_LOG_PREPEND "[%s] FAILED to connect to port to ArduPilot\n", vehicle->model_name.c_str());
+        delete sock;
         return false;
     }
 
-    ROS_INFO( PLUGIN_LOG_PREPEND "Opened ArduPilot fdm socket\n");
-    _sock_fdm_to_ardu->set_blocking(false);
-    _is_fdm_socket_open = true;
+    ROS_INFO( PLUGIN_LOG_PREPEND "[%s] Opened ArduPilot fdm socket\n", vehicle->model_name.c_str());
+    sock->set_blocking(false);
+    vehicle->fdm_to_ardu = sock;
+    vehicle->is_fdm_socket_open = true;
 
     // First message: introduction
     // (may not be received if ArduPilot is not yet running)
     char startup[] = "";
-    _sock_fdm_to_ardu->send(startup, strlen(startup));
+    vehicle->fdm_to_ardu->send(startup, strlen(startup));
+    return true;
+}
+
+/*
+  open both rings of the vehicle in the shared memory segment.
+  The vehicle's ArduPilot finds them by its servo port.
+ */
+bool ArdupilotSitlGazeboPlugin::open_shm_transport(vehicle_slot *vehicle)
+{
+    static_assert(sizeof(servo_packet) <= APM_SHM_SLOT_SIZE, "servo packets must fit in a ring slot");
+    static_assert(sizeof(fdm_packet) <= APM_SHM_SLOT_SIZE, "FDM packets must fit in a ring slot");
+    static_assert(FDM_V2_MAX_SIZE <= APM_SHM_SLOT_SIZE, "v2 FDM packets must fit in a ring slot");
+    apm_shm_vehicle *rings = _shm_segment.get_vehicle(vehicle->index);
+
+    if (!rings)
+        return false;
+
+    rings->port_base = vehicle->port_from_ardupilot;
+    vehicle->control_from_ardu = new ShmTransportAPM(&_shm_segment, &rings->servo, SHM_TRANSPORT_READER);
+    vehicle->fdm_to_ardu       = new ShmTransportAPM(&_shm_segment, &rings->fdm, SHM_TRANSPORT_WRITER);
+    vehicle->is_control_socket_open = true;
+    vehicle->is_fdm_socket_open = true;
+
+    ROS_INFO( PLUGIN_LOG_PREPEND "[%s] Opened ArduPilot shared memory rings, vehicle %d\n", vehicle->model_name.c_str(), vehicle->index);
     return true;
 }
 
@@ -101,73 +217,249 @@ bool ArdupilotSitlGazeboPlugin::open_fdm_socket()
 //-------------------------------------------------
 
 /*
-  Receive control inputs from the APM SITL and publishes them in a command/motor_speed topic
+  Receive control inputs from the APM SITL and forwards them as motor speed commands
  */
-bool ArdupilotSitlGazeboPlugin::receive_apm_input()
+bool ArdupilotSitlGazeboPlugin::receive_apm_input(vehicle_slot *vehicle)
 {
+    static_assert(SERVO_V2_MAX_SIZE > sizeof(servo_packet), "the buffer must fit both servo packets");
+    char buf[SERVO_V2_MAX_SIZE];
+    servo_v2_header header;
     servo_packet pkt;
+    unsigned int nb_dropped_before = vehicle->stats_nb_dropped;
     int szRecv;
 
-    if (!_is_control_socket_open) {
-        ROS_INFO( PLUGIN_LOG_PREPEND "Cannot receive input from Ardu, for the port is not open !");
+    if (!vehicle->is_control_socket_open) {
+        ROS_INFO( PLUGIN_LOG_PREPEND "[%s] Cannot receive input from Ardu, for the port is not open !", vehicle->model_name.c_str());
         return false;
     }
 
-    szRecv = _sock_control_from_ardu->recv(&pkt, sizeof(pkt), 100);
-    // Expects a servo control packet
-    if (szRecv != sizeof(servo_packet)) {
+    // The main loop already waited for the socket to be readable.
+    // If ArduPilot out-ran the simulation, only its latest servo packet matters.
+    szRecv = vehicle->control_from_ardu->recv_latest(buf, sizeof(buf), &vehicle->stats_nb_dropped);
+    if (szRecv < 0)
+        return false;
+    
+    // Expects a servo control packet, v2 ones are numbered
+    if (servo_v2_unpack(buf, szRecv, &header, pkt.servos, NB_SERVOS)) {
+        if (!check_servo_sequence(vehicle, header, vehicle->stats_nb_dropped - nb_dropped_before, LatencyHistogram::now_ns()))
+            return false;
+    } else if (szRecv == sizeof(servo_packet)) {
+        memcpy(&pkt, buf, sizeof(pkt));
+        vehicle->is_servo_v2 = false;
+    } else {
         return false;
     }
+    
+    if (_recorder.is_open())
+        _recorder.append(REPLAY_RECORD_SERVO, vehicle->index, _batch_index, vehicle->fdm_timestamp.read(), &pkt, sizeof(pkt));
+    vehicle->telemetry.append(REPLAY_RECORD_SERVO, vehicle->index, _batch_index, vehicle->fdm_timestamp.read(), &pkt, sizeof(pkt));
+
+    apply_apm_input(vehicle, pkt);
+    return true;
+}
+
+/*
+  Checks the sequence of a v2 servo packet, and notes the FDM packet it answers.
+  @param nb_superseded: packets received along with it, older: they are not lost
+  @return false if it is older than the last one applied (reordered by the network): it is ignored
+ */
+bool ArdupilotSitlGazeboPlugin::check_servo_sequence(vehicle_slot *vehicle, const servo_v2_header &header,
+                                                     unsigned int nb_superseded, int64_t now_ns)
+{
+    int32_t gap = header.sequence - vehicle->servo_sequence;
+    uint32_t ahead;
+
+    // A new connection (an ArduPilot restarted, a snapshot restored) starts its own sequence
+    if (vehicle->is_connection_alive && vehicle->is_servo_v2) {
+        if (gap <= 0) {
+            vehicle->stats_nb_reordered++;
+            return false;
+        }
+        vehicle->stats_nb_lost += (gap - 1) - std::min<unsigned int>(gap - 1, nb_superseded);
+    }
+    vehicle->servo_sequence = header.sequence;
+    vehicle->is_servo_v2 = true;
+
+    // An echo from the future is from another run of the plugin: the FDM it answers is unknown
+    ahead = vehicle->fdm_sequence - header.fdm_sequence;
+    if ((int32_t)ahead < 0) {
+        vehicle->fdm_sequence_answered = vehicle->fdm_sequence;
+        return true;
+    }
+    vehicle->fdm_sequence_answered = header.fdm_sequence;
+    if (ahead > vehicle->stats_ahead_max)
+        vehicle->stats_ahead_max = ahead;
+    if ((header.fdm_sequence > 0) && (ahead < FDM_SEND_HISTORY)) {
+        double round_trip = (now_ns - vehicle->fdm_send_ns[header.fdm_sequence % FDM_SEND_HISTORY]) * 1e-9;
+        vehicle->stats_nb_round_trips++;
+        vehicle->stats_round_trip_sum += round_trip;
+        if (round_trip > vehicle->stats_round_trip_max)
+            vehicle->stats_round_trip_max = round_trip;
+    }
+    return true;
+}
 
+/*
+  Applies a servo packet, received from ArduPilot or replayed: forwards it as motor speed
+  commands, and checks the parachute release
+ */
+void ArdupilotSitlGazeboPlugin::apply_apm_input(vehicle_slot *vehicle, const servo_packet &pkt)
+{
     // Overwrites the servo control message
     int i;
     bool areAllRotorsOff = true;
 
-    for (i=0; i<_nbMotorSpeed; i++) {
-        _cmd_motor_speed[i] = pkt.servos[i] * 1000.0;
-        if (areAllRotorsOff && (_cmd_motor_speed[i] > 1))
+    for (i=0; i<vehicle->nb_motor_speed; i++) {
+        vehicle->cmd_motor_speed[i] = pkt.servos[i] * 1000.0;
+        if (areAllRotorsOff && (vehicle->cmd_motor_speed[i] > 1))
             areAllRotorsOff = false;
     }
 
     // When all rotors are off, makes them turn at a very slow pace
     // shows to show that everything works and that the simulation is running
-    if (areAllRotorsOff) {
-        for (i=0; i<_nbMotorSpeed; i++) {
+    if (VehicleTraits::IDLE_SPIN && areAllRotorsOff) {
+        for (i=0; i<vehicle->nb_motor_speed; i++) {
             // in [rad/s]
-            _cmd_motor_speed[i] = 5;     // <=> 0.5 tr/sec
+            vehicle->cmd_motor_speed[i] = 5;     // <=> 0.5 tr/sec
         }
     }
 
     // Checks if the parachute servo commands a release
-    check_parachute_cmd(pkt.servos[SERVO_PARACHUTE]);
+    if (VehicleTraits::HAS_PARACHUTE)
+        check_parachute_cmd(vehicle, pkt.servos[SERVO_PARACHUTE]);
 
-    publish_commandMotorSpeed();
-    return true;
+    output_motor_commands(vehicle);
+}
+
+/*
+  Sends the motor speed commands to the outputs of the vehicle (MOTOR_COMMAND_OUTPUT).
+  The mailbox is read at the beginning of the next step, so the command is applied in the
+  step it was received for; the topic is delivered whenever the subscribers are scheduled.
+ */
+void ArdupilotSitlGazeboPlugin::output_motor_commands(vehicle_slot *vehicle)
+{
+    if (vehicle->motor_command_output & MOTOR_COMMAND_OUTPUT_DIRECT)
+        vehicle->command_mailbox->post(vehicle->cmd_motor_speed, vehicle->nb_motor_speed);
+    if (vehicle->motor_command_output & MOTOR_COMMAND_OUTPUT_ROS)
+        publish_commandMotorSpeed(vehicle);
 }
 
 
 /*
   Packages the fdmState data and sends it to the APM SITL
  */
-void ArdupilotSitlGazeboPlugin::send_apm_output()
+void ArdupilotSitlGazeboPlugin::send_apm_output(vehicle_slot *vehicle)
 {
     fdm_packet pkt;
+    fdm_sample_times_block sample_times;
+    char buf[FDM_V2_MAX_SIZE];
+    void *data;
+    size_t size, header_size;
+    int64_t t_start_ns, t_assembled_ns;
+    ssize_t sent;
 
-    if (!_is_control_socket_open) {
-        ROS_INFO( PLUGIN_LOG_PREPEND "Cannot send output to Ardu, for the port is not open !");
+    // In replay, the packet is only assembled for the check and the replay log
+    if (!vehicle->is_control_socket_open && !_is_replay) {
+        ROS_INFO( PLUGIN_LOG_PREPEND "[%s] Cannot send output to Ardu, for the port is not open !", vehicle->model_name.c_str());
         return;
     }   
     
-    // Mutex on '_fdm', for it is concurrently written by ROS callbacks
-    _fdm_mutex.lock();
-    memcpy(&pkt, &_fdm, sizeof(fdm_packet));
-    _fdm_mutex.unlock();
+    t_start_ns = LatencyHistogram::now_ns();
+    
+    // Assembles the latest value of each block. They are concurrently written by the ROS
+    // callbacks and Gazebo's update, but never block: each read is a consistent snapshot.
+    const fdm_imu_block          &imu          = vehicle->fdm_imu.read();
+    const fdm_gps_block          &gps          = vehicle->fdm_gps.read();
+    const fdm_gps_velocity_block &gps_velocity = vehicle->fdm_gps_velocity.read();
+    
+    pkt.timestamp = vehicle->fdm_timestamp.read();
+    memcpy(pkt.imu_angular_velocity_rpy,    imu.angular_velocity_rpy,    sizeof(pkt.imu_angular_velocity_rpy));
+    memcpy(pkt.imu_linear_acceleration_xyz, imu.linear_acceleration_xyz, sizeof(pkt.imu_linear_acceleration_xyz));
+    memcpy(pkt.imu_orientation_quat,        imu.orientation_quat,        sizeof(pkt.imu_orientation_quat));
+    memcpy(pkt.velocity_xyz,                gps_velocity.velocity_xyz,   sizeof(pkt.velocity_xyz));
+    memcpy(pkt.position_xyz,                imu.position_xyz,            sizeof(pkt.position_xyz));
+    memcpy(pkt.position_latlonalt,          gps.position_latlonalt,      sizeof(pkt.position_latlonalt));
+    const fdm_range_block &sonar_down = vehicle->fdm_sonar_down.read();
+    pkt.sonar_down  = sonar_down.range;
+    sample_times.rangefinder_down = sonar_down.sample_time;
+#if SONAR_FRONT == ENABLED
+    const fdm_range_block &sonar_front = vehicle->fdm_sonar_front.read();
+    pkt.sonar_front = sonar_front.range;
+    sample_times.rangefinder_front = sonar_front.sample_time;
+#else
+    sample_times.rangefinder_front = 0;
+#endif
+    sample_times.imu = imu.sample_time;
+    // The position and velocity come from the same sample with the direct source, the older one otherwise
+    sample_times.gps = std::min(gps.sample_time, gps_velocity.sample_time);
     
     // Makes sure the timestamp is non 0, otherwise Ardupilot can believe it to be an erroneous packet
     if (pkt.timestamp < 1e-6)
         pkt.timestamp = 1e-6;       // 1e-6 [s] = 0.001 [ms]
 
-    ssize_t sent = _sock_fdm_to_ardu->send(&pkt, sizeof(pkt));
+    // Numbers the frame, the v2 servo packets answering it echo its sequence
+    vehicle->fdm_sequence++;
+    if (vehicle->fdm_format == FDM_FORMAT_V2) {
+        size = pack_fdm_v2(vehicle, pkt, sample_times, buf);
+        data = buf;
+        header_size = sizeof(fdm_v2_header);
+    } else {
+        size = sizeof(pkt);
+        data = &pkt;
+        header_size = 0;
+    }
+    t_assembled_ns = LatencyHistogram::now_ns();
+    _timing_fdm_assembly.add(t_assembled_ns - t_start_ns);
+    
+    if (_recorder.is_open())
+        _recorder.append(REPLAY_RECORD_FDM, vehicle->index, _batch_index, pkt.timestamp, data, size);
+    vehicle->telemetry.append(REPLAY_RECORD_FDM, vehicle->index, _batch_index, pkt.timestamp, data, size);
+    if (_is_replay)
+        _replay_check.check(vehicle->index, _batch_index, data, size, header_size);
+    vehicle->fdm_send_ns[vehicle->fdm_sequence % FDM_SEND_HISTORY] = t_assembled_ns;
+    if (vehicle->fdm_to_ardu)
+        sent = vehicle->fdm_to_ardu->send(data, size);
+    _timing_send.add(LatencyHistogram::now_ns() - t_assembled_ns);
+}
+
+/*
+  Builds the v2 packet from the legacy one, and the sensors only described in v2.
+  The layout of the vehicle already knows which blocks to copy.
+  @return the size of the packet written in 'buf' (at least FDM_V2_MAX_SIZE bytes)
+ */
+size_t ArdupilotSitlGazeboPlugin::pack_fdm_v2(vehicle_slot *vehicle, const fdm_packet &pkt, const fdm_sample_times_block &sample_times, char *buf)
+{
+    const void *blocks[FDM_NB_SENSORS];
+    fdm_v2_core core;
+    fdm_rangefinder_block rangefinder_down, rangefinder_front;
+    fdm_airspeed_block airspeed;
+    fdm_rpm_block rpm;
+    int i;
+    
+    // The core block is the legacy packet without its range finders
+    static_assert(sizeof(fdm_v2_core) <= sizeof(fdm_packet), "the core block must be a prefix of the legacy packet");
+    memcpy(&core, &pkt, sizeof(core));
+    
+    rangefinder_down.distance = pkt.sonar_down;
+#if SONAR_FRONT == ENABLED
+    rangefinder_front.distance = pkt.sonar_front;
+#else
+    rangefinder_front.distance = 0;     // never in the layout, see 'init_fdm_format()'
+#endif
+    // No wind in the simulation: the airspeed is the ground speed
+    airspeed.airspeed = sqrt(pkt.velocity_xyz[0]*pkt.velocity_xyz[0] + pkt.velocity_xyz[1]*pkt.velocity_xyz[1] +
+                             pkt.velocity_xyz[2]*pkt.velocity_xyz[2]);
+    // Commanded motor speeds, from [rad/s]
+    for (i=0; i<FDM_NB_RPM; i++)
+        rpm.rpm[i] = (i < vehicle->nb_motor_speed) ? (vehicle->cmd_motor_speed[i] * 60.0 / (2*PI)) : 0.0;
+    
+    blocks[FDM_SENSOR_RANGEFINDER_DOWN]  = &rangefinder_down;
+    blocks[FDM_SENSOR_RANGEFINDER_FRONT] = &rangefinder_front;
+    blocks[FDM_SENSOR_AIRSPEED]          = &airspeed;
+    blocks[FDM_SENSOR_RPM]               = &rpm;
+    blocks[FDM_SENSOR_SAMPLE_TIMES]      = &sample_times;
+    
+    return vehicle->fdm_layout.pack(buf, core, blocks, vehicle->fdm_sequence);
 }
 
 } // end of "namespace gazebo"
@@ -0,0 +1,312 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+  Direct FDM source (SDF <FDM_SOURCE>direct</FDM_SOURCE>):
+
+  Instead of waiting for the sensor plugins to publish on ROS topics, the FDM state is
+  sampled from the vehicle's link and ray sensors at the end of each Gazebo step.
+  ArduPilot thus receives the state of the step it commanded, and ROS is out of the
+  lockstep path.
+  The values are computed as the sensor plugins do (rotors' ground truth IMU, Hector's GPS),
+  so both sources are interchangeable.
+ */
+
+#include "../include/ardupilot_sitl_gazebo_plugin/ardupilot_sitl_gazebo_plugin.h"
+#include <math.h>
+#include <algorithm>
+
+
+namespace gazebo
+{
+
+/*
+  Returns 'true' if the scoped name of a sensor ("world::model::link::sensor") ends with 'name'
+ */
+static bool is_sensor_named(const std::string &scoped_name, const std::string &name)
+{
+    std::string suffix = "::" + name;
+
+    return (scoped_name.size() >= suffix.size()) &&
+           (scoped_name.compare(scoped_name.size() - suffix.size(), suffix.size(), suffix) == 0);
+}
+
+/*
+  Returns the shortest distance seen by a ray sensor, as the range finder plugin does
+ */
+static double read_ray_range(const sensors::RaySensorPtr &ray)
+{
+    double range = ray->GetRangeMax();
+    int i;
+
+    for (i=0; i<ray->GetRangeCount(); i++)
+        range = std::min(range, ray->GetRange(i));
+    return range;
+}
+
+
+/*
+  Reads the GPS home of the direct source from the SDF, and precomputes the radii of the
+  ellipsoid at its latitude.
+  In case of fatal failure, returns 'false'.
+ */
+bool ArdupilotSitlGazeboPlugin::init_fdm_direct()
+{
+    const double excentrity2 = 2*WGS84_FLATTENING - WGS84_FLATTENING*WGS84_FLATTENING;
+    double heading_deg = REFERENCE_HEADING_DEFAULT;
+    double sin_lat, temp, prime_vertical_radius;
+
+    _reference_latitude  = REFERENCE_LATITUDE_DEFAULT;
+    _reference_longitude = REFERENCE_LONGITUDE_DEFAULT;
+    _reference_altitude  = REFERENCE_ALTITUDE_DEFAULT;
+    if (_sdf->HasElement("REFERENCE_LATITUDE"))
+        _reference_latitude = _sdf->Get<double>("REFERENCE_LATITUDE");
+    if (_sdf->HasElement("REFERENCE_LONGITUDE"))
+        _reference_longitude = _sdf->Get<double>("REFERENCE_LONGITUDE");
+    if (_sdf->HasElement("REFERENCE_ALTITUDE"))
+        _reference_altitude = _sdf->Get<double>("REFERENCE_ALTITUDE");
+    if (_sdf->HasElement("REFERENCE_HEADING"))
+        heading_deg = _sdf->Get<double>("REFERENCE_HEADING");
+    _reference_heading = heading_deg * PI / 180.0;
+
+    // Same model as Hector's GPS plugin
+    sin_lat = sin(_reference_latitude * PI / 180.0);
+    temp = 1.0 / (1.0 - excentrity2 * sin_lat * sin_lat);
+    prime_vertical_radius = WGS84_EQUATORIAL_RADIUS * sqrt(temp);
+    _radius_north = prime_vertical_radius * (1 - excentrity2) * temp;
+    _radius_east  = prime_vertical_radius * cos(_reference_latitude * PI / 180.0);
+
+    ROS_INFO( PLUGIN_LOG_PREPEND "FDM source: direct, GPS home %f, %f, %f m, heading %f",
+              _reference_latitude, _reference_longitude, _reference_altitude, heading_deg);
+    return true;
+}
+
+/*
+  Looks for the vehicle's link and ray sensors in Gazebo.
+  The model may be spawned after the plugin is loaded, and its sensors created later by
+  Gazebo's sensors thread: this is retried on each step until found.
+  Returns 'true' once the link is known.
+ */
+bool ArdupilotSitlGazeboPlugin::bind_fdm_direct(vehicle_slot *vehicle)
+{
+    unsigned int j;
+    size_t i;
+
+    if (!vehicle->direct_cg_link) {
+        physics::ModelPtr model = _parent_world->GetModel(vehicle->model_name);
+        if (!model)
+            return false;
+
+        vehicle->direct_cg_link = model->GetLink(UAV_MODEL_CG_LINK);
+        if (!vehicle->direct_cg_link) {
+            ROS_WARN( PLUGIN_LOG_PREPEND "[%s] No link '" UAV_MODEL_CG_LINK "', using the canonical link", vehicle->model_name.c_str());
+            vehicle->direct_cg_link = model->GetLink();
+            if (!vehicle->direct_cg_link)
+                return false;
+        }
+
+        // Ray sensors can be attached to any link of the model
+        const physics::Link_V &links = model->GetLinks();
+        for (i=0; i<links.size(); i++) {
+            for (j=0; j<links[i]->GetSensorCount(); j++) {
+                std::string sensor_name = links[i]->GetSensorName(j);
+                if (is_sensor_named(sensor_name, SONAR_DOWN_SENSOR_NAME))
+                    vehicle->direct_sonar_down_name = sensor_name;
+                else if (is_sensor_named(sensor_name, SONAR_FRONT_SENSOR_NAME))
+                    vehicle->direct_sonar_front_name = sensor_name;
+            }
+        }
+        ROS_INFO( PLUGIN_LOG_PREPEND "[%s] Direct FDM source bound, sonar down: '%s', sonar front: '%s'", vehicle->model_name.c_str(),
+                  vehicle->direct_sonar_down_name.c_str(), vehicle->direct_sonar_front_name.c_str());
+    }
+
+    if (!vehicle->direct_sonar_down && !vehicle->direct_sonar_down_name.empty()) {
+        vehicle->direct_sonar_down = boost::dynamic_pointer_cast<sensors::RaySensor>(
+                                     sensors::SensorManager::Instance()->GetSensor(vehicle->direct_sonar_down_name));
+        throttle_ray_sensor(vehicle, vehicle->direct_sonar_down, SCHEDULED_SENSOR_SONAR_DOWN);
+    }
+#if SONAR_FRONT == ENABLED
+    if (!vehicle->direct_sonar_front && !vehicle->direct_sonar_front_name.empty()) {
+        vehicle->direct_sonar_front = boost::dynamic_pointer_cast<sensors::RaySensor>(
+                                      sensors::SensorManager::Instance()->GetSensor(vehicle->direct_sonar_front_name));
+        throttle_ray_sensor(vehicle, vehicle->direct_sonar_front, SCHEDULED_SENSOR_SONAR_FRONT);
+    }
+#endif
+
+    return true;
+}
+
+/*
+  Lowers the update rate of a ray sensor to the rate it is read at: Gazebo casts its rays
+  at the rate of the model's SDF, whether or not the value is used.
+ */
+void ArdupilotSitlGazeboPlugin::throttle_ray_sensor(vehicle_slot *vehicle, const sensors::RaySensorPtr &ray, int sensor)
+{
+    double rate = vehicle->sensor_scheduler.get_rate(sensor);
+
+    if (!ray || !(rate > 0.0))
+        return;
+    // Sampled faster than it updates: the SDF rate is the one of the sensor
+    if ((ray->GetUpdateRate() > 0.0) && (ray->GetUpdateRate() <= rate))
+        return;
+    ray->SetUpdateRate(rate);
+    ROS_INFO( PLUGIN_LOG_PREPEND "[%s] Ray sensor '%s' updated at %.1f Hz", vehicle->model_name.c_str(),
+              SensorScheduler::get_sensor_name(sensor), rate);
+}
+
+/*
+  Writes the FDM state of a restored snapshot, handed over by 'restore_snapshot()'.
+  Called by 'on_gazebo_update()', the writer of the timestamp and of the direct source, before
+  its first sample of the restored timeline.
+ */
+void ArdupilotSitlGazeboPlugin::apply_fdm_restore(vehicle_slot *vehicle)
+{
+    const fdm_state_block &restored = vehicle->fdm_restore;
+
+    vehicle->fdm_timestamp.write(restored.timestamp);
+    if (_fdm_source == FDM_SOURCE_DIRECT) {
+        vehicle->fdm_imu.write(restored.imu);
+        vehicle->fdm_gps.write(restored.gps);
+        vehicle->fdm_gps_velocity.write(restored.gps_velocity);
+        vehicle->fdm_sonar_down.write(restored.sonar_down);
+    #if SONAR_FRONT == ENABLED
+        vehicle->fdm_sonar_front.write(restored.sonar_front);
+    #endif
+        vehicle->direct_angular_velocity_sum.Set(0, 0, 0);
+        vehicle->direct_acceleration_sum.Set(0, 0, 0);
+        vehicle->direct_nb_substeps = 0;
+        // A new grid from the restored time: every sensor is sampled at the next frame
+        vehicle->sensor_scheduler.reset();
+    }
+    vehicle->is_fdm_restore_pending.store(false, std::memory_order_relaxed);
+}
+
+/*
+  Fills the vehicle's FDM blocks from its state in Gazebo.
+  Called at the end of each step, by 'on_gazebo_update()'. The blocks are only written on the
+  last step of the frame, and only those of the sensors due (see 'SensorScheduler.h'); with
+  IMU_SUBSTEP_AVERAGE, the steps since the previous IMU sample feed its average.
+ */
+void ArdupilotSitlGazeboPlugin::sample_fdm_direct(vehicle_slot *vehicle, bool is_frame_end, const common::Time &sim_time)
+{
+    // This method is executed independently from the main loop thread.
+    // Beware of access to shared variables memory: the FDM blocks are single-writer triple buffers.
+
+    if (!bind_fdm_direct(vehicle))
+        return;
+    if (!is_frame_end && (_imu_substep_mode != IMU_SUBSTEP_AVERAGE))
+        return;
+
+    const physics::LinkPtr &link = vehicle->direct_cg_link;
+    const math::Pose pose = link->GetWorldPose();
+
+    if (_imu_substep_mode == IMU_SUBSTEP_AVERAGE) {
+        vehicle->direct_angular_velocity_sum += link->GetRelativeAngularVel();
+        vehicle->direct_acceleration_sum += link->GetRelativeLinearAccel()
+                                          - pose.rot.RotateVectorReverse(_parent_world->GetPhysicsEngine()->GetGravity());
+        vehicle->direct_nb_substeps++;
+        if (!is_frame_end)
+            return;
+    }
+
+    const uint32_t due = vehicle->sensor_scheduler.update((int64_t)sim_time.sec * 1000000000 + sim_time.nsec);
+    const double sample_time = sim_time.Double();
+    const double cos_heading = cos(_reference_heading);
+    const double sin_heading = sin(_reference_heading);
+
+    if (due & (1u << SCHEDULED_SENSOR_IMU)) {
+        math::Vector3 angular_velocity, acceleration;
+
+        if (_imu_substep_mode == IMU_SUBSTEP_AVERAGE) {
+            // (fewer steps than the frame's if the model was bound in the middle of it)
+            angular_velocity = vehicle->direct_angular_velocity_sum / vehicle->direct_nb_substeps;
+            acceleration = vehicle->direct_acceleration_sum / vehicle->direct_nb_substeps;
+            vehicle->direct_angular_velocity_sum.Set(0, 0, 0);
+            vehicle->direct_acceleration_sum.Set(0, 0, 0);
+            vehicle->direct_nb_substeps = 0;
+        } else {
+            angular_velocity = link->GetRelativeAngularVel();
+            // An accelerometer measures the specific force, i.e. without the gravity, in body frame
+            acceleration = link->GetRelativeLinearAccel()
+                         - pose.rot.RotateVectorReverse(_parent_world->GetPhysicsEngine()->GetGravity());
+        }
+
+        // Frame conversion, as in 'imu_callback()':
+        //   Gazebo's frame has Y toward West and Z toward UP, so values are converted to NED frame.
+        fdm_imu_block &imu = vehicle->fdm_imu.write_slot();
+
+        imu.orientation_quat[0] =  pose.rot.w;
+        imu.orientation_quat[1] =  pose.rot.x;
+        imu.orientation_quat[2] = -pose.rot.y;
+        imu.orientation_quat[3] = -pose.rot.z;
+
+        imu.angular_velocity_rpy[0] =  angular_velocity.x;    // [rad/s]
+        imu.angular_velocity_rpy[1] = -angular_velocity.y;    // [rad/s]
+        imu.angular_velocity_rpy[2] = -angular_velocity.z;    // [rad/s]
+
+        imu.linear_acceleration_xyz[0] =  acceleration.x;     // [m/s/s]
+        imu.linear_acceleration_xyz[1] = -acceleration.y;     // [m/s/s]
+        imu.linear_acceleration_xyz[2] = -acceleration.z;     // [m/s/s]
+
+        // Position in the Gazebo world (NOT HANDLED YET, as with the ROS source)
+        imu.position_xyz[0] = 0;    // [m]
+        imu.position_xyz[1] = 0;    // [m]
+        imu.position_xyz[2] = 0;    // [m]
+
+        imu.sample_time = sample_time;
+        vehicle->fdm_imu.publish();
+    }
+
+    if (due & (1u << SCHEDULED_SENSOR_GPS)) {
+        const math::Vector3 velocity = link->GetWorldLinearVel();
+
+        // GPS fix, as Hector's plugin computes it
+        fdm_gps_block &gps = vehicle->fdm_gps.write_slot();
+
+        gps.position_latlonalt[0] = _reference_latitude  + ( cos_heading * pose.pos.x + sin_heading * pose.pos.y) / _radius_north * 180.0 / PI;    // in [degrees]
+        gps.position_latlonalt[1] = _reference_longitude - (-sin_heading * pose.pos.x + cos_heading * pose.pos.y) / _radius_east  * 180.0 / PI;    // in [degrees]
+        gps.position_latlonalt[2] = _reference_altitude  + pose.pos.z;                                                                          // in [m], toward UP
+        gps.sample_time = sample_time;
+
+        vehicle->fdm_gps.publish();
+
+        // GPS velocity, Y toward West and Z toward UP in Hector's plugin, converted as in 'gps_velocity_callback()'
+        fdm_gps_velocity_block &gps_velocity = vehicle->fdm_gps_velocity.write_slot();
+
+        gps_velocity.velocity_xyz[0] =   cos_heading * velocity.x + sin_heading * velocity.y;     // in [m/s]
+        gps_velocity.velocity_xyz[1] = -(-sin_heading * velocity.x + cos_heading * velocity.y);   // in [m/s]
+        gps_velocity.velocity_xyz[2] = -velocity.z;                                               // in [m/s]
+        gps_velocity.sample_time = sample_time;
+
+        vehicle->fdm_gps_velocity.publish();
+    }
+
+    // Range finders
+    if (vehicle->direct_sonar_down && (due & (1u << SCHEDULED_SENSOR_SONAR_DOWN))) {
+        fdm_range_block &sonar = vehicle->fdm_sonar_down.write_slot();
+        sonar.range = read_ray_range(vehicle->direct_sonar_down);      // in [m]
+        sonar.sample_time = sample_time;
+        vehicle->fdm_sonar_down.publish();
+    }
+#if SONAR_FRONT == ENABLED
+    if (vehicle->direct_sonar_front && (due & (1u << SCHEDULED_SENSOR_SONAR_FRONT))) {
+        fdm_range_block &sonar = vehicle->fdm_sonar_front.write_slot();
+        sonar.range = read_ray_range(vehicle->direct_sonar_front);     // in [m]
+        sonar.sample_time = sample_time;
+        vehicle->fdm_sonar_front.publish();
+    }
+#endif
+}
+
+} // end of "namespace gazebo"
@@ -29,6 +29,7 @@
 
 
 #include "../include/ardupilot_sitl_gazebo_plugin/ardupilot_sitl_gazebo_plugin.h"
+#include <sstream>
 
 namespace gazebo
 {
@@ -49,12 +50,117 @@ bool ArdupilotSitlGazeboPlugin::init_gazebo_side(physics::WorldPtr world, sdf::E
     
     // Setup Gazebo node infrastructure
 
-    if (_sdf->HasElement("UAV_MODEL"))
-        _modelName = _sdf->Get<std::string>("UAV_MODEL");
-    if (_sdf->HasElement("NB_SERVOS_MOTOR_SPEED"))
-        _nbMotorSpeed = _sdf->Get<int>("NB_SERVOS_MOTOR_SPEED");
-    ROS_INFO("Model name:      %s", _modelName.c_str());
-    ROS_INFO("Nb motor servos: %d", _nbMotorSpeed);
+    if (!init_vehicles(_sdf))
+        return false;
+    
+    if (_sdf->HasElement("PACING_MODE")) {
+        std::string pacing_mode = _sdf->Get<std::string>("PACING_MODE");
+        if (!_pacer.set_mode(pacing_mode))
+            ROS_WARN( PLUGIN_LOG_PREPEND "Unknown PACING_MODE '%s', expected realtime, speedup:<N>, afap or replay", pacing_mode.c_str());
+    }
+    if (_sdf->HasElement("STRAGGLER_TIMEOUT_MS"))
+        _straggler_timeout_ms = _sdf->Get<int>("STRAGGLER_TIMEOUT_MS");
+    if ((_straggler_timeout_ms < 0) || (_straggler_timeout_ms >= APM_INPUT_TIMEOUT_MS)) {
+        ROS_WARN( PLUGIN_LOG_PREPEND "STRAGGLER_TIMEOUT_MS must be within [0, %d[, using %d", APM_INPUT_TIMEOUT_MS, STRAGGLER_TIMEOUT_MS);
+        _straggler_timeout_ms = STRAGGLER_TIMEOUT_MS;
+    }
+    if (_sdf->HasElement("FDM_SOURCE")) {
+        std::string fdm_source = _sdf->Get<std::string>("FDM_SOURCE");
+        if (fdm_source == "direct")
+            _fdm_source = FDM_SOURCE_DIRECT;
+        else if (fdm_source != "ros")
+            ROS_WARN( PLUGIN_LOG_PREPEND "Unknown FDM_SOURCE '%s', expected ros or direct", fdm_source.c_str());
+    }
+    if ((_fdm_source == FDM_SOURCE_DIRECT) && !init_fdm_direct())
+        return false;
+    if (_sdf->HasElement("APM_TRANSPORT")) {
+        std::string apm_transport = _sdf->Get<std::string>("APM_TRANSPORT");
+        if (apm_transport == "shm")
+            _apm_transport = APM_TRANSPORT_SHM;
+        else if (apm_transport != "udp")
+            ROS_WARN( PLUGIN_LOG_PREPEND "Unknown APM_TRANSPORT '%s', expected udp or shm", apm_transport.c_str());
+    }
+    if (_sdf->HasElement("SHM_NAME"))
+        _shm_name = _sdf->Get<std::string>("SHM_NAME");
+    if (_sdf->HasElement("LISTEN_ADDRESS")) {
+        struct in_addr address;
+        _listen_address = _sdf->Get<std::string>("LISTEN_ADDRESS");
+        if (inet_pton(AF_INET, _listen_address.c_str(), &address) != 1) {
+            ROS_WARN( PLUGIN_LOG_PREPEND "Invalid LISTEN_ADDRESS '%s', expected an IPv4 address, using %s", _listen_address.c_str(), LISTEN_ADDRESS_DEFAULT);
+            _listen_address = LISTEN_ADDRESS_DEFAULT;
+        }
+    }
+    if (_apm_transport == APM_TRANSPORT_SHM) {
+        for (size_t i=0; i<_vehicles.size(); i++) {
+            if (_vehicles[i]->apm_address != APM_ADDRESS_DEFAULT)
+                ROS_WARN( PLUGIN_LOG_PREPEND "[%s] APM_ADDRESS ignored, the shm transport is local", _vehicles[i]->model_name.c_str());
+        }
+    }
+    if (_sdf->HasElement("LOOP_CPUS")) {
+        std::string loop_cpus = _sdf->Get<std::string>("LOOP_CPUS");
+        if (!_loop_realtime.set_cpus(loop_cpus))
+            ROS_WARN( PLUGIN_LOG_PREPEND "Invalid LOOP_CPUS '%s', expected CPU ids and ranges, e.g. '2,3' or '2-5'", loop_cpus.c_str());
+    }
+    if (_sdf->HasElement("LOOP_PRIORITY")) {
+        int loop_priority = _sdf->Get<int>("LOOP_PRIORITY");
+        if (!_loop_realtime.set_priority(loop_priority))
+            ROS_WARN( PLUGIN_LOG_PREPEND "LOOP_PRIORITY must be within [%d, %d], or 0 for the normal scheduling",
+                      sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO));
+    }
+    if (_sdf->HasElement("LOCK_MEMORY"))
+        _loop_realtime.set_lock_memory(_sdf->Get<bool>("LOCK_MEMORY"));
+    if (_sdf->HasElement("TELEMETRY_SECONDS"))
+        _telemetry_seconds = _sdf->Get<double>("TELEMETRY_SECONDS");
+    if (_telemetry_seconds < 0) {
+        ROS_WARN( PLUGIN_LOG_PREPEND "TELEMETRY_SECONDS must be positive, or 0 to disable it");
+        _telemetry_seconds = 0;
+    }
+    if (_sdf->HasElement("TELEMETRY_DUMP_DIR"))
+        _telemetry_dump_dir = _sdf->Get<std::string>("TELEMETRY_DUMP_DIR");
+    if (_sdf->HasElement("RECORD_FILE"))
+        _record_file = _sdf->Get<std::string>("RECORD_FILE");
+    if (_sdf->HasElement("REPLAY_FILE"))
+        _replay_file = _sdf->Get<std::string>("REPLAY_FILE");
+    if (_sdf->HasElement("REPLAY_TOLERANCES")) {
+        std::string replay_tolerances = _sdf->Get<std::string>("REPLAY_TOLERANCES");
+        if (!_replay_check.set_tolerances(replay_tolerances))
+            ROS_WARN( PLUGIN_LOG_PREPEND "Invalid REPLAY_TOLERANCES '%s', expected <field>:<tolerance> ...", replay_tolerances.c_str());
+    }
+    if (_sdf->HasElement("STEPS_PER_FRAME"))
+        _steps_per_frame = _sdf->Get<int>("STEPS_PER_FRAME");
+    if ((_steps_per_frame < 1) || (_steps_per_frame > MAX_STEPS_PER_FRAME)) {
+        ROS_WARN( PLUGIN_LOG_PREPEND "STEPS_PER_FRAME must be within [1, %d], using %d", MAX_STEPS_PER_FRAME, STEPS_PER_FRAME);
+        _steps_per_frame = STEPS_PER_FRAME;
+    }
+    if (_sdf->HasElement("IMU_SUBSTEP_MODE")) {
+        std::string imu_substep_mode = _sdf->Get<std::string>("IMU_SUBSTEP_MODE");
+        if (imu_substep_mode == "average")
+            _imu_substep_mode = IMU_SUBSTEP_AVERAGE;
+        else if (imu_substep_mode != "last")
+            ROS_WARN( PLUGIN_LOG_PREPEND "Unknown IMU_SUBSTEP_MODE '%s', expected last or average", imu_substep_mode.c_str());
+    }
+    if ((_imu_substep_mode == IMU_SUBSTEP_AVERAGE) && (_fdm_source != FDM_SOURCE_DIRECT)) {
+        // The sensor plugins publish one sample per step, which can't be related to the frames
+        ROS_WARN( PLUGIN_LOG_PREPEND "IMU_SUBSTEP_MODE average requires FDM_SOURCE direct, using last");
+        _imu_substep_mode = IMU_SUBSTEP_LAST;
+    }
+    ROS_INFO( PLUGIN_LOG_PREPEND "%d physics step(s) per ArduPilot frame, IMU of the %s step(s)", _steps_per_frame,
+              (_imu_substep_mode == IMU_SUBSTEP_AVERAGE) ? "averaged" : "last");
+    if (_sdf->HasElement("RENDER_PIPELINE_DEPTH")) {
+        int render_pipeline_depth = _sdf->Get<int>("RENDER_PIPELINE_DEPTH");
+        if (render_pipeline_depth >= 0)
+            _render_pipeline.set_depth(render_pipeline_depth);
+        else
+            ROS_WARN( PLUGIN_LOG_PREPEND "RENDER_PIPELINE_DEPTH must be positive, or 0 to disable it");
+    }
+    if (_render_pipeline.is_enabled())
+        ROS_INFO( PLUGIN_LOG_PREPEND "Cameras rendered up to %u frame(s) behind the simulation", _render_pipeline.get_depth());
+    if (_sdf->HasElement("PARACHUTE_PRELOAD"))
+        _parachute_preload = _sdf->Get<bool>("PARACHUTE_PRELOAD");
+    if (_parachute_preload && !VehicleTraits::HAS_PARACHUTE) {
+        ROS_WARN( PLUGIN_LOG_PREPEND "PARACHUTE_PRELOAD ignored, this vehicle type has no parachute");
+        _parachute_preload = false;
+    }
 
     // 'transport' is the communication library of Gazebo. It handles publishers
     // and subscribers.
@@ -70,9 +176,9 @@ bool ArdupilotSitlGazeboPlugin::init_gazebo_side(physics::WorldPtr world, sdf::E
     msgs::Physics physicsMsg;
     physicsMsg.set_type(msgs::Physics::ODE);
 
-    // Set the step time: 2.5 ms to achieve the 400 Hz required by ArduPilot on Pixhawk
-    // TODO: pass it to parametric
-    physicsMsg.set_max_step_size(STEP_SIZE_FOR_ARDUPILOT);
+    // Set the step time: 2.5 ms to achieve the 400 Hz required by ArduPilot on Pixhawk,
+    // divided in STEPS_PER_FRAME physics steps
+    physicsMsg.set_max_step_size(STEP_SIZE_FOR_ARDUPILOT / _steps_per_frame);
     physicsPub->Publish(physicsMsg);
     
     _controlSub = node->Subscribe("~/world_control", &ArdupilotSitlGazeboPlugin::on_gazebo_control, this);
@@ -87,6 +193,339 @@ bool ArdupilotSitlGazeboPlugin::init_gazebo_side(physics::WorldPtr world, sdf::E
     // Or we could also use 'ConnectWorldUpdateBegin'
     // For a list of all available connection events, see: Gazebo-X.X/gazebo/common/Events.hh 
     
+    if (_parachute_preload || VehicleTraits::HAS_DRIVE) {
+        // The preloaded parachutes are parked and deployed between two steps,
+        // and the drives actuated before the step their command was received for
+        _updateBeginConnection = event::Events::ConnectWorldUpdateBegin(
+              boost::bind(&ArdupilotSitlGazeboPlugin::on_gazebo_update_begin, this));
+    }
+    if (_parachute_preload) {
+        for (size_t i=0; i<_vehicles.size(); i++)
+            preload_parachute_model(_vehicles[i]);
+    }
+    
+    return true;
+}
+
+/*
+  Starts parsing the meshes of the world, with SDF MESH_PRELOAD_THREADS threads (0 to disable),
+  and the extra ones of MESH_PRELOAD_URIS (the vehicles spawned later, for instance).
+ */
+void ArdupilotSitlGazeboPlugin::start_mesh_preload(physics::WorldPtr world, sdf::ElementPtr sdf)
+{
+    if (sdf->HasElement("MESH_PRELOAD_THREADS")) {
+        int nb_threads = sdf->Get<int>("MESH_PRELOAD_THREADS");
+        if (nb_threads >= 0)
+            _mesh_preloader.set_nb_threads(nb_threads);
+        else
+            ROS_WARN( PLUGIN_LOG_PREPEND "MESH_PRELOAD_THREADS must be positive, or 0 to disable it");
+    }
+    if (_mesh_preloader.get_nb_threads() == 0)
+        return;
+
+    _mesh_preloader.add_sdf_meshes(world->GetSDF());
+    if (sdf->HasElement("MESH_PRELOAD_URIS"))
+        _mesh_preloader.add_uris(sdf->Get<std::string>("MESH_PRELOAD_URIS"));
+    _mesh_preloader.start();
+}
+
+/*
+  Waits for the meshes, and registers them in Gazebo
+ */
+void ArdupilotSitlGazeboPlugin::finish_mesh_preload()
+{
+    std::string failed_names;
+    size_t nb_meshes = _mesh_preloader.get_nb_meshes();
+    unsigned int nb_registered;
+
+    if (nb_meshes == 0)
+        return;
+    nb_registered = _mesh_preloader.finish(&failed_names);
+    if (!failed_names.empty())
+        ROS_WARN( PLUGIN_LOG_PREPEND "Could not preload the meshes %s", failed_names.c_str());
+    ROS_INFO( PLUGIN_LOG_PREPEND "%u of %zu mesh(es) preloaded by %u thread(s)", nb_registered, nb_meshes,
+              std::min<unsigned int>(_mesh_preloader.get_nb_threads(), nb_meshes));
+}
+
+/*
+  Declares the vehicles from the plugin's SDF.
+  
+  Either a list of vehicles, each one driven by its own ArduPilot SITL instance:
+      <VEHICLE>
+        <UAV_MODEL>iris_1</UAV_MODEL>                        model name in Gazebo
+        <PORT_BASE>9012</PORT_BASE>                          servo port, the FDM goes to PORT_BASE+1
+        <NAMESPACE>iris_1</NAMESPACE>                        prefix of its ROS topics
+        <NB_SERVOS_MOTOR_SPEED>4</NB_SERVOS_MOTOR_SPEED>
+      </VEHICLE>
+      <VEHICLE>
+        ...
+  or, if there is no <VEHICLE> element, a single vehicle configured by the top-level
+  UAV_MODEL and NB_SERVOS_MOTOR_SPEED elements.
+  The top-level elements are also the defaults of the list's vehicles.
+  In case of fatal failure, returns 'false'.
+ */
+bool ArdupilotSitlGazeboPlugin::init_vehicles(sdf::ElementPtr sdf)
+{
+    std::string default_model = UAV_MODEL_NAME;
+    int default_nb_motor_speed = NB_SERVOS_MOTOR_SPEED;
+    sdf::ElementPtr vehicle_sdf;
+    vehicle_slot *vehicle;
+    
+    if (sdf->HasElement("UAV_MODEL"))
+        default_model = sdf->Get<std::string>("UAV_MODEL");
+    if (sdf->HasElement("NB_SERVOS_MOTOR_SPEED"))
+        default_nb_motor_speed = sdf->Get<int>("NB_SERVOS_MOTOR_SPEED");
+    
+    if (!sdf->HasElement("VEHICLE")) {
+        vehicle = add_vehicle(sdf::ElementPtr(), default_model, default_nb_motor_speed);
+        if (!vehicle)
+            return false;
+        // Single vehicle setups keep the range finders on the global topics
+        vehicle->sonar_topic_prefix = "";
+        return true;
+    }
+    
+    for (vehicle_sdf = sdf->GetElement("VEHICLE"); vehicle_sdf; vehicle_sdf = vehicle_sdf->GetNextElement("VEHICLE")) {
+        if (!add_vehicle(vehicle_sdf, default_model, default_nb_motor_speed))
+            return false;
+    }
+    return true;
+}
+
+/*
+  Creates the slot of a vehicle, and appends it to '_vehicles'.
+  @param vehicle_sdf: the <VEHICLE> element, or NULL for the single vehicle setup
+  @return the new slot, or NULL if the configuration is invalid
+ */
+ArdupilotSitlGazeboPlugin::vehicle_slot* ArdupilotSitlGazeboPlugin::add_vehicle(sdf::ElementPtr vehicle_sdf,
+                                                                                  const std::string &default_model,
+                                                                                  int default_nb_motor_speed)
+{
+    vehicle_slot *vehicle = new vehicle_slot();
+    int port_base;
+    size_t i;
+    
+    vehicle->index = _vehicles.size();
+    vehicle->model_name = default_model;
+    vehicle->nb_motor_speed = default_nb_motor_speed;
+    // Each vehicle of the list gets its own block of ports by default
+    port_base = PORT_DATA_FROM_ARDUPILOT + vehicle->index * PORT_OFFSET_PER_VEHICLE;
+    
+    if (vehicle_sdf) {
+        if (vehicle_sdf->HasElement("UAV_MODEL"))
+            vehicle->model_name = vehicle_sdf->Get<std::string>("UAV_MODEL");
+        if (vehicle_sdf->HasElement("NB_SERVOS_MOTOR_SPEED"))
+            vehicle->nb_motor_speed = vehicle_sdf->Get<int>("NB_SERVOS_MOTOR_SPEED");
+        if (vehicle_sdf->HasElement("PORT_BASE"))
+            port_base = vehicle_sdf->Get<int>("PORT_BASE");
+    }
+    
+    vehicle->ros_namespace = vehicle->model_name;
+    if (vehicle_sdf && vehicle_sdf->HasElement("NAMESPACE"))
+        vehicle->ros_namespace = vehicle_sdf->Get<std::string>("NAMESPACE");
+    // Topics are built as "/<namespace>/..."
+    while (!vehicle->ros_namespace.empty() && (vehicle->ros_namespace[0] == '/'))
+        vehicle->ros_namespace.erase(0, 1);
+    vehicle->sonar_topic_prefix = std::string("/") + vehicle->ros_namespace;
+    
+    vehicle->port_from_ardupilot = port_base;
+    vehicle->port_to_ardupilot   = port_base + (PORT_DATA_TO_ARDUPILOT - PORT_DATA_FROM_ARDUPILOT);
+    
+    // The first parachute keeps the name of its model file, the next ones are renamed after their vehicle
+    if (vehicle->index > 0)
+        vehicle->parachute_name = std::string(PARACHUTE_MODEL_NAME "_") + vehicle->model_name;
+    
+    if ((vehicle->nb_motor_speed < 0) || (vehicle->nb_motor_speed > NB_SERVOS)) {
+        ROS_ERROR( PLUGIN_LOG_PREPEND "[%s] NB_SERVOS_MOTOR_SPEED must be within [0, %d]", vehicle->model_name.c_str(), NB_SERVOS);
+        delete vehicle;
+        return NULL;
+    }
+    
+    if (!init_fdm_format(vehicle, vehicle_sdf) || !init_sensor_rates(vehicle, vehicle_sdf) ||
+        !init_motor_command_output(vehicle, vehicle_sdf) || !init_apm_endpoint(vehicle, vehicle_sdf)) {
+        delete vehicle;
+        return NULL;
+    }
+    
+    for (i=0; i<_vehicles.size(); i++) {
+        // ArduPilots on distinct hosts may use the same FDM port
+        if ((_vehicles[i]->model_name == vehicle->model_name) ||
+            (_vehicles[i]->port_from_ardupilot == vehicle->port_from_ardupilot) ||
+            ((_vehicles[i]->port_to_ardupilot == vehicle->port_to_ardupilot) && (_vehicles[i]->apm_address == vehicle->apm_address))) {
+            ROS_ERROR( PLUGIN_LOG_PREPEND "[%s] Vehicle model name and ports must be unique, conflict with '%s'",
+                       vehicle->model_name.c_str(), _vehicles[i]->model_name.c_str());
+            delete vehicle;
+            return NULL;
+        }
+    }
+    
+    ROS_INFO("Model name:      %s", vehicle->model_name.c_str());
+    ROS_INFO("Nb motor servos: %d", vehicle->nb_motor_speed);
+    ROS_INFO("Ports:           %d (servos), %s:%d (fdm)", vehicle->port_from_ardupilot, vehicle->apm_address.c_str(), vehicle->port_to_ardupilot);
+    if (vehicle->pipeline_window > 0)
+        ROS_INFO("Pipeline window: %d frame(s), with v2 servo packets", vehicle->pipeline_window);
+    
+    _vehicles.push_back(vehicle);
+    return vehicle;
+}
+
+/*
+  Reads the format of the FDM packets of a vehicle, from its VEHICLE element or else from the
+  top-level elements:
+      <FDM_FORMAT>v2</FDM_FORMAT>                                     legacy (default) or v2
+      <FDM_SENSORS>rangefinder_down airspeed rpm</FDM_SENSORS>       blocks of the v2 packets
+  In case of fatal failure, returns 'false'.
+ */
+bool ArdupilotSitlGazeboPlugin::init_fdm_format(vehicle_slot *vehicle, sdf::ElementPtr vehicle_sdf)
+{
+    std::string fdm_format = "legacy";
+    std::string sensors = "rangefinder_down";
+    std::string sensor_name;
+    uint32_t sensor_mask = 0;
+    
+#if SONAR_FRONT == ENABLED
+    sensors += " rangefinder_front";
+#endif
+    if (vehicle_sdf && vehicle_sdf->HasElement("FDM_FORMAT"))
+        fdm_format = vehicle_sdf->Get<std::string>("FDM_FORMAT");
+    else if (_sdf->HasElement("FDM_FORMAT"))
+        fdm_format = _sdf->Get<std::string>("FDM_FORMAT");
+    if (vehicle_sdf && vehicle_sdf->HasElement("FDM_SENSORS"))
+        sensors = vehicle_sdf->Get<std::string>("FDM_SENSORS");
+    else if (_sdf->HasElement("FDM_SENSORS"))
+        sensors = _sdf->Get<std::string>("FDM_SENSORS");
+    
+    if (fdm_format == "v2") {
+        vehicle->fdm_format = FDM_FORMAT_V2;
+    } else if (fdm_format != "legacy") {
+        ROS_ERROR( PLUGIN_LOG_PREPEND "[%s] Unknown FDM_FORMAT '%s', expected legacy or v2", vehicle->model_name.c_str(), fdm_format.c_str());
+        return false;
+    }
+    
+    std::istringstream sensor_list(sensors);
+    while (sensor_list >> sensor_name) {
+        int id = vehicle->fdm_layout.find_sensor(sensor_name);
+        if (id < 0) {
+            ROS_ERROR( PLUGIN_LOG_PREPEND "[%s] Unknown FDM sensor '%s'", vehicle->model_name.c_str(), sensor_name.c_str());
+            return false;
+        }
+#if SONAR_FRONT != ENABLED
+        if (id == FDM_SENSOR_RANGEFINDER_FRONT) {
+            // Part of the format, but nothing in the simulation provides it
+            ROS_WARN( PLUGIN_LOG_PREPEND "[%s] No source for the FDM sensor '%s', ignored", vehicle->model_name.c_str(), sensor_name.c_str());
+            continue;
+        }
+#endif
+        sensor_mask |= (1u << id);
+    }
+    vehicle->fdm_layout.init(sensor_mask);
+    
+    if (vehicle->fdm_format == FDM_FORMAT_V2)
+        ROS_INFO("FDM format:      v2, sensors '%s', %d bytes", sensors.c_str(), (int)vehicle->fdm_layout.get_size());
+    else
+        ROS_INFO("FDM format:      legacy");
+    return true;
+}
+
+/*
+  Reads where the ArduPilot of a vehicle runs, from its VEHICLE element or else from the
+  top-level elements:
+      <APM_ADDRESS>10.0.0.12</APM_ADDRESS>       IPv4 address of its host, receives the FDM packets
+      <PIPELINE_WINDOW>2</PIPELINE_WINDOW>       [frames] steps run ahead of its servo packets
+  The window only applies once the ArduPilot sends v2 servo packets (see 'FdmWireFormat.h'):
+  the legacy ones do not tell which FDM packet they answer.
+  In case of fatal failure, returns 'false'.
+ */
+bool ArdupilotSitlGazeboPlugin::init_apm_endpoint(vehicle_slot *vehicle, sdf::ElementPtr vehicle_sdf)
+{
+    struct in_addr address;
+    
+    if (vehicle_sdf && vehicle_sdf->HasElement("APM_ADDRESS"))
+        vehicle->apm_address = vehicle_sdf->Get<std::string>("APM_ADDRESS");
+    else if (_sdf->HasElement("APM_ADDRESS"))
+        vehicle->apm_address = _sdf->Get<std::string>("APM_ADDRESS");
+    if (inet_pton(AF_INET, vehicle->apm_address.c_str(), &address) != 1) {
+        ROS_ERROR( PLUGIN_LOG_PREPEND "[%s] Invalid APM_ADDRESS '%s', expected an IPv4 address", vehicle->model_name.c_str(),
+                   vehicle->apm_address.c_str());
+        return false;
+    }
+    
+    if (vehicle_sdf && vehicle_sdf->HasElement("PIPELINE_WINDOW"))
+        vehicle->pipeline_window = vehicle_sdf->Get<int>("PIPELINE_WINDOW");
+    else if (_sdf->HasElement("PIPELINE_WINDOW"))
+        vehicle->pipeline_window = _sdf->Get<int>("PIPELINE_WINDOW");
+    if ((vehicle->pipeline_window < 0) || (vehicle->pipeline_window > MAX_PIPELINE_WINDOW)) {
+        ROS_WARN( PLUGIN_LOG_PREPEND "[%s] PIPELINE_WINDOW must be within [0, %d], using %d", vehicle->model_name.c_str(),
+                  MAX_PIPELINE_WINDOW, PIPELINE_WINDOW_DEFAULT);
+        vehicle->pipeline_window = PIPELINE_WINDOW_DEFAULT;
+    }
+    return true;
+}
+
+/*
+  Reads the sampling rates of the FDM sensors of a vehicle, from its VEHICLE element or else
+  from the top-level elements:
+      <SENSOR_RATES>imu:400 gps:10 sonar:20</SENSOR_RATES>     [Hz] of simulation time, 0 for every frame
+  Only the direct FDM source is scheduled: with the ROS source, the sensor plugins publish at
+  the rates of the models' xacros.
+  In case of fatal failure, returns 'false'.
+ */
+bool ArdupilotSitlGazeboPlugin::init_sensor_rates(vehicle_slot *vehicle, sdf::ElementPtr vehicle_sdf)
+{
+    std::string rates;
+    
+    if (vehicle_sdf && vehicle_sdf->HasElement("SENSOR_RATES"))
+        rates = vehicle_sdf->Get<std::string>("SENSOR_RATES");
+    else if (_sdf->HasElement("SENSOR_RATES"))
+        rates = _sdf->Get<std::string>("SENSOR_RATES");
+    
+    if (!vehicle->sensor_scheduler.set_rates(rates)) {
+        ROS_ERROR( PLUGIN_LOG_PREPEND "[%s] Invalid SENSOR_RATES '%s', expected e.g. 'imu:400 gps:10 sonar:20'",
+                   vehicle->model_name.c_str(), rates.c_str());
+        return false;
+    }
+    ROS_INFO("Sensor rates:    %s", vehicle->sensor_scheduler.get_rates_str().c_str());
+    return true;
+}
+
+/*
+  Reads where the motor speed commands of a vehicle go, from its VEHICLE element or else from
+  the top-level elements:
+      <MOTOR_COMMAND_OUTPUT>both</MOTOR_COMMAND_OUTPUT>    ros, direct or both
+  'direct' writes them to the in-process mailbox of the model, read by AircraftPlugin at the
+  beginning of each step. Motor models that only subscribe to the topic (e.g. the rotors
+  plugins of the iris) need 'ros' or 'both'. The default depends on the vehicle type.
+  A vehicle type with a drive always gets the mailbox, the drive being its reader.
+  In case of fatal failure, returns 'false'.
+ */
+bool ArdupilotSitlGazeboPlugin::init_motor_command_output(vehicle_slot *vehicle, sdf::ElementPtr vehicle_sdf)
+{
+    std::string output = VehicleTraits::default_motor_command_output();
+    
+    if (vehicle_sdf && vehicle_sdf->HasElement("MOTOR_COMMAND_OUTPUT"))
+        output = vehicle_sdf->Get<std::string>("MOTOR_COMMAND_OUTPUT");
+    else if (_sdf->HasElement("MOTOR_COMMAND_OUTPUT"))
+        output = _sdf->Get<std::string>("MOTOR_COMMAND_OUTPUT");
+    
+    if (output == "ros") {
+        vehicle->motor_command_output = MOTOR_COMMAND_OUTPUT_ROS;
+    } else if (output == "direct") {
+        vehicle->motor_command_output = MOTOR_COMMAND_OUTPUT_DIRECT;
+    } else if (output == "both") {
+        vehicle->motor_command_output = MOTOR_COMMAND_OUTPUT_BOTH;
+    } else {
+        ROS_ERROR( PLUGIN_LOG_PREPEND "[%s] Unknown MOTOR_COMMAND_OUTPUT '%s', expected ros, direct or both", vehicle->model_name.c_str(), output.c_str());
+        return false;
+    }
+    
+    if (VehicleTraits::HAS_DRIVE) {
+        vehicle->motor_command_output |= MOTOR_COMMAND_OUTPUT_DIRECT;
+        // Not in the registry: only this plugin posts to it, from the ROS spinner
+        vehicle->manual_drive_mailbox = std::make_shared<CommandMailbox>();
+    }
+    if (vehicle->motor_command_output & MOTOR_COMMAND_OUTPUT_DIRECT)
+        vehicle->command_mailbox = CommandMailbox::get(vehicle->model_name);
+    ROS_INFO("Motor commands:  %s", output.c_str());
     return true;
 }
 
@@ -96,7 +535,7 @@ bool ArdupilotSitlGazeboPlugin::init_gazebo_side(physics::WorldPtr world, sdf::E
 //-------------------------------------------------
 
 /*
-  Advances the simulation by 1 step
+  Advances the simulation by 1 ArduPilot frame, i.e. STEPS_PER_FRAME physics steps (for all vehicles)
  */
 void ArdupilotSitlGazeboPlugin::step_gazebo_sim()
 {
@@ -105,23 +544,143 @@ void ArdupilotSitlGazeboPlugin::step_gazebo_sim()
     // Unfortunately, it breaks the Gazebo system of Real Time clock and Factor,
     // as well as the functionnality of the Pause & Step GUI buttons.
     // The functionnality of the Pause GUI button is emulated within 'on_gazebo_control()'.
-    _parent_world->Step(1);
+    // 'World::Step()' returns once the world thread has run the steps, and their update events:
+    // the FDM of the frame is sampled, and the world is idle until the next call.
+    // It polls for the world thread (sleeps of 1 ns), which may share the CPUs of the loop:
+    // the loop leaves SCHED_FIFO meanwhile, not to spin ahead of it (LOOP_PRIORITY).
+    _loop_realtime.suspend_priority();
+    _parent_world->Step(_steps_per_frame);
+    _loop_realtime.resume_priority();
+}
+
+/*
+  Adds the cameras of the vehicles' models to the render pipeline (RENDER_PIPELINE_DEPTH).
+  The models may be spawned after the plugin is loaded, and their sensors created later by
+  Gazebo's sensors thread: a model is bound once all its sensors exist, retried by the loop
+  thread at each statistics period until then.
+ */
+void ArdupilotSitlGazeboPlugin::bind_render_sensors()
+{
+    std::vector<sensors::SensorPtr> model_sensors;
+    bool are_all_created;
+    unsigned int j;
+    size_t i, k;
+    
+    if (!_render_pipeline.is_enabled())
+        return;
+    
+    for (i=0; i<_vehicles.size(); i++) {
+        vehicle_slot *vehicle = _vehicles[i];
+        
+        if (vehicle->is_render_bound)
+            continue;
+        physics::ModelPtr model = _parent_world->GetModel(vehicle->model_name);
+        if (!model)
+            continue;
+        
+        model_sensors.clear();
+        are_all_created = true;
+        const physics::Link_V &links = model->GetLinks();
+        for (k=0; k<links.size(); k++) {
+            for (j=0; j<links[k]->GetSensorCount(); j++) {
+                sensors::SensorPtr sensor = sensors::SensorManager::Instance()->GetSensor(links[k]->GetSensorName(j));
+                if (!sensor)
+                    are_all_created = false;
+                else if (RenderPipeline::is_render_sensor(sensor))
+                    model_sensors.push_back(sensor);
+            }
+        }
+        if (!are_all_created)
+            continue;
+        
+        for (k=0; k<model_sensors.size(); k++) {
+            if (_render_pipeline.add_sensor(model_sensors[k], boost::bind(&ArdupilotSitlGazeboPlugin::on_render_image, this)))
+                ROS_INFO( PLUGIN_LOG_PREPEND "[%s] Camera '%s' in the render pipeline, at %.1f Hz", vehicle->model_name.c_str(),
+                          model_sensors[k]->GetName().c_str(), model_sensors[k]->GetUpdateRate());
+            else
+                ROS_WARN( PLUGIN_LOG_PREPEND "[%s] Camera '%s' has no update rate, it does not hold the loop", vehicle->model_name.c_str(),
+                          model_sensors[k]->GetName().c_str());
+        }
+        vehicle->is_render_bound = true;
+    }
+}
+
+/*
+  Returns 'true' while a camera lags more than RENDER_PIPELINE_DEPTH of its frames behind the
+  simulation: the loop waits before the next step, see 'wait_render_image()'.
+  Only called by the loop thread.
+ */
+bool ArdupilotSitlGazeboPlugin::is_render_pipeline_full()
+{
+    std::string stalled_names, resumed_names;
+    bool is_full;
+    
+    if (!_render_pipeline.is_enabled())
+        return false;
+    
+    // Before the check: an image rendered from now on wakes the wait up
+    _is_render_waiting.store(true);
+    is_full = _render_pipeline.is_full(_parent_world->GetSimTime(), LatencyHistogram::now_ns(), &stalled_names, &resumed_names);
+    if (!stalled_names.empty())
+        ROS_WARN( PLUGIN_LOG_PREPEND "No image from '%s' for %.1f s, left out of the render pipeline until it renders",
+                  stalled_names.c_str(), RENDER_STALL_TIMEOUT);
+    if (!resumed_names.empty())
+        ROS_INFO( PLUGIN_LOG_PREPEND "'%s' renders again, back in the render pipeline", resumed_names.c_str());
+    if (is_full)
+        _stats_nb_render_waits++;
+    else
+        _is_render_waiting.store(false);
+    return is_full;
+}
+
+/*
+  Sleeps until a camera renders an image, while the render pipeline is full.
+  The timeout only lets the stalled cameras be noticed.
+ */
+void ArdupilotSitlGazeboPlugin::wait_render_image()
+{
+    wait_loop_wakeup(RENDER_WAIT_TIMEOUT_MS);
+    _is_render_waiting.store(false);
+}
+
+/*
+  Callback of the cameras of the render pipeline, from Gazebo's sensors thread after each image
+ */
+void ArdupilotSitlGazeboPlugin::on_render_image()
+{
+    if (_is_render_waiting.load())
+        wake_loop_thread();
 }
 
 /*
   Callback from gazebo after each simulation step
-  (thus after each call to 'step_gazebo_sim()')
+  (thus STEPS_PER_FRAME times per call to 'step_gazebo_sim()')
  */
 void ArdupilotSitlGazeboPlugin::on_gazebo_update()
 {
     // This method is executed independently from the main loop thread.
     // Beware of access to shared variables memory. USe mutexes if required.
     
+    // Steps are only run by 'step_gazebo_sim()', by whole frames
+    _substep_index++;
+    bool is_frame_end = (_substep_index >= _steps_per_frame);
+    if (is_frame_end)
+        _substep_index = 0;
+    
     // Get the simulation time
     gazebo::common::Time gz_time_now = _parent_world->GetSimTime();
     // Converts it to seconds
-    _fdm.timestamp = gz_time_now.sec + gz_time_now.nsec * 1e-9;
-
+    double timestamp = gz_time_now.sec + gz_time_now.nsec * 1e-9;
+    for (size_t i=0; i<_vehicles.size(); i++) {
+        if (_vehicles[i]->is_fdm_restore_pending.load(std::memory_order_acquire))
+            apply_fdm_restore(_vehicles[i]);
+        // The state of the frame that just ended, ready before the loop thread sends it
+        if (_fdm_source == FDM_SOURCE_DIRECT)
+            sample_fdm_direct(_vehicles[i], is_frame_end, gz_time_now);
+        if (is_frame_end)
+            _vehicles[i]->fdm_timestamp.write(timestamp);
+    }
+    
     if (!_timeMsgAlreadyDisplayed) {
         // (It seems) The displayed value is only updated after the first iteration
         ROS_INFO( PLUGIN_LOG_PREPEND "Simulation step size is = %f", _parent_world->GetPhysicsEngine()->GetMaxStepSize());
@@ -129,6 +688,59 @@ void ArdupilotSitlGazeboPlugin::on_gazebo_update()
     }
 }
     
+/*
+  Callback from gazebo before each simulation step, connected with PARACHUTE_PRELOAD or a drive.
+  The preloaded parachutes change state here, and the drives are actuated, while the physics
+  is not running.
+ */
+void ArdupilotSitlGazeboPlugin::on_gazebo_update_begin()
+{
+    for (size_t i=0; i<_vehicles.size(); i++) {
+        vehicle_slot *vehicle = _vehicles[i];
+        
+        if (VehicleTraits::HAS_DRIVE)
+            update_drive(vehicle);
+        if (!VehicleTraits::HAS_PARACHUTE)
+            continue;
+        if (vehicle->parachute_state == PARACHUTE_LOADED)
+            park_parachute_model(vehicle);
+        if ((vehicle->parachute_state == PARACHUTE_PARKED) && vehicle->is_parachute_deploy_requested)
+            deploy_parachute_model(vehicle);
+    }
+}
+
+/*
+  Applies the newest commands of a vehicle to its drive: those of ArduPilot, then those of
+  the 'cmd_vel' topic. The drive is bound on the first command after the model is spawned.
+ */
+void ArdupilotSitlGazeboPlugin::update_drive(vehicle_slot *vehicle)
+{
+    const motor_command *cmd = vehicle->command_mailbox->fetch();
+    const motor_command *manual_cmd = vehicle->manual_drive_mailbox->fetch();
+    
+    if (!cmd && !manual_cmd)
+        return;
+    
+    if (!vehicle->is_drive_bound) {
+        physics::ModelPtr model = _parent_world->GetModel(vehicle->model_name);
+        
+        // Not spawned yet
+        if (!model || vehicle->is_drive_bind_failed)
+            return;
+        if (!VehicleTraits::bind_drive(vehicle->drive, model)) {
+            ROS_ERROR( PLUGIN_LOG_PREPEND "[%s] Joints of the drive not found in the model", vehicle->model_name.c_str());
+            vehicle->is_drive_bind_failed = true;
+            return;
+        }
+        vehicle->is_drive_bound = true;
+    }
+    
+    if (cmd)
+        VehicleTraits::apply_drive(vehicle->drive, cmd->values, cmd->nb_values);
+    if (manual_cmd)
+        VehicleTraits::apply_drive(vehicle->drive, manual_cmd->values, manual_cmd->nb_values);
+}
+
 /*
   Emulates the Pause GUI button functionnality.
   Shortcomings: The GUI button does not change shape between Play/Resume
@@ -153,6 +765,8 @@ void ArdupilotSitlGazeboPlugin::on_gazebo_control(ConstWorldControlPtr &_msg)
         } else {
             ROS_INFO( PLUGIN_LOG_PREPEND "Resuming simulation");
         }
+        
+        wake_loop_thread();
     }
 }
 
@@ -167,10 +781,20 @@ void ArdupilotSitlGazeboPlugin::on_gazebo_modelInfo(ConstModelPtr &_msg)
     
     ROS_DEBUG( PLUGIN_LOG_PREPEND "on_gazebo_modelInfo, name %s", _msg->name().c_str());
     
-    if (!_msg->name().compare(PARACHUTE_MODEL_NAME)) {
-        // Gazebo has finally finished loading the parachute model.
-        // It's about time, our UAV was falling to the ground at high speed !!!
-        on_parachute_model_loaded();
+    for (size_t i=0; i<_vehicles.size(); i++) {
+        if (!_msg->name().compare(_vehicles[i]->parachute_name)) {
+            int preloading = PARACHUTE_PRELOADING;
+            if (_vehicles[i]->parachute_state.compare_exchange_strong(preloading, PARACHUTE_LOADED)) {
+                // Inserted at startup, it is parked before the next step
+                ROS_INFO( PLUGIN_LOG_PREPEND "[%s] Parachute model preloaded", _vehicles[i]->model_name.c_str());
+                continue;
+            }
+            if (_vehicles[i]->parachute_state != PARACHUTE_NONE)
+                continue;
+            // Gazebo has finally finished loading the parachute model.
+            // It's about time, our UAV was falling to the ground at high speed !!!
+            on_parachute_model_loaded(_vehicles[i]);
+        }
     }
 }
 
@@ -14,44 +14,59 @@
 
 #include "../include/ardupilot_sitl_gazebo_plugin/ardupilot_sitl_gazebo_plugin.h"
 #include <math.h>
+#include <sstream>
 
 
 
 namespace gazebo
 {
-void ArdupilotSitlGazeboPlugin::check_parachute_cmd(float servo_parachute)
+void ArdupilotSitlGazeboPlugin::check_parachute_cmd(vehicle_slot *vehicle, float servo_parachute)
 {
     // 0.5 is the threshold for parachute release
     if (servo_parachute < 0.5)
         return;
     
-    if (_is_parachute_available) {
-        ROS_INFO( PLUGIN_LOG_PREPEND "Releasing the parachute !!!");
-        load_parachute_model();
-        _is_parachute_available = false;   
+    if (vehicle->is_parachute_available) {
+        ROS_INFO( PLUGIN_LOG_PREPEND "[%s] Releasing the parachute !!!", vehicle->model_name.c_str());
+        if (vehicle->parachute_state == PARACHUTE_NONE) {
+            load_parachute_model(vehicle);
+        } else {
+            // Preloaded: deployed at the beginning of the next step, or as soon as parked
+            vehicle->is_parachute_deploy_requested = true;
+        }
+        vehicle->is_parachute_available = false;   
     }
 }
 
 
 // METHOD 1: Add a new parachute model, and make a joint between the 2 models
 
-void ArdupilotSitlGazeboPlugin::load_parachute_model()
+void ArdupilotSitlGazeboPlugin::load_parachute_model(vehicle_slot *vehicle)
 {
     // Gets a pointer to the UAV model
-    _uav_model = _parent_world->GetModel(_modelName);
-    if (!_uav_model) {
-        ROS_INFO( PLUGIN_LOG_PREPEND "UAV MODEL NOT FOUND !!!");
+    vehicle->uav_model = _parent_world->GetModel(vehicle->model_name);
+    if (!vehicle->uav_model) {
+        ROS_INFO( PLUGIN_LOG_PREPEND "[%s] UAV MODEL NOT FOUND !!!", vehicle->model_name.c_str());
         return;
     } else {
         ROS_DEBUG( PLUGIN_LOG_PREPEND "UAV model pointer acquired");
     }
     
     // Creates the parachute model
-    _parent_world->InsertModelFile("model://" PARACHUTE_MODEL_NAME);
+    if (vehicle->parachute_name == PARACHUTE_MODEL_NAME) {
+        _parent_world->InsertModelFile("model://" PARACHUTE_MODEL_NAME);
+    } else {
+        // Several parachutes can not share the name of the model file, so this one is renamed
+        _parent_world->InsertModelString(
+            "<sdf version='1.4'><world name='default'><include>"
+              "<uri>model://" PARACHUTE_MODEL_NAME "</uri>"
+              "<name>" + vehicle->parachute_name + "</name>"
+            "</include></world></sdf>");
+    }
     
     // Takes the lock, with an expiration date.
     // This way the simulation is paused until the model is fully loaded
-    take_lapseLock(MAX_LAPSE_LOCK_ON_MODEL_INSERT);
+    vehicle->parachute_lapse_token = take_lapseLock(MAX_LAPSE_LOCK_ON_MODEL_INSERT, vehicle->parachute_name);
     ROS_INFO( PLUGIN_LOG_PREPEND "Simulation shortly paused to load the parachute model");
 }
 
@@ -62,51 +77,135 @@ void ArdupilotSitlGazeboPlugin::load_parachute_model()
   Gazebo loads models asyncrhonously, in a thread. This callback method is called once
   the parachute model is loaded.
  */
-void ArdupilotSitlGazeboPlugin::on_parachute_model_loaded()
+void ArdupilotSitlGazeboPlugin::on_parachute_model_loaded(vehicle_slot *vehicle)
 {
     // This method is executed independently from the main loop thread.
     // Beware of access to shared variables memory. Use mutexes if required.
     
-    _parachute_model = _parent_world->GetModel(PARACHUTE_MODEL_NAME);
-    if (!_parachute_model) {
-        ROS_ERROR( PLUGIN_LOG_PREPEND "Error: Parachute model failed to load !");
+    vehicle->parachute_model = _parent_world->GetModel(vehicle->parachute_name);
+    if (!vehicle->parachute_model || !vehicle->uav_model) {
+        ROS_ERROR( PLUGIN_LOG_PREPEND "[%s] Error: Parachute model failed to load !", vehicle->model_name.c_str());
         // Frees the lock
-        _loop_lapseLock = 0.0f;
+        release_lapseLock(vehicle->parachute_lapse_token);
         return;
     }
 
-    const math::Pose uavPose = _uav_model->GetWorldPose();
-    _parachute_model->SetWorldPose(math::Pose(uavPose.pos.x, uavPose.pos.y, uavPose.pos.z, 0, PI_2, 0));        // or use uavPose.ros.GetYaw() ?
-    ROS_DEBUG( PLUGIN_LOG_PREPEND "Parachute pose: %f, %f, %f", uavPose.pos.x, uavPose.pos.y, uavPose.pos.z);
+    attach_parachute(vehicle);
+    vehicle->parachute_state = PARACHUTE_DEPLOYED;
 
-    // create the joint for the given model
+    if (release_lapseLock(vehicle->parachute_lapse_token))
+        ROS_INFO( PLUGIN_LOG_PREPEND "Parachute model loaded, resuming the simulation"); 
+    else
+        ROS_INFO( PLUGIN_LOG_PREPEND "Parachute model loaded");
+}
+
+
+// METHOD 2 (PARACHUTE_PRELOAD): Add the parachute model at startup, away and disabled,
+// and only move it, enable it and make the joint on deploy: no model loading, no lapse-lock
+
+/*
+  Inserts the parachute model of a vehicle at its parking place.
+  The simulation is not held: it is parked by the first step after its loading.
+ */
+void ArdupilotSitlGazeboPlugin::preload_parachute_model(vehicle_slot *vehicle)
+{
+    std::ostringstream parking_pose;
+    
+    parking_pose << vehicle->index * PARACHUTE_PARKING_SPACING << " 0 " << PARACHUTE_PARKING_ALTITUDE << " 0 0 0";
+    
+    vehicle->parachute_state = PARACHUTE_PRELOADING;
+    _parent_world->InsertModelString(
+        "<sdf version='1.4'><world name='default'><include>"
+          "<uri>model://" PARACHUTE_MODEL_NAME "</uri>"
+          "<name>" + vehicle->parachute_name + "</name>"
+          "<pose>" + parking_pose.str() + "</pose>"
+        "</include></world></sdf>");
+    ROS_INFO( PLUGIN_LOG_PREPEND "[%s] Preloading the parachute model '%s'", vehicle->model_name.c_str(), vehicle->parachute_name.c_str());
+}
+
+/*
+  Takes a loaded parachute out of the simulation: no gravity, no collision, bodies disabled
+ */
+void ArdupilotSitlGazeboPlugin::park_parachute_model(vehicle_slot *vehicle)
+{
+    vehicle->parachute_model = _parent_world->GetModel(vehicle->parachute_name);
+    if (!vehicle->parachute_model) {
+        ROS_ERROR( PLUGIN_LOG_PREPEND "[%s] Error: Preloaded parachute model not found !", vehicle->model_name.c_str());
+        vehicle->parachute_state = PARACHUTE_DEPLOYED;      // nothing left to do with it
+        return;
+    }
+    
+    vehicle->parachute_model->SetGravityMode(false);
+    vehicle->parachute_model->SetCollideMode("none");
+    vehicle->parachute_model->ResetPhysicsStates();
+    vehicle->parachute_model->SetEnabled(false);
+    vehicle->parachute_state = PARACHUTE_PARKED;
+}
+
+/*
+  Brings a parked parachute back at its vehicle, and joins them
+ */
+void ArdupilotSitlGazeboPlugin::deploy_parachute_model(vehicle_slot *vehicle)
+{
+    vehicle->is_parachute_deploy_requested = false;
+    vehicle->parachute_state = PARACHUTE_DEPLOYED;
+    
+    vehicle->uav_model = _parent_world->GetModel(vehicle->model_name);
+    if (!vehicle->uav_model) {
+        ROS_INFO( PLUGIN_LOG_PREPEND "[%s] UAV MODEL NOT FOUND !!!", vehicle->model_name.c_str());
+        return;
+    }
     
-    _uav_chute_joint = _parent_world->GetPhysicsEngine()->CreateJoint("ball", _uav_model);
-    _uav_chute_joint->SetName("uav_chute_joint");
-    ROS_DEBUG( PLUGIN_LOG_PREPEND "Joint created id %d", _uav_chute_joint->GetId()); 
+    vehicle->parachute_model->SetEnabled(true);
+    vehicle->parachute_model->SetGravityMode(true);
+    vehicle->parachute_model->SetCollideMode("all");
+    if (!attach_parachute(vehicle))
+        return;
+    // Leaves with the velocity of the vehicle, not from a standstill
+    vehicle->parachute_model->SetLinearVel(vehicle->uav_model->GetWorldLinearVel());
     
+    ROS_INFO( PLUGIN_LOG_PREPEND "[%s] Preloaded parachute deployed", vehicle->model_name.c_str());
+}
+
+/*
+  Moves the parachute of a vehicle above it, and makes the joint between them.
+  @return false if one of the links is missing
+ */
+bool ArdupilotSitlGazeboPlugin::attach_parachute(vehicle_slot *vehicle)
+{
     // retrieves links
-    gazebo::physics::LinkPtr uav_link = _uav_model->GetLink(UAV_MODEL_CG_LINK);
-    gazebo::physics::LinkPtr chute_link = _parachute_model->GetLink(PARACHUTE_MODEL_ATTACH_LINK);
+    gazebo::physics::LinkPtr uav_link = vehicle->uav_model->GetLink(UAV_MODEL_CG_LINK);
+    gazebo::physics::LinkPtr chute_link = vehicle->parachute_model->GetLink(PARACHUTE_MODEL_ATTACH_LINK);
+    if (!uav_link || !chute_link) {
+        ROS_ERROR( PLUGIN_LOG_PREPEND "[%s] Error: links '%s' or '%s' not found, parachute not attached", vehicle->model_name.c_str(),
+                   UAV_MODEL_CG_LINK, PARACHUTE_MODEL_ATTACH_LINK);
+        return false;
+    }
 
+    const math::Pose uavPose = vehicle->uav_model->GetWorldPose();
+    vehicle->parachute_model->SetWorldPose(math::Pose(uavPose.pos.x, uavPose.pos.y, uavPose.pos.z, 0, PI_2, 0));        // or use uavPose.ros.GetYaw() ?
+    ROS_DEBUG( PLUGIN_LOG_PREPEND "Parachute pose: %f, %f, %f", uavPose.pos.x, uavPose.pos.y, uavPose.pos.z);
+
+    // create the joint for the given model
+    
+    vehicle->uav_chute_joint = _parent_world->GetPhysicsEngine()->CreateJoint("ball", vehicle->uav_model);
+    vehicle->uav_chute_joint->SetName("uav_chute_joint");
+    ROS_DEBUG( PLUGIN_LOG_PREPEND "Joint created id %d", vehicle->uav_chute_joint->GetId()); 
+    
     // attach joint to links
-    _uav_chute_joint->Attach(uav_link, chute_link);
+    vehicle->uav_chute_joint->Attach(uav_link, chute_link);
 
     // load the joint, and set up its anchor point
-    _uav_chute_joint->Load(uav_link, chute_link, math::Pose(0, 0, 0, 0, 0, 0));
+    vehicle->uav_chute_joint->Load(uav_link, chute_link, math::Pose(0, 0, 0, 0, 0, 0));
 
     // set the axis of revolution
-    //_uav_chute_joint->SetAxis(0, math::Vector3(0,0,1));
+    //vehicle->uav_chute_joint->SetAxis(0, math::Vector3(0,0,1));
 
     // set other joint attributes
-    _uav_chute_joint->SetLowerLimit(0, math::Angle(-3));
-    _uav_chute_joint->SetUpperLimit(0, math::Angle(3));
-    _uav_chute_joint->SetDamping(0, 15);
-
-    if (release_lapseLock())
-        ROS_INFO( PLUGIN_LOG_PREPEND "Parachute model loaded, resuming the simulation"); 
-    else
-        ROS_INFO( PLUGIN_LOG_PREPEND "Parachute model loaded");
+    vehicle->uav_chute_joint->SetLowerLimit(0, math::Angle(-3));
+    vehicle->uav_chute_joint->SetUpperLimit(0, math::Angle(3));
+    vehicle->uav_chute_joint->SetDamping(0, 15);
+    return true;
 }
 
 } // end of "namespace gazebo"
@@ -17,10 +17,6 @@
 #include "../include/ardupilot_sitl_gazebo_plugin/ardupilot_sitl_gazebo_plugin.h"
 #include <cstdlib>
 
-// TODO: find a cleaner way to ge the robot namespace
-#define ROBOT_NAMESPACE     "iris"
-//#define ROBOT_NAMESPACE     "cessna"
-
 
 namespace gazebo
 {
@@ -44,41 +40,107 @@ bool ArdupilotSitlGazeboPlugin::init_ros_side()
     // Setup ROS node infrastructure
     _rosnode = new ros::NodeHandle(ROS_NAMESPACE);
     
+    // The ROS parameter, if any and not empty, overrides the SDF pacing mode
+    std::string pacing_mode;
+    if (_rosnode->getParam("pacing_mode", pacing_mode) && !pacing_mode.empty()) {
+        if (!_pacer.set_mode(pacing_mode))
+            ROS_WARN( PLUGIN_LOG_PREPEND "Unknown pacing_mode '%s', expected realtime, speedup:<N>, afap or replay", pacing_mode.c_str());
+    }
+    ROS_INFO( PLUGIN_LOG_PREPEND "Pacing mode: %s", _pacer.get_mode_str().c_str());
+    
+    // Likewise for the replay logs, so a CI job chooses the log without editing the world
+    std::string log_file;
+    if (_rosnode->getParam("replay_file", log_file) && !log_file.empty())
+        _replay_file = log_file;
+    if (_rosnode->getParam("record_file", log_file) && !log_file.empty())
+        _record_file = log_file;
+    
+    // Topics of each vehicle
+    for (size_t i=0; i<_vehicles.size(); i++)
+        init_vehicle_ros_side(_vehicles[i]);
+    
+    // Loop statistics, once per LOOP_STATS_PERIOD: wait of the vehicles at the barrier, and timing of the steps
+    _barrier_stats_publisher = _rosnode->advertise<ardupilot_sitl_gazebo_plugin::LockstepBarrierStats>("lockstep_barrier_stats", 1);
+    _loop_timing_publisher   = _rosnode->advertise<ardupilot_sitl_gazebo_plugin::LoopTimingStats>("lockstep_timing_stats", 1);
+    
+    // Services
+    _service_take_lapseLock    = _rosnode->advertiseService("take_apm_lapseLock",    &ArdupilotSitlGazeboPlugin::service_take_lapseLock,    this);
+    _service_release_lapseLock = _rosnode->advertiseService("release_apm_lapseLock", &ArdupilotSitlGazeboPlugin::service_release_lapseLock, this);
+    _service_save_snapshot     = _rosnode->advertiseService("save_world_snapshot",    &ArdupilotSitlGazeboPlugin::service_save_snapshot,    this);
+    _service_restore_snapshot  = _rosnode->advertiseService("restore_world_snapshot", &ArdupilotSitlGazeboPlugin::service_restore_snapshot, this);
+    _service_dump_telemetry    = _rosnode->advertiseService("dump_telemetry",         &ArdupilotSitlGazeboPlugin::service_dump_telemetry,   this);
+    ROS_INFO( PLUGIN_LOG_PREPEND "Services declared !");
+    
+    // Same lapse-lock through persistent topics: no connection nor reply per request
+    _lapseLock_take_subscriber    = _rosnode->subscribe("lapse_lock/take", 100, &ArdupilotSitlGazeboPlugin::lapseLock_take_callback, this,
+                                                        ros::TransportHints().tcpNoDelay());
+    _lapseLock_release_subscriber = _rosnode->subscribe("lapse_lock/release", 100, &ArdupilotSitlGazeboPlugin::lapseLock_release_callback, this,
+                                                        ros::TransportHints().tcpNoDelay());
+    _lapseLock_state_publisher    = _rosnode->advertise<ardupilot_sitl_gazebo_plugin::LapseLockState>("lapse_lock/state", 1, true);
+    publish_lapseLock_state("", 0, false);
+      
+    return true;
+}
+
+/*
+  Declares the subscribers/publisher of a vehicle, under its namespace.
+ */
+void ArdupilotSitlGazeboPlugin::init_vehicle_ros_side(vehicle_slot *vehicle)
+{
     // Defines topics callback methods
     std::string topicNameBuf;
+    std::string vehicle_prefix = std::string("/") + vehicle->ros_namespace;
+
+    // Buffer size of 10 messages before old ones are removed
+    topicNameBuf = vehicle_prefix + "/command/motor_speed";
+    vehicle->motorSpd_publisher = _rosnode->advertise<mav_msgs::CommandMotorSpeed>(topicNameBuf, 10);
+    // The pool is filled now, for the steps not to allocate
+    for (int i=0; i<MOTOR_SPEED_MSG_POOL_SIZE; i++) {
+        vehicle->motor_speed_msgs[i] = boost::make_shared<mav_msgs::CommandMotorSpeed>();
+        vehicle->motor_speed_msgs[i]->header.frame_id = MOTOR_SPEED_FRAME_ID;
+        vehicle->motor_speed_msgs[i]->motor_speed.resize(vehicle->nb_motor_speed);
+    }
+    
+    // Manual commands of the drive, same units as the motor speeds
+    if (VehicleTraits::HAS_DRIVE) {
+        topicNameBuf = vehicle_prefix + "/cmd_vel";
+        vehicle->manual_drive_subscriber = _rosnode->subscribe<mav_msgs::CommandMotorSpeed>(topicNameBuf, 100,
+                                           boost::bind(&ArdupilotSitlGazeboPlugin::manual_drive_callback, this, _1, vehicle));
+    }
+    
+    // With the direct FDM source, the sensors are read from Gazebo instead
+    if (_fdm_source == FDM_SOURCE_DIRECT)
+        return;
 
     // IMU topic (noise free)
-    topicNameBuf = std::string("/") + _modelName + "/ground_truth/imu";
-    _imu_subscriber = _rosnode->subscribe(topicNameBuf.c_str(), 1, &ArdupilotSitlGazeboPlugin::imu_callback, this);
+    topicNameBuf = vehicle_prefix + "/ground_truth/imu";
+    vehicle->imu_subscriber = _rosnode->subscribe<sensor_msgs::Imu>(topicNameBuf, 1,
+                              boost::bind(&ArdupilotSitlGazeboPlugin::imu_callback, this, _1, vehicle));
 
     // GPS topic
-    topicNameBuf = std::string("/") + _modelName + "/fix";
-    _gps_subscriber = _rosnode->subscribe(topicNameBuf.c_str(), 1, &ArdupilotSitlGazeboPlugin::gps_callback, this);
+    topicNameBuf = vehicle_prefix + "/fix";
+    vehicle->gps_subscriber = _rosnode->subscribe<sensor_msgs::NavSatFix>(topicNameBuf, 1,
+                              boost::bind(&ArdupilotSitlGazeboPlugin::gps_callback, this, _1, vehicle));
 
     // GPS velocity topic
-    topicNameBuf = std::string("/") + _modelName + "/fix_velocity";
-    _gps_velocity_subscriber = _rosnode->subscribe(topicNameBuf.c_str(), 1, &ArdupilotSitlGazeboPlugin::gps_velocity_callback, this);
+    topicNameBuf = vehicle_prefix + "/fix_velocity";
+    vehicle->gps_velocity_subscriber = _rosnode->subscribe<geometry_msgs::Vector3Stamped>(topicNameBuf, 1,
+                                       boost::bind(&ArdupilotSitlGazeboPlugin::gps_velocity_callback, this, _1, vehicle));
 
-    _sonar_down_subscriber   = _rosnode->subscribe("/sonar_down", 1, &ArdupilotSitlGazeboPlugin::sonar_down_callback,   this);
+    topicNameBuf = vehicle->sonar_topic_prefix + "/sonar_down";
+    vehicle->sonar_down_subscriber = _rosnode->subscribe<sensor_msgs::Range>(topicNameBuf, 1,
+                                     boost::bind(&ArdupilotSitlGazeboPlugin::sonar_down_callback, this, _1, vehicle));
 #if SONAR_FRONT == ENABLED
-    _sonar_front_subscriber  = _rosnode->subscribe("/sonar_front", 1, &ArdupilotSitlGazeboPlugin::sonar_front_callback,  this);
+    topicNameBuf = vehicle->sonar_topic_prefix + "/sonar_front";
+    vehicle->sonar_front_subscriber = _rosnode->subscribe<sensor_msgs::Range>(topicNameBuf, 1,
+                                      boost::bind(&ArdupilotSitlGazeboPlugin::sonar_front_callback, this, _1, vehicle));
 #endif
     
     // Notes:
     //  - Uses the truth IMU, with a 1-size queue. All noises will be added by Ardupilot
     //  - For the noisy imu, use the topic "/iris/imu".
     //  - No need to subscribe to ROS's clock topic, "/clock", for we use Gazebo's clock
-    
-    // Buffer size of 10 messages before old ones are removed
-    topicNameBuf = std::string("/") + _modelName + "/command/motor_speed";
-    _motorSpd_publisher = _rosnode->advertise<mav_msgs::CommandMotorSpeed>(topicNameBuf.c_str(), 10);
-    
-    // Services
-    _service_take_lapseLock    = _rosnode->advertiseService("take_apm_lapseLock",    &ArdupilotSitlGazeboPlugin::service_take_lapseLock,    this);
-    _service_release_lapseLock = _rosnode->advertiseService("release_apm_lapseLock", &ArdupilotSitlGazeboPlugin::service_release_lapseLock, this);
-    ROS_INFO( PLUGIN_LOG_PREPEND "Services declared !");
-      
-    return true;
+
 }
 
 
@@ -90,8 +152,8 @@ bool ArdupilotSitlGazeboPlugin::service_take_lapseLock(ardupilot_sitl_gazebo_plu
                                                        ardupilot_sitl_gazebo_plugin::TakeApmLapseLock::Response &res)
 {
     ROS_DEBUG( PLUGIN_LOG_PREPEND "service_take_lapseLock: called by process '%s'", req.process_id.c_str());
-    take_lapseLock(req.max_duration);
-    res.nb_holders = _nbHolders_lapseLock;
+    res.token = take_lapseLock(req.max_duration, req.process_id);
+    res.nb_holders = _lapseLock.get_nb_holders();
     return true;
 }
 
@@ -100,11 +162,56 @@ bool ArdupilotSitlGazeboPlugin::service_release_lapseLock(ardupilot_sitl_gazebo_
                                                           ardupilot_sitl_gazebo_plugin::ReleaseApmLapseLock::Response &res)
 {
     ROS_DEBUG( PLUGIN_LOG_PREPEND "service_release_lapseLock: called by process '%s'", req.process_id.c_str());
-    release_lapseLock();
-    res.nb_holders = _nbHolders_lapseLock;
+    release_lapseLock(req.token, req.process_id);
+    res.nb_holders = _lapseLock.get_nb_holders();
     return true;
 }
 
+/*
+  Lapse-lock topics: each take of a process is named by its 'request_id',
+  and ended by a release with the same process_id and request_id
+ */
+void ArdupilotSitlGazeboPlugin::lapseLock_take_callback(const ardupilot_sitl_gazebo_plugin::LapseLockRequestConstPtr &msg)
+{
+    uint32_t token = take_lapseLock(msg->max_duration, msg->process_id);
+    
+    _lapseLock_topic_mutex.lock();
+    // Takes never released (crashed process) expire by themselves, only their entries remain
+    if (_lapseLock_topic_tokens.size() >= MAX_LAPSE_LOCK_TOPIC_TAKES) {
+        std::map<std::pair<std::string, uint32_t>, uint32_t>::iterator it = _lapseLock_topic_tokens.begin();
+        while (it != _lapseLock_topic_tokens.end()) {
+            if (_lapseLock.is_held(it->second))
+                ++it;
+            else
+                _lapseLock_topic_tokens.erase(it++);
+        }
+    }
+    _lapseLock_topic_tokens[std::make_pair(msg->process_id, msg->request_id)] = token;
+    _lapseLock_topic_mutex.unlock();
+    
+    publish_lapseLock_state(msg->process_id, msg->request_id, true);
+}
+
+void ArdupilotSitlGazeboPlugin::lapseLock_release_callback(const ardupilot_sitl_gazebo_plugin::LapseLockRequestConstPtr &msg)
+{
+    uint32_t token = LAPSE_LOCK_NO_TOKEN;
+    
+    _lapseLock_topic_mutex.lock();
+    std::map<std::pair<std::string, uint32_t>, uint32_t>::iterator it =
+        _lapseLock_topic_tokens.find(std::make_pair(msg->process_id, msg->request_id));
+    if (it != _lapseLock_topic_tokens.end()) {
+        token = it->second;
+        _lapseLock_topic_tokens.erase(it);
+    }
+    _lapseLock_topic_mutex.unlock();
+    
+    // Unknown take (lost, or released twice): nothing to release
+    if (token == LAPSE_LOCK_NO_TOKEN)
+        return;
+    release_lapseLock(token);
+    publish_lapseLock_state(msg->process_id, msg->request_id, false);
+}
+
 //-------------------------------------------------
 //  ROS Topics Listeners
 //-------------------------------------------------
@@ -112,186 +219,277 @@ bool ArdupilotSitlGazeboPlugin::service_release_lapseLock(ardupilot_sitl_gazebo_
 /*
   Callback method for ROS messages ".../imu", coming from an IMU sensor
  */
-void ArdupilotSitlGazeboPlugin::imu_callback(const sensor_msgs::Imu &imu_msg)
+void ArdupilotSitlGazeboPlugin::imu_callback(const sensor_msgs::ImuConstPtr &imu_msg, vehicle_slot *vehicle)
 {
     // This method is executed independently from the main loop thread.
-    // Beware of access to shared variables memory. Use mutexes if required.
+    // Beware of access to shared variables memory: the FDM blocks are single-writer triple buffers.
     
     // Frame conversion:
     //   IMU messages arrive expressed in Gazebo frame (Y toward West, Z toward UP).
     //   So values are converted to NED frame before sending them to Ardupilot.
     
-    // Mutex on '_fdm', for it is concurrently read by 'send_apm_output()'
-    _fdm_mutex.lock();
+    // Fills the writer's copy of the block, concurrently read by 'send_apm_output()' without any lock
+    fdm_imu_block &imu = vehicle->fdm_imu.write_slot();
     
     // Attitude (quaternion)
-    _fdm.imu_orientation_quat[0] =  imu_msg.orientation.w;
-    _fdm.imu_orientation_quat[1] =  imu_msg.orientation.x;
-    _fdm.imu_orientation_quat[2] = -imu_msg.orientation.y;
-    _fdm.imu_orientation_quat[3] = -imu_msg.orientation.z;
+    imu.orientation_quat[0] =  imu_msg->orientation.w;
+    imu.orientation_quat[1] =  imu_msg->orientation.x;
+    imu.orientation_quat[2] = -imu_msg->orientation.y;
+    imu.orientation_quat[3] = -imu_msg->orientation.z;
     
     // Angular velocity
-    _fdm.imu_angular_velocity_rpy[0] =  imu_msg.angular_velocity.x;    // [rad/s]
-    _fdm.imu_angular_velocity_rpy[1] = -imu_msg.angular_velocity.y;    // [rad/s]
-    _fdm.imu_angular_velocity_rpy[2] = -imu_msg.angular_velocity.z;    // [rad/s]
+    imu.angular_velocity_rpy[0] =  imu_msg->angular_velocity.x;    // [rad/s]
+    imu.angular_velocity_rpy[1] = -imu_msg->angular_velocity.y;    // [rad/s]
+    imu.angular_velocity_rpy[2] = -imu_msg->angular_velocity.z;    // [rad/s]
 
     // Acceleration
-    _fdm.imu_linear_acceleration_xyz[0] =  imu_msg.linear_acceleration.x;    // [m/s/s]
-    _fdm.imu_linear_acceleration_xyz[1] = -imu_msg.linear_acceleration.y;    // [m/s/s]
-    _fdm.imu_linear_acceleration_xyz[2] = -imu_msg.linear_acceleration.z;    // [m/s/s]
+    imu.linear_acceleration_xyz[0] =  imu_msg->linear_acceleration.x;    // [m/s/s]
+    imu.linear_acceleration_xyz[1] = -imu_msg->linear_acceleration.y;    // [m/s/s]
+    imu.linear_acceleration_xyz[2] = -imu_msg->linear_acceleration.z;    // [m/s/s]
     
     // Position in the Gazebo world (NOT HANDLED YET)
-    _fdm.position_xyz[0] = 0;    // [m]
-    _fdm.position_xyz[1] = 0;    // [m]
-    _fdm.position_xyz[2] = 0;    // [m]
+    imu.position_xyz[0] = 0;    // [m]
+    imu.position_xyz[1] = 0;    // [m]
+    imu.position_xyz[2] = 0;    // [m]
+    
+    // Simulation time of the measure, the plugins stamping their messages with it
+    imu.sample_time = imu_msg->header.stamp.toSec();
     
-    _fdm_mutex.unlock();
+    vehicle->fdm_imu.publish();
 }
 
 /*
   Callback method for ROS messages ".../fix", coming from a GPS sensor
  */
-void ArdupilotSitlGazeboPlugin::gps_callback(const sensor_msgs::NavSatFix &gps_fix_msg)
+void ArdupilotSitlGazeboPlugin::gps_callback(const sensor_msgs::NavSatFixConstPtr &gps_fix_msg, vehicle_slot *vehicle)
 {
     // This method is executed independently from the main loop thread.
-    // Beware of access to shared variables memory. Use mutexes if required.
-    
-    // Mutex on '_fdm', for it is concurrently read by 'send_apm_output()'
-    _fdm_mutex.lock();
+    // Beware of access to shared variables memory: the FDM blocks are single-writer triple buffers.
     
-    _fdm.position_latlonalt[0] = gps_fix_msg.latitude;     // in [degrees]
-    _fdm.position_latlonalt[1] = gps_fix_msg.longitude;    // in [degrees]
-    _fdm.position_latlonalt[2] = gps_fix_msg.altitude;     // in [m], toward UP
+    fdm_gps_block &gps = vehicle->fdm_gps.write_slot();
     
-    _fdm_mutex.unlock();
+    gps.position_latlonalt[0] = gps_fix_msg->latitude;     // in [degrees]
+    gps.position_latlonalt[1] = gps_fix_msg->longitude;    // in [degrees]
+    gps.position_latlonalt[2] = gps_fix_msg->altitude;     // in [m], toward UP
+    gps.sample_time = gps_fix_msg->header.stamp.toSec();
     
-    // Available display for GPS debug
-    #ifdef DEBUG_DISP_GPS_POSITION
-        static double home_lat = 0, home_lon = 0;       // a home for debug
-        double north_m, east_m, r = 6371000;
-        
-        // The relative position in meters is calculated from the first non-0
-        // GPS position. (So it will be equivalent to the starting point of the UAV)
-        if ((abs(home_lat) < 1e-5) && (abs(home_lon) < 1e-5) &&
-        	((abs(gps_fix_msg.latitude) > 1e-4) || (abs(gps_fix_msg.longitude) > 1e-4))) {
-        	home_lat = gps_fix_msg.latitude;
-        	home_lon = gps_fix_msg.longitude;
-        }
-
-        north_m = r * sin(gps_fix_msg.latitude - home_lat);
-        east_m = r * cos(gps_fix_msg.latitude) * sin(gps_fix_msg.longitude - home_lon);
-        
-        // Latitude & longitude can be tricky to interpret in a debug log.
-        // That is why the home debug was introduced, to display results in a more readable coordinate system.
-        ROS_INFO( PLUGIN_LOG_PREPEND "GPS latitude = %f [d] - %f [m]   longi = %f [d] - %f [m]   alt = %f [m]", gps_fix_msg.latitude, north_m, gps_fix_msg.longitude, east_m, gps_fix_msg.altitude);
-    #endif // DEBUG_DISP_GPS_POSITION
+    vehicle->fdm_gps.publish();
 }
 
 /*
   Callback method for ROS messages ".../fix_velocity", coming from a GPS sensor
  */
-void ArdupilotSitlGazeboPlugin::gps_velocity_callback(const geometry_msgs::Vector3Stamped &gps_velocity_fix_msg)
+void ArdupilotSitlGazeboPlugin::gps_velocity_callback(const geometry_msgs::Vector3StampedConstPtr &gps_velocity_fix_msg, vehicle_slot *vehicle)
 {
     // This method is executed independently from the main loop thread.
-    // Beware of access to shared variables memory. Use mutexes if required.
+    // Beware of access to shared variables memory: the FDM blocks are single-writer triple buffers.
     
-    // Mutex on '_fdm', for it is concurrently read by 'send_apm_output()'
-    _fdm_mutex.lock();
+    fdm_gps_velocity_block &gps_velocity = vehicle->fdm_gps_velocity.write_slot();
     
     // in Hector's plugin, the GPS velocity Y is toward West, not East. And velocity Z is toward UP
-    _fdm.velocity_xyz[0] =  gps_velocity_fix_msg.vector.x;    // in [m/s]
-    _fdm.velocity_xyz[1] = -gps_velocity_fix_msg.vector.y;    // in [m/s]
-    _fdm.velocity_xyz[2] = -gps_velocity_fix_msg.vector.z;    // in [m/s]
-    
-    // Available display for GPS speed debug
-    #ifdef DEBUG_DISP_GPS_POSITION
-        ROS_INFO( PLUGIN_LOG_PREPEND "GPS speed N = %f   E = %f   D = %f", _fdm.velocity_xyz[0], _fdm.velocity_xyz[1], _fdm.velocity_xyz[2]);
-    #endif // DEBUG_DISP_GPS_POSITION
+    gps_velocity.velocity_xyz[0] =  gps_velocity_fix_msg->vector.x;    // in [m/s]
+    gps_velocity.velocity_xyz[1] = -gps_velocity_fix_msg->vector.y;    // in [m/s]
+    gps_velocity.velocity_xyz[2] = -gps_velocity_fix_msg->vector.z;    // in [m/s]
+    gps_velocity.sample_time = gps_velocity_fix_msg->header.stamp.toSec();
     
-    _fdm_mutex.unlock();
+    vehicle->fdm_gps_velocity.publish();
 }
 
 /*
   Callback method for ROS messages ".../sonar_down", coming from a range finder sensor
  */
-void ArdupilotSitlGazeboPlugin::sonar_down_callback(const sensor_msgs::Range &sonar_range_msg) 
+void ArdupilotSitlGazeboPlugin::sonar_down_callback(const sensor_msgs::RangeConstPtr &sonar_range_msg, vehicle_slot *vehicle) 
 {
     // This method is executed independently from the main loop thread.
-    // Beware of access to shared variables memory. Use mutexes if required.
+    // Beware of access to shared variables memory: the FDM blocks are single-writer triple buffers.
     
-    // Mutex on '_fdm', for it is concurrently read by 'send_apm_output()'
-    _fdm_mutex.lock();
+    fdm_range_block &sonar = vehicle->fdm_sonar_down.write_slot();
     
-    _fdm.sonar_down = sonar_range_msg.range;    // in [m]
+    sonar.range = sonar_range_msg->range;    // in [m]
+    sonar.sample_time = sonar_range_msg->header.stamp.toSec();
     
-    _fdm_mutex.unlock();
+    vehicle->fdm_sonar_down.publish();
 }
 
 /*
   Callback method for ROS messages ".../sonar_front", coming from a range finder sensor
  */
 #if SONAR_FRONT == ENABLED
-void ArdupilotSitlGazeboPlugin::sonar_front_callback(const sensor_msgs::Range &sonar_range_msg)
+void ArdupilotSitlGazeboPlugin::sonar_front_callback(const sensor_msgs::RangeConstPtr &sonar_range_msg, vehicle_slot *vehicle)
 {
     // This method is executed independently from the main loop thread.
-    // Beware of access to shared variables memory. Use mutexes if required.
+    // Beware of access to shared variables memory: the FDM blocks are single-writer triple buffers.
     
-    // Mutex on '_fdm', for it is concurrently read by 'send_apm_output()'
-    _fdm_mutex.lock();
+    fdm_range_block &sonar = vehicle->fdm_sonar_front.write_slot();
     
-    _fdm.sonar_front = sonar_range_msg.range;    // in [m]
+    sonar.range = sonar_range_msg->range;    // in [m]
+    sonar.sample_time = sonar_range_msg->header.stamp.toSec();
     
-    _fdm_mutex.unlock();
+    vehicle->fdm_sonar_front.publish();
 }
 #endif
 
+/*
+  Callback method for ROS messages ".../cmd_vel", manual commands of a drive (VehicleTraits::HAS_DRIVE)
+ */
+void ArdupilotSitlGazeboPlugin::manual_drive_callback(const mav_msgs::CommandMotorSpeedConstPtr &motor_speed_msg, vehicle_slot *vehicle)
+{
+    // This method is executed independently from the main loop thread.
+    // The drive is only actuated by Gazebo's update thread, before the next step.
+
+    vehicle->manual_drive_mailbox->post(motor_speed_msg->motor_speed.data(), motor_speed_msg->motor_speed.size());
+}
+
 
 //-------------------------------------------------
 //  ROS Topics Publishers
 //-------------------------------------------------
 
 /*
-  Fill and publish motor speed command data message
+  Fill and publish motor speed command data message of a vehicle
  */
-void ArdupilotSitlGazeboPlugin::publish_commandMotorSpeed()
+void ArdupilotSitlGazeboPlugin::publish_commandMotorSpeed(vehicle_slot *vehicle)
 {
-    boost::shared_ptr<mav_msgs::CommandMotorSpeed> cmdMotSpd_msg = boost::make_shared<mav_msgs::CommandMotorSpeed>();
-    //auto cmdMotSpd_msg = boost::make_shared<mav_msgs::CommandMotorSpeed>();
-    
-    // The 'auto' keyword is used in some plugins with the 'boost::make_shared'.
-    // It is a recent (new) feature since 2014 in g++ compilers.
-    // It did not work with my version, so I preferred to use the old
-    // way with an explicit type declaration.
+    // Messages are taken in turn from the vehicle's pool, filled by 'init_vehicle_ros_side()',
+    // so a step does not allocate. Subscribers of the same process (the motor model plugins in
+    // gzserver) receive the message itself rather than a copy, and keep it in their callback
+    // queue: the pool outlasts a full queue (MOTOR_SPEED_SUBSCRIBER_QUEUE). The oldest message
+    // still held anyway (a subscriber with a deeper queue) is never overwritten: the frame is
+    // not published, the model plugins then apply the next one.
+    mav_msgs::CommandMotorSpeedPtr &cmdMotSpd_msg = vehicle->motor_speed_msgs[vehicle->next_motor_speed_msg];
     
     int i;
-    std::string frame_id = "quad";
     
-    cmdMotSpd_msg->header.frame_id = frame_id;
+    if (cmdMotSpd_msg.use_count() > 1) {
+        vehicle->stats_nb_motor_speed_skipped++;
+        return;
+    }
+    vehicle->next_motor_speed_msg = (vehicle->next_motor_speed_msg + 1) % MOTOR_SPEED_MSG_POOL_SIZE;
+    
     cmdMotSpd_msg->header.stamp = ros::Time::now();
-    cmdMotSpd_msg->motor_speed.clear();
-    for (i=0; i<_nbMotorSpeed; i++)
-       cmdMotSpd_msg->motor_speed.push_back(_cmd_motor_speed[i]);
+    for (i=0; i<vehicle->nb_motor_speed; i++)
+       cmdMotSpd_msg->motor_speed[i] = vehicle->cmd_motor_speed[i];
     
-    _motorSpd_publisher.publish(cmdMotSpd_msg);
+    vehicle->motorSpd_publisher.publish(cmdMotSpd_msg);
+}
+
+/*
+  Fills and publishes the barrier statistics since the previous call, then resets them.
+  Called by the main loop thread.
+ */
+void ArdupilotSitlGazeboPlugin::publish_barrier_stats(const ros::WallTime &now)
+{
+    size_t i;
     
-    // Available display for motors commands debug
-    #ifdef DEBUG_DISP_MOTORS_COMMANDS
-        static float s_debug_cmd_motor_speed_prev[_nbMotorSpeed];
-        bool isDiffFromPrev = false;
+    if (_barrier_stats_publisher.getNumSubscribers() > 0) {
+        ardupilot_sitl_gazebo_plugin::LockstepBarrierStatsPtr stats_msg = boost::make_shared<ardupilot_sitl_gazebo_plugin::LockstepBarrierStats>();
         
-        for (i=0; i<_nbMotorSpeed; i++) {
-            if (abs(s_debug_cmd_motor_speed_prev[i] - _cmd_motor_speed[i]) > 0.001) {
-                isDiffFromPrev = true;
-                s_debug_cmd_motor_speed_prev[i] = _cmd_motor_speed[i];
-                // Do not break, to continue updating every field
-            }
+        stats_msg->header.stamp = ros::Time::now();
+        stats_msg->period       = (now - _stats_walltime).toSec();
+        stats_msg->nb_steps     = _stats_nb_batches;
+        stats_msg->nb_timeouts  = _stats_nb_timeouts;
+        stats_msg->vehicles.resize(_vehicles.size());
+        for (i=0; i<_vehicles.size(); i++) {
+            vehicle_slot *vehicle = _vehicles[i];
+            ardupilot_sitl_gazebo_plugin::VehicleBarrierStats &vehicle_stats = stats_msg->vehicles[i];
+            
+            vehicle_stats.name      = vehicle->model_name;
+            vehicle_stats.nb_steps  = vehicle->stats_nb_waits;
+            vehicle_stats.nb_missed = vehicle->stats_nb_missed;
+            vehicle_stats.nb_dropped = vehicle->stats_nb_dropped;
+            vehicle_stats.mean_wait = (vehicle->stats_nb_waits > 0) ? (vehicle->stats_wait_sum / vehicle->stats_nb_waits) : 0.0;
+            vehicle_stats.max_wait  = vehicle->stats_wait_max;
+            vehicle_stats.nb_lost      = vehicle->stats_nb_lost;
+            vehicle_stats.nb_reordered = vehicle->stats_nb_reordered;
+            vehicle_stats.mean_round_trip = (vehicle->stats_nb_round_trips > 0) ? (vehicle->stats_round_trip_sum / vehicle->stats_nb_round_trips) : 0.0;
+            vehicle_stats.max_round_trip  = vehicle->stats_round_trip_max;
+            vehicle_stats.max_ahead    = vehicle->stats_ahead_max;
+            vehicle_stats.nb_motor_speed_skipped = vehicle->stats_nb_motor_speed_skipped;
         }
         
-        if (isDiffFromPrev) {
-            ROS_INFO( PLUGIN_LOG_PREPEND "published motor speed: %f, %f, %f, %f", _cmd_motor_speed[0],
-                  _cmd_motor_speed[1], _cmd_motor_speed[2], _cmd_motor_speed[3]);
-        }
-    #endif // DEBUG_DISP_MOTORS_COMMANDS
+        _barrier_stats_publisher.publish(stats_msg);
+    }
+    
+    // Starts a new period
+    _stats_nb_batches  = 0;
+    _stats_nb_timeouts = 0;
+    for (i=0; i<_vehicles.size(); i++) {
+        _vehicles[i]->stats_nb_waits  = 0;
+        _vehicles[i]->stats_nb_missed = 0;
+        _vehicles[i]->stats_nb_dropped = 0;
+        _vehicles[i]->stats_wait_sum  = 0.0;
+        _vehicles[i]->stats_wait_max  = 0.0;
+        _vehicles[i]->stats_nb_lost   = 0;
+        _vehicles[i]->stats_nb_reordered = 0;
+        _vehicles[i]->stats_nb_round_trips = 0;
+        _vehicles[i]->stats_round_trip_sum = 0.0;
+        _vehicles[i]->stats_round_trip_max = 0.0;
+        _vehicles[i]->stats_ahead_max = 0;
+        _vehicles[i]->stats_nb_motor_speed_skipped = 0;
+    }
+}
+
+/*
+  Converts a histogram of durations into its message
+ */
+static void fill_latency_stats(ardupilot_sitl_gazebo_plugin::LatencyStats &stats_msg, const LatencyHistogram &histogram)
+{
+    stats_msg.count = histogram.get_count();
+    stats_msg.p50   = histogram.get_percentile(0.50) * 1e-9;    // [s]
+    stats_msg.p99   = histogram.get_percentile(0.99) * 1e-9;    // [s]
+    stats_msg.max   = histogram.get_max() * 1e-9;               // [s]
+}
+
+/*
+  Fills and publishes the timing statistics of the loop since the previous call, then resets them.
+  Called by the main loop thread.
+ */
+void ArdupilotSitlGazeboPlugin::publish_loop_timing_stats(const ros::WallTime &now)
+{
+    double period = (now - _stats_walltime).toSec();
+    
+    if ((_loop_timing_publisher.getNumSubscribers() > 0) && (period > 0.0)) {
+        ardupilot_sitl_gazebo_plugin::LoopTimingStatsPtr timing_msg = boost::make_shared<ardupilot_sitl_gazebo_plugin::LoopTimingStats>();
+        
+        timing_msg->header.stamp     = ros::Time::now();
+        timing_msg->period           = period;
+        timing_msg->nb_steps         = _stats_nb_sim_steps;
+        timing_msg->real_time_factor = _stats_nb_sim_steps * STEP_SIZE_FOR_ARDUPILOT / period;
+        fill_latency_stats(timing_msg->wait_servo,   _timing_wait_servo);
+        fill_latency_stats(timing_msg->step,         _timing_step);
+        fill_latency_stats(timing_msg->pace,         _timing_pace);
+        fill_latency_stats(timing_msg->fdm_assembly, _timing_fdm_assembly);
+        fill_latency_stats(timing_msg->send,         _timing_send);
+        timing_msg->nb_render_waits  = _stats_nb_render_waits;
+        timing_msg->render_lag_max   = _render_pipeline.get_max_lag();
+        
+        _loop_timing_publisher.publish(timing_msg);
+    }
+    
+    // Starts a new period
+    _stats_nb_sim_steps = 0;
+    _stats_nb_render_waits = 0;
+    _render_pipeline.reset_stats();
+    _timing_wait_servo.reset();
+    _timing_step.reset();
+    _timing_pace.reset();
+    _timing_fdm_assembly.reset();
+    _timing_send.reset();
+}
+
+/*
+  Publishes (latched) the holders of the lapse-lock, after a change
+ */
+void ArdupilotSitlGazeboPlugin::publish_lapseLock_state(const std::string &process_id, uint32_t request_id, bool is_taken)
+{
+    ardupilot_sitl_gazebo_plugin::LapseLockStatePtr state_msg = boost::make_shared<ardupilot_sitl_gazebo_plugin::LapseLockState>();
+    
+    state_msg->header.stamp = ros::Time::now();
+    state_msg->nb_holders   = _lapseLock.get_nb_holders();
+    state_msg->process_id   = process_id;
+    state_msg->request_id   = request_id;
+    state_msg->is_taken     = is_taken;
+    _lapseLock_state_publisher.publish(state_msg);
 }
 
 } // end of "namespace gazebo"
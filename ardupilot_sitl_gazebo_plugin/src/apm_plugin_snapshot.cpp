@@ -0,0 +1,355 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * World snapshots: saves the state of the world under a name, and brings the world back to it
+ * without restarting gzserver, e.g. between the trials of a Monte-Carlo batch.
+ *
+ * A snapshot holds the pose and velocities of every non-static model and link, the sim time,
+ * the FDM state of each vehicle, its parachute and its last motor commands.
+ * It is saved and restored by the loop thread between two steps, while the world is idle.
+ */
+
+#include "../include/ardupilot_sitl_gazebo_plugin/ardupilot_sitl_gazebo_plugin.h"
+#include <sstream>
+
+namespace gazebo
+{
+
+//-------------------------------------------------
+//  ROS Services
+//-------------------------------------------------
+
+bool ArdupilotSitlGazeboPlugin::service_save_snapshot(ardupilot_sitl_gazebo_plugin::SaveWorldSnapshot::Request  &req,
+                                                      ardupilot_sitl_gazebo_plugin::SaveWorldSnapshot::Response &res)
+{
+    ROS_DEBUG( PLUGIN_LOG_PREPEND "service_save_snapshot: '%s'", req.name.c_str());
+    res.success = request_snapshot(SNAPSHOT_SAVE, req.name, &res.sim_time, &res.message);
+    return true;
+}
+
+bool ArdupilotSitlGazeboPlugin::service_restore_snapshot(ardupilot_sitl_gazebo_plugin::RestoreWorldSnapshot::Request  &req,
+                                                         ardupilot_sitl_gazebo_plugin::RestoreWorldSnapshot::Response &res)
+{
+    ROS_DEBUG( PLUGIN_LOG_PREPEND "service_restore_snapshot: '%s'", req.name.c_str());
+    res.success = request_snapshot(SNAPSHOT_RESTORE, req.name, &res.sim_time, &res.message);
+    return true;
+}
+
+
+//-------------------------------------------------
+//  Requests, from the services to the loop thread
+//-------------------------------------------------
+
+/*
+  Posts a request to the loop thread, and waits for its result.
+  Called from the ROS services' threads, one request at a time.
+  @return true on success, otherwise 'message' tells why
+ */
+bool ArdupilotSitlGazeboPlugin::request_snapshot(int type, const std::string &name, double *sim_time, std::string *message)
+{
+    // Serializes the calls: the result of a request must be read before the next one is posted
+    boost::mutex::scoped_lock service_lock(_snapshot_service_mutex);
+    boost::mutex::scoped_lock lock(_snapshot_mutex);
+
+    *sim_time = 0.0;
+    if (_is_replay) {
+        // The replay follows the batches of its log
+        *message = "snapshots are not available in replay";
+        return false;
+    }
+
+    _snapshot_request_name = name;
+    _snapshot_request = type;
+    wake_loop_thread();
+
+    while (_snapshot_request != SNAPSHOT_NONE) {
+        if (!_rosnode->ok()) {
+            *message = "shutting down";
+            return false;
+        }
+        _snapshot_cond.timed_wait(lock, boost::posix_time::milliseconds(100));
+    }
+
+    *sim_time = _snapshot_sim_time;
+    *message = _snapshot_message;
+    return _snapshot_success;
+}
+
+/*
+  Runs the pending request, if any. Called by the loop thread, between two steps.
+ */
+void ArdupilotSitlGazeboPlugin::handle_snapshot_request()
+{
+    int request = _snapshot_request;
+    std::string name, message;
+    double sim_time = 0.0;
+    bool success;
+
+    if (request == SNAPSHOT_NONE)
+        return;
+
+    {
+        boost::mutex::scoped_lock lock(_snapshot_mutex);
+        name = _snapshot_request_name;
+    }
+
+    if (request == SNAPSHOT_SAVE)
+        success = save_snapshot(name, &sim_time, &message);
+    else
+        success = restore_snapshot(name, &sim_time, &message);
+
+    {
+        boost::mutex::scoped_lock lock(_snapshot_mutex);
+        _snapshot_success = success;
+        _snapshot_sim_time = sim_time;
+        _snapshot_message = message;
+        _snapshot_request = SNAPSHOT_NONE;
+    }
+    _snapshot_cond.notify_all();
+}
+
+
+//-------------------------------------------------
+//  Save / restore
+//-------------------------------------------------
+
+/*
+  Saves the state of the world under 'name', replacing the former snapshot of that name.
+  Refused while a parachute model is being inserted: it would be missing from the snapshot.
+ */
+bool ArdupilotSitlGazeboPlugin::save_snapshot(const std::string &name, double *sim_time, std::string *message)
+{
+    world_snapshot snapshot;
+    size_t i, j;
+
+    for (i=0; i<_vehicles.size(); i++) {
+        vehicle_slot *vehicle = _vehicles[i];
+        int state = vehicle->parachute_state;
+
+        if ((state == PARACHUTE_PRELOADING) || (state == PARACHUTE_LOADED) || _lapseLock.is_held(vehicle->parachute_lapse_token)) {
+            *message = "the parachute of " + vehicle->model_name + " is being inserted, try again";
+            return false;
+        }
+    }
+
+    {
+        boost::recursive_mutex::scoped_lock lock(*_parent_world->GetPhysicsEngine()->GetPhysicsUpdateMutex());
+        const physics::Model_V models = _parent_world->GetModels();
+
+        snapshot.sim_time = _parent_world->GetSimTime();
+        for (i=0; i<models.size(); i++) {
+            // Static models do not move, heavy worlds are mostly made of them
+            if (models[i]->IsStatic())
+                continue;
+
+            snapshot_model model;
+            model.name = models[i]->GetName();
+            model.pose = models[i]->GetWorldPose();
+
+            const physics::Link_V &links = models[i]->GetLinks();
+            model.links.resize(links.size());
+            for (j=0; j<links.size(); j++) {
+                model.links[j].name             = links[j]->GetName();
+                model.links[j].pose             = links[j]->GetWorldPose();
+                model.links[j].linear_velocity  = links[j]->GetWorldCoGLinearVel();
+                model.links[j].angular_velocity = links[j]->GetWorldAngularVel();
+            }
+            snapshot.models.push_back(model);
+        }
+    }
+
+    // The loop thread is the reader of the FDM buffers
+    snapshot.vehicles.resize(_vehicles.size());
+    for (i=0; i<_vehicles.size(); i++) {
+        vehicle_slot *vehicle = _vehicles[i];
+        snapshot_vehicle &saved = snapshot.vehicles[i];
+
+        saved.fdm.timestamp    = vehicle->fdm_timestamp.read();
+        saved.fdm.imu          = vehicle->fdm_imu.read();
+        saved.fdm.gps          = vehicle->fdm_gps.read();
+        saved.fdm.gps_velocity = vehicle->fdm_gps_velocity.read();
+        saved.fdm.sonar_down   = vehicle->fdm_sonar_down.read();
+    #if SONAR_FRONT == ENABLED
+        saved.fdm.sonar_front  = vehicle->fdm_sonar_front.read();
+    #else
+        saved.fdm.sonar_front.range       = 0.0;
+        saved.fdm.sonar_front.sample_time = 0.0;
+    #endif
+        saved.parachute_state        = vehicle->parachute_state;
+        saved.is_parachute_available = vehicle->is_parachute_available;
+        memcpy(saved.cmd_motor_speed, vehicle->cmd_motor_speed, sizeof(saved.cmd_motor_speed));
+    }
+
+    *sim_time = snapshot.sim_time.Double();
+    ROS_INFO( PLUGIN_LOG_PREPEND "Snapshot '%s' saved at %.3f s, %u models", name.c_str(), *sim_time, (unsigned int)snapshot.models.size());
+    _snapshots[name].models.swap(snapshot.models);
+    _snapshots[name].vehicles.swap(snapshot.vehicles);
+    _snapshots[name].sim_time = snapshot.sim_time;
+    return true;
+}
+
+/*
+  Brings the world back to the snapshot 'name'.
+  The models inserted since are left as they are, except the parachutes. The lapse-lock is
+  left free: its holders were leases of wall time, of processes following the former timeline.
+ */
+bool ArdupilotSitlGazeboPlugin::restore_snapshot(const std::string &name, double *sim_time, std::string *message)
+{
+    std::map<std::string, world_snapshot>::const_iterator found = _snapshots.find(name);
+    unsigned int nb_missing = 0;
+    size_t i, j;
+
+    if (found == _snapshots.end()) {
+        *message = "no snapshot named '" + name + "'";
+        return false;
+    }
+    const world_snapshot &snapshot = found->second;
+
+    for (i=0; i<_vehicles.size(); i++) {
+        vehicle_slot *vehicle = _vehicles[i];
+        int state = vehicle->parachute_state;
+
+        if ((state == PARACHUTE_PRELOADING) || (state == PARACHUTE_LOADED) || _lapseLock.is_held(vehicle->parachute_lapse_token)) {
+            *message = "the parachute of " + vehicle->model_name + " is being inserted, try again";
+            return false;
+        }
+    }
+
+    {
+        boost::recursive_mutex::scoped_lock lock(*_parent_world->GetPhysicsEngine()->GetPhysicsUpdateMutex());
+
+        for (i=0; i<_vehicles.size(); i++)
+            restore_parachute(_vehicles[i], snapshot.vehicles[i]);
+
+        for (i=0; i<snapshot.models.size(); i++) {
+            const snapshot_model &saved = snapshot.models[i];
+            physics::ModelPtr model = _parent_world->GetModel(saved.name);
+
+            if (!model) {
+                nb_missing++;
+                continue;
+            }
+            model->SetWorldPose(saved.pose);
+            for (j=0; j<saved.links.size(); j++) {
+                physics::LinkPtr link = model->GetLink(saved.links[j].name);
+
+                if (!link)
+                    continue;
+                link->SetWorldPose(saved.links[j].pose);
+                // Also clears the accelerations and forces of the former timeline
+                link->ResetPhysicsStates();
+                link->SetLinearVel(saved.links[j].linear_velocity);
+                link->SetAngularVel(saved.links[j].angular_velocity);
+            }
+        }
+        _parent_world->SetSimTime(snapshot.sim_time);
+
+        // The FDM buffers are single-writer: the restored state is handed to Gazebo's update
+        // thread, which applies it before its next sample. With FDM_SOURCE ros, the sensor
+        // plugins' next messages bring the restored state.
+        for (i=0; i<_vehicles.size(); i++) {
+            _vehicles[i]->fdm_restore = snapshot.vehicles[i].fdm;
+            _vehicles[i]->is_fdm_restore_pending.store(true, std::memory_order_release);
+        }
+        _substep_index = 0;
+    }
+
+    // The motors turn as they did, until the next servo packet
+    for (i=0; i<_vehicles.size(); i++) {
+        memcpy(_vehicles[i]->cmd_motor_speed, snapshot.vehicles[i].cmd_motor_speed, sizeof(_vehicles[i]->cmd_motor_speed));
+        output_motor_commands(_vehicles[i]);
+    }
+
+    if (_lapseLock.get_nb_holders() > 0) {
+        _lapseLock.clear();
+        publish_lapseLock_state("", 0, false);
+    }
+
+    resync_ardupilot();
+
+    *sim_time = snapshot.sim_time.Double();
+    if (nb_missing > 0) {
+        std::ostringstream msg;
+        msg << nb_missing << " model(s) of the snapshot no longer in the world";
+        *message = msg.str();
+    }
+    ROS_INFO( PLUGIN_LOG_PREPEND "Snapshot '%s' restored, back at %.3f s", name.c_str(), *sim_time);
+    return true;
+}
+
+/*
+  Brings the parachute of a vehicle back to its state in the snapshot.
+  Called with the physics locked, Gazebo's thread idle.
+ */
+void ArdupilotSitlGazeboPlugin::restore_parachute(vehicle_slot *vehicle, const snapshot_vehicle &saved)
+{
+    int state = vehicle->parachute_state;
+
+    vehicle->is_parachute_available = saved.is_parachute_available;
+    vehicle->is_parachute_deploy_requested = false;
+    if (state == saved.parachute_state)
+        return;
+
+    if (state == PARACHUTE_DEPLOYED) {
+        // Released since: detached, then parked again (preloaded) or removed (inserted on deploy)
+        if (vehicle->uav_chute_joint) {
+            vehicle->uav_chute_joint->Detach();
+            vehicle->uav_chute_joint.reset();
+        }
+        if (saved.parachute_state == PARACHUTE_PARKED) {
+            park_parachute_model(vehicle);
+        } else {
+            _parent_world->RemoveModel(vehicle->parachute_name);
+            vehicle->parachute_model.reset();
+            vehicle->parachute_state = PARACHUTE_NONE;
+        }
+    } else if ((state == PARACHUTE_PARKED) && (saved.parachute_state == PARACHUTE_DEPLOYED)) {
+        // Joined again, the poses of the snapshot are restored next
+        deploy_parachute_model(vehicle);
+    }
+}
+
+/*
+  After a restore, each ArduPilot starts again from the restored time: its pending servo packets,
+  of the former timeline, are dropped, and it joins the barrier again with its next packet,
+  answered with the FDM of the restored state.
+ */
+void ArdupilotSitlGazeboPlugin::resync_ardupilot()
+{
+    servo_packet pkt;
+    size_t i;
+
+    for (i=0; i<_vehicles.size(); i++) {
+        vehicle_slot *vehicle = _vehicles[i];
+
+        if (vehicle->is_control_socket_open)
+            vehicle->control_from_ardu->recv_latest(&pkt, sizeof(pkt));
+        vehicle->is_input_ready = false;
+        vehicle->has_new_servo = false;
+        // The FDM packets in flight are from before the restore, the pipeline starts again
+        vehicle->fdm_sequence_answered = vehicle->fdm_sequence;
+        vehicle->is_servo_v2 = false;
+        if (vehicle->is_connection_alive) {
+            vehicle->is_connection_alive = false;
+            ROS_INFO( PLUGIN_LOG_PREPEND "[%s] Ardupilot link reset by the snapshot restore", vehicle->model_name.c_str());
+        }
+    }
+
+    _is_batch_open = false;
+    _pacer.reset();
+    _timing_batch_end_ns = 0;
+}
+
+} // end of "namespace gazebo"
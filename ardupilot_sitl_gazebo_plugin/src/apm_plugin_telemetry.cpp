@@ -0,0 +1,229 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Telemetry: the last TELEMETRY_SECONDS of the servo packets, FDM packets and step timings,
+ * kept in memory at no logging cost, and dumped to a file after an incident (an ArduPilot
+ * connection lost, a lapse-lock holder out of time) or on request (service 'dump_telemetry').
+ *
+ * The loop thread only appends to the rings, and notes the incidents: the dumps are written
+ * by the service's thread, or by '_telemetry_thread'.
+ */
+
+#include "../include/ardupilot_sitl_gazebo_plugin/ardupilot_sitl_gazebo_plugin.h"
+#include <time.h>
+#include <algorithm>
+
+namespace gazebo
+{
+
+static_assert(FDM_V2_MAX_SIZE <= REPLAY_RECORD_MAX_SIZE, "the FDM packets must fit the records");
+
+//-------------------------------------------------
+//  Initialization
+//-------------------------------------------------
+
+/*
+  Allocates the rings, for TELEMETRY_SECONDS of frames, and starts the thread of the dumps.
+  Called once the vehicles are declared, before the loop starts.
+ */
+void ArdupilotSitlGazeboPlugin::init_telemetry()
+{
+    size_t nb_frames;
+    size_t i;
+
+    if (_telemetry_seconds <= 0) {
+        ROS_INFO( PLUGIN_LOG_PREPEND "Telemetry disabled");
+        return;
+    }
+
+    // A servo packet and an FDM packet per frame and vehicle, a step per frame
+    nb_frames = (size_t)ceil(_telemetry_seconds / STEP_SIZE_FOR_ARDUPILOT);
+    for (i=0; i<_vehicles.size(); i++)
+        _vehicles[i]->telemetry.init(2 * nb_frames, std::max(sizeof(servo_packet), std::max(sizeof(fdm_packet), FDM_V2_MAX_SIZE)));
+    _telemetry_steps.init(nb_frames, sizeof(telemetry_step));
+
+    _telemetry_thread = boost::thread(boost::bind(&ArdupilotSitlGazeboPlugin::telemetry_dump_thread, this));
+    ROS_INFO( PLUGIN_LOG_PREPEND "Telemetry of the last %.1f s of simulation kept, dumped to '%s' after an incident",
+              _telemetry_seconds, _telemetry_dump_dir.c_str());
+}
+
+/*
+  Writes the dumps still pending, then stops the thread. Called once the loop has exited.
+ */
+void ArdupilotSitlGazeboPlugin::stop_telemetry()
+{
+    if (!_telemetry_thread.joinable())
+        return;
+    {
+        boost::mutex::scoped_lock lock(_telemetry_request_mutex);
+        _is_telemetry_stopping = true;
+    }
+    _telemetry_request_cond.notify_one();
+    _telemetry_thread.join();
+}
+
+
+//-------------------------------------------------
+//  Loop side
+//-------------------------------------------------
+
+/*
+  Appends the timing of the batch being released. Called by the loop thread.
+ */
+void ArdupilotSitlGazeboPlugin::record_telemetry_step(int64_t start_ns, int64_t wait_servo_ns, int64_t step_ns, int64_t pace_ns,
+                                                      unsigned int nb_vehicles, uint32_t flags)
+{
+    telemetry_step step;
+
+    step.start_ns      = start_ns;
+    step.wait_servo_ns = wait_servo_ns;
+    step.step_ns       = step_ns;
+    step.pace_ns       = pace_ns;
+    step.nb_vehicles   = nb_vehicles;
+    step.flags         = flags;
+    _telemetry_steps.append(TELEMETRY_RECORD_STEP, TELEMETRY_VEHICLE_NONE, _batch_index, 0.0, &step, sizeof(step));
+}
+
+/*
+  Notes an incident, for '_telemetry_thread' to dump the rings. Called by the loop thread:
+  the lock is only held by the dump thread to take the reasons, never across the disk access.
+  @param reason: TELEMETRY_DUMP_xxx
+ */
+void ArdupilotSitlGazeboPlugin::request_telemetry_dump(int reason)
+{
+    if (!_telemetry_thread.joinable() || (_nb_telemetry_auto_dumps >= TELEMETRY_MAX_AUTO_DUMPS))
+        return;
+    _nb_telemetry_auto_dumps++;
+    {
+        boost::mutex::scoped_lock lock(_telemetry_request_mutex);
+        _telemetry_request_reasons |= reason;
+    }
+    _telemetry_request_cond.notify_one();
+}
+
+
+//-------------------------------------------------
+//  Dumps
+//-------------------------------------------------
+
+/*
+  Thread writing the dumps requested by the loop. Incidents noted while a dump is written
+  are gathered in the next one.
+ */
+void ArdupilotSitlGazeboPlugin::telemetry_dump_thread()
+{
+    boost::mutex::scoped_lock lock(_telemetry_request_mutex);
+    std::string reason, path, message;
+    size_t nb_records;
+    int reasons;
+
+    while (true) {
+        while ((_telemetry_request_reasons == 0) && !_is_telemetry_stopping)
+            _telemetry_request_cond.wait(lock);
+        if (_telemetry_request_reasons == 0)
+            break;
+        reasons = _telemetry_request_reasons;
+        _telemetry_request_reasons = 0;
+        lock.unlock();
+
+        reason.clear();
+        if (reasons & TELEMETRY_DUMP_LINK_LOST)
+            reason += "link_lost";
+        if (reasons & TELEMETRY_DUMP_LAPSE_TIMEOUT)
+            reason += std::string(reason.empty() ? "" : "+") + "lapse_timeout";
+        if (dump_telemetry("", reason, &path, &nb_records, &message))
+            ROS_WARN( PLUGIN_LOG_PREPEND "Telemetry dumped to '%s' (%s, %u records)", path.c_str(), reason.c_str(), (unsigned int)nb_records);
+        else
+            ROS_WARN( PLUGIN_LOG_PREPEND "Failed to dump the telemetry (%s): %s", reason.c_str(), message.c_str());
+
+        lock.lock();
+    }
+}
+
+/*
+  Writes the rings to a file of TELEMETRY_DUMP_DIR. Any thread but the loop's, one dump at a time.
+  @param name: bare name of the file (any ROS client may ask: no directory, no '..'),
+               empty for a new one named after the time and 'reason'
+  @return true on success, otherwise 'message' tells why
+ */
+bool ArdupilotSitlGazeboPlugin::dump_telemetry(const std::string &name, const std::string &reason, std::string *written_path,
+                                               size_t *nb_records, std::string *message)
+{
+    boost::mutex::scoped_lock lock(_telemetry_dump_mutex);
+    std::vector<const TelemetryRing*> rings;
+    replay_log_header header;
+    struct timespec now;
+    struct tm now_tm;
+    char date[32], auto_name[64];
+    size_t i;
+    int err;
+
+    *nb_records = 0;
+    written_path->clear();
+    if (!_telemetry_steps.is_enabled()) {
+        *message = "telemetry is disabled (TELEMETRY_SECONDS 0)";
+        return false;
+    }
+
+    if ((name.find('/') != std::string::npos) || (name.find("..") != std::string::npos) || (name == ".")) {
+        *message = "'" + name + "' is not a bare file name, the dumps are written in TELEMETRY_DUMP_DIR";
+        return false;
+    }
+    if (name.empty()) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        localtime_r(&now.tv_sec, &now_tm);
+        strftime(date, sizeof(date), "%Y%m%d-%H%M%S", &now_tm);
+        snprintf(auto_name, sizeof(auto_name), "telemetry_%s.%03ld_", date, now.tv_nsec / 1000000);
+        *written_path = _telemetry_dump_dir + "/" + auto_name + reason + ".bin";
+    } else {
+        *written_path = _telemetry_dump_dir + "/" + name;
+    }
+
+    header.magic = TELEMETRY_DUMP_MAGIC;
+    header.version = TELEMETRY_DUMP_VERSION;
+    header.nb_vehicles = _vehicles.size();
+    header.steps_per_frame = _steps_per_frame;
+    header.frame_duration = STEP_SIZE_FOR_ARDUPILOT;
+
+    // The steps first, then the vehicles, each one oldest first: the batches relate them
+    rings.push_back(&_telemetry_steps);
+    for (i=0; i<_vehicles.size(); i++)
+        rings.push_back(&_vehicles[i]->telemetry);
+
+    err = TelemetryRing::dump(*written_path, header, rings, nb_records);
+    if (err != 0) {
+        *message = std::string("'") + *written_path + "': " + strerror(err);
+        return false;
+    }
+    return true;
+}
+
+
+//-------------------------------------------------
+//  ROS Services
+//-------------------------------------------------
+
+bool ArdupilotSitlGazeboPlugin::service_dump_telemetry(ardupilot_sitl_gazebo_plugin::DumpTelemetry::Request  &req,
+                                                       ardupilot_sitl_gazebo_plugin::DumpTelemetry::Response &res)
+{
+    size_t nb_records;
+
+    ROS_DEBUG( PLUGIN_LOG_PREPEND "service_dump_telemetry: '%s'", req.path.c_str());
+    res.success = dump_telemetry(req.path, "request", &res.path, &nb_records, &res.message);
+    res.nb_records = nb_records;
+    return true;
+}
+
+} // end of "namespace gazebo"
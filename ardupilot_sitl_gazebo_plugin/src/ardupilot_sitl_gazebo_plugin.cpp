@@ -25,6 +25,7 @@
 
 #include "../include/ardupilot_sitl_gazebo_plugin/ardupilot_sitl_gazebo_plugin.h"
 #include <math.h>
+#include <algorithm>
 
 // For threads,
 // See:
@@ -59,65 +60,51 @@ GZ_REGISTER_WORLD_PLUGIN(ArdupilotSitlGazeboPlugin)
 
 ArdupilotSitlGazeboPlugin::ArdupilotSitlGazeboPlugin()
     : WorldPlugin(),
-      _is_control_socket_open(false),
-      _is_fdm_socket_open(false),
       _rosnode(NULL),
       _isSimPaused(false),       // starts in running state
       _timeMsgAlreadyDisplayed(false),
-      _is_parachute_available(true),
-      _modelName(UAV_MODEL_NAME),
-      _nbMotorSpeed(NB_SERVOS_MOTOR_SPEED),
-      _loop_lapseLock(0.0f),
-      _nbHolders_lapseLock(0)
+      _fdm_source(FDM_SOURCE_ROS),
+      _reference_latitude(REFERENCE_LATITUDE_DEFAULT),
+      _reference_longitude(REFERENCE_LONGITUDE_DEFAULT),
+      _reference_altitude(REFERENCE_ALTITUDE_DEFAULT),
+      _reference_heading(REFERENCE_HEADING_DEFAULT),
+      _radius_north(WGS84_EQUATORIAL_RADIUS),
+      _radius_east(WGS84_EQUATORIAL_RADIUS),
+      _steps_per_frame(STEPS_PER_FRAME),
+      _imu_substep_mode(IMU_SUBSTEP_LAST),
+      _parachute_preload(false),
+      _substep_index(0),
+      _is_batch_open(false),
+      _straggler_timeout_ms(STRAGGLER_TIMEOUT_MS),
+      _stats_nb_batches(0),
+      _stats_nb_timeouts(0),
+      _batch_index(0),
+      _timing_batch_end_ns(0),
+      _stats_nb_sim_steps(0),
+      _stats_nb_render_waits(0),
+      _loop_epoll_fd(-1),
+      _loop_wakeup_fd(-1),
+      _apm_transport(APM_TRANSPORT_UDP),
+      _listen_address(LISTEN_ADDRESS_DEFAULT),
+      _shm_name(APM_SHM_NAME_DEFAULT),
+      _shm_doorbell_seen(0),
+      _is_replay(false),
+      _telemetry_seconds(TELEMETRY_SECONDS_DEFAULT),
+      _telemetry_dump_dir(TELEMETRY_DUMP_DIR_DEFAULT),
+      _telemetry_request_reasons(0),
+      _is_telemetry_stopping(false),
+      _nb_telemetry_auto_dumps(0),
+      _is_render_waiting(false),
+      _snapshot_request(SNAPSHOT_NONE),
+      _snapshot_success(false),
+      _snapshot_sim_time(0.0),
+      _lapseLock()
 {
     // Gazebo pointers (to world/model/joint/...) are based on Boost shared pointers.
     // To pass them to NULL, the 'reset()' method must be used.
     _parent_world.reset();
-    _uav_model.reset();
-    _parachute_model.reset();
-    _uav_chute_joint.reset();
-    
-    // Initializes the FDM structure
-    _fdm.timestamp = 1e-6;
-    _fdm.imu_angular_velocity_rpy[0] = 0;
-    _fdm.imu_angular_velocity_rpy[1] = 0;
-    _fdm.imu_angular_velocity_rpy[2] = 0;
-    
-    _fdm.imu_linear_acceleration_xyz[0] = 0;
-    _fdm.imu_linear_acceleration_xyz[1] = 0;
-    _fdm.imu_linear_acceleration_xyz[2] = 0;
-    
-    _fdm.imu_orientation_quat[0] = 0;
-    _fdm.imu_orientation_quat[1] = 0;
-    _fdm.imu_orientation_quat[2] = 0;
-    _fdm.imu_orientation_quat[3] = 0;
-    
-    _fdm.velocity_xyz[0] = 0;
-    _fdm.velocity_xyz[1] = 0;
-    _fdm.velocity_xyz[2] = 0;
-    
-    _fdm.position_xyz[0] = 0;
-    _fdm.position_xyz[1] = 0;
-    _fdm.position_xyz[2] = 0;
-    
-    _fdm.position_latlonalt[0] = 0;
-    _fdm.position_latlonalt[1] = 0;
-    _fdm.position_latlonalt[2] = 0;
-    
-    _fdm.sonar_down = 0;
-  #if SONAR_FRONT == ENABLED
-    _fdm.sonar_front = 0;
-  #endif
-    
-    _sock_fdm_to_ardu       = new SocketAPM(true);
-    _sock_control_from_ardu = new SocketAPM(true);
-          
-    // In case ArduPilot is a bit long to start and the '_ctrls' message is published
-    // to ROS before being defined by ArduPilot. in [rad/s]
-    int i;
-    for (i=0; i<NB_SERVOS_MOTOR_SPEED; i++) {
-        _cmd_motor_speed[i] = 0.0;
-    }
+    
+    // Vehicles are declared on 'Load()', from the SDF
     
     // should not be blocking
 }
@@ -127,9 +114,6 @@ ArdupilotSitlGazeboPlugin::~ArdupilotSitlGazeboPlugin()
     // Gazebo pointers (to world/model/joint/...) are based on Boost shared pointers.
     // To pass them to NULL, the 'reset()' method must be used.
     _parent_world.reset();
-    _uav_model.reset();
-    _parachute_model.reset();
-    _uav_chute_joint.reset();
     
     // Finalizes the ROS node
     //   Make sure to call the 'shutdown' before the thread.join(),
@@ -137,39 +121,157 @@ ArdupilotSitlGazeboPlugin::~ArdupilotSitlGazeboPlugin()
     _rosnode->shutdown();
     
     // Releases all locks
-    _fdm_mutex.unlock();
-    _lapseLock_mutex.unlock();
-    _loop_lapseLock = 0.0f;
-    _nbHolders_lapseLock = 0;
+    _lapseLock.clear();
+    
+    // Wakes the loop thread up, in case it is waiting for ArduPilot
+    wake_loop_thread();
     
     // Sleeps (pauses the destructor) until the thread has finished
     _callback_loop_thread.join();
     
+    // Ends the pending dumps of the telemetry
+    stop_telemetry();
+    
+    // Writes the end of the replay log, once the loop can no longer append to it
+    if (_recorder.is_open()) {
+        _recorder.close();
+        if (_recorder.get_nb_dropped() > 0)
+            ROS_WARN( PLUGIN_LOG_PREPEND "Record '%s' is incomplete: %u records dropped, the disk was too slow", _record_file.c_str(), _recorder.get_nb_dropped());
+        if (_recorder.get_write_error())
+            ROS_WARN( PLUGIN_LOG_PREPEND "Record '%s' is incomplete: %s", _record_file.c_str(), strerror(_recorder.get_write_error()));
+    }
+    
+    if (_loop_epoll_fd >= 0)
+        close(_loop_epoll_fd);
+    if (_loop_wakeup_fd >= 0)
+        close(_loop_wakeup_fd);
+    
+    for (size_t i=0; i<_vehicles.size(); i++)
+        delete _vehicles[i];
+    _vehicles.clear();
+    
     delete _rosnode;
     _rosnode = NULL;
 }
 
 
+/*
+  Constructor of a vehicle slot, with the default configuration of a single vehicle
+ */
+ArdupilotSitlGazeboPlugin::vehicle_slot::vehicle_slot()
+    : index(0),
+      model_name(UAV_MODEL_NAME),
+      ros_namespace(UAV_MODEL_NAME),
+      parachute_name(PARACHUTE_MODEL_NAME),
+      port_from_ardupilot(PORT_DATA_FROM_ARDUPILOT),
+      port_to_ardupilot(PORT_DATA_TO_ARDUPILOT),
+      apm_address(APM_ADDRESS_DEFAULT),
+      pipeline_window(PIPELINE_WINDOW_DEFAULT),
+      nb_motor_speed(NB_SERVOS_MOTOR_SPEED),
+      fdm_format(FDM_FORMAT_LEGACY),
+      motor_command_output(MOTOR_COMMAND_OUTPUT_ROS),
+      is_control_socket_open(false),
+      is_fdm_socket_open(false),
+      is_input_ready(false),
+      has_new_servo(false),
+      is_connection_alive(false),
+      nb_link_connects(0),
+      nb_link_losses(0),
+      is_servo_v2(false),
+      fdm_sequence(0),
+      fdm_sequence_answered(0),
+      servo_sequence(0),
+      stats_nb_waits(0),
+      stats_nb_missed(0),
+      stats_nb_dropped(0),
+      stats_wait_sum(0.0),
+      stats_wait_max(0.0),
+      stats_nb_lost(0),
+      stats_nb_reordered(0),
+      stats_nb_round_trips(0),
+      stats_round_trip_sum(0.0),
+      stats_round_trip_max(0.0),
+      stats_ahead_max(0),
+      stats_nb_motor_speed_skipped(0),
+      next_motor_speed_msg(0),
+      is_parachute_available(true),
+      parachute_state(PARACHUTE_NONE),
+      is_parachute_deploy_requested(false),
+      parachute_lapse_token(LAPSE_LOCK_NO_TOKEN),
+      is_drive_bound(false),
+      is_drive_bind_failed(false),
+      direct_nb_substeps(0),
+      is_fdm_restore_pending(false),
+      is_render_bound(false)
+{
+    uav_model.reset();
+    parachute_model.reset();
+    uav_chute_joint.reset();
+    
+    // Initializes the FDM state, all other blocks start at 0
+    fdm_timestamp.write(1e-6);
+    memset(fdm_send_ns, 0, sizeof(fdm_send_ns));
+    
+    // Created when opened, depending on the transport
+    fdm_to_ardu       = NULL;
+    control_from_ardu = NULL;
+    
+    // In case ArduPilot is a bit long to start and the '_ctrls' message is published
+    // to ROS before being defined by ArduPilot. in [rad/s]
+    int i;
+    for (i=0; i<NB_SERVOS; i++) {
+        cmd_motor_speed[i] = 0.0;
+    }
+}
+
+ArdupilotSitlGazeboPlugin::vehicle_slot::~vehicle_slot()
+{
+    uav_model.reset();
+    parachute_model.reset();
+    uav_chute_joint.reset();
+    
+    delete fdm_to_ardu;
+    delete control_from_ardu;
+}
+
+
 // This method is called by Gazebo on start up.
 // It shall be non blocking.
 void ArdupilotSitlGazeboPlugin::Load(physics::WorldPtr world, sdf::ElementPtr sdf)
 {
+    int64_t t_start, t_gazebo, t_ros, t_ardupilot, t_meshes;
+    
+    // The meshes are parsed in the background, meanwhile
+    t_start = LatencyHistogram::now_ns();
+    start_mesh_preload(world, sdf);
+    
     // Calls every initialization method. They will return 'false' in case of
     // fatal failure.
     
     if (!init_gazebo_side(world, sdf))
         return;
+    t_gazebo = LatencyHistogram::now_ns();
     
     if (!init_ros_side())
         return;
+    t_ros = LatencyHistogram::now_ns();
     
     if (!init_ardupilot_side())
         return;
+    t_ardupilot = LatencyHistogram::now_ns();
     
-    ROS_INFO( PLUGIN_LOG_PREPEND "Initialization finished");
+    finish_mesh_preload();
+    t_meshes = LatencyHistogram::now_ns();
+    
+    ROS_INFO( PLUGIN_LOG_PREPEND "Initialization finished in %.1f ms: Gazebo side %.1f ms, ROS side %.1f ms, ArduPilot side %.1f ms, waiting for the meshes %.1f ms",
+              (t_meshes - t_start) * 1e-6, (t_gazebo - t_start) * 1e-6, (t_ros - t_gazebo) * 1e-6,
+              (t_ardupilot - t_ros) * 1e-6, (t_meshes - t_ardupilot) * 1e-6);
     
     // Starts the loop thread
-    _callback_loop_thread = boost::thread( boost::bind( &ArdupilotSitlGazeboPlugin::loop_thread,this ) );
+    if (_is_replay)
+        _callback_loop_thread = boost::thread( boost::bind( &ArdupilotSitlGazeboPlugin::replay_loop_thread,this ) );
+    else
+        _callback_loop_thread = boost::thread( boost::bind( &ArdupilotSitlGazeboPlugin::loop_thread,this ) );
 }
 
 
@@ -182,177 +284,662 @@ void ArdupilotSitlGazeboPlugin::Load(physics::WorldPtr world, sdf::ElementPtr sd
   Main loop of the plugin.
   Handles the whole Gazebo / Ardupilot synchronisation :
   
-      - waits until it receives an Ardupilot servos command
-      - runs a single Gazebo step
-      - sends to Ardupilot the FDM message
+      - waits until it receives Ardupilot servos commands, from every connected vehicle
+        (or until the straggler timeout)
+      - runs a single Gazebo step, for all the vehicles
+      - sends to each Ardupilot of the batch its FDM message
+  
+  The loop does not poll: it sleeps until a servo packet is readable on a control socket,
+  or until another thread wakes it up (see 'wake_loop_thread()'). The lockstep rate is thus
+  only bounded by the cost of the physics step.
  */
 void ArdupilotSitlGazeboPlugin::loop_thread()
 {
     // Or is 'boost::chrono::duration' better ?
-    ros::WallTime prevloop_t_start, loop_t_start;
-    ros::WallDuration loop_dt;
-    bool isConnectionAlive = false;
+    ros::WallTime loop_t_start;
+    int loop_events;
+    int wait_timeout_ms;
+    float remaining_lock;
+    double batch_age_ms;
+    size_t i;
     
-    int nbSteps = 100;
-    ros::WallTime prevloop10_t_start, loop10_t_start;
-    ros::WallDuration loop10_dt;
-    float step10_dt = STEP_SIZE_FOR_ARDUPILOT * nbSteps; // [s]
-
-    loop10_t_start = ros::WallTime::now();
-    int iLoopCounter = 0;
-    
-    
-    // Checks for Ardu messages at 400 Hz
-    //boost::posix_time::milliseconds thread_delay(2.5);
-    boost::posix_time::milliseconds thread_delay(0.5);
-    //boost::posix_time::milliseconds thread_delay(500);
+    loop_t_start = ros::WallTime::now();
+    _stats_walltime = loop_t_start;
     
     ROS_INFO( PLUGIN_LOG_PREPEND "Starting listening loop for ArduPilot messages");
+    init_loop_realtime();
+    bind_render_sensors();
     
     // Keeps running while ROS is on
     while (_rosnode->ok()) {
         
-        // Slow down your horses !
-        boost::this_thread::sleep(thread_delay);
+        // Sleeps until Ardupilot talks to us, or someone wakes us up.
+        // While a batch is open, no longer than its straggler timeout.
+        wait_timeout_ms = APM_INPUT_TIMEOUT_MS;
+        if (_is_batch_open && is_barrier_complete()) {
+            // Pipelined vehicles: the step does not wait for their answers
+            wait_timeout_ms = 0;
+        } else if (_is_batch_open) {
+            batch_age_ms = (ros::WallTime::now() - _batch_open_walltime).toSec() * 1000.0;
+            wait_timeout_ms = std::max(0, (int)ceil(_straggler_timeout_ms - batch_age_ms));
+        }
+        loop_events = wait_loop_event(wait_timeout_ms);
         
-        // Notes the start time, calculates the loop duration
-        prevloop_t_start = loop_t_start;
+        // Notes the start time
         loop_t_start = ros::WallTime::now();
-        loop_dt = loop_t_start - prevloop_t_start;
-
-        /*if (loop_dt.toSec() < STEP_SIZE_FOR_ARDUPILOT) {
-           ROS_INFO( PLUGIN_LOG_PREPEND "Wait %f", STEP_SIZE_FOR_ARDUPILOT - loop_dt.toSec());
-           boost::this_thread::sleep(boost::posix_time::seconds(STEP_SIZE_FOR_ARDUPILOT - loop_dt.toSec()));
-        }*/
-
-        //iLoopCounter++;
-        if (iLoopCounter >= nbSteps) {
-            iLoopCounter = 0;
-            prevloop10_t_start = loop10_t_start;
-            loop10_t_start = ros::WallTime::now();
-            loop10_dt = loop10_t_start - prevloop10_t_start;
-            if (loop10_dt.toSec() < step10_dt) {
-                //ROS_INFO( PLUGIN_LOG_PREPEND "Wait %f", step10_dt - loop10_dt.toSec());
-                boost::this_thread::sleep(boost::posix_time::seconds(step10_dt - loop10_dt.toSec()));
+
+        // Saves or restores a world snapshot, between two steps
+        handle_snapshot_request();
+
+        // Checks if there is a lapse lock. If yes, waits until the other task frees it, or until the lock expires
+        if (!check_lapseLock(&remaining_lock)) {
+            // The servo packets stay in the sockets, they are processed once the lock is free.
+            // Meanwhile the thread sleeps, until the lock is released or has expired.
+            wait_loop_wakeup((int)ceil(remaining_lock * 1000.0f));
+            handle_snapshot_request();
+            _pacer.reset();
+            // The lock is not the stragglers' fault, nor ArduPilot's
+            if (_is_batch_open)
+                _batch_open_walltime = ros::WallTime::now();
+            _timing_batch_end_ns = 0;
+            continue;
+        }
+        
+        // Cameras too far behind the simulation: the step waits for them to catch up
+        if (is_render_pipeline_full()) {
+            wait_render_image();
+            handle_snapshot_request();
+            _pacer.reset();
+            if (_is_batch_open)
+                _batch_open_walltime = ros::WallTime::now();
+            _timing_batch_end_ns = 0;
+            continue;
+        }
+        
+        // Checks the inboxes for any email from Ardupilot.
+        // A vehicle already in the batch may resend its packet (ArduPilot timed out): the newest one is kept.
+        if (loop_events & LOOP_EVENT_APM_INPUT) {
+            for (i=0; i<_vehicles.size(); i++) {
+                vehicle_slot *vehicle = _vehicles[i];
+                
+                if (!vehicle->is_input_ready)
+                    continue;
+                vehicle->is_input_ready = false;
+                
+                if (!receive_apm_input(vehicle))
+                    continue;
+                vehicle->has_new_servo = true;
+                vehicle->last_input_walltime = loop_t_start;
+                if (!_is_batch_open) {
+                    _is_batch_open = true;
+                    _batch_open_walltime = loop_t_start;
+                }
+                
+                // We have a friend !
+                if (!vehicle->is_connection_alive) {
+                    vehicle->is_connection_alive = true;
+                    vehicle->nb_link_connects++;
+                    _pacer.reset();
+                    _timing_batch_end_ns = 0;
+                }
             }
         }
+        
+        // No message from an Ardupilot for a while, maybe next one ?
+        // It leaves the barrier, so the others are no longer held by it.
+        for (i=0; i<_vehicles.size(); i++) {
+            vehicle_slot *vehicle = _vehicles[i];
+            
+            if (vehicle->is_connection_alive && !vehicle->has_new_servo &&
+                ((loop_t_start - vehicle->last_input_walltime).toSec() * 1000.0 > APM_INPUT_TIMEOUT_MS)) {
+                vehicle->is_connection_alive = false;
+                vehicle->nb_link_losses++;
+                request_telemetry_dump(TELEMETRY_DUMP_LINK_LOST);
+            }
+        }
+        
+        // Steps once everyone is here, or once the stragglers are late
+        if (_is_batch_open) {
+            batch_age_ms = (loop_t_start - _batch_open_walltime).toSec() * 1000.0;
+            if (is_barrier_complete())
+                release_barrier(loop_t_start, false);
+            else if (batch_age_ms >= _straggler_timeout_ms)
+                release_barrier(loop_t_start, true);
+        }
+        
+        if ((loop_t_start - _stats_walltime).toSec() >= LOOP_STATS_PERIOD) {
+            report_link_events();
+            publish_barrier_stats(loop_t_start);
+            publish_loop_timing_stats(loop_t_start);
+            _stats_walltime = loop_t_start;
+            bind_render_sensors();
+        }
+    }
     
+    report_link_events();
+    ROS_INFO( PLUGIN_LOG_PREPEND "Exited listening loop for Ardupilot messages");
+}
+
+/*
+  Main loop of the plugin in replay mode (REPLAY_FILE), without any ArduPilot.
+  Feeds the servo packets of each recorded batch to their vehicles, as if they had just been
+  received, then releases the barrier: the world runs the same sequence of steps as the
+  recording. The FDM packets produced are compared with the recorded ones (see 'end_replay()'),
+  and also sent to the replay log if RECORD_FILE is set.
+  Paced by the PACING_MODE, like the live loop: 'replay' runs it as fast as the physics allows.
+  The lapse-lock and the pause are honored.
+ */
+void ArdupilotSitlGazeboPlugin::replay_loop_thread()
+{
+    replay_record record;
+    ros::WallTime loop_t_start;
+    float remaining_lock;
+    bool has_record;
+    uint32_t batch;
+    
+    loop_t_start = ros::WallTime::now();
+    _stats_walltime = loop_t_start;
+    
+    // The vehicles are spawned by other nodes, after the plugin is loaded
+    if (!wait_replay_models()) {
+        end_replay(REPLAY_EXIT_ERROR);
+        return;
+    }
+    ROS_INFO( PLUGIN_LOG_PREPEND "Starting replay of '%s'", _replay_file.c_str());
+    init_loop_realtime();
+    bind_render_sensors();
+    
+    has_record = _replay_reader.next(&record);
+    while (_rosnode->ok() && has_record) {
         
-        // Checks if there is a lapse lock. If yes, waits until the other task frees it, or until the lock expires
-        if (!check_lapseLock(loop_dt.toSec())) {
+        if (!check_lapseLock(&remaining_lock)) {
+            wait_loop_wakeup((int)ceil(remaining_lock * 1000.0f));
+            _pacer.reset();
+            _timing_batch_end_ns = 0;
+            continue;
+        }
+        // A paused world would not step, and the batch would be lost
+        if (_isSimPaused) {
+            wait_loop_wakeup(APM_INPUT_TIMEOUT_MS);
+            _pacer.reset();
+            _timing_batch_end_ns = 0;
+            continue;
+        }
+        if (is_render_pipeline_full()) {
+            wait_render_image();
+            _pacer.reset();
+            _timing_batch_end_ns = 0;
             continue;
         }
         
-        // Checks the inbox for any email from Ardupilot
-        if (receive_apm_input()) {
-            // We have a friend !
-            if (!isConnectionAlive) {
-                isConnectionAlive = true;
-                ROS_INFO( PLUGIN_LOG_PREPEND "Connected with Ardupilot");
+        loop_t_start = ros::WallTime::now();
+        
+        // Every record of a batch is contiguous in the log
+        batch = record.header.batch;
+        while (has_record && (record.header.batch == batch)) {
+            if ((record.header.type == REPLAY_RECORD_SERVO) && (record.header.vehicle < _vehicles.size()) &&
+                (record.header.size == sizeof(servo_packet))) {
+                vehicle_slot *vehicle = _vehicles[record.header.vehicle];
+                
+                vehicle->telemetry.append(REPLAY_RECORD_SERVO, vehicle->index, _batch_index, vehicle->fdm_timestamp.read(),
+                                          record.data, sizeof(servo_packet));
+                apply_apm_input(vehicle, *(const servo_packet*)record.data);
+                vehicle->has_new_servo = true;
+                vehicle->last_input_walltime = loop_t_start;
+            } else if (record.header.type == REPLAY_RECORD_FDM) {
+                _replay_check.set_reference(record);
             }
-            
-            // Advances the simulation by 1 step
-            if (!_isSimPaused) {
-                ROS_DEBUG(PLUGIN_LOG_PREPEND "step");
-                step_gazebo_sim();
-                iLoopCounter++;
+            has_record = _replay_reader.next(&record);
+        }
+        
+        // The batch index of the replay follows the recorded one, so the records of both logs match
+        _batch_index = batch;
+        release_barrier(loop_t_start, false);
+        
+        if ((loop_t_start - _stats_walltime).toSec() >= LOOP_STATS_PERIOD) {
+            report_link_events();
+            publish_barrier_stats(loop_t_start);
+            publish_loop_timing_stats(loop_t_start);
+            _stats_walltime = loop_t_start;
+            bind_render_sensors();
+        }
+    }
+    
+    _replay_reader.close();
+    ROS_INFO( PLUGIN_LOG_PREPEND "Finished replay of '%s', after %u batches", _replay_file.c_str(), _batch_index);
+    // Interrupted by the shutdown, the replay is not complete
+    end_replay(has_record ? REPLAY_EXIT_ERROR : REPLAY_EXIT_MATCH);
+}
+
+/*
+  Waits for every vehicle model to be in the world, before the replay starts.
+  @return false on timeout (REPLAY_MODELS_TIMEOUT) or shutdown
+ */
+bool ArdupilotSitlGazeboPlugin::wait_replay_models()
+{
+    ros::WallTime t_start = ros::WallTime::now();
+    bool are_all_loaded;
+    size_t i;
+    
+    while (_rosnode->ok()) {
+        are_all_loaded = true;
+        for (i=0; i<_vehicles.size(); i++) {
+            if (!_parent_world->GetModel(_vehicles[i]->model_name))
+                are_all_loaded = false;
+        }
+        if (are_all_loaded)
+            return true;
+        
+        if ((ros::WallTime::now() - t_start).toSec() > REPLAY_MODELS_TIMEOUT) {
+            for (i=0; i<_vehicles.size(); i++) {
+                if (!_parent_world->GetModel(_vehicles[i]->model_name))
+                    ROS_ERROR( PLUGIN_LOG_PREPEND "[%s] Model not spawned after %.0f s, cannot replay", _vehicles[i]->model_name.c_str(), REPLAY_MODELS_TIMEOUT);
             }
+            return false;
+        }
+        wait_loop_wakeup(100);
+    }
+    return false;
+}
+
+/*
+  Reports the comparison of the FDM packets produced by the replay with the recorded ones.
+  With the 'replay' pacing, then exits gzserver with the status, for the CI jobs:
+  REPLAY_EXIT_MATCH, REPLAY_EXIT_MISMATCH, or REPLAY_EXIT_ERROR if the replay could not be run.
+  @param status: REPLAY_EXIT_MATCH if the whole log was replayed, otherwise REPLAY_EXIT_ERROR
+ */
+void ArdupilotSitlGazeboPlugin::end_replay(int status)
+{
+    int i;
+    
+    if (status == REPLAY_EXIT_MATCH) {
+        _replay_check.finish();
+        ROS_INFO( PLUGIN_LOG_PREPEND "Replay checked %u FDM packets: %u out of tolerance, %u without counterpart",
+                  _replay_check.get_nb_checked(), _replay_check.get_nb_mismatches(), _replay_check.get_nb_unmatched());
+        for (i=0; i<REPLAY_NB_FIELDS; i++) {
+            ROS_INFO( PLUGIN_LOG_PREPEND "  %-10s max error %g, %u out of tolerance", ReplayCheck::get_field_name(i),
+                      _replay_check.get_max_error(i), _replay_check.get_nb_field_mismatches(i));
+        }
+        if (!_replay_check.is_match()) {
+            ROS_WARN( PLUGIN_LOG_PREPEND "Replay differs from the record, first at %s", _replay_check.get_first_mismatch().c_str());
+            status = REPLAY_EXIT_MISMATCH;
+        }
+    }
+    
+    if (_pacer.get_mode() != LockstepPacer::PACING_REPLAY)
+        return;
+    
+    // The destructors of the plugins are not run: completes the record here
+    if (_recorder.is_open())
+        _recorder.close();
+    ROS_INFO( PLUGIN_LOG_PREPEND "Replay ended, exiting with status %d", status);
+    fflush(stdout);
+    fflush(stderr);
+    _exit(status);
+}
+
+
+//-------------------------------------------------
+//  Barrier methods
+//-------------------------------------------------
+
+/*
+  Returns 'true' if every vehicle connected with its ArduPilot has sent its servo packet
+  for the current batch.
+ */
+bool ArdupilotSitlGazeboPlugin::is_barrier_complete()
+{
+    for (size_t i=0; i<_vehicles.size(); i++) {
+        if (_vehicles[i]->is_connection_alive && !is_vehicle_ready(_vehicles[i]))
+            return false;
+    }
+    return true;
+}
+
+/*
+  A vehicle is ready for the next step once its servo packet is here. A pipelined one (v2 servo
+  packets, PIPELINE_WINDOW) is also ready while its ArduPilot has not answered more than
+  PIPELINE_WINDOW of the FDM packets sent: the step runs with its previous commands, and the
+  network round trip overlaps the physics.
+ */
+bool ArdupilotSitlGazeboPlugin::is_vehicle_ready(const vehicle_slot *vehicle) const
+{
+    if ((vehicle->pipeline_window == 0) || !vehicle->is_servo_v2)
+        return vehicle->has_new_servo;
+    return (vehicle->fdm_sequence - vehicle->fdm_sequence_answered) <= (uint32_t)vehicle->pipeline_window;
+}
+
+/*
+  Closes the current batch: advances the world by 1 step, then returns the new state
+  to the ArduPilots of the batch.
+  @param is_timeout: the batch is released by the straggler timeout, some vehicles are missing
+ */
+void ArdupilotSitlGazeboPlugin::release_barrier(const ros::WallTime &now, bool is_timeout)
+{
+    int64_t t_start_ns, t_stepped_ns;
+    int64_t wait_servo_ns = 0, step_ns = 0, pace_ns = 0;
+    unsigned int nb_sent = 0;
+    double wait;
+    size_t i;
+    
+    t_start_ns = LatencyHistogram::now_ns();
+    if (_timing_batch_end_ns > 0) {
+        wait_servo_ns = t_start_ns - _timing_batch_end_ns;
+        _timing_wait_servo.add(wait_servo_ns);
+    }
+    
+    // Advances the simulation by 1 step, for everyone
+    if (!_isSimPaused) {
+        step_gazebo_sim();
+        t_stepped_ns = LatencyHistogram::now_ns();
+        step_ns = t_stepped_ns - t_start_ns;
+        _timing_step.add(step_ns);
+        _stats_nb_sim_steps++;
+        
+        // Holds the replies until the step's wall-clock deadline (no-op in 'afap' mode)
+        _pacer.wait_step(STEP_SIZE_FOR_ARDUPILOT);
+        pace_ns = LatencyHistogram::now_ns() - t_stepped_ns;
+        _timing_pace.add(pace_ns);
+    } else {
+        _pacer.reset();
+    }
+    
+    // Returns the new state to the ArduPilots which sent a command
+    for (i=0; i<_vehicles.size(); i++) {
+        vehicle_slot *vehicle = _vehicles[i];
+        
+        if (vehicle->has_new_servo) {
+            vehicle->has_new_servo = false;
+            send_apm_output(vehicle);
+            nb_sent++;
             
-            // Returns the new state to ArduPilot
-            send_apm_output();
-        } else {
-            // No message from Ardupilot on this loop, maybe next one ?
-            if (isConnectionAlive) {
-                isConnectionAlive = false;
-                ROS_INFO( PLUGIN_LOG_PREPEND "Ardupilot connection off, no messages");
-            }
+            wait = (now - vehicle->last_input_walltime).toSec();
+            vehicle->stats_nb_waits++;
+            vehicle->stats_wait_sum += wait;
+            if (wait > vehicle->stats_wait_max)
+                vehicle->stats_wait_max = wait;
+        } else if (vehicle->is_connection_alive && is_vehicle_ready(vehicle)) {
+            // Pipelined, its answer is still on the way
+            send_apm_output(vehicle);
+            nb_sent++;
+            vehicle->stats_nb_waits++;
+        } else if (vehicle->is_connection_alive) {
+            vehicle->stats_nb_missed++;
         }
     }
     
-    ROS_INFO( PLUGIN_LOG_PREPEND "Exited listening loop for Ardupilot messages");
+    record_telemetry_step(t_start_ns, wait_servo_ns, step_ns, pace_ns, nb_sent,
+                          (is_timeout ? TELEMETRY_STEP_TIMEOUT : 0) | (_isSimPaused ? TELEMETRY_STEP_PAUSED : 0));
+    
+    _is_batch_open = false;
+    _timing_batch_end_ns = LatencyHistogram::now_ns();
+    _stats_nb_batches++;
+    _batch_index++;
+    if (is_timeout)
+        _stats_nb_timeouts++;
+    
+    // Pipelined vehicles all ready for the next step: no packet will come to open it
+    for (i=0; i<_vehicles.size(); i++) {
+        vehicle_slot *vehicle = _vehicles[i];
+        
+        if (vehicle->is_connection_alive && vehicle->is_servo_v2 && (vehicle->pipeline_window > 0)) {
+            if (is_barrier_complete()) {
+                _is_batch_open = true;
+                _batch_open_walltime = ros::WallTime::now();
+            }
+            break;
+        }
+    }
 }
 
 
 //-------------------------------------------------
-//  LapseLock methods
+//  Loop events methods
 //-------------------------------------------------
 
 /*
-  Service for processes so they can grab a lapse-lock for the specified maximum time (wall time).
+  Creates the epoll set the main loop sleeps on: the control sockets from the ArduPilots,
+  and an eventfd used by other threads to wake the loop up.
+  In case of fatal failure, returns 'false'.
  */
-void ArdupilotSitlGazeboPlugin::take_lapseLock(float max_holder_lock_duration)
+bool ArdupilotSitlGazeboPlugin::init_loop_events()
 {
-    _lapseLock_mutex.lock();        // prevents concurrent modification of lapse-lock data
-    // If the caller asks for a longer lapse-lock pause than the current one, grants him his wish
-    if (_loop_lapseLock < max_holder_lock_duration) {
-        _loop_lapseLock = max_holder_lock_duration;
+    struct epoll_event ev;
+    
+    _loop_wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_loop_wakeup_fd < 0) {
+        ROS_ERROR( PLUGIN_LOG_PREPEND "Failed to create the loop wake-up eventfd: %s", strerror(errno));
+        return false;
+    }
+    
+    _loop_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (_loop_epoll_fd < 0) {
+        ROS_ERROR( PLUGIN_LOG_PREPEND "Failed to create the loop epoll set: %s", strerror(errno));
+        return false;
     }
     
-    // There is one more lapse-lock caller
-    _nbHolders_lapseLock++;
-    _lapseLock_mutex.unlock();
+    // The event's data is the index of the vehicle, or -1 for the wake-up eventfd
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = LOOP_EVENT_ID_WAKEUP;
+    if (epoll_ctl(_loop_epoll_fd, EPOLL_CTL_ADD, _loop_wakeup_fd, &ev) != 0) {
+        ROS_ERROR( PLUGIN_LOG_PREPEND "Failed to register the loop wake-up eventfd: %s", strerror(errno));
+        return false;
+    }
+    
+    // A control socket might not be open (e.g. port already in use),
+    // that vehicle is then never stepped.
+    // Shared memory rings have no descriptor, see 'wait_loop_event()'.
+    for (size_t i=0; i<_vehicles.size(); i++) {
+        if (!_vehicles[i]->is_control_socket_open || (_vehicles[i]->control_from_ardu->get_fd() < 0))
+            continue;
+        ev.data.u64 = i;
+        if (epoll_ctl(_loop_epoll_fd, EPOLL_CTL_ADD, _vehicles[i]->control_from_ardu->get_fd(), &ev) != 0) {
+            ROS_ERROR( PLUGIN_LOG_PREPEND "[%s] Failed to register the control socket: %s", _vehicles[i]->model_name.c_str(), strerror(errno));
+            return false;
+        }
+    }
+    
+    return true;
 }
 
 /*
-  Service for processes holding a lapselock, to signal their process is finished.
-  @return true if it was the last holder of the lock (= lapse-lock is now free)
+  Applies the real-time settings of the SDF to the calling thread, the loop thread.
+  A setting which fails is only reported: the loop runs anyway, with the normal scheduling.
+ */
+void ArdupilotSitlGazeboPlugin::init_loop_realtime()
+{
+    int err;
+    
+    if ((err = _loop_realtime.apply_lock_memory()) != 0)
+        ROS_WARN( PLUGIN_LOG_PREPEND "LOCK_MEMORY failed: %s (see 'ulimit -l')", strerror(err));
+    else if (_loop_realtime.is_memory_locked())
+        ROS_INFO( PLUGIN_LOG_PREPEND "Memory of gzserver locked");
+    
+    if ((err = _loop_realtime.apply_cpus()) != 0)
+        ROS_WARN( PLUGIN_LOG_PREPEND "LOOP_CPUS '%s' failed: %s", _loop_realtime.get_cpus_str().c_str(), strerror(err));
+    else if (_loop_realtime.has_cpus())
+        ROS_INFO( PLUGIN_LOG_PREPEND "Loop thread pinned to the CPUs %s", _loop_realtime.get_cpus_str().c_str());
+    
+    if ((err = _loop_realtime.apply_priority()) != 0)
+        ROS_WARN( PLUGIN_LOG_PREPEND "LOOP_PRIORITY %d failed: %s (requires CAP_SYS_NICE, or 'ulimit -r')", _loop_realtime.get_priority(), strerror(err));
+    else if (_loop_realtime.get_priority() > 0)
+        ROS_INFO( PLUGIN_LOG_PREPEND "Loop thread scheduled with SCHED_FIFO, priority %d", _loop_realtime.get_priority());
+}
+
+/*
+  Logs the changes of the connections with ArduPilot, noted by the steps since the last
+  statistics: a step does not log. The changes alternate, the current state is the last one.
  */
-bool ArdupilotSitlGazeboPlugin::release_lapseLock()
+void ArdupilotSitlGazeboPlugin::report_link_events()
 {
-    bool is_lapseLock_now_free = false;
+    size_t i;
     
-    _lapseLock_mutex.lock();        // prevents concurrent modification of lapse-lock data
-    // One less lapse-lock caller
-    if (_nbHolders_lapseLock > 0)
-        _nbHolders_lapseLock--;
+    for (i=0; i<_vehicles.size(); i++) {
+        vehicle_slot *vehicle = _vehicles[i];
+        
+        if ((vehicle->nb_link_connects == 0) && (vehicle->nb_link_losses == 0))
+            continue;
+        if (vehicle->nb_link_connects + vehicle->nb_link_losses > 1)
+            ROS_INFO( PLUGIN_LOG_PREPEND "[%s] Ardupilot connection lost %u time(s), back %u time(s) since the last statistics",
+                      vehicle->model_name.c_str(), vehicle->nb_link_losses, vehicle->nb_link_connects);
+        if (vehicle->is_connection_alive)
+            ROS_INFO( PLUGIN_LOG_PREPEND "[%s] Connected with Ardupilot", vehicle->model_name.c_str());
+        else
+            ROS_INFO( PLUGIN_LOG_PREPEND "[%s] Ardupilot connection off, no messages", vehicle->model_name.c_str());
+        vehicle->nb_link_connects = 0;
+        vehicle->nb_link_losses = 0;
+    }
+}
+
+/*
+  Sleeps until a servo packet is readable from an ArduPilot, the loop is woken up, or the timeout expires.
+  Flags 'is_input_ready' of the vehicles whose control socket is readable
+  (with the shared memory transport: of all the vehicles, once any ArduPilot rang the doorbell).
+  @param timeout_ms: maximum time to wait, in [ms]
+  @return a combination of the LOOP_EVENT_xxx flags
+ */
+int ArdupilotSitlGazeboPlugin::wait_loop_event(int timeout_ms)
+{
+    struct epoll_event events[LOOP_MAX_EVENTS];
+    int loop_events = LOOP_EVENT_NONE;
+    uint64_t counter;
+    int i, nb;
+    
+    if (_apm_transport == APM_TRANSPORT_SHM) {
+        // The doorbell does not tell which vehicle wrote: all are flagged,
+        // and 'receive_apm_input()' finds their rings empty at the cost of an atomic load.
+        if (_shm_segment.wait_doorbell(_shm_doorbell_seen, timeout_ms)) {
+            _shm_doorbell_seen = _shm_segment.get_doorbell();
+            for (size_t j=0; j<_vehicles.size(); j++)
+                _vehicles[j]->is_input_ready = _vehicles[j]->is_control_socket_open;
+            loop_events |= LOOP_EVENT_APM_INPUT;
+        }
+        // The eventfd is non-blocking
+        if (read(_loop_wakeup_fd, &counter, sizeof(counter)) > 0)
+            loop_events |= LOOP_EVENT_WAKEUP;
+        return loop_events;
+    }
+    
+    nb = epoll_wait(_loop_epoll_fd, events, LOOP_MAX_EVENTS, timeout_ms);
+    if (nb < 0) {
+        // Interrupted by a signal: reports it as a wake-up, not as a silent ArduPilot
+        return LOOP_EVENT_WAKEUP;
+    }
     
-    // If no more holders, resets the timer
-    if(!_nbHolders_lapseLock) {
-        _loop_lapseLock = 0.0f;
-        is_lapseLock_now_free = true;
+    for (i=0; i<nb; i++) {
+        if (events[i].data.u64 == LOOP_EVENT_ID_WAKEUP) {
+            // Consumes the wake-up, so the next wait is blocking again
+            if (read(_loop_wakeup_fd, &counter, sizeof(counter)) < 0) {}
+            loop_events |= LOOP_EVENT_WAKEUP;
+        } else if (events[i].data.u64 < _vehicles.size()) {
+            _vehicles[events[i].data.u64]->is_input_ready = true;
+            loop_events |= LOOP_EVENT_APM_INPUT;
+        }
     }
+    return loop_events;
+}
+
+/*
+  Sleeps until the loop is woken up, or until the timeout expires.
+  Unlike 'wait_loop_event()', it does not return when a servo packet is readable.
+  @param timeout_ms: maximum time to wait, in [ms]
+  @return true if woken up, false on timeout
+ */
+bool ArdupilotSitlGazeboPlugin::wait_loop_wakeup(int timeout_ms)
+{
+    struct pollfd pfd;
+    uint64_t counter;
+    
+    pfd.fd = _loop_wakeup_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
     
-    _lapseLock_mutex.unlock();
+    if (poll(&pfd, 1, timeout_ms) != 1)
+        return false;
+    
+    if (read(_loop_wakeup_fd, &counter, sizeof(counter)) < 0) {}
+    return true;
+}
+
+/*
+  Wakes the main loop up, so it re-evaluates its state (lapse-lock, pause, shutdown)
+  without waiting for the next ArduPilot packet or timeout.
+  Can be called from any thread.
+ */
+void ArdupilotSitlGazeboPlugin::wake_loop_thread()
+{
+    uint64_t one = 1;
+    
+    if (_loop_wakeup_fd < 0)
+        return;
+    if (write(_loop_wakeup_fd, &one, sizeof(one)) < 0) {}
+    // The loop may be sleeping on the shared memory doorbell rather than epoll
+    if (_shm_segment.is_open())
+        _shm_segment.ring_doorbell();
+}
+
+
+//-------------------------------------------------
+//  LapseLock methods
+//-------------------------------------------------
+
+/*
+  Service for processes so they can grab a lapse-lock for the specified maximum time (wall time).
+  @return the token of the holder, for 'release_lapseLock()'
+ */
+uint32_t ArdupilotSitlGazeboPlugin::take_lapseLock(float max_holder_lock_duration, const std::string &holder_name)
+{
+    // The loop notices the new holder before its next step, no need to wake it up
+    return _lapseLock.take(max_holder_lock_duration, holder_name);
+}
+
+/*
+  Service for processes holding a lapselock, to signal their process is finished.
+  @param token: returned by 'take_lapseLock()', or LAPSE_LOCK_NO_TOKEN to release a holder by name
+  @return true if it was the last holder of the lock (= lapse-lock is now free)
+ */
+bool ArdupilotSitlGazeboPlugin::release_lapseLock(uint32_t token, const std::string &holder_name)
+{
+    bool is_lapseLock_now_free = _lapseLock.release(token, holder_name);
+    
+    // Resumes the main loop right away, rather than at the lock expiration
+    if (is_lapseLock_now_free)
+        wake_loop_thread();
     return is_lapseLock_now_free;
 }
 
 
 /*
   Tests if the simulation can run, or if it should wait because their is a lapse-lock.
-  Decreases the lapse-lock by the specified elapsed time
-  @param loop_elapsed_dt: seconds
+  The holders past their deadline are dropped.
+  @param remaining_lock: if not NULL, receives the time until the earliest deadline, in seconds
   @return true if the simulation can run, or false if paused 
  */
-bool ArdupilotSitlGazeboPlugin::check_lapseLock(float loop_elapsed_dt)
+bool ArdupilotSitlGazeboPlugin::check_lapseLock(float *remaining_lock)
 {
-    bool sim_can_run = false;
-    
-    _lapseLock_mutex.lock();        // prevents concurrent modification of lapse-lock data
-    if (_loop_lapseLock < 1e-6) {
-        sim_can_run = true;
-    } else {
-        _loop_lapseLock = _loop_lapseLock - loop_elapsed_dt;
-        if (_loop_lapseLock < 0.0f) {
-            // Clears the lock
-            _loop_lapseLock = 0.0f;
-            _nbHolders_lapseLock = 0;
-            ROS_INFO( PLUGIN_LOG_PREPEND "Extern process locked the simulation for too long. Resuming the simulation...");
-            sim_can_run = true;
-        }
+    unsigned int nb_expired;
+    int64_t remaining_ns = _lapseLock.check(&nb_expired);
+    
+    if (nb_expired > 0) {
+        ROS_INFO( PLUGIN_LOG_PREPEND "%u extern process(es) locked the simulation for too long, %u holder(s) left",
+                  nb_expired, _lapseLock.get_nb_holders());
+        publish_lapseLock_state("", 0, false);
+        request_telemetry_dump(TELEMETRY_DUMP_LAPSE_TIMEOUT);
     }
     
-    _lapseLock_mutex.unlock();
-    return sim_can_run;
+    if (remaining_lock)
+        *remaining_lock = remaining_ns * 1e-9f;
+    return remaining_ns == 0;
 }
 
 
 void ArdupilotSitlGazeboPlugin::clear_lapseLock()
 {
-    _lapseLock_mutex.lock();        // prevents concurrent modification of lapse-lock data
     // Fully resets the lapse-lock
-    _nbHolders_lapseLock = 0;
-    _loop_lapseLock = 0.0f;
-    _lapseLock_mutex.unlock();
+    _lapseLock.clear();
+    
+    wake_loop_thread();
 }  
     
     
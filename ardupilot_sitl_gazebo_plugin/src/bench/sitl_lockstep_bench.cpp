@@ -0,0 +1,652 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+  Lockstep throughput benchmark of the plugin.
+
+  Plays the role of ArduPilot SITL: sends a servo packet, waits for the FDM packet of the
+  step, and again, as fast as the plugin answers. For each world it reports:
+    - the steps per second and the real-time factor,
+    - the distribution of the servo -> FDM round trip,
+    - the CPU time of gzserver, and of this peer, per step.
+  Results are written as JSON, to be compared across releases.
+
+  Usage:
+    sitl_lockstep_bench [--world <name>]... [--steps N] [--warmup N] [--output <file.json>]
+
+  With '--world', the world's .launch file of this package is started headless, with the
+  'afap' pacing, and stopped after the run ('empty_world', 'warehouse', 'outdoor_village').
+  Without it, the benchmark runs against an already started simulation.
+  ArduPilot must not be running: the benchmark uses its ports (or its shared memory rings, with
+  --transport shm against a world whose APM_TRANSPORT is shm).
+ */
+
+#include "../../include/ardupilot_sitl_gazebo_plugin/SocketAPM.h"
+#include "../../include/ardupilot_sitl_gazebo_plugin/ShmTransportAPM.h"
+#include "../../include/ardupilot_sitl_gazebo_plugin/FdmWireFormat.h"
+#include "../../include/ardupilot_sitl_gazebo_plugin/LatencyHistogram.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+
+#define BENCH_NB_SERVOS             16          // as the plugin's NB_SERVOS
+#define BENCH_FDM_MIN_SIZE          (21 * sizeof(double))   // smallest legacy FDM packet, without the front range finder
+
+#define BENCH_DEFAULT_STEPS         4000        // 10 s of simulation at 400 Hz
+#define BENCH_DEFAULT_WARMUP        400
+#define BENCH_DEFAULT_SERVO_PORT    9002
+#define BENCH_DEFAULT_FDM_PORT      9003
+#define BENCH_REPLY_TIMEOUT_MS      1000        // [ms] max wait for the FDM of a step
+#define BENCH_CONNECT_PERIOD_MS     100         // [ms] servo packets period while the plugin is not answering
+#define BENCH_STARTUP_TIMEOUT       180         // [s] max time for the world to load and answer
+#define BENCH_STOP_TIMEOUT          20          // [s] max time for roslaunch to exit on SIGINT
+
+#define BENCH_PACKAGE               "ardupilot_sitl_gazebo_plugin"
+
+
+/*
+  packet sent to the plugin, as 'ArdupilotSitlGazeboPlugin::servo_packet'
+ */
+struct bench_servo_packet {
+    float servos[BENCH_NB_SERVOS];
+};
+
+struct bench_options {
+    std::vector<std::string> worlds;
+    int steps;
+    int warmup;
+    uint16_t servo_port;
+    uint16_t fdm_port;
+    int startup_timeout;
+    int server_pid;                 // gzserver to measure, 0 to look for it
+    bool use_shm;                   // shared memory transport instead of UDP
+    std::string shm_name;
+    bool verbose;
+    std::string output;
+};
+
+struct bench_result {
+    std::string world;
+    bool ok;
+    std::string error;
+    int steps;
+    int timeouts;                   // FDM packets never received
+    int stale;                      // FDM packets whose sim time did not advance
+    double wall_time;               // [s]
+    double sim_time;                // [s]
+    double server_cpu;              // [s] gzserver user+system time during the run, < 0 if unknown
+    double peer_cpu;                // [s]
+    LatencyHistogram rtt;
+};
+
+
+static volatile sig_atomic_t s_interrupted = 0;
+
+static void on_signal(int)
+{
+    s_interrupted = 1;
+}
+
+static double now_s()
+{
+    return LatencyHistogram::now_ns() * 1e-9;
+}
+
+
+//-------------------------------------------------
+//  Processes
+//-------------------------------------------------
+
+/*
+  Starts 'roslaunch <package> <world>.launch' headless, in its own process group.
+  @return the pid of roslaunch, or -1
+ */
+static pid_t launch_world(const std::string &world, bool verbose)
+{
+    std::string launch_file = world + ".launch";
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        setpgid(0, 0);
+        if (!verbose) {
+            int devnull = open("/dev/null", O_WRONLY);
+            if (devnull >= 0) {
+                dup2(devnull, STDOUT_FILENO);
+                dup2(devnull, STDERR_FILENO);
+                close(devnull);
+            }
+        }
+        execlp("roslaunch", "roslaunch", BENCH_PACKAGE, launch_file.c_str(),
+               "gui:=false", "headless:=true", "pacing_mode:=afap", (char *)NULL);
+        perror("execlp roslaunch");
+        _exit(127);
+    }
+    setpgid(pid, pid);
+    return pid;
+}
+
+/*
+  Stops roslaunch and everything it started: SIGINT as with Ctrl-C, then SIGKILL if too long
+ */
+static void stop_world(pid_t pid)
+{
+    double deadline;
+    int status;
+
+    if (pid <= 0)
+        return;
+
+    kill(-pid, SIGINT);
+    deadline = now_s() + BENCH_STOP_TIMEOUT;
+    while (now_s() < deadline) {
+        if (waitpid(pid, &status, WNOHANG) == pid)
+            return;
+        usleep(100000);
+    }
+    fprintf(stderr, "roslaunch did not stop, killing it\n");
+    kill(-pid, SIGKILL);
+    waitpid(pid, &status, 0);
+}
+
+/*
+  Looks for a running gzserver process
+  @return its pid, or 0 if none
+ */
+static int find_gzserver()
+{
+    DIR *proc = opendir("/proc");
+    struct dirent *entry;
+    int pid = 0;
+
+    if (!proc)
+        return 0;
+    while (!pid && ((entry = readdir(proc)) != NULL)) {
+        char path[300], comm[64];
+        FILE *f;
+
+        if ((entry->d_name[0] < '0') || (entry->d_name[0] > '9'))
+            continue;
+        snprintf(path, sizeof(path), "/proc/%s/comm", entry->d_name);
+        f = fopen(path, "r");
+        if (!f)
+            continue;
+        if (fgets(comm, sizeof(comm), f) && (strncmp(comm, "gzserver", 8) == 0))
+            pid = atoi(entry->d_name);
+        fclose(f);
+    }
+    closedir(proc);
+    return pid;
+}
+
+/*
+  CPU time (user + system) consumed by a process
+  @return [s], or -1 if unknown
+ */
+static double process_cpu_time(int pid)
+{
+    char path[64], buf[1024];
+    unsigned long utime, stime;
+    FILE *f;
+    char *p;
+    int i;
+
+    if (pid <= 0)
+        return -1;
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+    p = fgets(buf, sizeof(buf), f);
+    fclose(f);
+    if (!p)
+        return -1;
+
+    // Fields after the command name, which can contain spaces: state is the 3rd field, utime the 14th
+    p = strrchr(buf, ')');
+    if (!p)
+        return -1;
+    p++;
+    for (i=0; i<11; i++) {
+        p = strchr(p + 1, ' ');
+        if (!p)
+            return -1;
+    }
+    if (sscanf(p, " %lu %lu", &utime, &stime) != 2)
+        return -1;
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static double self_cpu_time()
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6
+         + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+}
+
+
+//-------------------------------------------------
+//  Fake ArduPilot peer
+//-------------------------------------------------
+
+class BenchPeer {
+public:
+    BenchPeer(const bench_options &options)
+        : _use_shm(options.use_shm),
+          _shm_name(options.shm_name),
+          _sock(true),
+          _servo_out(NULL),
+          _fdm_in(NULL),
+          _servo_port(options.servo_port),
+          _fdm_port(options.fdm_port)
+    {
+        memset(&_servo, 0, sizeof(_servo));
+    }
+
+    ~BenchPeer()
+    {
+        close();
+    }
+
+    /*
+      UDP: binds the FDM port, once for all the runs.
+      Shared memory: nothing, the segment only exists once the world is loaded.
+     */
+    bool open()
+    {
+        if (_use_shm)
+            return true;
+        _sock.reuseaddress();
+        if (!_sock.bind("127.0.0.1", _fdm_port)) {
+            fprintf(stderr, "Unable to bind the FDM port %u: %s\n", _fdm_port, strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    /*
+      Shared memory: attaches to the segment of the plugin, and to the rings of the vehicle
+      using the servo port (or of the first one)
+      @return false if the plugin has not created it yet
+     */
+    bool attach()
+    {
+        int index;
+
+        if (!_use_shm || _servo_out)
+            return true;
+        if (!_segment.attach(_shm_name))
+            return false;
+        index = _segment.find_vehicle(_servo_port);
+        if (index < 0)
+            index = 0;
+        if (!_segment.get_vehicle(index))
+            return false;
+        _servo_out = new ShmTransportAPM(&_segment, &_segment.get_vehicle(index)->servo, SHM_TRANSPORT_WRITER | SHM_TRANSPORT_DOORBELL);
+        _fdm_in    = new ShmTransportAPM(&_segment, &_segment.get_vehicle(index)->fdm, SHM_TRANSPORT_READER);
+        return true;
+    }
+
+    // Shared memory: detaches, the next world creates a new segment
+    void close()
+    {
+        delete _servo_out;
+        delete _fdm_in;
+        _servo_out = NULL;
+        _fdm_in = NULL;
+    }
+
+    /*
+      One lockstep: sends the servos, and waits for the FDM of the step
+      @return true if received, with its sim time
+     */
+    bool step(uint32_t timeout_ms, double *timestamp)
+    {
+        ApmTransport *fdm_in = _use_shm ? _fdm_in : static_cast<ApmTransport*>(&_sock);
+        double deadline;
+        ssize_t sent;
+
+        if (!fdm_in)
+            return false;
+
+        // Drops the late replies of previous steps, so each FDM matches its servo packet
+        while (fdm_in->recv_latest(_buf, sizeof(_buf)) > 0) {}
+
+        if (_use_shm)
+            sent = _servo_out->send(&_servo, sizeof(_servo));
+        else
+            sent = _sock.sendto(&_servo, sizeof(_servo), "127.0.0.1", _servo_port);
+        if (sent != (ssize_t)sizeof(_servo))
+            return false;
+
+        deadline = now_s() + timeout_ms * 1e-3;
+        while (true) {
+            double remaining = deadline - now_s();
+            if (remaining <= 0)
+                return false;
+            ssize_t len = fdm_in->recv(_buf, sizeof(_buf), (uint32_t)(remaining * 1000.0) + 1);
+            // Ignores anything but FDM packets (the plugin's startup message)
+            if ((len > 0) && _layout.unpack_header(_buf, len)) {
+                memcpy(timestamp, _buf + sizeof(fdm_v2_header), sizeof(double));
+                return true;
+            }
+            if (len >= (ssize_t)BENCH_FDM_MIN_SIZE) {
+                memcpy(timestamp, _buf, sizeof(double));
+                return true;
+            }
+        }
+    }
+
+private:
+    bool _use_shm;
+    std::string _shm_name;
+    SocketAPM _sock;
+    ShmSegmentAPM _segment;
+    ApmTransport *_servo_out;       // shared memory rings, once attached
+    ApmTransport *_fdm_in;
+    uint16_t _servo_port;
+    uint16_t _fdm_port;
+    bench_servo_packet _servo;      // motors off
+    FdmLayout _layout;              // of the v2 FDM packets
+    char _buf[1024];
+};
+
+/*
+  Waits for the plugin to answer, e.g. while Gazebo loads the world
+ */
+static bool wait_plugin(BenchPeer &peer, int startup_timeout)
+{
+    double deadline = now_s() + startup_timeout;
+    double timestamp;
+
+    while (!s_interrupted && (now_s() < deadline)) {
+        if (!peer.attach()) {
+            usleep(BENCH_CONNECT_PERIOD_MS * 1000);
+            continue;
+        }
+        if (peer.step(BENCH_CONNECT_PERIOD_MS, &timestamp))
+            return true;
+    }
+    return false;
+}
+
+static void run_bench(const bench_options &options, BenchPeer &peer, bench_result &result)
+{
+    double timestamp = 0, prev_timestamp = -1, first_timestamp = -1;
+    double t_start, server_cpu_start, peer_cpu_start;
+    int64_t t_send_ns;
+    int server_pid, i;
+
+    if (!wait_plugin(peer, options.startup_timeout)) {
+        result.error = "the plugin did not answer";
+        return;
+    }
+
+    for (i=0; (i<options.warmup) && !s_interrupted; i++)
+        peer.step(BENCH_REPLY_TIMEOUT_MS, &timestamp);
+
+    server_pid = options.server_pid ? options.server_pid : find_gzserver();
+    server_cpu_start = process_cpu_time(server_pid);
+    peer_cpu_start = self_cpu_time();
+    t_start = now_s();
+
+    for (i=0; (i<options.steps) && !s_interrupted; i++) {
+        t_send_ns = LatencyHistogram::now_ns();
+        if (!peer.step(BENCH_REPLY_TIMEOUT_MS, &timestamp)) {
+            result.timeouts++;
+            continue;
+        }
+        result.rtt.add(LatencyHistogram::now_ns() - t_send_ns);
+        result.steps++;
+
+        if (first_timestamp < 0)
+            first_timestamp = timestamp;
+        if (timestamp <= prev_timestamp)
+            result.stale++;
+        prev_timestamp = timestamp;
+    }
+
+    result.wall_time = now_s() - t_start;
+    result.peer_cpu = self_cpu_time() - peer_cpu_start;
+    result.server_cpu = -1;
+    if (server_cpu_start >= 0) {
+        double server_cpu_end = process_cpu_time(server_pid);
+        if (server_cpu_end >= 0)
+            result.server_cpu = server_cpu_end - server_cpu_start;
+    }
+    result.sim_time = (prev_timestamp > first_timestamp) ? (prev_timestamp - first_timestamp) : 0;
+
+    if (s_interrupted)
+        result.error = "interrupted";
+    else if (result.steps == 0)
+        result.error = "no FDM received";
+    else
+        result.ok = true;
+}
+
+
+//-------------------------------------------------
+//  Report
+//-------------------------------------------------
+
+static void print_result_json(FILE *out, const bench_result &r, bool is_last)
+{
+    double steps_per_s = (r.wall_time > 0) ? r.steps / r.wall_time : 0;
+    double rtf = (r.wall_time > 0) ? r.sim_time / r.wall_time : 0;
+
+    fprintf(out, "    {\n");
+    fprintf(out, "      \"world\": \"%s\",\n", r.world.c_str());
+    fprintf(out, "      \"ok\": %s,\n", r.ok ? "true" : "false");
+    fprintf(out, "      \"error\": \"%s\",\n", r.error.c_str());
+    fprintf(out, "      \"steps\": %d,\n", r.steps);
+    fprintf(out, "      \"timeouts\": %d,\n", r.timeouts);
+    fprintf(out, "      \"stale\": %d,\n", r.stale);
+    fprintf(out, "      \"wall_time_s\": %.6f,\n", r.wall_time);
+    fprintf(out, "      \"sim_time_s\": %.6f,\n", r.sim_time);
+    fprintf(out, "      \"steps_per_s\": %.1f,\n", steps_per_s);
+    fprintf(out, "      \"real_time_factor\": %.3f,\n", rtf);
+    fprintf(out, "      \"rtt_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f},\n",
+            r.rtt.get_percentile(0.50) * 1e-3, r.rtt.get_percentile(0.90) * 1e-3,
+            r.rtt.get_percentile(0.99) * 1e-3, r.rtt.get_max() * 1e-3);
+    if ((r.server_cpu >= 0) && (r.steps > 0))
+        fprintf(out, "      \"server_cpu_per_step_us\": %.1f,\n", r.server_cpu / r.steps * 1e6);
+    else
+        fprintf(out, "      \"server_cpu_per_step_us\": null,\n");
+    fprintf(out, "      \"peer_cpu_per_step_us\": %.1f\n", (r.steps > 0) ? r.peer_cpu / r.steps * 1e6 : 0.0);
+    fprintf(out, "    }%s\n", is_last ? "" : ",");
+}
+
+static void print_report_json(FILE *out, const bench_options &options, const std::vector<bench_result*> &results)
+{
+    size_t i;
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"benchmark\": \"sitl_lockstep_bench\",\n");
+    fprintf(out, "  \"format_version\": 1,\n");
+    fprintf(out, "  \"steps_requested\": %d,\n", options.steps);
+    fprintf(out, "  \"warmup_steps\": %d,\n", options.warmup);
+    fprintf(out, "  \"transport\": \"%s\",\n", options.use_shm ? "shm" : "udp");
+    fprintf(out, "  \"runs\": [\n");
+    for (i=0; i<results.size(); i++)
+        print_result_json(out, *results[i], i + 1 == results.size());
+    fprintf(out, "  ]\n");
+    fprintf(out, "}\n");
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --world <name>         world to launch (empty_world, warehouse, outdoor_village...), repeatable.\n"
+        "                         Without it, runs against an already started simulation.\n"
+        "  --steps <N>            measured steps per world (default %d)\n"
+        "  --warmup <N>           steps before measuring (default %d)\n"
+        "  --servo-port <port>    plugin's servo port (default %d)\n"
+        "  --fdm-port <port>      port the plugin sends the FDM to (default %d)\n"
+        "  --startup-timeout <s>  max wait for the plugin to answer (default %d)\n"
+        "  --server-pid <pid>     gzserver process to measure (default: looked for)\n"
+        "  --transport <udp|shm>  as the world's APM_TRANSPORT (default udp)\n"
+        "  --shm-name <name>      as the world's SHM_NAME (default " APM_SHM_NAME_DEFAULT ")\n"
+        "  --output <file>        JSON report (default: stdout)\n"
+        "  --verbose              shows roslaunch's output\n",
+        prog, BENCH_DEFAULT_STEPS, BENCH_DEFAULT_WARMUP, BENCH_DEFAULT_SERVO_PORT, BENCH_DEFAULT_FDM_PORT,
+        BENCH_STARTUP_TIMEOUT);
+}
+
+static bool parse_options(int argc, char **argv, bench_options &options)
+{
+    static const struct option long_options[] = {
+        {"world",           required_argument, NULL, 'w'},
+        {"steps",           required_argument, NULL, 's'},
+        {"warmup",          required_argument, NULL, 'u'},
+        {"servo-port",      required_argument, NULL, 'p'},
+        {"fdm-port",        required_argument, NULL, 'f'},
+        {"startup-timeout", required_argument, NULL, 't'},
+        {"server-pid",      required_argument, NULL, 'g'},
+        {"transport",       required_argument, NULL, 'r'},
+        {"shm-name",        required_argument, NULL, 'n'},
+        {"output",          required_argument, NULL, 'o'},
+        {"verbose",         no_argument,       NULL, 'v'},
+        {"help",            no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+
+    options.steps = BENCH_DEFAULT_STEPS;
+    options.warmup = BENCH_DEFAULT_WARMUP;
+    options.servo_port = BENCH_DEFAULT_SERVO_PORT;
+    options.fdm_port = BENCH_DEFAULT_FDM_PORT;
+    options.startup_timeout = BENCH_STARTUP_TIMEOUT;
+    options.server_pid = 0;
+    options.use_shm = false;
+    options.shm_name = APM_SHM_NAME_DEFAULT;
+    options.verbose = false;
+
+    while ((opt = getopt_long(argc, argv, "w:s:u:p:f:t:g:r:n:o:vh", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'w': options.worlds.push_back(optarg); break;
+            case 's': options.steps = atoi(optarg); break;
+            case 'u': options.warmup = atoi(optarg); break;
+            case 'p': options.servo_port = atoi(optarg); break;
+            case 'f': options.fdm_port = atoi(optarg); break;
+            case 't': options.startup_timeout = atoi(optarg); break;
+            case 'g': options.server_pid = atoi(optarg); break;
+            case 'r':
+                if (strcmp(optarg, "shm") == 0)
+                    options.use_shm = true;
+                else if (strcmp(optarg, "udp") != 0)
+                    return false;
+                break;
+            case 'n': options.shm_name = optarg; break;
+            case 'o': options.output = optarg; break;
+            case 'v': options.verbose = true; break;
+            default:
+                return false;
+        }
+    }
+    return (optind == argc) && (options.steps > 0) && (options.warmup >= 0);
+}
+
+
+int main(int argc, char **argv)
+{
+    bench_options options;
+    std::vector<bench_result*> results;
+    FILE *out = stdout;
+    bool all_ok = true;
+    size_t i;
+
+    if (!parse_options(argc, argv, options)) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    BenchPeer peer(options);
+    if (!peer.open())
+        return 1;
+
+    // An empty name stands for the simulation already running
+    if (options.worlds.empty())
+        options.worlds.push_back("");
+
+    for (i=0; (i<options.worlds.size()) && !s_interrupted; i++) {
+        bench_result *result = new bench_result();
+        pid_t launch_pid = -1;
+
+        result->world = options.worlds[i].empty() ? "running" : options.worlds[i];
+        result->ok = false;
+        result->steps = result->timeouts = result->stale = 0;
+        result->wall_time = result->sim_time = result->peer_cpu = 0;
+        result->server_cpu = -1;
+        results.push_back(result);
+
+        fprintf(stderr, "[%s] starting\n", result->world.c_str());
+        if (!options.worlds[i].empty()) {
+            launch_pid = launch_world(options.worlds[i], options.verbose);
+            if (launch_pid < 0) {
+                result->error = "roslaunch failed";
+                all_ok = false;
+                continue;
+            }
+        }
+
+        run_bench(options, peer, *result);
+        stop_world(launch_pid);
+        peer.close();
+
+        fprintf(stderr, "[%s] %s: %d steps in %.2f s, rtt p50 %.1f us, p99 %.1f us\n", result->world.c_str(),
+                result->ok ? "done" : result->error.c_str(), result->steps, result->wall_time,
+                result->rtt.get_percentile(0.50) * 1e-3, result->rtt.get_percentile(0.99) * 1e-3);
+        all_ok = all_ok && result->ok;
+    }
+
+    if (!options.output.empty()) {
+        out = fopen(options.output.c_str(), "w");
+        if (!out) {
+            fprintf(stderr, "Unable to write %s: %s\n", options.output.c_str(), strerror(errno));
+            out = stdout;
+        }
+    }
+    print_report_json(out, options, results);
+    if (out != stdout)
+        fclose(out);
+
+    for (i=0; i<results.size(); i++)
+        delete results[i];
+    return all_ok ? 0 : 1;
+}
@@ -3,6 +3,10 @@
 #include <gazebo/physics/physics.hh>
 #include <gazebo/common/common.hh>
 #include <stdio.h>
+#include <math.h>
+#include <algorithm>
+#include <sstream>
+#include <vector>
 
 // Circle radius
 #define RADIUS 3
@@ -16,18 +20,32 @@
 #define SQUARE 1
 #define STOP   2
 #define DOT    2 // DOT == STOP
+#define SPLINE 3
 
-//#define STEP   0.001
+// Default speeds along the path [m/s] (SDF <speed>),
+// those of the former fixed increments at 400 Hz (0.0004 rad and 0.0005 m per update)
+#define CIRCLE_SPEED   (0.16 * RADIUS)
+#define SQUARE_SPEED   0.2
+#define SPLINE_SPEED   0.2
 
-// Square status
-#define INITIAL 0
-#define SIDE0   1
-#define SIDE1   2
-#define SIDE2   3
-#define SIDE3   4
+// Pose updates per second of sim time (SDF <update_rate>), 0 for every physics step
+#define UPDATE_RATE    0
 
 namespace gazebo
 {
+  /*
+    Moves the mark along a closed path, as a function of the sim time since the first update:
+    its speed does not depend on the physics step size nor on the pacing of the simulation.
+
+      <plugin name="mark_driver" filename="libmark_plugin.so">
+        <shape>spline</shape>             circle, square, spline, dot or stop
+        <speed>0.5</speed>                [m/s] along the path
+        <update_rate>50</update_rate>     [Hz] of sim time, 0 for every step
+        <waypoints>0 0 0  2 0 0  2 2 1</waypoints>   spline only, [m] from the initial position
+      </plugin>
+
+    The orientation stays the initial one of the model.
+  */
   class MarkPlugin : public ModelPlugin
   {
 
@@ -37,40 +55,45 @@ namespace gazebo
     // Pointer to the update event connection
     private: event::ConnectionPtr updateConnection;
 
-    //private: math::Pose initialPose;
-    private: double initialX, initialY, initialZ;
-    private: double initialRoll, initialPitch, initialYaw;
-    private: float angle;
+    // Initial pose, origin of the paths. Only its position is modified at each update.
+    private: math::Pose initialPose;
+    private: math::Pose pose;
     private: int shape;
 
-    private: float X, Y;
+    private: double speed;            // [m/s]
+    private: double period;           // [s] of sim time to go once along the path
 
-    private: float STEP;
+    // Decimation of the pose updates
+    private: double updatePeriod;     // [s] of sim time, 0 for every step
+    private: double startTime;        // [s] of sim time
+    private: double nextUpdateTime;   // [s] of sim time
+    private: bool isStarted;
 
-    private: int status;
+    // Closed Catmull-Rom spline through the waypoints, each segment run at 'speed' along its chord
+    private: std::vector<math::Vector3> waypoints;
+    private: std::vector<double> segmentStarts;   // [s] from the start of the loop
+    private: size_t segment;                      // last segment used, the search starts there
 
     public: void Load(physics::ModelPtr _parent, sdf::ElementPtr _sdf)
     {
       // Store the pointer to the model
       this->model = _parent;
 
-      angle = 0;
-
-      math::Pose initialPose = this->model->GetWorldPose();
-      initialX      = initialPose.pos[0];
-      initialY      = initialPose.pos[1];
-      initialZ      = initialPose.pos[2];
-      initialRoll   = initialPose.pos[3];
-      initialPitch  = initialPose.pos[4];
-      initialYaw    = initialPose.pos[5];
+      initialPose = this->model->GetWorldPose();
+      pose = initialPose;
 
       std::string shapeParam = _sdf->Get<std::string>("shape");
       std::transform(shapeParam.begin(), shapeParam.end(), shapeParam.begin(), ::tolower);
 
       if(shapeParam == "square"){
         shape = SQUARE;
+        speed = SQUARE_SPEED;
       } else if ( shapeParam == "circle"){
         shape = CIRCLE;
+        speed = CIRCLE_SPEED;
+      } else if ( shapeParam == "spline"){
+        shape = SPLINE;
+        speed = SPLINE_SPEED;
       } else if ( shapeParam == "dot"){
         shape = DOT;
       } else if ( shapeParam == "stop"){
@@ -79,37 +102,73 @@ namespace gazebo
         shape = STOP;
       }
 
-      // Hardcoded for testing
-      // shape = SQUARE; 
-      STEP = 0.0005; 
+      if (_sdf->HasElement("speed"))
+        speed = _sdf->Get<double>("speed");
+
+      double updateRate = UPDATE_RATE;
+      if (_sdf->HasElement("update_rate"))
+        updateRate = _sdf->Get<double>("update_rate");
+      updatePeriod = (updateRate > 0) ? 1.0 / updateRate : 0;
+
+      if ((shape == SPLINE) && !LoadWaypoints(_sdf))
+        shape = STOP;
+
+      switch (shape)
+      {
+        case CIRCLE:
+          period = 2 * M_PI * RADIUS / speed;
+          break;
+        case SQUARE:
+          period = 2 * (HEIGHT + WIDTH) / speed;
+          break;
+        case SPLINE:
+          period = segmentStarts.back();
+          break;
+        default:
+          period = 0;
+          break;
+      }
+      if (!(period > 0) || std::isinf(period))
+        shape = STOP;
 
-      status = INITIAL;
+      isStarted = false;
+      segment = 0;
 
       // Listen to the update event. This event is broadcast every
       // simulation iteration.
-      this->updateConnection = event::Events::ConnectWorldUpdateBegin(
-          boost::bind(&MarkPlugin::OnUpdate, this, _1));
+      if (shape != STOP)
+        this->updateConnection = event::Events::ConnectWorldUpdateBegin(
+            boost::bind(&MarkPlugin::OnUpdate, this, _1));
     }
 
     // Called by the world update start event
-    public: void OnUpdate(const common::UpdateInfo & /*_info*/)
+    public: void OnUpdate(const common::UpdateInfo & _info)
     {
-      // Draw a circle
-      //this->model->SetLinearVel(math::Vector3(1, 0, 0));
-      //this->model->SetAngularVel(math::Vector3(0, 0, 1));
+      double simTime = _info.simTime.Double();
+
+      // Restarts the path if the time went back (world reset, snapshot restored)
+      if (!isStarted || (simTime < startTime)) {
+        startTime = simTime;
+        nextUpdateTime = simTime;
+        isStarted = true;
+      }
+      if (simTime < nextUpdateTime)
+        return;
+      // Next update on the grid of the update period, skipping the missed ones
+      if (updatePeriod > 0)
+        nextUpdateTime = startTime + (floor((simTime - startTime) / updatePeriod) + 1) * updatePeriod;
+
+      double t = fmod(simTime - startTime, period);
+      math::Vector3 offset;
 
       switch (shape)
       {
         case CIRCLE:
         {
-          angle = angle + 0.0004;
-          X = initialX + sin(angle) * RADIUS;
-          Y = initialY + cos(angle) * RADIUS;
-          math::Pose pose = math::Pose(math::Vector3(X,Y,initialZ), math::Quaternion(math::Vector3(initialRoll,initialPitch,initialYaw)));
-          this->model->SetWorldPose(pose);
+          double angle = 2 * M_PI * t / period;
+          offset.Set(sin(angle) * RADIUS, cos(angle) * RADIUS, 0);
           break;
         } // end case CIRCLE
-          
 
         case SQUARE:
         {
@@ -126,100 +185,95 @@ namespace gazebo
             (2) : (initialX + WIDTH, initialY + HEIGHT)
             (3) : (initialX + WIDTH, initialY)
           */
-
-          switch (status)
-          {
-
-            case (INITIAL):
-            {
-              X = (float)initialX;
-              Y = (float)initialY;
-              status = SIDE0;
-              break;
-            }
-
-            case (SIDE0):
-            {
-              /*
-                (1)
-                 ^
-                 |
-                (0)
-              */
-              Y = Y + STEP;
-              math::Pose pose = math::Pose(math::Vector3(X,Y,initialZ), math::Quaternion(math::Vector3(initialRoll,initialPitch,initialYaw)));
-              this->model->SetWorldPose(pose);
-              if (Y >= (initialY + HEIGHT)){
-                status = SIDE1;
-              }
-              break;
-            }
-
-            case (SIDE1):
-            {
-              /*
-                (1)------->(2)
-              */
-              X = X + STEP;
-              math::Pose pose = math::Pose(math::Vector3(X,Y,initialZ), math::Quaternion(math::Vector3(initialRoll,initialPitch,initialYaw)));
-              this->model->SetWorldPose(pose);
-              if (X >= (initialX + WIDTH)){
-                status = SIDE2;
-              }
-              break;
-            }
-
-            case (SIDE2):
-            {
-              /*
-                (2)
-                 |
-                 v
-                (3)
-              */
-              Y = Y - STEP;
-              math::Pose pose = math::Pose(math::Vector3(X,Y,initialZ), math::Quaternion(math::Vector3(initialRoll,initialPitch,initialYaw)));
-              this->model->SetWorldPose(pose);
-              if (Y <= initialY){
-                status = SIDE3;
-              }
-              break;
-            }
-
-            case (SIDE3):
-            {
-              /*
-                (0)<-------(3)
-              */
-              X = X - STEP;
-              math::Pose pose = math::Pose(math::Vector3(X,Y,initialZ), math::Quaternion(math::Vector3(initialRoll,initialPitch,initialYaw)));
-              this->model->SetWorldPose(pose);
-
-              if(X <= initialX){
-                status = INITIAL;
-              }
-              break;
-            }
-
-          }  
-
+          double s = t * speed;
+
+          if (s < HEIGHT)
+            offset.Set(0, s, 0);
+          else if (s < HEIGHT + WIDTH)
+            offset.Set(s - HEIGHT, HEIGHT, 0);
+          else if (s < 2 * HEIGHT + WIDTH)
+            offset.Set(WIDTH, HEIGHT - (s - HEIGHT - WIDTH), 0);
+          else
+            offset.Set(WIDTH - (s - 2 * HEIGHT - WIDTH), 0, 0);
           break;
-          
         } // end case SQUARE
 
-      case (STOP):
-      {
-        break;
-      }  // end case STOP
-
-      break;
+        case SPLINE:
+        {
+          offset = GetSplinePosition(t);
+          break;
+        } // end case SPLINE
 
+        default:
+          return;
       } // end switch shape
 
+      pose.pos = initialPose.pos + offset;
+      this->model->SetWorldPose(pose);
+
     } // end void OnUpdate
 
+    /*
+      Reads the waypoints of the spline, and the start time of each of its segments.
+      @return false if there are fewer than 2 distinct waypoints
+    */
+    private: bool LoadWaypoints(sdf::ElementPtr _sdf)
+    {
+      double x, y, z, length;
+      size_t i, next;
+
+      if (_sdf->HasElement("waypoints")) {
+        std::istringstream values(_sdf->Get<std::string>("waypoints"));
+        while (values >> x >> y >> z)
+          waypoints.push_back(math::Vector3(x, y, z));
+      }
+      if ((waypoints.size() < 2) || !(speed > 0)) {
+        gzerr << "[mark_plugin] A spline needs at least 2 waypoints and a speed, the mark stays still\n";
+        return false;
+      }
+
+      segmentStarts.resize(waypoints.size() + 1);
+      segmentStarts[0] = 0;
+      for (i = 0; i < waypoints.size(); i++) {
+        next = (i + 1) % waypoints.size();
+        length = (waypoints[next] - waypoints[i]).GetLength();
+        segmentStarts[i + 1] = segmentStarts[i] + length / speed;
+      }
+      return segmentStarts.back() > 0;
+    }
+
+    /*
+      @return the position on the closed spline at 't' [s] from the start of the loop
+    */
+    private: math::Vector3 GetSplinePosition(double t)
+    {
+      size_t n = waypoints.size();
+
+      // Time only goes forward within a loop: the segment is usually the last one, or the next
+      if (t < segmentStarts[segment])
+        segment = 0;
+      while ((segment + 1 < n) && (t >= segmentStarts[segment + 1]))
+        segment++;
+
+      double duration = segmentStarts[segment + 1] - segmentStarts[segment];
+      double u = (duration > 0) ? (t - segmentStarts[segment]) / duration : 0;
+      double u2 = u * u;
+      double u3 = u2 * u;
+
+      const math::Vector3 &p0 = waypoints[(segment + n - 1) % n];
+      const math::Vector3 &p1 = waypoints[segment];
+      const math::Vector3 &p2 = waypoints[(segment + 1) % n];
+      const math::Vector3 &p3 = waypoints[(segment + 2) % n];
+
+      // Catmull-Rom: goes through every waypoint, with a continuous tangent
+      return (p1 * 2.0
+              + (p2 - p0) * u
+              + (p0 * 2.0 - p1 * 5.0 + p2 * 4.0 - p3) * u2
+              + (p1 * 3.0 - p0 - p2 * 3.0 + p3) * u3) * 0.5;
+    }
+
   };
 
   // Register this plugin with the simulator
   GZ_REGISTER_MODEL_PLUGIN(MarkPlugin)
-} // end namespace GAZEBO
\ No newline at end of file
+} // end namespace GAZEBO